@@ -0,0 +1,82 @@
+/*
+
+    File: hist.c
+    Description: Implements a log-linear latency histogram used by the
+    benchmarking tools
+
+*/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <time.h>
+
+#include "hist.h"
+
+static int bucket_of(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int sub = (int)((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+static uint64_t upper_edge(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS) {
+        return (uint64_t)bucket;
+    }
+    int msb = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = (uint64_t)(bucket % HIST_SUB_BUCKETS);
+    return ((HIST_SUB_BUCKETS + sub + 1) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+void hist_init(histogram* h) {
+    memset(h, 0, sizeof(histogram));
+}
+
+void hist_record(histogram* h, uint64_t value) {
+    h -> buckets[bucket_of(value)]++;
+    h -> count++;
+    h -> sum += value;
+    if (value > h -> max) {
+        h -> max = value;
+    }
+}
+
+void hist_merge(histogram* into, histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into -> buckets[i] += from -> buckets[i];
+    }
+    into -> count += from -> count;
+    into -> sum += from -> sum;
+    if (from -> max > into -> max) {
+        into -> max = from -> max;
+    }
+}
+
+uint64_t hist_percentile(histogram* h, double fraction) {
+    if (!h -> count) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * (double)h -> count);
+    if (rank >= h -> count) {
+        rank = h -> count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h -> buckets[i];
+        if (seen > rank) {
+            uint64_t edge = upper_edge(i);
+            return edge < h -> max ? edge : h -> max;
+        }
+    }
+    return h -> max;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
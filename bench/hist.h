@@ -0,0 +1,39 @@
+/*
+
+    File: hist.h
+    Description: Describes a log-linear latency histogram used by the
+    benchmarking tools
+
+*/
+
+#ifndef TECNICOFS_HIST_H
+#define TECNICOFS_HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Every power of two is split in this many linear sub-buckets
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+void hist_init(histogram*);
+void hist_record(histogram*, uint64_t);
+void hist_merge(histogram*, histogram*);
+
+/*
+    Returns the value below which the given fraction (0..1) of samples
+    fall, rounded up to the upper edge of its bucket.
+*/
+uint64_t hist_percentile(histogram*, double);
+
+uint64_t now_ns();
+
+#endif
@@ -0,0 +1,434 @@
+/*
+
+    File: loadgen.c
+    Description: Closed-loop load generator for a live TecnicoFS server.
+
+    Spawns N clients (processes, or threads of this process with -T), each
+    one mounting its own session and issuing requests back to back (plus an
+    optional think time), then reports the aggregated throughput and
+    latency percentiles.
+
+    Usage: loadgen -s socket [-c clients] [-d seconds] [-k keys]
+                   [-z theta] [-m c,d,r,l,w] [-f bytes] [-t think_us] [-q depth] [-L entries] [-T] [-C]
+
+*/
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../include/tecnicofs-api-constants.h"
+#include "../include/tecnicofs-client-api.h"
+#include "hist.h"
+
+// Operation types, in the same order as the -m weights
+enum { OP_CREATE, OP_DELETE, OP_RENAME, OP_READ, OP_WRITE, NUM_OPS };
+static const char* opNames[NUM_OPS] = { "create", "delete", "rename", "read", "write" };
+
+// First characters of generated names (the server hashes whole names, so
+// the buckets get an even share of them whatever these are)
+static const char KEY_CHARSET[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+#define MAX_FILE_SIZE 1000
+
+typedef struct {
+    histogram total;
+    histogram perOp[NUM_OPS];
+    uint64_t errors;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint64_t cacheStale;
+} client_result;
+
+static char* socketPath = NULL;
+static int numClients = 1;
+static double duration = 5.0;
+static int numKeys = 1000;
+static double zipfTheta = 0.0;
+static int weights[NUM_OPS] = { 20, 10, 5, 45, 20 };
+static int fileSize = 64;
+static int thinkTime = 0;
+static bool csv = false;
+static bool useThreads = false;
+static int depth = 1;
+static int cacheEntries = 0;
+
+static double* zipfCdf = NULL;
+
+static void usage(char* name) {
+    fprintf(stderr,
+        "Usage: %s -s socket [options]\n"
+        "  -c clients   number of clients (default 1)\n"
+        "  -d seconds   how long to run (default 5)\n"
+        "  -k keys      size of the key space (default 1000)\n"
+        "  -z theta     Zipf skew of the key distribution, 0 = uniform (default 0)\n"
+        "  -m c,d,r,l,w weights of create,delete,rename,read,write (default 20,10,5,45,20)\n"
+        "  -f bytes     size of the written contents (default 64, max %d)\n"
+        "  -t micros    think time between requests (default 0)\n"
+        "  -q depth     requests each client keeps in flight on its session (default 1)\n"
+        "  -L entries   turn on the client metadata cache, with room for that many names\n"
+        "  -T           run the clients as threads of a single process\n"
+        "  -C           print a single CSV line instead of the report\n",
+        name, MAX_FILE_SIZE
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:c:d:k:z:m:f:t:q:L:TC")) != -1) {
+        switch (opt) {
+            case 's': socketPath = optarg; break;
+            case 'c': numClients = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'k': numKeys = atoi(optarg); break;
+            case 'z': zipfTheta = atof(optarg); break;
+            case 'f': fileSize = atoi(optarg); break;
+            case 't': thinkTime = atoi(optarg); break;
+            case 'q': depth = atoi(optarg); break;
+            case 'L': cacheEntries = atoi(optarg); break;
+            case 'T': useThreads = true; break;
+            case 'C': csv = true; break;
+            case 'm':
+                if (sscanf(optarg, "%d,%d,%d,%d,%d", weights, weights + 1, weights + 2, weights + 3, weights + 4) != NUM_OPS) {
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+
+    int weightSum = 0;
+    for (int i = 0; i < NUM_OPS; i++) {
+        weightSum += weights[i] < 0 ? -1000 : weights[i];
+    }
+    if (!socketPath || numClients < 1 || duration <= 0 || numKeys < 1 || zipfTheta < 0 ||
+        fileSize < 1 || fileSize > MAX_FILE_SIZE || thinkTime < 0 || depth < 1 || cacheEntries < 0 || weightSum <= 0) {
+        usage(argv[0]);
+    }
+}
+
+/*
+    Precomputes the cumulative distribution of a Zipf(theta) law over the
+    key space, so keys can be drawn with a binary search.
+*/
+static void zipfInit() {
+    zipfCdf = malloc(sizeof(double) * numKeys);
+    double sum = 0;
+    for (int i = 0; i < numKeys; i++) {
+        sum += 1.0 / pow((double)(i + 1), zipfTheta);
+        zipfCdf[i] = sum;
+    }
+    for (int i = 0; i < numKeys; i++) {
+        zipfCdf[i] /= sum;
+    }
+}
+
+static int nextKey(unsigned int* seed) {
+    double u = (double)rand_r(seed) / ((double)RAND_MAX + 1.0);
+    if (zipfTheta == 0) {
+        return (int)(u * numKeys);
+    }
+
+    int lo = 0, hi = numKeys - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipfCdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void keyName(int key, char* out) {
+    int charsetSize = sizeof(KEY_CHARSET) - 1;
+    sprintf(out, "%c%d", KEY_CHARSET[key % charsetSize], key / charsetSize);
+}
+
+static int nextOp(unsigned int* seed) {
+    int weightSum = 0;
+    for (int i = 0; i < NUM_OPS; i++) {
+        weightSum += weights[i];
+    }
+    int pick = rand_r(seed) % weightSum;
+    for (int i = 0; i < NUM_OPS; i++) {
+        if (pick < weights[i]) {
+            return i;
+        }
+        pick -= weights[i];
+    }
+    return OP_READ;
+}
+
+/*
+    Runs one request of the given type, returning whether the server
+    reported a protocol/connection failure. Application-level outcomes
+    (file exists, not found, ...) are part of the workload, not errors.
+*/
+static bool runOp(tfs_session* session, int op, unsigned int* seed, char* payload) {
+    char name[32], target[32], buffer[MAX_FILE_SIZE + 1];
+    keyName(nextKey(seed), name);
+
+    int status = TECNICOFS_OK;
+    switch (op) {
+        case OP_CREATE:
+            status = tfsSessionCreate(session, name, RW, READ);
+            break;
+        case OP_DELETE:
+            status = tfsSessionDelete(session, name);
+            break;
+        case OP_RENAME:
+            keyName(nextKey(seed), target);
+            status = tfsSessionRename(session, name, target);
+            break;
+        case OP_READ:
+        case OP_WRITE:
+        {
+            int fd = tfsSessionOpen(session, name, op == OP_READ ? READ : WRITE);
+            if (fd < 0) {
+                status = fd;
+                break;
+            }
+            if (op == OP_READ) {
+                status = tfsSessionRead(session, fd, buffer, sizeof(buffer));
+            } else {
+                status = tfsSessionWrite(session, fd, payload, fileSize);
+            }
+            int closed = tfsSessionClose(session, fd);
+            if (closed == TECNICOFS_ERROR_CONNECTION_ERROR) {
+                status = closed;
+            }
+            break;
+        }
+    }
+
+    return status == TECNICOFS_ERROR_CONNECTION_ERROR ||
+        status == TECNICOFS_ERROR_NO_OPEN_SESSION ||
+        status == TECNICOFS_ERROR_OTHER;
+}
+
+static void resultInit(client_result* result) {
+    hist_init(&result -> total);
+    for (int op = 0; op < NUM_OPS; op++) {
+        hist_init(&result -> perOp[op]);
+    }
+    result -> errors = 0;
+    result -> cacheHits = result -> cacheMisses = result -> cacheStale = 0;
+}
+
+static void resultMerge(client_result* into, client_result* from) {
+    hist_merge(&into -> total, &from -> total);
+    for (int op = 0; op < NUM_OPS; op++) {
+        hist_merge(&into -> perOp[op], &from -> perOp[op]);
+    }
+    into -> errors += from -> errors;
+    into -> cacheHits += from -> cacheHits;
+    into -> cacheMisses += from -> cacheMisses;
+    into -> cacheStale += from -> cacheStale;
+}
+
+/*
+    One closed loop of requests. A client runs depth of them over its
+    session, so that many requests are in flight on one connection.
+*/
+typedef struct {
+    tfs_session* session;
+    unsigned int seed;
+    uint64_t deadline;
+    client_result result;
+} request_stream;
+
+static void* runStream(void* ptr) {
+    request_stream* stream = ptr;
+    char payload[MAX_FILE_SIZE + 1];
+    memset(payload, 'x', fileSize);
+    payload[fileSize] = '\0';
+
+    uint64_t now;
+    while ((now = now_ns()) < stream -> deadline) {
+        int op = nextOp(&stream -> seed);
+        if (runOp(stream -> session, op, &stream -> seed, payload)) {
+            stream -> result.errors++;
+        }
+        uint64_t latency = now_ns() - now;
+        hist_record(&stream -> result.total, latency);
+        hist_record(&stream -> result.perOp[op], latency);
+
+        if (thinkTime) {
+            usleep(thinkTime);
+        }
+    }
+    return NULL;
+}
+
+static void runClient(int id, client_result* result) {
+    tfs_session* session;
+    if (tfsMountSession(socketPath, &session) != TECNICOFS_OK) {
+        fprintf(stderr, "Client %d: unable to mount %s\n", id, socketPath);
+        result -> errors++;
+        return;
+    }
+    if (cacheEntries && tfsSessionCache(session, cacheEntries) != TECNICOFS_OK) {
+        fprintf(stderr, "Client %d: unable to set up the metadata cache\n", id);
+        result -> errors++;
+    }
+
+    request_stream* streams = malloc(sizeof(request_stream) * depth);
+    pthread_t* tids = malloc(sizeof(pthread_t) * depth);
+    uint64_t deadline = now_ns() + (uint64_t)(duration * 1e9);
+    for (int i = 0; i < depth; i++) {
+        streams[i].session = session;
+        streams[i].seed = (unsigned int)(getpid() ^ (id * 7919) ^ (i * 104729));
+        streams[i].deadline = deadline;
+        resultInit(&streams[i].result);
+    }
+
+    for (int i = 1; i < depth; i++) {
+        if (pthread_create(tids + i, NULL, runStream, streams + i)) {
+            perror("Unable to spawn request stream");
+            exit(EXIT_FAILURE);
+        }
+    }
+    runStream(streams);
+    for (int i = 1; i < depth; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (int i = 0; i < depth; i++) {
+        resultMerge(result, &streams[i].result);
+    }
+    free(streams);
+    free(tids);
+
+    unsigned long hits, misses, stale;
+    tfsSessionCacheStats(session, &hits, &misses, &stale);
+    result -> cacheHits = hits;
+    result -> cacheMisses = misses;
+    result -> cacheStale = stale;
+    tfsUnmountSession(session);
+}
+
+typedef struct {
+    int id;
+    client_result* result;
+} client_args;
+
+static void* clientThread(void* ptr) {
+    client_args* args = ptr;
+    runClient(args -> id, args -> result);
+    return NULL;
+}
+
+static void report(histogram* h, const char* label, double seconds) {
+    printf("%-8s %10llu ops %12.1f ops/s   p50 %9.1f us   p99 %9.1f us   p999 %9.1f us\n",
+        label,
+        (unsigned long long)h -> count,
+        (double)h -> count / seconds,
+        hist_percentile(h, 0.5) / 1000.0,
+        hist_percentile(h, 0.99) / 1000.0,
+        hist_percentile(h, 0.999) / 1000.0
+    );
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+    if (zipfTheta > 0) {
+        zipfInit();
+    }
+
+    // Children report back through a shared anonymous mapping
+    client_result* results = mmap(NULL, sizeof(client_result) * numClients,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("Unable to map the results area");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < numClients; i++) {
+        resultInit(results + i);
+    }
+
+    uint64_t start = now_ns();
+    if (useThreads) {
+        pthread_t* tids = malloc(sizeof(pthread_t) * numClients);
+        client_args* args = malloc(sizeof(client_args) * numClients);
+        for (int i = 0; i < numClients; i++) {
+            args[i].id = i;
+            args[i].result = results + i;
+            if (pthread_create(tids + i, NULL, clientThread, args + i)) {
+                perror("Unable to spawn client");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < numClients; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        free(tids);
+        free(args);
+    } else {
+        for (int i = 0; i < numClients; i++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("Unable to spawn client");
+                exit(EXIT_FAILURE);
+            } else if (!pid) {
+                runClient(i, results + i);
+                exit(EXIT_SUCCESS);
+            }
+        }
+        while (wait(NULL) > 0);
+    }
+    double seconds = (double)(now_ns() - start) / 1e9;
+
+    client_result all;
+    resultInit(&all);
+    for (int i = 0; i < numClients; i++) {
+        resultMerge(&all, results + i);
+    }
+
+    if (csv) {
+        printf("%d,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%llu\n",
+            numClients,
+            (unsigned long long)all.total.count,
+            seconds,
+            (double)all.total.count / seconds,
+            hist_percentile(&all.total, 0.5) / 1000.0,
+            hist_percentile(&all.total, 0.99) / 1000.0,
+            hist_percentile(&all.total, 0.999) / 1000.0,
+            (unsigned long long)all.errors
+        );
+    } else {
+        printf("%d %s, %.2f s, %d keys (zipf %.2f), %d byte files, %d us think time, %d in flight per client\n",
+            numClients, useThreads ? "threads" : "processes", seconds, numKeys, zipfTheta, fileSize, thinkTime, depth);
+        for (int op = 0; op < NUM_OPS; op++) {
+            if (weights[op]) {
+                report(&all.perOp[op], opNames[op], seconds);
+            }
+        }
+        report(&all.total, "total", seconds);
+        printf("errors   %10llu\n", (unsigned long long)all.errors);
+        if (cacheEntries) {
+            printf("cache    %10llu hits, %llu misses, %llu stale leases\n",
+                (unsigned long long)all.cacheHits,
+                (unsigned long long)all.cacheMisses,
+                (unsigned long long)all.cacheStale);
+        }
+    }
+
+    munmap(results, sizeof(client_result) * numClients);
+    free(zipfCdf);
+    exit(all.errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,328 @@
+/*
+
+    File: microbench.c
+    Description: Microbenchmarks for the data structures behind the server
+    (bst, hash, inode table and the bucketed fs), measured in isolation.
+
+    Results are printed one per line, either as CSV (default) or as JSON
+    objects (-j), so runs from different builds can be diffed.
+
+    Usage: microbench-<lock> [-n keys] [-t maxThreads] [-b buckets] [-F density] [-j]
+
+*/
+
+#define _GNU_SOURCE
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/fs.h"
+#include "../src/lib/bst.h"
+#include "../src/lib/filter.h"
+#include "../src/lib/hash.h"
+#include "../src/lib/inodes.h"
+#include "../src/lib/locks.h"
+#include "hist.h"
+
+#define KEY_SIZE 64
+#define HOT_KEYS 4
+
+enum { KEYS_RANDOM, KEYS_SORTED, KEYS_PREFIX, NUM_KEYSETS };
+static const char* keysetNames[NUM_KEYSETS] = { "random", "sorted", "prefix" };
+
+static int numKeys = 5000;
+static int maxThreads = 4;
+static int numBuckets = 16;
+static bool json = false;
+
+static char (*keys)[KEY_SIZE] = NULL;
+
+/*
+    Prints one result line. ops and elapsed (ns) give the throughput,
+    extra carries benchmark-specific figures (e.g. bucket spread).
+*/
+static void result(const char* bench, const char* variant, int threads, long ops, uint64_t elapsed, const char* extra) {
+    double nsPerOp = ops ? (double)elapsed / (double)ops : 0;
+    double mops = elapsed ? (double)ops * 1e3 / (double)elapsed : 0;
+    if (json) {
+        printf("{\"lock\":\"%s\",\"bench\":\"%s\",\"case\":\"%s\",\"threads\":%d,\"ops\":%ld,"
+            "\"ns_per_op\":%.1f,\"mops\":%.3f,\"extra\":\"%s\"}\n",
+            LOCK_NAME, bench, variant, threads, ops, nsPerOp, mops, extra ? extra : "");
+    } else {
+        printf("%s,%s,%s,%d,%ld,%.1f,%.3f,%s\n",
+            LOCK_NAME, bench, variant, threads, ops, nsPerOp, mops, extra ? extra : "");
+    }
+    fflush(stdout);
+}
+
+static void makeKeys(int keyset) {
+    unsigned int seed = 42;
+    for (int i = 0; i < numKeys; i++) {
+        switch (keyset) {
+            case KEYS_RANDOM:
+                for (int c = 0; c < 12; c++) {
+                    keys[i][c] = 'a' + rand_r(&seed) % 26;
+                }
+                keys[i][12] = '\0';
+                break;
+            case KEYS_SORTED:
+                sprintf(keys[i], "file%08d", i);
+                break;
+            case KEYS_PREFIX:
+                // Long shared prefix, so every comparison walks most of the key
+                sprintf(keys[i], "tmp-build-artifacts-cache-%08x", (unsigned int)rand_r(&seed));
+                break;
+        }
+    }
+}
+
+/* bst: insert, search and remove_item on a single tree */
+static void benchBst() {
+    for (int keyset = 0; keyset < NUM_KEYSETS; keyset++) {
+        makeKeys(keyset);
+        node* root = NULL;
+
+        uint64_t start = now_ns();
+        for (int i = 0; i < numKeys; i++) {
+            root = insert(root, keys[i], i);
+        }
+        result("bst_insert", keysetNames[keyset], 1, numKeys, now_ns() - start, NULL);
+
+        start = now_ns();
+        long found = 0;
+        for (int i = 0; i < numKeys; i++) {
+            found += search(root, keys[i]) != NULL;
+        }
+        char extra[32];
+        sprintf(extra, "found=%ld", found);
+        result("bst_search", keysetNames[keyset], 1, numKeys, now_ns() - start, extra);
+
+        start = now_ns();
+        for (int i = 0; i < numKeys; i++) {
+            root = remove_item(root, keys[i]);
+        }
+        result("bst_remove", keysetNames[keyset], 1, numKeys, now_ns() - start, NULL);
+        free_tree(root);
+    }
+}
+
+/* hash: throughput and how evenly the keys land in the buckets */
+static void benchHash() {
+    int* load = malloc(sizeof(int) * numBuckets);
+    for (int keyset = 0; keyset < NUM_KEYSETS; keyset++) {
+        makeKeys(keyset);
+        memset(load, 0, sizeof(int) * numBuckets);
+
+        volatile int sink = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < numKeys; i++) {
+            sink += hash(keys[i], numBuckets);
+        }
+        uint64_t elapsed = now_ns() - start;
+        (void)sink;
+
+        for (int i = 0; i < numKeys; i++) {
+            load[hash(keys[i], numBuckets)]++;
+        }
+        int used = 0, max = 0;
+        double mean = (double)numKeys / numBuckets, variance = 0;
+        for (int b = 0; b < numBuckets; b++) {
+            used += load[b] > 0;
+            max = load[b] > max ? load[b] : max;
+            variance += (load[b] - mean) * (load[b] - mean);
+        }
+        char extra[128];
+        sprintf(extra, "buckets=%d used=%d max=%d mean=%.1f stddev=%.1f",
+            numBuckets, used, max, mean, sqrt(variance / numBuckets));
+        result("hash", keysetNames[keyset], 1, numKeys, elapsed, extra);
+    }
+    free(load);
+}
+
+typedef struct {
+    int id;
+    int threads;
+    long ops;
+    tecnicofs* fs;
+    pthread_barrier_t* barrier;
+    uint64_t start;         // around the thread's own loop: the main thread may not run until it's over
+    uint64_t end;
+} worker_args;
+
+/* Each thread creates its share of inodes, reads and rewrites them, then frees them */
+static void* inodeWorker(void* ptr) {
+    worker_args* args = ptr;
+    int share = numKeys / args -> threads;
+    int* inumbers = malloc(sizeof(int) * share);
+    char content[32];
+    pthread_barrier_wait(args -> barrier);
+    args -> start = now_ns();
+
+    for (int i = 0; i < share; i++) {
+        inumbers[i] = inode_create(1000, RW, READ);
+    }
+    for (int i = 0; i < share; i++) {
+        sprintf(content, "contents-%d", i);
+        inode_set(inumbers[i], content, strlen(content));
+        inode_get(inumbers[i], NULL, NULL, NULL, NULL, content, sizeof(content));
+    }
+    for (int i = 0; i < share; i++) {
+        inode_delete(inumbers[i]);
+    }
+    args -> end = now_ns();
+    args -> ops = share * 4L;
+
+    free(inumbers);
+    return NULL;
+}
+
+/* Each thread creates, looks up and deletes its share of names through fs.c */
+static void* fsWorker(void* ptr) {
+    worker_args* args = ptr;
+    int share = numKeys / args -> threads;
+    char (*mine)[KEY_SIZE] = keys + args -> id * share;
+    pthread_barrier_wait(args -> barrier);
+    args -> start = now_ns();
+
+    for (int i = 0; i < share; i++) {
+        lock* l = get_lock(*args -> fs, mine[i]);
+        LOCK_WRITE(l);
+        if (lookup(*args -> fs, mine[i]) < 0) {
+            create(*args -> fs, mine[i], i);
+        }
+        LOCK_UNLOCK(l);
+    }
+    for (int i = 0; i < share; i++) {
+        lookup(*args -> fs, mine[i]);
+    }
+    for (int i = 0; i < share; i++) {
+        lock* l = get_lock(*args -> fs, mine[i]);
+        LOCK_WRITE(l);
+        delete(*args -> fs, mine[i]);
+        LOCK_UNLOCK(l);
+    }
+    args -> end = now_ns();
+    args -> ops = share * 3L;
+    return NULL;
+}
+
+/* Every thread looks up the same few names, over and over: a handful of hot buckets */
+static void* hotWorker(void* ptr) {
+    worker_args* args = ptr;
+    int share = numKeys / args -> threads;
+    pthread_barrier_wait(args -> barrier);
+    args -> start = now_ns();
+
+    for (int i = 0; i < share; i++) {
+        lookup(*args -> fs, keys[(args -> id + i) % HOT_KEYS]);
+    }
+    args -> end = now_ns();
+    args -> ops = share;
+    return NULL;
+}
+
+static void runThreads(const char* bench, const char* variant, void* (*worker)(void*), tecnicofs* fs) {
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        pthread_t tids[threads];
+        worker_args args[threads];
+        pthread_barrier_t barrier;
+        pthread_barrier_init(&barrier, NULL, threads + 1);
+
+        for (int i = 0; i < threads; i++) {
+            args[i].id = i;
+            args[i].threads = threads;
+            args[i].ops = 0;
+            args[i].fs = fs;
+            args[i].barrier = &barrier;
+            pthread_create(tids + i, NULL, worker, args + i);
+        }
+
+        filter_stats before, after;
+        unsigned long retriesBefore = 0, fallbacksBefore = 0;
+        if (fs) {
+            get_filter_stats(*fs, &before);
+            get_lookup_stats(&retriesBefore, &fallbacksBefore);
+        }
+
+        // From the first thread to start to the last one to finish
+        pthread_barrier_wait(&barrier);
+        long ops = 0;
+        uint64_t start = UINT64_MAX, end = 0;
+        for (int i = 0; i < threads; i++) {
+            pthread_join(tids[i], NULL);
+            ops += args[i].ops;
+            start = args[i].start < start ? args[i].start : start;
+            end = args[i].end > end ? args[i].end : end;
+        }
+        uint64_t elapsed = end - start;
+
+        char extra[192] = "";
+        if (fs) {
+            unsigned long retries, fallbacks;
+            get_filter_stats(*fs, &after);
+            get_lookup_stats(&retries, &fallbacks);
+            sprintf(extra, "lookups=%lu rejected=%lu false_positives=%lu retries=%lu fallbacks=%lu",
+                after.lookups - before.lookups, after.rejected - before.rejected,
+                after.falsePositives - before.falsePositives,
+                retries - retriesBefore, fallbacks - fallbacksBefore);
+        }
+        result(bench, variant, threads, ops, elapsed, extra);
+        pthread_barrier_destroy(&barrier);
+    }
+}
+
+static void usage(char* name) {
+    fprintf(stderr, "Usage: %s [-n keys] [-t maxThreads] [-b buckets] [-F density] [-j]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:b:F:j")) != -1) {
+        switch (opt) {
+            case 'n': numKeys = atoi(optarg); break;
+            case 't': maxThreads = atoi(optarg); break;
+            case 'b': numBuckets = atoi(optarg); break;
+            case 'F': filterDensity = atoi(optarg); break;
+            case 'j': json = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (numKeys < 1 || numKeys > INODE_TABLE_SIZE || maxThreads < 1 || numBuckets < 1 || filterDensity < 0) {
+        usage(argv[0]);
+    }
+
+    keys = malloc(sizeof(*keys) * numKeys);
+    if (!json) {
+        printf("lock,bench,case,threads,ops,ns_per_op,mops,extra\n");
+    }
+
+    benchBst();
+    benchHash();
+
+    inode_table_init();
+    runThreads("inode", "create_set_get_delete", inodeWorker, NULL);
+    inode_table_destroy();
+
+    tecnicofs fs = new_tecnicofs(numBuckets);
+    for (int keyset = 0; keyset < NUM_KEYSETS; keyset++) {
+        makeKeys(keyset);
+        runThreads("fs", keysetNames[keyset], fsWorker, &fs);
+    }
+
+    // Lookups only ever read the buckets, so these should scale with the threads
+    for (int i = 0; i < HOT_KEYS && i < numKeys; i++) {
+        create(fs, keys[i], i);
+    }
+    runThreads("fs_hot", "lookup", hotWorker, &fs);
+    free_tecnicofs(fs);
+
+    free(keys);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,370 @@
+/*
+
+    File: replay.c
+    Description: Replays a request trace recorded by the server (-R)
+    against a live TecnicoFS server.
+
+    Every recorded session is replayed by its own client process, so the
+    original concurrency is kept. Requests are issued at their original
+    offsets (optionally sped up), or back to back with -f.
+
+    A session's requests are replayed one at a time, in the order the
+    server was done with them: the ones that were in flight together
+    didn't conflict (or the server would have run them one after the
+    other), so that's the order their effects, and the fds opens got,
+    were handed out in.
+
+    Usage: replay -s socket [-f] [-x speedup] [-C] trace_file
+
+*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../include/tecnicofs-api-constants.h"
+#include "../include/tecnicofs-client-api.h"
+#include "../src/lib/record.h"
+#include "hist.h"
+
+#define MAX_ARG_SIZE 1024
+
+typedef struct {
+    uint32_t id;
+    size_t count;
+    size_t capacity;
+    trace_record** records;
+} session;
+
+typedef struct {
+    histogram latency;
+    uint64_t mismatches;
+    uint64_t skipped;
+} session_result;
+
+static char* socketPath = NULL;
+static bool asFastAsPossible = false;
+static double speedup = 1.0;
+static bool csv = false;
+
+static session* sessions = NULL;
+static size_t numSessions = 0;
+
+static void usage(char* name) {
+    fprintf(stderr, "Usage: %s -s socket [-f] [-x speedup] [-C] trace_file\n", name);
+    exit(EXIT_FAILURE);
+}
+
+static session* sessionFor(uint32_t id) {
+    for (size_t i = 0; i < numSessions; i++) {
+        if (sessions[i].id == id) {
+            return sessions + i;
+        }
+    }
+    sessions = realloc(sessions, sizeof(session) * (numSessions + 1));
+    session* s = sessions + numSessions++;
+    s -> id = id;
+    s -> count = 0;
+    s -> capacity = 0;
+    s -> records = NULL;
+    return s;
+}
+
+static int byAnswer(const void* a, const void* b) {
+    trace_record* x = *(trace_record**)a;
+    trace_record* y = *(trace_record**)b;
+    if (x -> answered != y -> answered) {
+        return x -> answered < y -> answered ? -1 : 1;
+    }
+    // Same instant: keep them as they are in the file
+    return x < y ? -1 : x > y;
+}
+
+/*
+    Maps the trace in memory and splits its records by session, each
+    session's sorted by when the server answered them.
+*/
+static void loadTrace(char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(trace_header)) {
+        perror("Unable to open the trace file");
+        exit(EXIT_FAILURE);
+    }
+
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Unable to map the trace file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    trace_header* header = (trace_header*)data;
+    if (memcmp(header -> magic, TRACE_MAGIC, sizeof(header -> magic)) || header -> version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a TecnicoFS trace (or has an unsupported version)\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t offset = sizeof(trace_header);
+    while (offset + sizeof(trace_record) <= (size_t)st.st_size) {
+        trace_record* rec = (trace_record*)(data + offset);
+        size_t size = sizeof(trace_record) + rec -> arg1Len + rec -> arg2Len;
+        if (offset + size > (size_t)st.st_size) {
+            fprintf(stderr, "Warning: trace is truncated, ignoring its tail\n");
+            break;
+        }
+
+        session* s = sessionFor(rec -> session);
+        if (s -> count == s -> capacity) {
+            s -> capacity = s -> capacity ? s -> capacity * 2 : 64;
+            s -> records = realloc(s -> records, sizeof(trace_record*) * s -> capacity);
+        }
+        s -> records[s -> count++] = rec;
+        offset += size;
+    }
+
+    // Workers flush their buffers whenever they fill up (or exit), so the file order means little
+    for (size_t i = 0; i < numSessions; i++) {
+        qsort(sessions[i].records, sessions[i].count, sizeof(trace_record*), byAnswer);
+    }
+}
+
+static void copyArg(char* out, char* from, uint16_t len) {
+    memcpy(out, from, len);
+    out[len] = '\0';
+}
+
+/*
+    Waits until the given trace offset (ns), relative to the replay start.
+*/
+static void waitFor(uint64_t replayStart, uint64_t traceOffset, uint64_t traceStart) {
+    if (asFastAsPossible) {
+        return;
+    }
+    uint64_t target = replayStart + (uint64_t)((double)(traceOffset - traceStart) / speedup);
+    uint64_t now = now_ns();
+    if (target > now) {
+        usleep((target - now) / 1000);
+    }
+}
+
+static void replaySession(session* s, session_result* result, uint64_t replayStart, uint64_t traceStart) {
+    // Recorded fds are the server's, they're translated to the ones we get now
+    int fds[MAX_OPEN_FILES];
+    char arg1[MAX_ARG_SIZE + 1], arg2[MAX_ARG_SIZE + 1], buffer[MAX_ARG_SIZE + 1];
+    bool mounted = false;
+
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        fds[i] = -1;
+    }
+
+    for (size_t i = 0; i < s -> count; i++) {
+        trace_record* rec = s -> records[i];
+        char* args = (char*)(rec + 1);
+        copyArg(arg1, args, rec -> arg1Len);
+        copyArg(arg2, args + rec -> arg1Len, rec -> arg2Len);
+
+        waitFor(replayStart, rec -> timestamp, traceStart);
+
+        if (!mounted) {
+            if (tfsMount(socketPath) != TECNICOFS_OK) {
+                fprintf(stderr, "Session %u: unable to mount %s\n", s -> id, socketPath);
+                exit(EXIT_FAILURE);
+            }
+            mounted = true;
+        }
+
+        int fd = atoi(arg1);
+        bool validFd = fd >= 0 && fd < MAX_OPEN_FILES;
+        uint64_t start = now_ns();
+        int status;
+
+        switch (rec -> opcode) {
+            case 'p':
+                status = TECNICOFS_OK;
+                break;
+            case 'c':
+                status = tfsCreate(arg1, arg2[0] - '0', arg2[1] - '0');
+                break;
+            case 'd':
+                status = tfsDelete(arg1);
+                break;
+            case 'r':
+                status = tfsRename(arg1, arg2);
+                break;
+            case 'm':
+                status = tfsMkdir(arg1, arg2[0] - '0', arg2[1] - '0');
+                break;
+            case 'e':
+                status = tfsRmdir(arg1);
+                break;
+            case 'o':
+                status = tfsOpen(arg1, arg2[0] - '0');
+                if (rec -> status >= 0 && rec -> status < MAX_OPEN_FILES) {
+                    fds[rec -> status] = status;
+                }
+                break;
+            case 'x':
+                status = tfsClose(validFd ? fds[fd] : fd);
+                if (validFd) {
+                    fds[fd] = -1;
+                }
+                break;
+            case 'l':
+            case 'z':
+            {
+                int len = rec -> payload > MAX_ARG_SIZE ? MAX_ARG_SIZE : (int)rec -> payload;
+                status = tfsRead(validFd ? fds[fd] : fd, buffer, len);
+                break;
+            }
+            case 'w':
+            {
+                int len = rec -> payload > MAX_ARG_SIZE ? MAX_ARG_SIZE : (int)rec -> payload;
+                memset(buffer, 'x', len);
+                buffer[len] = '\0';
+                status = tfsWrite(validFd ? fds[fd] : fd, buffer, len);
+                break;
+            }
+            case 'n':
+            {
+                int limit, prefixAt = -1;
+                if (sscanf(arg1, "%d:%n", &limit, &prefixAt) != 1 || prefixAt < 0) {
+                    limit = 0;
+                    prefixAt = 0;
+                }
+                status = tfsList(arg1 + prefixAt, arg2, limit, buffer, sizeof(buffer));
+                break;
+            }
+            case RECORD_HANGUP:
+                tfsUnmount();
+                mounted = false;
+                continue;
+            default:
+                result -> skipped++;
+                continue;
+        }
+
+        hist_record(&result -> latency, now_ns() - start);
+
+        // Reads, opens and listings only need to agree on success, not on the value
+        bool sameOutcome = (rec -> opcode == 'l' || rec -> opcode == 'z' || rec -> opcode == 'o' || rec -> opcode == 'n')
+            ? (status >= 0) == (rec -> status >= 0)
+            : status == rec -> status;
+        if (!sameOutcome) {
+            result -> mismatches++;
+        }
+    }
+
+    if (mounted) {
+        tfsUnmount();
+    }
+}
+
+int main(int argc, char** argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "s:fx:C")) != -1) {
+        switch (opt) {
+            case 's': socketPath = optarg; break;
+            case 'f': asFastAsPossible = true; break;
+            case 'x': speedup = atof(optarg); break;
+            case 'C': csv = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (!socketPath || speedup <= 0 || argc - optind != 1) {
+        usage(argv[0]);
+    }
+
+    loadTrace(argv[optind]);
+    if (!numSessions) {
+        fprintf(stderr, "The trace is empty\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // The trace starts at the first request of any session (not necessarily the first answered)
+    uint64_t traceStart = UINT64_MAX, traceEnd = 0;
+    size_t numRequests = 0;
+    for (size_t i = 0; i < numSessions; i++) {
+        for (size_t j = 0; j < sessions[i].count; j++) {
+            if (sessions[i].records[j] -> timestamp < traceStart) {
+                traceStart = sessions[i].records[j] -> timestamp;
+            }
+        }
+        if (sessions[i].records[sessions[i].count - 1] -> answered > traceEnd) {
+            traceEnd = sessions[i].records[sessions[i].count - 1] -> answered;
+        }
+        numRequests += sessions[i].count;
+    }
+
+    session_result* results = mmap(NULL, sizeof(session_result) * numSessions,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("Unable to map the results area");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t replayStart = now_ns();
+    for (size_t i = 0; i < numSessions; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Unable to spawn client");
+            exit(EXIT_FAILURE);
+        } else if (!pid) {
+            hist_init(&results[i].latency);
+            results[i].mismatches = 0;
+            results[i].skipped = 0;
+            replaySession(sessions + i, results + i, replayStart, traceStart);
+            exit(EXIT_SUCCESS);
+        }
+    }
+    while (wait(NULL) > 0);
+    double seconds = (double)(now_ns() - replayStart) / 1e9;
+
+    histogram all;
+    hist_init(&all);
+    uint64_t mismatches = 0, skipped = 0;
+    for (size_t i = 0; i < numSessions; i++) {
+        hist_merge(&all, &results[i].latency);
+        mismatches += results[i].mismatches;
+        skipped += results[i].skipped;
+    }
+
+    if (csv) {
+        printf("%zu,%llu,%.3f,%.1f,%.1f,%.1f,%.1f,%llu\n",
+            numSessions,
+            (unsigned long long)all.count,
+            seconds,
+            (double)all.count / seconds,
+            hist_percentile(&all, 0.5) / 1000.0,
+            hist_percentile(&all, 0.99) / 1000.0,
+            hist_percentile(&all, 0.999) / 1000.0,
+            (unsigned long long)mismatches
+        );
+    } else {
+        printf("%zu sessions, %zu records, recorded over %.3f s, replayed in %.3f s%s\n",
+            numSessions, numRequests, (double)(traceEnd - traceStart) / 1e9, seconds,
+            asFastAsPossible ? " (as fast as possible)" : "");
+        printf("%llu requests, %.1f req/s, p50 %.1f us, p99 %.1f us, p999 %.1f us\n",
+            (unsigned long long)all.count,
+            (double)all.count / seconds,
+            hist_percentile(&all, 0.5) / 1000.0,
+            hist_percentile(&all, 0.99) / 1000.0,
+            hist_percentile(&all, 0.999) / 1000.0
+        );
+        printf("%llu outcomes differ from the recording, %llu records skipped\n",
+            (unsigned long long)mismatches, (unsigned long long)skipped);
+    }
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,79 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#define FILES 40
+
+int completed = 0;
+pthread_mutex_t completedLock = PTHREAD_MUTEX_INITIALIZER;
+
+void onDelete(int status, void* arg) {
+    assert(status == 0);
+    pthread_mutex_lock(&completedLock);
+    completed++;
+    pthread_mutex_unlock(&completedLock);
+}
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    tfs_session* session;
+    char names[FILES][8], buffers[FILES][16];
+    int requests[FILES], fds[FILES];
+    assert(tfsMountSession(argv[1], &session) == 0);
+
+    printf("Test: many creates in flight on one session");
+    for (int i = 0; i < FILES; i++) {
+        sprintf(names[i], "%c%d", 'a' + i % 26, i);
+        requests[i] = tfsAsyncCreate(session, names[i], RW, READ, NULL, NULL);
+        assert(requests[i] > 0);
+    }
+    for (int i = FILES - 1; i >= 0; i--) {
+        assert(tfsWait(session, requests[i]) == 0);
+    }
+
+    printf("Test: pipelined opens, writes and reads");
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        requests[i] = tfsAsyncOpen(session, names[i], RW, NULL, NULL);
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        fds[i] = tfsWait(session, requests[i]);
+        assert(fds[i] >= 0);
+        requests[i] = tfsAsyncWrite(session, fds[i], names[i], strlen(names[i]), NULL, NULL);
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        assert(tfsWait(session, requests[i]) == 0);
+        requests[i] = tfsAsyncRead(session, fds[i], buffers[i], sizeof(buffers[i]), NULL, NULL);
+    }
+    for (int i = MAX_OPEN_FILES - 1; i >= 0; i--) {
+        assert(tfsWait(session, requests[i]) == (int)strlen(names[i]));
+        assert(!strcmp(buffers[i], names[i]));
+        assert(tfsSessionClose(session, fds[i]) == 0);
+    }
+
+    printf("Test: completion callbacks");
+    for (int i = 0; i < FILES; i++) {
+        assert(tfsAsyncDelete(session, names[i], onDelete, NULL) > 0);
+    }
+    for (int tries = 0; tries < 1000; tries++) {
+        pthread_mutex_lock(&completedLock);
+        int done = completed;
+        pthread_mutex_unlock(&completedLock);
+        if (done == FILES) {
+            break;
+        }
+        usleep(1000);
+    }
+    assert(completed == FILES);
+    assert(tfsSessionOpen(session, names[0], READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+    assert(tfsUnmountSession(session) == 0);
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SIZE (READ_BLOB_THRESHOLD + 100)
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    char contents[SIZE + 1], buffer[2 * SIZE];
+    tfs_session *writer, *reader;
+    assert(tfsMountSession(argv[1], &writer) == 0);
+    assert(tfsMountSession(argv[1], &reader) == 0);
+
+    printf("Test: large reads come back whole, from every session");
+    memset(contents, 'b', SIZE);
+    contents[SIZE] = '\0';
+    assert(tfsSessionCreate(writer, "large", RW, READ) == 0);
+    int wfd = tfsSessionOpen(writer, "large", RW);
+    assert(wfd >= 0);
+    assert(tfsSessionWrite(writer, wfd, contents, SIZE) == 0);
+    int rfd = tfsSessionOpen(reader, "large", READ);
+    assert(rfd >= 0);
+    for (int i = 0; i < 2; i++) {
+        memset(buffer, 0, sizeof(buffer));
+        assert(tfsSessionRead(reader, rfd, buffer, sizeof(buffer)) == SIZE);
+        assert(!strcmp(buffer, contents));
+    }
+    assert(tfsSessionRead(writer, wfd, buffer, sizeof(buffer)) == SIZE);
+    assert(!strcmp(buffer, contents));
+
+    printf("Test: large reads are cut to the buffer");
+    assert(tfsSessionRead(reader, rfd, buffer, READ_BLOB_THRESHOLD) == READ_BLOB_THRESHOLD - 1);
+    assert(strlen(buffer) == READ_BLOB_THRESHOLD - 1);
+    assert(tfsSessionRead(reader, rfd, buffer, 16) == 15);
+    assert(!strncmp(buffer, contents, 15) && !buffer[15]);
+
+    printf("Test: a write is seen by the next large read");
+    contents[0] = 'a';
+    assert(tfsSessionWrite(writer, wfd, contents, SIZE) == 0);
+    assert(tfsSessionRead(reader, rfd, buffer, sizeof(buffer)) == SIZE);
+    assert(!strcmp(buffer, contents));
+    assert(tfsSessionWrite(writer, wfd, "small", 5) == 0);
+    assert(tfsSessionRead(reader, rfd, buffer, sizeof(buffer)) == 5);
+    assert(!strcmp(buffer, "small"));
+
+    assert(tfsSessionClose(reader, rfd) == 0);
+    assert(tfsSessionClose(writer, wfd) == 0);
+    assert(tfsSessionDelete(writer, "large") == 0);
+    assert(tfsUnmountSession(reader) == 0);
+    assert(tfsUnmountSession(writer) == 0);
+    printf("\n--> All tests OK\n");
+
+    return 0;
+}
@@ -0,0 +1,52 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    tfs_session *cached, *other;
+    unsigned long hits, misses, stale;
+    assert(tfsMountSession(argv[1], &cached) == 0);
+    assert(tfsMountSession(argv[1], &other) == 0);
+    assert(tfsSessionCache(cached, 128) == 0);
+
+    printf("Test: reopening a leased name hits the cache");
+    assert(tfsSessionCreate(cached, "a", RW, READ) == 0);
+    for (int i = 0; i < 3; i++) {
+        int fd = tfsSessionOpen(cached, "a", RW);
+        assert(fd >= 0);
+        assert(tfsSessionClose(cached, fd) == 0);
+    }
+    tfsSessionCacheStats(cached, &hits, &misses, &stale);
+    assert(hits == 2 && misses == 1 && stale == 0);
+
+    printf("Test: a rename elsewhere makes the lease stale");
+    assert(tfsSessionRename(other, "a", "b") == 0);
+    assert(tfsSessionOpen(cached, "a", RW) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+    tfsSessionCacheStats(cached, &hits, &misses, &stale);
+    assert(stale == 1);
+
+    printf("Test: a file replaced elsewhere makes the lease stale");
+    int fd = tfsSessionOpen(cached, "b", RW);
+    assert(fd >= 0);
+    assert(tfsSessionClose(cached, fd) == 0);
+    assert(tfsSessionDelete(other, "b") == 0);
+    assert(tfsSessionCreate(other, "b", RW, NONE) == 0);
+    fd = tfsSessionOpen(cached, "b", RW);
+    assert(fd >= 0);
+    assert(tfsSessionClose(cached, fd) == 0);
+    tfsSessionCacheStats(cached, &hits, &misses, &stale);
+    assert(stale == 2);
+
+    assert(tfsSessionDelete(cached, "b") == 0);
+    assert(tfsUnmountSession(cached) == 0);
+    assert(tfsUnmountSession(other) == 0);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+    Meant for a server that compresses contents (-C 64, say), though
+    compression is transparent: it passes against any server.
+*/
+
+#define SIZE 1000
+
+static void readBack(tfs_session* session, int fd, char* contents) {
+    char buffer[2 * SIZE];
+    memset(buffer, 0, sizeof(buffer));
+    assert(tfsSessionRead(session, fd, buffer, sizeof(buffer)) == (int)strlen(contents));
+    assert(!strcmp(buffer, contents));
+}
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    char logs[SIZE + 64], noise[SIZE + 1], buffer[SIZE];
+    tfs_session *writer, *reader;
+    assert(tfsMountSession(argv[1], &writer) == 0);
+    assert(tfsMountSession(argv[1], &reader) == 0);
+
+    printf("Test: contents that compress read back as written");
+    int len = 0;
+    for (int i = 0; len < SIZE - 64; i++) {
+        len += sprintf(logs + len, "{\"level\":\"info\",\"event\":\"request\",\"id\":%d}", i);
+    }
+    assert(tfsSessionCreate(writer, "logs", RW, READ) == 0);
+    int wfd = tfsSessionOpen(writer, "logs", RW);
+    assert(wfd >= 0);
+    assert(tfsSessionWrite(writer, wfd, logs, strlen(logs)) == 0);
+    int rfd = tfsSessionOpen(reader, "logs", READ);
+    assert(rfd >= 0);
+    readBack(reader, rfd, logs);
+    readBack(writer, wfd, logs);
+
+    printf("Test: reads of compressed contents are cut to the buffer");
+    assert(tfsSessionRead(reader, rfd, buffer, 40) == 39);
+    assert(!strncmp(buffer, logs, 39) && !buffer[39]);
+    assert(tfsSessionRead(reader, rfd, buffer, READ_BLOB_THRESHOLD) == READ_BLOB_THRESHOLD - 1);
+    assert(!strncmp(buffer, logs, READ_BLOB_THRESHOLD - 1));
+
+    printf("Test: contents that don't compress, or are small, read back as written");
+    srand(7);
+    for (int i = 0; i < SIZE; i++) {
+        noise[i] = 'a' + rand() % 26;
+    }
+    noise[SIZE] = '\0';
+    assert(tfsSessionWrite(writer, wfd, noise, SIZE) == 0);
+    readBack(reader, rfd, noise);
+    assert(tfsSessionWrite(writer, wfd, "small", 5) == 0);
+    readBack(reader, rfd, "small");
+    assert(tfsSessionWrite(writer, wfd, logs, strlen(logs)) == 0);
+    readBack(reader, rfd, logs);
+
+    assert(tfsSessionClose(reader, rfd) == 0);
+    assert(tfsSessionClose(writer, wfd) == 0);
+    assert(tfsSessionDelete(writer, "logs") == 0);
+    assert(tfsUnmountSession(reader) == 0);
+    assert(tfsUnmountSession(writer) == 0);
+    printf("\n--> All tests OK\n");
+
+    return 0;
+}
@@ -0,0 +1,60 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    char buffer[64];
+    assert(tfsMount(argv[1]) == 0);
+
+    printf("Test: files in nested directories");
+    assert(tfsMkdir("a", RW, READ) == 0);
+    assert(tfsMkdir("/a/b", RW, READ) == 0);
+    assert(tfsCreate("a/b/f", RW, READ) == 0);
+    assert(tfsCreate("a/b/f", RW, READ) == TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
+    assert(tfsCreate("b", RW, READ) == 0);    // not the same as a/b
+    assert(tfsCreate("a/missing/f", RW, READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+    assert(tfsCreate("b/f", RW, READ) == TECNICOFS_ERROR_NOT_A_DIRECTORY);
+    assert(tfsOpen("a/b", READ) == TECNICOFS_ERROR_IS_A_DIRECTORY);
+    int fd = tfsOpen("a/b/f", RW);
+    assert(fd >= 0);
+    assert(tfsWrite(fd, "nested", 6) == 0);
+    assert(tfsClose(fd) == 0);
+
+    printf("Test: listing a directory");
+    assert(tfsList("a/", NULL, 10, buffer, sizeof(buffer)) == 1);
+    assert(!strcmp(buffer, "b"));
+    assert(tfsList("", NULL, 10, buffer, sizeof(buffer)) == 2);
+    assert(!strcmp(buffer, "a") && !strcmp(buffer + 2, "b"));
+
+    printf("Test: moving a directory moves what's inside");
+    assert(tfsRename("a", "c") == 0);
+    assert(tfsOpen("a/b/f", READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+    fd = tfsOpen("c/b/f", READ);
+    assert(fd >= 0);
+    assert(tfsRead(fd, buffer, sizeof(buffer)) == 6);
+    assert(!strcmp(buffer, "nested"));
+    assert(tfsClose(fd) == 0);
+    assert(tfsRename("c", "c/b/c") == TECNICOFS_ERROR_OTHER);
+    assert(tfsRename("c/b/f", "f") == 0);
+    assert(tfsRename("f", "c/f") == 0);
+
+    printf("Test: only empty directories can be deleted");
+    assert(tfsDelete("c/b") == TECNICOFS_ERROR_IS_A_DIRECTORY);
+    assert(tfsRmdir("c/f") == TECNICOFS_ERROR_NOT_A_DIRECTORY);
+    assert(tfsRmdir("c") == TECNICOFS_ERROR_DIRECTORY_NOT_EMPTY);
+    assert(tfsRmdir("c/b") == 0);
+    assert(tfsDelete("c/f") == 0);
+    assert(tfsRmdir("c") == 0);
+    assert(tfsCreate("c/f", RW, READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+    assert(tfsDelete("b") == 0);
+    assert(tfsUnmount() == 0);
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define TEMPORARY 30
+#define PAGE 8
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    char name[16], cursor[16] = "", last[16] = "", buffer[PAGE * 16], all[1024];
+    char* others[] = { "zeta", "alpha", "mid", "beta", "tmp" };
+    assert(tfsMount(argv[1]) == 0);
+
+    for (int i = 0; i < TEMPORARY; i++) {
+        sprintf(name, "tmp-%02d", i);
+        assert(tfsCreate(name, RW, READ) == 0);
+    }
+    for (int i = 0; i < 5; i++) {
+        assert(tfsCreate(others[i], RW, READ) == 0);
+    }
+
+    printf("Test: every name, sorted across buckets");
+    int count = tfsList("", NULL, 100, all, sizeof(all));
+    assert(count == TEMPORARY + 5);
+    char* n = all;
+    for (int i = 1; i < count; i++) {
+        char* next = n + strlen(n) + 1;
+        assert(strcmp(n, next) < 0);
+        n = next;
+    }
+    assert(!strcmp(all, "alpha"));
+    assert(!strcmp(n, "zeta"));
+
+    printf("Test: only whole names that fit in the buffer");
+    assert(tfsList("", NULL, 100, all, 20) == 4); // alpha, beta, mid, tmp
+
+    printf("Test: paging through a prefix");
+    int seen = 0;
+    while ((count = tfsList("tmp-", cursor, PAGE, buffer, sizeof(buffer))) > 0) {
+        assert(count <= PAGE);
+        for (char* n = buffer; count--; n += strlen(n) + 1) {
+            assert(!strncmp(n, "tmp-", 4));
+            assert(strcmp(n, last) > 0);
+            strcpy(last, n);
+            seen++;
+        }
+        strcpy(cursor, last);
+    }
+    assert(count == 0);
+    assert(seen == TEMPORARY);
+
+    printf("Test: nothing with a prefix past every name");
+    assert(tfsList("zz", NULL, PAGE, buffer, sizeof(buffer)) == 0);
+    assert(tfsList("", "zeta", PAGE, buffer, sizeof(buffer)) == 0);
+    assert(tfsList("", NULL, 0, buffer, sizeof(buffer)) == TECNICOFS_ERROR_OTHER);
+
+    for (int i = 0; i < TEMPORARY; i++) {
+        sprintf(name, "tmp-%02d", i);
+        assert(tfsDelete(name) == 0);
+    }
+    for (int i = 0; i < 5; i++) {
+        assert(tfsDelete(others[i]) == 0);
+    }
+    assert(tfsUnmount() == 0);
+
+    return 0;
+}
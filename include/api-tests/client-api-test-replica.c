@@ -0,0 +1,73 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+/*
+    Runs against a primary (-X log_socket) and a replica following it
+    (-Y log_socket). Replication is asynchronous: the replica is given a
+    while to catch up.
+*/
+
+static int openOnReplica(tfs_session* replica, char* filename) {
+    int fd = TECNICOFS_ERROR_FILE_NOT_FOUND;
+    for (int i = 0; i < 100 && fd == TECNICOFS_ERROR_FILE_NOT_FOUND; i++) {
+        if ((fd = tfsSessionOpen(replica, filename, READ)) == TECNICOFS_ERROR_FILE_NOT_FOUND) {
+            usleep(20000);
+        }
+    }
+    return fd;
+}
+
+int main(int argc, char** argv) {
+     if (argc != 3) {
+        printf("Usage: %s primary_sock_path replica_sock_path\n", argv[0]);
+        exit(0);
+    }
+    char buffer[64];
+    tfs_session *primary, *replica;
+    assert(tfsMountSession(argv[1], &primary) == 0);
+    assert(tfsMountSession(argv[2], &replica) == 0);
+
+    printf("Test: what is written on the primary shows up on the replica");
+    assert(tfsSessionMkdir(primary, "shipped", RW, READ) == 0);
+    assert(tfsSessionCreate(primary, "shipped/file", RW, READ) == 0);
+    int fd = tfsSessionOpen(primary, "shipped/file", WRITE);
+    assert(fd >= 0);
+    assert(tfsSessionWrite(primary, fd, "replicated", 10) == 0);
+    assert(tfsSessionClose(primary, fd) == 0);
+    assert(tfsSessionRename(primary, "shipped/file", "shipped/moved") == 0);
+    fd = openOnReplica(replica, "shipped/moved");
+    assert(fd >= 0);
+    for (int i = 0; i < 100 && tfsSessionRead(replica, fd, buffer, sizeof(buffer)) != 10; i++) {
+        usleep(20000);
+    }
+    assert(!strcmp(buffer, "replicated"));
+    assert(tfsSessionClose(replica, fd) == 0);
+    assert(tfsSessionOpen(replica, "shipped/file", READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+
+    printf("Test: the replica only serves reads");
+    assert(tfsSessionCreate(replica, "local", RW, READ) == TECNICOFS_ERROR_READ_ONLY);
+    assert(tfsSessionDelete(replica, "shipped/moved") == TECNICOFS_ERROR_READ_ONLY);
+    assert(tfsSessionOpen(replica, "shipped/moved", WRITE) == TECNICOFS_ERROR_READ_ONLY);
+
+    printf("Test: a delete reaches a file the replica has open");
+    fd = tfsSessionOpen(replica, "shipped/moved", READ);
+    assert(fd >= 0);
+    assert(tfsSessionDelete(primary, "shipped/moved") == 0);
+    assert(tfsSessionRmdir(primary, "shipped") == 0);
+    for (int i = 0; i < 100 && tfsSessionOpen(replica, "shipped", READ) != TECNICOFS_ERROR_FILE_NOT_FOUND; i++) {
+        usleep(20000);
+    }
+    assert(tfsSessionOpen(replica, "shipped/moved", READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+    assert(tfsSessionClose(replica, fd) == 0);
+
+    assert(tfsUnmountSession(replica) == 0);
+    assert(tfsUnmountSession(primary) == 0);
+    printf("\n--> All tests OK\n");
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+    Runs against a router (tecnicofs-router router_sock shard_sock...)
+    in front of two or more servers, and one more server, not in front
+    of which it is yet, that joins halfway.
+*/
+
+#define NUM_FILES 32
+
+static void readBack(tfs_session* session, char* name, char* contents) {
+    char buffer[64];
+    int fd = tfsSessionOpen(session, name, READ);
+    assert(fd >= 0);
+    assert(tfsSessionRead(session, fd, buffer, sizeof(buffer)) == (int)strlen(contents));
+    assert(!strcmp(buffer, contents));
+    assert(tfsSessionClose(session, fd) == 0);
+}
+
+int main(int argc, char** argv) {
+     if (argc != 3) {
+        printf("Usage: %s router_sock_path joining_shard_sock_path\n", argv[0]);
+        exit(0);
+    }
+    char name[32], renamed[32], buffer[4096];
+    tfs_session *router, *joined;
+    assert(tfsMountSession(argv[1], &router) == 0);
+
+    printf("Test: names spread over the shards read back as written");
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "f%02d", i);
+        assert(tfsSessionCreate(router, name, RW, READ) == 0);
+        int fd = tfsSessionOpen(router, name, WRITE);
+        assert(fd >= 0);
+        assert(tfsSessionWrite(router, fd, name, strlen(name)) == 0);
+        assert(tfsSessionClose(router, fd) == 0);
+    }
+    assert(tfsSessionMkdir(router, "dir", RW, READ) == 0);
+    assert(tfsSessionCreate(router, "dir/inner", RW, READ) == 0);
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "f%02d", i);
+        readBack(router, name, name);
+    }
+
+    printf("Test: the root lists every shard's names, in order");
+    assert(tfsSessionList(router, "", NULL, 100, buffer, sizeof(buffer)) == NUM_FILES + 1);
+    assert(!strcmp(buffer, "dir"));
+    char* at = buffer + strlen(buffer) + 1;
+    for (int i = 0; i < NUM_FILES; i++, at += strlen(at) + 1) {
+        sprintf(name, "f%02d", i);
+        assert(!strcmp(at, name));
+    }
+    assert(tfsSessionList(router, "f", "f09", 3, buffer, sizeof(buffer)) == 3);
+    assert(!strcmp(buffer, "f10"));
+    assert(tfsSessionList(router, "dir/", NULL, 10, buffer, sizeof(buffer)) == 1);
+    assert(!strcmp(buffer, "inner"));
+
+    printf("Test: renames work whichever shards the names are on");
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "f%02d", i);
+        sprintf(renamed, "g%02d", i);
+        assert(tfsSessionRename(router, name, renamed) == 0);
+        assert(tfsSessionOpen(router, name, READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+        readBack(router, renamed, name);
+    }
+    assert(tfsSessionRename(router, "dir", "moved") == 0);
+    assert(tfsSessionList(router, "moved/", NULL, 10, buffer, sizeof(buffer)) == 1);
+    assert(tfsSessionOpen(router, "dir/inner", READ) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+
+    printf("Test: open files don't move to another shard");
+    int fd = tfsSessionOpen(router, "g00", READ);
+    assert(fd >= 0);
+    int status = TECNICOFS_OK;
+    for (int i = 0; i < NUM_FILES && status == TECNICOFS_OK; i++) {
+        // Same shard: renamed as a server would, open or not
+        sprintf(renamed, "h%02d", i);
+        status = tfsSessionRename(router, "g00", renamed);
+        if (status == TECNICOFS_OK) {
+            assert(tfsSessionRename(router, renamed, "g00") == 0);
+        }
+    }
+    assert(status == TECNICOFS_ERROR_FILE_IS_OPEN);
+    assert(tfsSessionClose(router, fd) == 0);
+
+    printf("Test: transactions stay within a shard");
+    tfs_transaction* transaction;
+    assert(tfsTransactionBegin(&transaction) == 0);
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "t%02d", i);
+        assert(tfsTransactionCreate(transaction, name, RW, NONE) == 0);
+    }
+    assert(tfsSessionCommit(router, transaction) == TECNICOFS_ERROR_CROSS_SHARD);
+    assert(tfsTransactionBegin(&transaction) == 0);
+    assert(tfsTransactionCreate(transaction, "t", RW, NONE) == 0);
+    assert(tfsTransactionWrite(transaction, "t", "committed", 9) == 0);
+    assert(tfsSessionCommit(router, transaction) == 0);
+    readBack(router, "t", "committed");
+
+    printf("Test: a shard joins, taking its names along");
+    assert(tfsSessionJoinShard(router, argv[2]) == 0);
+    assert(tfsSessionJoinShard(router, argv[2]) == TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
+    assert(tfsMountSession(argv[2], &joined) == 0);
+    assert(tfsSessionList(joined, "", NULL, 100, buffer, sizeof(buffer)) > 0);
+    assert(tfsSessionList(router, "", NULL, 100, buffer, sizeof(buffer)) == NUM_FILES + 2);
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "f%02d", i);
+        sprintf(renamed, "g%02d", i);
+        readBack(router, renamed, name);
+        assert(tfsSessionDelete(router, renamed) == 0);
+    }
+    readBack(router, "t", "committed");
+    assert(tfsSessionDelete(router, "t") == 0);
+    assert(tfsSessionDelete(router, "moved/inner") == 0);
+    assert(tfsSessionRmdir(router, "moved") == 0);
+    assert(tfsSessionList(joined, "", NULL, 100, buffer, sizeof(buffer)) == 0);
+
+    assert(tfsUnmountSession(joined) == 0);
+    assert(tfsUnmountSession(router) == 0);
+    printf("\n--> All tests OK\n");
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define THREADS 4
+#define ROUNDS 50
+
+tfs_pool* pool;
+
+void* worker(void* arg) {
+    char name[16], buffer[16];
+    sprintf(name, "t%ld", (long)arg);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        tfs_session* session = tfsPoolAcquire(pool);
+        assert(tfsSessionCreate(session, name, RW, READ) == 0);
+        int fd = tfsSessionOpen(session, name, RW);
+        assert(fd >= 0);
+        assert(tfsSessionWrite(session, fd, name, strlen(name)) == 0);
+        assert(tfsSessionRead(session, fd, buffer, sizeof(buffer)) == (int)strlen(name));
+        assert(!strcmp(buffer, name));
+        assert(tfsSessionClose(session, fd) == 0);
+        assert(tfsSessionDelete(session, name) == 0);
+        tfsPoolRelease(pool, session);
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    tfs_session *first, *second;
+    printf("Test: two sessions in the same process");
+    assert(tfsMountSession(argv[1], &first) == 0);
+    assert(tfsMountSession(argv[1], &second) == 0);
+    assert(tfsSessionCreate(first, "a", RW, READ) == 0);
+    assert(tfsSessionCreate(second, "a", RW, READ) == TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
+    int fd = tfsSessionOpen(first, "a", RW);
+    assert(fd >= 0);
+    printf("Test: file descriptors belong to their session");
+    assert(tfsSessionClose(second, fd) == TECNICOFS_ERROR_FILE_NOT_OPEN);
+    assert(tfsSessionClose(first, fd) == 0);
+    assert(tfsSessionDelete(second, "a") == 0);
+    assert(tfsUnmountSession(first) == 0);
+    assert(tfsUnmountSession(second) == 0);
+
+    printf("Test: threads sharing a pool of sessions");
+    assert(tfsPoolCreate(argv[1], 2, &pool) == 0);
+    pthread_t tids[THREADS];
+    for (long i = 0; i < THREADS; i++) {
+        assert(!pthread_create(tids + i, NULL, worker, (void*)i));
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    assert(tfsPoolDestroy(pool) == 0);
+
+    return 0;
+}
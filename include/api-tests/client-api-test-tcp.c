@@ -0,0 +1,53 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/*
+    Runs against a server listening on TCP (-T port -K token_file) with a
+    token of its own (any other user) in the token file.
+*/
+int main(int argc, char** argv) {
+     if (argc != 3) {
+        printf("Usage: %s sock_path tcp://token@host:port\n", argv[0]);
+        exit(0);
+    }
+    char buffer[64];
+    tfs_session *local, *remote;
+
+    printf("Test: a wrong token is turned down");
+    char* host = strchr(argv[2], '@');
+    assert(host);
+    sprintf(buffer, "tcp://not-a-token%s", host);
+    assert(tfsMountSession(buffer, &remote) == TECNICOFS_ERROR_PERMISSION_DENIED);
+    assert(tfsMountSession("tcp://no-host", &remote) == TECNICOFS_ERROR_CONNECTION_ERROR);
+
+    printf("Test: a TCP session sees what a local one does");
+    assert(tfsMountSession(argv[1], &local) == 0);
+    assert(tfsMountSession(argv[2], &remote) == 0);
+    assert(tfsSessionCreate(local, "shared", RW, READ) == 0);
+    int fd = tfsSessionOpen(local, "shared", WRITE);
+    assert(tfsSessionWrite(local, fd, "over-tcp", 8) == 0);
+    assert(tfsSessionClose(local, fd) == 0);
+    fd = tfsSessionOpen(remote, "shared", READ);
+    assert(fd >= 0);
+    assert(tfsSessionRead(remote, fd, buffer, sizeof(buffer)) == 8);
+    assert(!strcmp(buffer, "over-tcp"));
+    assert(tfsSessionClose(remote, fd) == 0);
+
+    printf("Test: a TCP session acts as its token's user");
+    assert(tfsSessionOpen(remote, "shared", WRITE) == TECNICOFS_ERROR_PERMISSION_DENIED);
+    assert(tfsSessionDelete(remote, "shared") == TECNICOFS_ERROR_PERMISSION_DENIED);
+    assert(tfsSessionCreate(remote, "theirs", RW, NONE) == 0);
+    assert(tfsSessionOpen(local, "theirs", READ) == TECNICOFS_ERROR_PERMISSION_DENIED);
+    assert(tfsSessionDelete(remote, "theirs") == 0);
+    assert(tfsSessionDelete(local, "shared") == 0);
+
+    assert(tfsUnmountSession(remote) == 0);
+    assert(tfsUnmountSession(local) == 0);
+    printf("\n--> All tests OK\n");
+
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define FILES 16
+
+/*
+    Turns tracing on for every request: sessions must carry on as usual,
+    same-host (shared-memory) ones and pipelined requests included.
+*/
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    char names[FILES][8], buffer[16];
+    int requests[FILES];
+    tfs_session* session;
+    assert(tfsMountSession(argv[1], &session) == 0);
+    assert(tfsSessionTraceSampling(session, 1) == 0);
+
+    printf("Test: traced requests are answered");
+    assert(tfsSessionCreate(session, "traced", RW, READ) == 0);
+    int fd = tfsSessionOpen(session, "traced", RW);
+    assert(fd >= 0);
+    assert(tfsSessionWrite(session, fd, "spans", 5) == 0);
+    assert(tfsSessionRead(session, fd, buffer, sizeof(buffer)) == 5);
+    assert(!strcmp(buffer, "spans"));
+    assert(tfsSessionClose(session, fd) == 0);
+
+    printf("Test: traced requests in flight together are answered");
+    for (int i = 0; i < FILES; i++) {
+        sprintf(names[i], "p%d", i);
+        requests[i] = tfsAsyncCreate(session, names[i], RW, READ, NULL, NULL);
+        assert(requests[i] > 0);
+    }
+    for (int i = 0; i < FILES; i++) {
+        assert(tfsWait(session, requests[i]) == 0);
+    }
+    for (int i = 0; i < FILES; i++) {
+        requests[i] = tfsAsyncDelete(session, names[i], NULL, NULL);
+        assert(requests[i] > 0);
+    }
+    for (int i = FILES - 1; i >= 0; i--) {
+        assert(tfsWait(session, requests[i]) == 0);
+    }
+
+    assert(tfsSessionDelete(session, "traced") == 0);
+    assert(tfsSessionTraceSampling(session, 0) == 0);
+    assert(tfsUnmountSession(session) == 0);
+    printf("\n--> All tests OK\n");
+
+    return 0;
+}
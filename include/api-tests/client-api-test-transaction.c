@@ -0,0 +1,79 @@
+#include "../tecnicofs-api-constants.h"
+#include "../tecnicofs-client-api.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+int main(int argc, char** argv) {
+     if (argc != 2) {
+        printf("Usage: %s sock_path\n", argv[0]);
+        exit(0);
+    }
+    char buffer[64];
+    tfs_transaction* t;
+    assert(tfsMount(argv[1]) == 0);
+
+    printf("Test: a transaction applies all of its operations");
+    assert(tfsMkdir("site", RW, READ) == 0);
+    assert(tfsCreate("site/old", RW, READ) == 0);
+    assert(tfsTransactionBegin(&t) == 0);
+    assert(tfsTransactionCreate(t, "site/index", RW, READ) == 0);
+    assert(tfsTransactionWrite(t, "site/index", "hello world", 11) == 0);
+    assert(tfsTransactionCreate(t, "site/draft", RW, READ) == 0);
+    assert(tfsTransactionRename(t, "site/draft", "site/page") == 0);
+    assert(tfsTransactionDelete(t, "site/old") == 0);
+    assert(tfsCommit(t) == 0);
+
+    assert(tfsList("site/", NULL, 10, buffer, sizeof(buffer)) == 2);
+    assert(!strcmp(buffer, "index") && !strcmp(buffer + 6, "page"));
+    int fd = tfsOpen("site/index", READ);
+    assert(fd >= 0);
+    assert(tfsRead(fd, buffer, sizeof(buffer)) == 11);
+    assert(!strcmp(buffer, "hello world"));
+    assert(tfsClose(fd) == 0);
+
+    printf("Test: a failing operation leaves everything as it was");
+    assert(tfsTransactionBegin(&t) == 0);
+    assert(tfsTransactionCreate(t, "site/new", RW, READ) == 0);
+    assert(tfsTransactionWrite(t, "site/index", "replaced", 8) == 0);
+    assert(tfsTransactionDelete(t, "site/page") == 0);
+    assert(tfsTransactionCreate(t, "site/index", RW, READ) == 0);
+    assert(tfsCommit(t) == TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
+
+    assert(tfsList("site/", NULL, 10, buffer, sizeof(buffer)) == 2);
+    assert(!strcmp(buffer, "index") && !strcmp(buffer + 6, "page"));
+    fd = tfsOpen("site/index", READ);
+    assert(tfsRead(fd, buffer, sizeof(buffer)) == 11);
+    assert(tfsClose(fd) == 0);
+
+    printf("Test: operations see the ones before them");
+    assert(tfsTransactionBegin(&t) == 0);
+    assert(tfsTransactionDelete(t, "site/page") == 0);
+    assert(tfsTransactionCreate(t, "site/page", RW, READ) == 0);
+    assert(tfsTransactionRename(t, "site/page", "page") == 0);
+    assert(tfsTransactionRename(t, "page", "site/page") == 0);
+    assert(tfsCommit(t) == 0);
+    assert(tfsTransactionBegin(&t) == 0);
+    assert(tfsTransactionDelete(t, "site/page") == 0);
+    assert(tfsTransactionDelete(t, "site/page") == 0);
+    assert(tfsCommit(t) == TECNICOFS_ERROR_FILE_NOT_FOUND);
+    assert(tfsOpen("site/page", READ) >= 0);
+
+    printf("Test: transactions that can't be sent are refused");
+    assert(tfsTransactionBegin(&t) == 0);
+    assert(tfsTransactionCreate(t, "has space", RW, READ) == TECNICOFS_ERROR_OTHER);
+    assert(tfsCommit(t) == TECNICOFS_ERROR_OTHER);
+    assert(tfsTransactionBegin(&t) == 0);
+    for (int i = 0; i < TRANSACTION_MAX_OPS; i++) {
+        sprintf(buffer, "f%d", i);
+        assert(tfsTransactionCreate(t, buffer, RW, READ) == 0);
+    }
+    assert(tfsTransactionCreate(t, "one-too-many", RW, READ) == TECNICOFS_ERROR_OTHER);
+    tfsTransactionAbort(t);
+
+    assert(tfsUnmount() == 0);
+    printf("\n--> All tests OK\n");
+
+    return 0;
+}
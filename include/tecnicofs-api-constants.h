@@ -1,35 +1,86 @@
-/* tecnicofs-api-constants.h */
-#ifndef TECNICOFS_API_CONSTANTS_H
-#define TECNICOFS_API_CONSTANTS_H
-
-typedef enum permission { NONE, WRITE, READ, RW } permission;
-
-#define MAX_OPEN_FILES 5
-
-/* Operation successful */
-#define TECNICOFS_OK 0
-
-/* Client already has an open session with a TecnicoFS server */
-#define TECNICOFS_ERROR_OPEN_SESSION -1
-/* Doesn't exist an open session */
-#define TECNICOFS_ERROR_NO_OPEN_SESSION -2
-/* Communication failed */
-#define TECNICOFS_ERROR_CONNECTION_ERROR -3
-/* Already exists a file with the given name */
-#define TECNICOFS_ERROR_FILE_ALREADY_EXISTS -4
-/* No file found with the given name */
-#define TECNICOFS_ERROR_FILE_NOT_FOUND -5
-/* Client doesn't have permissions for the operation */
-#define TECNICOFS_ERROR_PERMISSION_DENIED -6
-/* Number of open files that can be open has been reached */
-#define TECNICOFS_ERROR_MAXED_OPEN_FILES -7
-/* File is not open */
-#define TECNICOFS_ERROR_FILE_NOT_OPEN -8
-/* File is open */
-#define TECNICOFS_ERROR_FILE_IS_OPEN -9
-/* File is open in the a mode that doesn't allow the operation */
-#define TECNICOFS_ERROR_INVALID_MODE -10
-/* Generic error */
-#define TECNICOFS_ERROR_OTHER -11
-
-#endif /* TECNICOFS_API_CONSTANTS_H */
+/* tecnicofs-api-constants.h */
+#ifndef TECNICOFS_API_CONSTANTS_H
+#define TECNICOFS_API_CONSTANTS_H
+
+typedef enum permission { NONE, WRITE, READ, RW } permission;
+
+#define MAX_OPEN_FILES 5
+
+/* Listings stream their names in chunks of at most this many bytes */
+#define LIST_CHUNK_SIZE 4096
+
+/* Reads of contents at least this large may come back as a sealed memfd instead ('z') */
+#define READ_BLOB_THRESHOLD 512
+
+/* What follows the status of a successful 'z' reply: the contents, or a blob's size with the blob attached */
+#define READ_REPLY_INLINE 0
+#define READ_REPLY_BLOB 1
+
+/* A transaction carries at most this many operations, in at most this many bytes */
+#define TRANSACTION_MAX_OPS 64
+#define TRANSACTION_MAX_SIZE 8064
+
+/* Operation successful */
+#define TECNICOFS_OK 0
+
+/* Client already has an open session with a TecnicoFS server */
+#define TECNICOFS_ERROR_OPEN_SESSION -1
+/* Doesn't exist an open session */
+#define TECNICOFS_ERROR_NO_OPEN_SESSION -2
+/* Communication failed */
+#define TECNICOFS_ERROR_CONNECTION_ERROR -3
+/* Already exists a file with the given name */
+#define TECNICOFS_ERROR_FILE_ALREADY_EXISTS -4
+/* No file found with the given name */
+#define TECNICOFS_ERROR_FILE_NOT_FOUND -5
+/* Client doesn't have permissions for the operation */
+#define TECNICOFS_ERROR_PERMISSION_DENIED -6
+/* Number of open files that can be open has been reached */
+#define TECNICOFS_ERROR_MAXED_OPEN_FILES -7
+/* File is not open */
+#define TECNICOFS_ERROR_FILE_NOT_OPEN -8
+/* File is open */
+#define TECNICOFS_ERROR_FILE_IS_OPEN -9
+/* File is open in the a mode that doesn't allow the operation */
+#define TECNICOFS_ERROR_INVALID_MODE -10
+/* Generic error */
+#define TECNICOFS_ERROR_OTHER -11
+/* The file behind a lease was deleted, renamed or replaced */
+#define TECNICOFS_ERROR_STALE_LEASE -12
+/* Some component of the path is a file, not a directory */
+#define TECNICOFS_ERROR_NOT_A_DIRECTORY -13
+/* The directory still has entries */
+#define TECNICOFS_ERROR_DIRECTORY_NOT_EMPTY -14
+/* The operation takes a file, the path leads to a directory */
+#define TECNICOFS_ERROR_IS_A_DIRECTORY -15
+/* The server is a replica: it only serves reads */
+#define TECNICOFS_ERROR_READ_ONLY -16
+/* The names of a transaction are on different shards (behind a router) */
+#define TECNICOFS_ERROR_CROSS_SHARD -17
+
+/*
+    What the server grants along with a file opened with 'L': for
+    leaseMs, the client may reopen the file by i-node ('O') without
+    the server resolving its name again.
+*/
+typedef struct {
+    int inumber;
+    unsigned int generation;
+    unsigned int owner;
+    int ownerPermissions;
+    int othersPermissions;
+    int leaseMs;
+} tecnicofs_lease;
+
+/*
+    What 'i' tells whoever runs the server about a name (a router moving
+    it to another shard), ahead of the file's contents.
+*/
+typedef struct {
+    unsigned int owner;
+    int ownerPermissions;
+    int othersPermissions;
+    int isDirectory;
+} tecnicofs_entry;
+
+#endif /* TECNICOFS_API_CONSTANTS_H */
@@ -5,89 +5,838 @@
 
 */
 
+#include <pthread.h>
 #include <unistd.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
 #include "tecnicofs-api-constants.h"
 #include "tecnicofs-client-api.h"
+#include "tecnicofs-shm.h"
 
 #define NOMINAL_BUFFER_SIZE 1024
 #define GLOBAL_BUFFER_SIZE 3 + NOMINAL_BUFFER_SIZE * 2
 
+#define MAX_IN_FLIGHT 64
+#define MAX_CACHED_NAME 64
+
+#define TCP_SCHEME "tcp://"
+#define MAX_TOKEN_SIZE 256
+
 typedef struct sockaddr_un sockaddr;
 
-int currentSocketFD = 0;
-int statuscode[1];
-char cmd[GLOBAL_BUFFER_SIZE];
+enum { SLOT_FREE, SLOT_PENDING, SLOT_DONE };
+
+// What follows the status of a successful reply
+enum { PAYLOAD_NONE, PAYLOAD_CONTENTS, PAYLOAD_LEASE, PAYLOAD_NAMES, PAYLOAD_BLOB };
 
 /*
-    Internal function that sends a command to the tecnicofs server.
+    A request waiting for its reply. Requests are tagged with an id and
+    the slot is picked by id % MAX_IN_FLIGHT.
 */
-int run(char* cmd, void* buff, size_t len) {
-    if (!buff) {
-        buff = statuscode;
-        len = sizeof(int);
+typedef struct {
+    int id;
+    int state;
+    int status;
+    int payload;
+    char* buffer;        // where the payload goes
+    int len;
+    tfs_callback callback;
+    void* arg;
+} tfs_request;
+
+/*
+    A name the server leased to us: until expires, opening it can go
+    straight to the i-node.
+*/
+typedef struct {
+    char name[MAX_CACHED_NAME];
+    tecnicofs_lease lease;
+    uint64_t expires;
+} lease_entry;
+
+struct tfs_session {
+    int socket;
+    shm_channel* shm;    // where requests and replies go instead of the socket, if the server shared it
+    bool local;          // on a unix socket, where large reads may come back as blobs
+    uid_t uid;
+    int nextId;
+    bool receiving;      // some thread is reading a reply off the socket
+    bool broken;
+    pthread_t* receiver; // started by the first request with a callback
+    pthread_mutex_t lock;
+    pthread_mutex_t sendLock;
+    pthread_cond_t changed;
+    tfs_request slots[MAX_IN_FLIGHT];
+
+    // Metadata cache (when enabled), guarded by cacheLock
+    pthread_mutex_t cacheLock;
+    lease_entry* cache;
+    int cacheSize;
+    unsigned long cacheHits;
+    unsigned long cacheMisses;
+    unsigned long cacheStale;
+};
+
+/*
+    Operations waiting to be committed, already laid out as the lines
+    of the request: "\nop path [arg]" each.
+*/
+struct tfs_transaction {
+    int numOps;
+    int size;
+    bool overflown;      // an operation didn't fit, committing fails
+    char ops[TRANSACTION_MAX_SIZE];
+};
+
+struct tfs_pool {
+    int size;
+    int available;
+    tfs_session** sessions;
+    bool* busy;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+};
+
+// The session behind the legacy (global) API
+tfs_session* globalSession = NULL;
+
+static int readFully(tfs_session* session, void* buffer, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = session -> shm
+            ? shm_read(&session -> shm -> replies, (char*)buffer + got, len - got, session -> socket)
+            : read(session -> socket, (char*)buffer + got, len - got);
+        if (r <= 0) {
+            return -1;
+        }
+        got += r;
+    }
+    return 0;
+}
+
+/*
+    Reads a listing's chunks of names up to the empty one that ends it,
+    keeping the (whole) names that fit in buffer. Called without the
+    session lock.
+
+    Returns: 0 if successful (and how many names were kept in *count),
+    -1 if the connection is gone.
+*/
+static int receiveNames(tfs_session* session, char* buffer, int len, int* count) {
+    char chunk[LIST_CHUNK_SIZE];
+    int size;
+    int used = 0;
+    bool full = false;
+    *count = 0;
+
+    for (;;) {
+        if (readFully(session, &size, sizeof(size)) || size < 0 || size > LIST_CHUNK_SIZE) {
+            return -1;
+        }
+        if (!size) {
+            return 0;
+        }
+        if (readFully(session, chunk, size)) {
+            return -1;
+        }
+        for (int at = 0; at < size; ) {
+            int nameLen = strnlen(chunk + at, size - at) + 1;
+            if (!full && used + nameLen <= len) {
+                memcpy(buffer + used, chunk + at, nameLen);
+                buffer[used + nameLen - 1] = '\0';
+                used += nameLen;
+                (*count)++;
+            } else {
+                // Later names must not show up without the ones before them
+                full = true;
+            }
+            at += nameLen;
+        }
     }
+}
 
-    if (!currentSocketFD) {
+/*
+    Takes a blob (see inode_blob) off the socket, where it always comes even
+    if the session has shared memory, and copies up to len - 1 bytes of it
+    into buffer. Called without the session lock.
+
+    Returns: 0 if successful (and how many bytes were copied in *count),
+    -1 if the connection is gone.
+*/
+static int receiveBlob(tfs_session* session, char* buffer, int len, int* count) {
+    int size = -1;
+    int blob = -1;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec data = { &size, sizeof(size) };
+    struct msghdr message = { NULL, 0, &data, 1, control, sizeof(control), 0 };
+    if (recvmsg(session -> socket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(size)) {
+        return -1;
+    }
+    struct cmsghdr* attached = CMSG_FIRSTHDR(&message);
+    if (attached && attached -> cmsg_level == SOL_SOCKET && attached -> cmsg_type == SCM_RIGHTS) {
+        memcpy(&blob, CMSG_DATA(attached), sizeof(int));
+    }
+    if (blob < 0 || size <= 0) {
+        if (blob >= 0) {
+            close(blob);
+        }
+        return -1;
+    }
+
+    char* contents = mmap(NULL, size, PROT_READ, MAP_SHARED, blob, 0);
+    close(blob);
+    if (contents == MAP_FAILED) {
+        return -1;
+    }
+    *count = size < len ? size : len - 1;
+    memcpy(buffer, contents, *count);
+    buffer[*count] = '\0';
+    munmap(contents, size);
+    return 0;
+}
+
+/*
+    Completes a request: hands the status to its callback, or leaves it
+    for tfsWait(). Called with the session lock held.
+*/
+static void complete(tfs_session* session, tfs_request* req, int status) {
+    req -> status = status;
+    if (req -> callback) {
+        tfs_callback callback = req -> callback;
+        void* arg = req -> arg;
+        req -> state = SLOT_FREE;
+        pthread_mutex_unlock(&session -> lock);
+        callback(status, arg);
+        pthread_mutex_lock(&session -> lock);
+    } else {
+        req -> state = SLOT_DONE;
+    }
+    pthread_cond_broadcast(&session -> changed);
+}
+
+/*
+    Reads one reply off the socket and completes its request. Only one
+    thread receives at a time; called with the session lock held.
+
+    Returns: 0 if successful, -1 if the connection is gone (every pending
+    request then fails with TECNICOFS_ERROR_CONNECTION_ERROR).
+*/
+static int receive(tfs_session* session) {
+    int header[2];
+    session -> receiving = true;
+    pthread_mutex_unlock(&session -> lock);
+    int failed = readFully(session, header, sizeof(header));
+    pthread_mutex_lock(&session -> lock);
+
+    tfs_request* req = session -> slots + (unsigned int)header[0] % MAX_IN_FLIGHT;
+    if (!failed && (req -> state != SLOT_PENDING || req -> id != header[0])) {
+        // Not something we asked for, the stream can't be trusted anymore
+        failed = -1;
+    }
+
+    bool inlined = req -> payload == PAYLOAD_CONTENTS;
+    if (!failed && req -> payload == PAYLOAD_LEASE && header[1] >= 0) {
+        // Leasing opens carry the lease after the fd
+        tecnicofs_lease lease;
+        pthread_mutex_unlock(&session -> lock);
+        failed = readFully(session, &lease, sizeof(lease));
+        pthread_mutex_lock(&session -> lock);
+        memcpy(req -> buffer, &lease, sizeof(lease));
+    } else if (!failed && req -> payload == PAYLOAD_NAMES && header[1] >= 0) {
+        // Listings stream their names after the status, the request gets their count
+        char* buffer = req -> buffer;
+        int len = req -> len;
+        pthread_mutex_unlock(&session -> lock);
+        failed = receiveNames(session, buffer, len, header + 1);
+        pthread_mutex_lock(&session -> lock);
+    } else if (!failed && req -> payload == PAYLOAD_BLOB && header[1] >= 0) {
+        // Blob reads say first whether the contents follow or come as a blob
+        int kind;
+        char* buffer = req -> buffer;
+        int len = req -> len;
+        pthread_mutex_unlock(&session -> lock);
+        failed = readFully(session, &kind, sizeof(kind));
+        if (!failed && kind == READ_REPLY_BLOB) {
+            failed = receiveBlob(session, buffer, len, header + 1);
+        }
+        pthread_mutex_lock(&session -> lock);
+        inlined = kind != READ_REPLY_BLOB;
+    }
+    if (!failed && inlined && header[1] >= 0) {
+        // Read replies carry the contents (and their '\0') after the status
+        char* contents = malloc(header[1] + 1);
+        pthread_mutex_unlock(&session -> lock);
+        failed = readFully(session, contents, header[1] + 1);
+        pthread_mutex_lock(&session -> lock);
+        if (!failed) {
+            int size = header[1] + 1 < req -> len ? header[1] + 1 : req -> len;
+            memcpy(req -> buffer, contents, size);
+            req -> buffer[size - 1] = '\0';
+        }
+        free(contents);
+    }
+    session -> receiving = false;
+
+    if (failed) {
+        session -> broken = true;
+        for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+            if (session -> slots[i].state == SLOT_PENDING) {
+                complete(session, session -> slots + i, TECNICOFS_ERROR_CONNECTION_ERROR);
+            }
+        }
+        pthread_cond_broadcast(&session -> changed);
+        return -1;
+    }
+
+    complete(session, req, header[1]);
+    return 0;
+}
+
+/*
+    Drives the replies of requests with callbacks (nobody waits for those).
+*/
+static void* receiverThread(void* ptr) {
+    tfs_session* session = ptr;
+    pthread_mutex_lock(&session -> lock);
+    while (!session -> broken) {
+        if (session -> receiving) {
+            pthread_cond_wait(&session -> changed, &session -> lock);
+        } else if (receive(session) < 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session -> lock);
+    return NULL;
+}
+
+/*
+    Internal function that sends a command to the tecnicofs server tagged
+    with a fresh request id, without waiting for the answer. Requests
+    whose replies carry a payload hand over the buffer where it goes.
+
+    Returns:
+    - The request id (> 0), if successful;
+    - Error code, otherwise.
+*/
+static int submit(tfs_session* session, char* cmd, int payload, char* buffer, int len, tfs_callback callback, void* arg) {
+    char tagged[TRANSACTION_MAX_SIZE + 16];
+    if (!session) {
         return TECNICOFS_ERROR_NO_OPEN_SESSION;
     }
 
-    if (send(currentSocketFD, cmd, (strlen(cmd) + 1) * sizeof(int), 0) < 0) {
+    pthread_mutex_lock(&session -> lock);
+    if (callback && !session -> receiver) {
+        session -> receiver = malloc(sizeof(pthread_t));
+        if (pthread_create(session -> receiver, NULL, receiverThread, session)) {
+            free(session -> receiver);
+            session -> receiver = NULL;
+            pthread_mutex_unlock(&session -> lock);
+            return TECNICOFS_ERROR_OTHER;
+        }
+    }
+
+    // Wait for the slot of our id to be free (at most MAX_IN_FLIGHT requests in flight)
+    int id = session -> nextId;
+    session -> nextId = session -> nextId == INT32_MAX ? 1 : session -> nextId + 1;
+    tfs_request* req = session -> slots + id % MAX_IN_FLIGHT;
+    while (req -> state != SLOT_FREE && !session -> broken) {
+        pthread_cond_wait(&session -> changed, &session -> lock);
+    }
+    if (session -> broken) {
+        pthread_mutex_unlock(&session -> lock);
         return TECNICOFS_ERROR_CONNECTION_ERROR;
     }
+    req -> id = id;
+    req -> state = SLOT_PENDING;
+    req -> payload = payload;
+    req -> buffer = buffer;
+    req -> len = len;
+    req -> callback = callback;
+    req -> arg = arg;
+    pthread_mutex_unlock(&session -> lock);
+
+    int size = snprintf(tagged, sizeof(tagged), "@%d %s", id, cmd) + 1;
+    pthread_mutex_lock(&session -> sendLock);
+    int sent = session -> shm
+        ? (shm_write(&session -> shm -> requests, tagged, size, session -> socket) < 0 ? -1 : size)
+        : send(session -> socket, tagged, size, MSG_NOSIGNAL);
+    pthread_mutex_unlock(&session -> sendLock);
 
-    if (read(currentSocketFD, buff, len) < 1) {
+    if (sent < size) {
+        pthread_mutex_lock(&session -> lock);
+        req -> state = SLOT_FREE;
+        pthread_cond_broadcast(&session -> changed);
+        pthread_mutex_unlock(&session -> lock);
         return TECNICOFS_ERROR_CONNECTION_ERROR;
     }
+    return id;
+}
+
+/*
+    Waits for the reply to the given request. While nobody else is
+    reading the socket, the waiting thread receives replies itself
+    (completing other requests along the way).
+
+    Returns: the status of the request.
+*/
+int tfsWait(tfs_session* session, int request) {
+    if (!session) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    if (request <= 0) {
+        return request;
+    }
+
+    pthread_mutex_lock(&session -> lock);
+    tfs_request* req = session -> slots + request % MAX_IN_FLIGHT;
+    if (req -> id != request || req -> state == SLOT_FREE || req -> callback) {
+        pthread_mutex_unlock(&session -> lock);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    while (req -> state == SLOT_PENDING) {
+        if (session -> receiving || session -> receiver) {
+            pthread_cond_wait(&session -> changed, &session -> lock);
+        } else {
+            receive(session);
+        }
+    }
 
-    return *((int*)buff);
+    int status = req -> status;
+    req -> state = SLOT_FREE;
+    pthread_cond_broadcast(&session -> changed);
+    pthread_mutex_unlock(&session -> lock);
+    return status;
 }
 
 /*
-    Mounts the client to the tecnicofs server via the socket provided by the address.
+    Internal function that sends a command to the tecnicofs server, and
+    waits for the answer.
 */
-int tfsMount(char* address) {
-    if (currentSocketFD) {
-        return TECNICOFS_ERROR_OPEN_SESSION;
+static int run(tfs_session* session, char* cmd, int payload, char* buffer, int len) {
+    return tfsWait(session, submit(session, cmd, payload, buffer, len, NULL, NULL));
+}
+
+/*
+    Connects to a TCP address, "token@host:port" (the scheme already
+    stripped off), and copies the token out.
+
+    Returns: the connected socket, -1 if the address is malformed or the
+    connection fails.
+*/
+static int connectTcp(char* address, char* token) {
+    char* at = strchr(address, '@');
+    char* port = strrchr(address, ':');
+    if (!at || !port || port < at || at - address >= MAX_TOKEN_SIZE) {
+        return -1;
     }
+    memcpy(token, address, at - address);
+    token[at - address] = '\0';
 
-    sockaddr* server = malloc(sizeof(sockaddr));
-    currentSocketFD = socket(AF_UNIX, SOCK_STREAM, 0);
-    memset(server, '\0', sizeof(*server));
-    server -> sun_family = AF_UNIX;
-    strcpy(server -> sun_path, address);
+    char host[256];
+    snprintf(host, sizeof(host), "%.*s", (int)(port - at - 1), at + 1);
+    struct addrinfo hints, *found;
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port + 1, &hints, &found)) {
+        return -1;
+    }
+
+    int sock = -1;
+    for (struct addrinfo* candidate = found; candidate && sock < 0; candidate = candidate -> ai_next) {
+        sock = socket(candidate -> ai_family, SOCK_STREAM, 0);
+        if (sock >= 0 && connect(sock, candidate -> ai_addr, candidate -> ai_addrlen)) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(found);
+
+    // Requests are small and wait for their replies, don't hold them back
+    int on = 1;
+    if (sock >= 0 && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on))) {
+        close(sock);
+        sock = -1;
+    }
+    return sock;
+}
 
-    if (connect(currentSocketFD, (struct sockaddr*)server, sizeof(*server))) {
+static int connectUnix(char* address) {
+    sockaddr server;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&server, '\0', sizeof(server));
+    server.sun_family = AF_UNIX;
+    strncpy(server.sun_path, address, sizeof(server.sun_path) - 1);
+
+    if (connect(sock, (struct sockaddr*)&server, sizeof(server))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+    Asks the server to move the session to shared memory (see
+    tecnicofs-shm.h), before anything else goes through it. Servers that
+    won't (or can't) leave the session on the socket.
+*/
+static void shareMemory(tfs_session* session) {
+    char request[] = "h 0 0";
+    if (send(session -> socket, request, sizeof(request), MSG_NOSIGNAL) != sizeof(request)) {
+        return;
+    }
+
+    int status = TECNICOFS_ERROR_OTHER;
+    int fd = -1;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec reply = { &status, sizeof(status) };
+    struct msghdr message = { NULL, 0, &reply, 1, control, sizeof(control), 0 };
+    if (recvmsg(session -> socket, &message, MSG_WAITALL) != sizeof(status) || status != TECNICOFS_OK) {
+        return;
+    }
+    struct cmsghdr* attached = CMSG_FIRSTHDR(&message);
+    if (attached && attached -> cmsg_level == SOL_SOCKET && attached -> cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(attached), sizeof(int));
+    }
+    if (fd < 0) {
+        return;
+    }
+    shm_channel* shm = mmap(NULL, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm != MAP_FAILED) {
+        session -> shm = shm;
+    }
+}
+
+/*
+    Mounts a new session to the tecnicofs server via the socket provided by the address:
+    a socket path, or tcp://token@host:port for the server's TCP listener.
+
+    Returns:
+    - TECNICOFS_OK, if successful (and the new session in *session);
+    - Error code, otherwise.
+*/
+int tfsMountSession(char* address, tfs_session** session) {
+    tfs_session* new = malloc(sizeof(tfs_session));
+    if (!new) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    char token[MAX_TOKEN_SIZE];
+    bool tcp = !strncmp(address, TCP_SCHEME, strlen(TCP_SCHEME));
+    new -> socket = tcp ? connectTcp(address + strlen(TCP_SCHEME), token) : connectUnix(address);
+    if (new -> socket < 0) {
+        free(new);
         return TECNICOFS_ERROR_CONNECTION_ERROR;
     }
 
-    return run("p 0 0", NULL, 0);
+    new -> uid = getuid();
+    new -> shm = NULL;
+    new -> local = !tcp;
+    new -> cache = NULL;
+    new -> cacheSize = 0;
+    new -> cacheHits = new -> cacheMisses = new -> cacheStale = 0;
+    pthread_mutex_init(&new -> cacheLock, NULL);
+    new -> nextId = 1;
+    new -> receiving = false;
+    new -> broken = false;
+    new -> receiver = NULL;
+    for (int i = 0; i < MAX_IN_FLIGHT; i++) {
+        new -> slots[i].state = SLOT_FREE;
+    }
+    pthread_mutex_init(&new -> lock, NULL);
+    pthread_mutex_init(&new -> sendLock, NULL);
+    pthread_cond_init(&new -> changed, NULL);
+
+    // Over TCP the server only knows who we are from the token, and tells us
+    int status;
+    if (!tcp) {
+        shareMemory(new);
+    } else {
+        char auth[MAX_TOKEN_SIZE + 3];
+        snprintf(auth, sizeof(auth), "a %s", token);
+        status = run(new, auth, PAYLOAD_NONE, NULL, 0);
+        if (status < 0) {
+            tfsUnmountSession(new);
+            return status;
+        }
+        new -> uid = (uid_t)status;
+    }
+
+    status = run(new, "p 0 0", PAYLOAD_NONE, NULL, 0);
+    if (status != TECNICOFS_OK) {
+        tfsUnmountSession(new);
+        return status;
+    }
+
+    *session = new;
+    return TECNICOFS_OK;
 }
 
 /*
-    Unmounts the client from the current tecnicofs server.
+    Unmounts the session from the tecnicofs server and releases it.
+    Requests still in flight fail with TECNICOFS_ERROR_CONNECTION_ERROR.
 */
-int tfsUnmount() {
-    if (!currentSocketFD) {
+int tfsUnmountSession(tfs_session* session) {
+    if (!session) {
         return TECNICOFS_ERROR_NO_OPEN_SESSION;
     }
 
-    if (close(currentSocketFD)) {
+    if (session -> shm) {
+        // The server sees the end of the requests, the receiver that of the replies
+        shm_close(&session -> shm -> requests);
+        shm_close(&session -> shm -> replies);
+    }
+    if (session -> receiver) {
+        // Wakes the receiver up with an end of stream
+        shutdown(session -> socket, SHUT_RDWR);
+        pthread_join(*session -> receiver, NULL);
+        free(session -> receiver);
+    }
+
+    int closed = close(session -> socket);
+    if (session -> shm) {
+        munmap(session -> shm, sizeof(shm_channel));
+    }
+    pthread_mutex_destroy(&session -> lock);
+    pthread_mutex_destroy(&session -> sendLock);
+    pthread_cond_destroy(&session -> changed);
+    pthread_mutex_destroy(&session -> cacheLock);
+    free(session -> cache);
+    free(session);
+    return closed ? TECNICOFS_ERROR_OTHER : TECNICOFS_OK;
+}
+
+static uint64_t clockNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static lease_entry* cacheSlot(tfs_session* session, char* name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (char* c = name; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return session -> cache + hash % session -> cacheSize;
+}
+
+/*
+    Looks the name up in the session's cache, copying its lease if it's
+    still valid. Returns whether it was.
+*/
+static bool cacheLookup(tfs_session* session, char* name, tecnicofs_lease* lease) {
+    bool hit = false;
+    pthread_mutex_lock(&session -> cacheLock);
+    if (session -> cache) {
+        lease_entry* entry = cacheSlot(session, name);
+        hit = entry -> expires > clockNow() && !strcmp(entry -> name, name);
+        if (hit) {
+            *lease = entry -> lease;
+            session -> cacheHits++;
+        } else {
+            session -> cacheMisses++;
+        }
+    }
+    pthread_mutex_unlock(&session -> cacheLock);
+    return hit;
+}
+
+static void cacheStore(tfs_session* session, char* name, tecnicofs_lease* lease, uint64_t granted) {
+    if (strlen(name) >= MAX_CACHED_NAME || lease -> leaseMs <= 0) {
+        return;
+    }
+    pthread_mutex_lock(&session -> cacheLock);
+    if (session -> cache) {
+        lease_entry* entry = cacheSlot(session, name);
+        strcpy(entry -> name, name);
+        entry -> lease = *lease;
+        // Counted from when we asked, so we never outlive the server's side
+        entry -> expires = granted + (uint64_t)lease -> leaseMs * 1000000ull;
+    }
+    pthread_mutex_unlock(&session -> cacheLock);
+}
+
+static void cacheForget(tfs_session* session, char* name) {
+    pthread_mutex_lock(&session -> cacheLock);
+    if (session -> cache) {
+        lease_entry* entry = cacheSlot(session, name);
+        if (!strcmp(entry -> name, name)) {
+            entry -> expires = 0;
+        }
+    }
+    pthread_mutex_unlock(&session -> cacheLock);
+}
+
+/*
+    Turns the session's metadata cache on (with room for the given number
+    of names) or off (0). While it's on, tfsSessionOpen asks the server
+    for a lease on every name it opens, and opens leased names by i-node,
+    skipping the name lookup on the server.
+
+    Returns:
+    - TECNICOFS_OK, if successful;
+    - Error code, otherwise.
+*/
+int tfsSessionCache(tfs_session* session, int entries) {
+    if (!session) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+    if (entries < 0) {
         return TECNICOFS_ERROR_OTHER;
     }
 
-    currentSocketFD = 0;
+    lease_entry* cache = entries ? calloc(entries, sizeof(lease_entry)) : NULL;
+    if (entries && !cache) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    pthread_mutex_lock(&session -> cacheLock);
+    free(session -> cache);
+    session -> cache = cache;
+    session -> cacheSize = entries;
+    pthread_mutex_unlock(&session -> cacheLock);
     return TECNICOFS_OK;
 }
 
+/*
+    Gets how many opens found their name in the cache, how many didn't,
+    and how many cached leases turned out to be stale.
+*/
+void tfsSessionCacheStats(tfs_session* session, unsigned long* hits, unsigned long* misses, unsigned long* stale) {
+    pthread_mutex_lock(&session -> cacheLock);
+    *hits = session -> cacheHits;
+    *misses = session -> cacheMisses;
+    *stale = session -> cacheStale;
+    pthread_mutex_unlock(&session -> cacheLock);
+}
+
+/*
+    Asynchronous operations: they return as soon as the request is sent.
+
+    Returns:
+    - The request id (> 0), to hand over to tfsWait(), if successful;
+    - Error code, otherwise.
+
+    If a callback is given, it gets the status of the request instead
+    (from a receiver thread of the session) and the request can't be
+    waited for. Reads and listings fill buffer once complete, so it must
+    stay valid until then.
+*/
+int tfsAsyncCreate(tfs_session* session, char *filename, permission ownerPermissions, permission othersPermissions, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "c %s %d%d", filename, ownerPermissions, othersPermissions);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncDelete(tfs_session* session, char *filename, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    if (session) {
+        cacheForget(session, filename);
+    }
+    snprintf(cmd, sizeof(cmd), "d %s", filename);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncMkdir(tfs_session* session, char *path, permission ownerPermissions, permission othersPermissions, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "m %s %d%d", path, ownerPermissions, othersPermissions);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncRmdir(tfs_session* session, char *path, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "e %s", path);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncRename(tfs_session* session, char *filenameOld, char *filenameNew, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    if (session) {
+        cacheForget(session, filenameOld);
+    }
+    snprintf(cmd, sizeof(cmd), "r %s %s", filenameOld, filenameNew);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncOpen(tfs_session* session, char *filename, permission mode, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "o %s %d", filename, mode);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncClose(tfs_session* session, int fd, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "x %d", fd);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncRead(tfs_session* session, int fd, char *buffer, int len, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    // Large reads on this host may skip the copies through the socket
+    bool blob = session && session -> local && len >= READ_BLOB_THRESHOLD;
+    snprintf(cmd, sizeof(cmd), "%c %d %d", blob ? 'z' : 'l', fd, len);
+    return submit(session, cmd, blob ? PAYLOAD_BLOB : PAYLOAD_CONTENTS, buffer, len, callback, arg);
+}
+
+int tfsAsyncWrite(tfs_session* session, int fd, char *buffer, int len, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "w %d %.*s", fd, len, buffer);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
+int tfsAsyncList(tfs_session* session, char* prefix, char* cursor, int limit, char* buffer, int len, tfs_callback callback, void* arg) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    if (cursor && *cursor) {
+        snprintf(cmd, sizeof(cmd), "n %d:%s %s", limit, prefix, cursor);
+    } else {
+        snprintf(cmd, sizeof(cmd), "n %d:%s", limit, prefix);
+    }
+    return submit(session, cmd, PAYLOAD_NAMES, buffer, len, callback, arg);
+}
+
+/*
+    Commits the transaction (see tfsSessionCommit) without waiting for it.
+*/
+int tfsAsyncCommit(tfs_session* session, tfs_transaction* transaction, tfs_callback callback, void* arg) {
+    char cmd[TRANSACTION_MAX_SIZE + 16];
+    if (transaction -> overflown) {
+        tfsTransactionAbort(transaction);
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    // Leases on names it deletes or renames are as good as gone
+    for (char* line = strchr(transaction -> ops, '\n'); session && line; line = strchr(line + 1, '\n')) {
+        if (line[1] == 'd' || line[1] == 'r') {
+            char name[MAX_CACHED_NAME];
+            if (sscanf(line + 3, "%63s", name) == 1) {
+                cacheForget(session, name);
+            }
+        }
+    }
+
+    snprintf(cmd, sizeof(cmd), "t %d%s", transaction -> numOps, transaction -> ops);
+    tfsTransactionAbort(transaction);
+    return submit(session, cmd, PAYLOAD_NONE, NULL, 0, callback, arg);
+}
+
 /*
     Creates a file with the given name.
 
@@ -95,9 +844,8 @@ int tfsUnmount() {
     - TECNICOFS_OK, if successful;
     - Error code, otherwise.
 */
-int tfsCreate(char *filename, permission ownerPermissions, permission othersPermissions) {
-    sprintf(cmd, "c %s %d%d", filename, ownerPermissions, othersPermissions);
-    return run(cmd, NULL, 0);
+int tfsSessionCreate(tfs_session* session, char *filename, permission ownerPermissions, permission othersPermissions) {
+    return tfsWait(session, tfsAsyncCreate(session, filename, ownerPermissions, othersPermissions, NULL, NULL));
 }
 
 /*
@@ -107,33 +855,86 @@ int tfsCreate(char *filename, permission ownerPermissions, permission othersPerm
     - TECNICOFS_OK, if successful;
     - Error code, otherwise.
 */
-int tfsDelete(char *filename) {
-    sprintf(cmd, "d %s", filename);
-    return run(cmd, NULL, 0);
+int tfsSessionDelete(tfs_session* session, char *filename) {
+    return tfsWait(session, tfsAsyncDelete(session, filename, NULL, NULL));
 }
 
 /*
-    Renames the given file to the new name.
+    Creates a directory at the given path ("dir/.../name", the directories
+    above it must exist). Every other call takes paths as well; plain
+    names are in the root directory.
 
     Returns:
     - TECNICOFS_OK, if successful;
     - Error code, otherwise.
 */
-int tfsRename(char *filenameOld, char *filenameNew) {
-    sprintf(cmd, "r %s %s", filenameOld, filenameNew);
-    return run(cmd, NULL, 0);
+int tfsSessionMkdir(tfs_session* session, char *path, permission ownerPermissions, permission othersPermissions) {
+    return tfsWait(session, tfsAsyncMkdir(session, path, ownerPermissions, othersPermissions, NULL, NULL));
 }
 
 /*
-    Opens the given file in the given mode.
+    Deletes the directory at the given path, which must be empty.
+
+    Returns:
+    - TECNICOFS_OK, if successful;
+    - Error code, otherwise.
+*/
+int tfsSessionRmdir(tfs_session* session, char *path) {
+    return tfsWait(session, tfsAsyncRmdir(session, path, NULL, NULL));
+}
+
+/*
+    Renames (or moves) the given file or directory to the new path.
+
+    Returns:
+    - TECNICOFS_OK, if successful;
+    - Error code, otherwise.
+*/
+int tfsSessionRename(tfs_session* session, char *filenameOld, char *filenameNew) {
+    return tfsWait(session, tfsAsyncRename(session, filenameOld, filenameNew, NULL, NULL));
+}
+
+/*
+    Opens the given file in the given mode. With the session's cache on,
+    names leased before are opened by i-node (see tfsSessionCache).
 
     Returns:
     - The file descriptor, if successful;
     - Error code, otherwise.
 */
-int tfsOpen(char *filename, permission mode) {
-    sprintf(cmd, "o %s %d", filename, mode);
-    return run(cmd, NULL, 0);
+int tfsSessionOpen(tfs_session* session, char *filename, permission mode) {
+    char cmd[GLOBAL_BUFFER_SIZE];
+    tecnicofs_lease lease;
+    if (!session || !session -> cache) {
+        return tfsWait(session, tfsAsyncOpen(session, filename, mode, NULL, NULL));
+    }
+
+    if (cacheLookup(session, filename, &lease)) {
+        permission allowed = session -> uid == lease.owner ? lease.ownerPermissions : lease.othersPermissions;
+        if ((mode & allowed) != mode) {
+            return TECNICOFS_ERROR_PERMISSION_DENIED;
+        }
+
+        snprintf(cmd, sizeof(cmd), "O %d:%u %d", lease.inumber, lease.generation, mode);
+        int fd = run(session, cmd, PAYLOAD_NONE, NULL, 0);
+        if (fd != TECNICOFS_ERROR_STALE_LEASE) {
+            return fd;
+        }
+
+        // Deleted, renamed or replaced behind our back: resolve the name again
+        pthread_mutex_lock(&session -> cacheLock);
+        session -> cacheStale++;
+        pthread_mutex_unlock(&session -> cacheLock);
+        cacheForget(session, filename);
+    }
+
+    uint64_t asked = clockNow();
+    snprintf(cmd, sizeof(cmd), "L %s %d", filename, mode);
+    int fd = run(session, cmd, PAYLOAD_LEASE, (char*)&lease, sizeof(lease));
+    if (fd >= 0) {
+        cacheStore(session, filename, &lease, asked);
+    }
+    return fd;
 }
 
 /*
@@ -143,9 +944,8 @@ int tfsOpen(char *filename, permission mode) {
     - TECNICOFS_OK, if successful;
     - Error code, otherwise.
 */
-int tfsClose(int fd) {
-    sprintf(cmd, "x %d", fd);
-    return run(cmd, NULL, 0);
+int tfsSessionClose(tfs_session* session, int fd) {
+    return tfsWait(session, tfsAsyncClose(session, fd, NULL, NULL));
 }
 
 /*
@@ -155,13 +955,8 @@ int tfsClose(int fd) {
     - The number of characters actually read (0 <= x <= len), if successful;
     - Error code, otherwise.
 */
-int tfsRead(int fd, char *buffer, int len) {
-    void* out = malloc(sizeof(int) + len * sizeof(char));
-    sprintf(cmd, "l %d %d", fd, len);
-    int result = run(cmd, out, sizeof(int) + len * sizeof(char));
-    strcpy(buffer, (char*)((intptr_t)out + (intptr_t)sizeof(int)));
-    free(out);
-    return result;
+int tfsSessionRead(tfs_session* session, int fd, char *buffer, int len) {
+    return tfsWait(session, tfsAsyncRead(session, fd, buffer, len, NULL, NULL));
 }
 
 /*
@@ -171,7 +966,336 @@ int tfsRead(int fd, char *buffer, int len) {
     - TECNICOFS_OK, if successful;
     - Error code, otherwise.
 */
+int tfsSessionWrite(tfs_session* session, int fd, char *buffer, int len) {
+    return tfsWait(session, tfsAsyncWrite(session, fd, buffer, len, NULL, NULL));
+}
+
+/*
+    Lists, in order, up to limit names of a directory starting with prefix
+    ("dir/.../prefix"; "" for every name in the root) that come after cursor (NULL or "" to start from the first).
+    The names are put in buffer one after the other, each ending in '\0';
+    to get the next page, pass the last of them as the cursor. Names that
+    don't fit in buffer are left out (along with every name after them).
+
+    Returns:
+    - The number of names put in buffer (0 once there are no more), if successful;
+    - Error code, otherwise.
+*/
+int tfsSessionList(tfs_session* session, char* prefix, char* cursor, int limit, char* buffer, int len) {
+    return tfsWait(session, tfsAsyncList(session, prefix, cursor, limit, buffer, len, NULL, NULL));
+}
+
+/*
+    Starts a transaction: a batch of creates, deletes, renames and writes
+    that the server applies all at once, or not at all.
+
+    Returns:
+    - TECNICOFS_OK, if successful (and the new transaction in *transaction);
+    - Error code, otherwise.
+*/
+int tfsTransactionBegin(tfs_transaction** transaction) {
+    tfs_transaction* t = malloc(sizeof(tfs_transaction));
+    if (!t) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    t -> numOps = 0;
+    t -> size = 0;
+    t -> overflown = false;
+    t -> ops[0] = '\0';
+    *transaction = t;
+    return TECNICOFS_OK;
+}
+
+/*
+    Adds an operation line to the transaction, unless it would make it
+    too large (or, for names, the line would be ambiguous).
+*/
+static int addOperation(tfs_transaction* transaction, char op, char* path, char* arg, int argLen) {
+    int room = TRANSACTION_MAX_SIZE - 16 - transaction -> size;
+    int size = -1;
+    if (
+        transaction -> numOps < TRANSACTION_MAX_OPS &&
+        !strpbrk(path, " \n") && (!arg || !memchr(arg, '\n', argLen))
+    ) {
+        char* at = transaction -> ops + transaction -> size;
+        size = arg
+            ? snprintf(at, room, "\n%c %s %.*s", op, path, argLen, arg)
+            : snprintf(at, room, "\n%c %s", op, path);
+    }
+    if (size < 0 || size >= room) {
+        transaction -> ops[transaction -> size] = '\0';
+        transaction -> overflown = true;
+        return TECNICOFS_ERROR_OTHER;
+    }
+    transaction -> size += size;
+    transaction -> numOps++;
+    return TECNICOFS_OK;
+}
+
+/*
+    Adds the creation of a file to the transaction (as tfsSessionCreate).
+    Names can't have spaces; a transaction carries at most
+    TRANSACTION_MAX_OPS operations in TRANSACTION_MAX_SIZE bytes.
+
+    Returns:
+    - TECNICOFS_OK, if successful;
+    - Error code, otherwise (and committing the transaction fails).
+*/
+int tfsTransactionCreate(tfs_transaction* transaction, char *filename, permission ownerPermissions, permission othersPermissions) {
+    char perms[3] = { '0' + ownerPermissions, '0' + othersPermissions, '\0' };
+    return addOperation(transaction, 'c', filename, perms, 2);
+}
+
+int tfsTransactionDelete(tfs_transaction* transaction, char *filename) {
+    return addOperation(transaction, 'd', filename, NULL, 0);
+}
+
+int tfsTransactionRename(tfs_transaction* transaction, char *filenameOld, char *filenameNew) {
+    if (strpbrk(filenameNew, " \n")) {
+        transaction -> overflown = true;
+        return TECNICOFS_ERROR_OTHER;
+    }
+    return addOperation(transaction, 'r', filenameOld, filenameNew, strlen(filenameNew));
+}
+
+/*
+    Adds a write to the transaction: unlike tfsSessionWrite, it goes by
+    name (no need to open the file), replacing the file's contents with
+    the given ones, which can't have line breaks. Takes write permission
+    on the file, or creating it earlier in the same transaction.
+*/
+int tfsTransactionWrite(tfs_transaction* transaction, char *filename, char *buffer, int len) {
+    return addOperation(transaction, 'w', filename, buffer, len);
+}
+
+/*
+    Discards the transaction without committing it.
+*/
+void tfsTransactionAbort(tfs_transaction* transaction) {
+    free(transaction);
+}
+
+/*
+    Commits the transaction, which is released either way. The server
+    checks every operation (against the ones before it) before applying
+    any, so it either applies them all, or none.
+
+    Returns:
+    - TECNICOFS_OK, if every operation was applied;
+    - The error code of the first operation that couldn't be, otherwise.
+*/
+int tfsSessionCommit(tfs_session* session, tfs_transaction* transaction) {
+    return tfsWait(session, tfsAsyncCommit(session, transaction, NULL, NULL));
+}
+
+/*
+    Makes the server trace one in every rate requests (0 turns tracing off).
+    Only the user running the server is allowed to do this.
+
+    Returns:
+    - TECNICOFS_OK, if successful;
+    - Error code, otherwise.
+*/
+int tfsSessionTraceSampling(tfs_session* session, int rate) {
+    char cmd[32];
+    snprintf(cmd, sizeof(cmd), "T s %d", rate);
+    return run(session, cmd, PAYLOAD_NONE, NULL, 0);
+}
+
+/*
+    Makes the server dump the request spans it has collected so far
+    (as Chrome trace-event JSON, to the file given with its -J option).
+
+    Returns:
+    - TECNICOFS_OK, if successful;
+    - Error code, otherwise.
+*/
+int tfsSessionTraceDump(tfs_session* session) {
+    return run(session, "T d", PAYLOAD_NONE, NULL, 0);
+}
+
+/*
+    Asks a router (tecnicofs-router) to spread the names over one more
+    server, listening at the given socket path, moving the names that
+    now belong to it there. The call returns once they're all moved.
+    Only the user running the router is allowed to do this.
+
+    Returns:
+    - TECNICOFS_OK, if successful;
+    - Error code, otherwise.
+*/
+int tfsSessionJoinShard(tfs_session* session, char* address) {
+    char cmd[NOMINAL_BUFFER_SIZE];
+    snprintf(cmd, sizeof(cmd), "j %s", address);
+    return run(session, cmd, PAYLOAD_NONE, NULL, 0);
+}
+
+/*
+    Mounts size sessions to the server at the given address.
+
+    Returns:
+    - TECNICOFS_OK, if successful (and the new pool in *pool);
+    - Error code, otherwise.
+*/
+int tfsPoolCreate(char* address, int size, tfs_pool** pool) {
+    if (size < 1) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    tfs_pool* new = malloc(sizeof(tfs_pool));
+    if (!new) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+    new -> sessions = malloc(sizeof(tfs_session*) * size);
+    new -> busy = calloc(size, sizeof(bool));
+    new -> size = 0;
+    new -> available = 0;
+    pthread_mutex_init(&new -> lock, NULL);
+    pthread_cond_init(&new -> released, NULL);
+
+    for (int i = 0; i < size; i++) {
+        int status = tfsMountSession(address, new -> sessions + i);
+        if (status != TECNICOFS_OK) {
+            tfsPoolDestroy(new);
+            return status;
+        }
+        new -> size++;
+        new -> available++;
+    }
+
+    *pool = new;
+    return TECNICOFS_OK;
+}
+
+/*
+    Takes a session from the pool for exclusive use, waiting for one to
+    be released if they're all taken. File descriptors are only valid on
+    the session that opened them, so keep the session until they're closed.
+*/
+tfs_session* tfsPoolAcquire(tfs_pool* pool) {
+    pthread_mutex_lock(&pool -> lock);
+    while (!pool -> available) {
+        pthread_cond_wait(&pool -> released, &pool -> lock);
+    }
+
+    tfs_session* session = NULL;
+    for (int i = 0; i < pool -> size; i++) {
+        if (!pool -> busy[i]) {
+            pool -> busy[i] = true;
+            pool -> available--;
+            session = pool -> sessions[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool -> lock);
+    return session;
+}
+
+/*
+    Gives a session back to the pool.
+*/
+void tfsPoolRelease(tfs_pool* pool, tfs_session* session) {
+    pthread_mutex_lock(&pool -> lock);
+    for (int i = 0; i < pool -> size; i++) {
+        if (pool -> sessions[i] == session && pool -> busy[i]) {
+            pool -> busy[i] = false;
+            pool -> available++;
+            pthread_cond_signal(&pool -> released);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool -> lock);
+}
+
+/*
+    Unmounts every session of the pool and releases it.
+*/
+int tfsPoolDestroy(tfs_pool* pool) {
+    int status = TECNICOFS_OK;
+    for (int i = 0; i < pool -> size; i++) {
+        if (tfsUnmountSession(pool -> sessions[i]) != TECNICOFS_OK) {
+            status = TECNICOFS_ERROR_OTHER;
+        }
+    }
+    pthread_mutex_destroy(&pool -> lock);
+    pthread_cond_destroy(&pool -> released);
+    free(pool -> sessions);
+    free(pool -> busy);
+    free(pool);
+    return status;
+}
+
+/*
+    Mounts the client to the tecnicofs server via the socket provided by the address.
+*/
+int tfsMount(char* address) {
+    if (globalSession) {
+        return TECNICOFS_ERROR_OPEN_SESSION;
+    }
+    return tfsMountSession(address, &globalSession);
+}
+
+/*
+    Unmounts the client from the current tecnicofs server.
+*/
+int tfsUnmount() {
+    if (!globalSession) {
+        return TECNICOFS_ERROR_NO_OPEN_SESSION;
+    }
+
+    int status = tfsUnmountSession(globalSession);
+    globalSession = NULL;
+    return status;
+}
+
+int tfsCreate(char *filename, permission ownerPermissions, permission othersPermissions) {
+    return tfsSessionCreate(globalSession, filename, ownerPermissions, othersPermissions);
+}
+
+int tfsDelete(char *filename) {
+    return tfsSessionDelete(globalSession, filename);
+}
+
+int tfsRename(char *filenameOld, char *filenameNew) {
+    return tfsSessionRename(globalSession, filenameOld, filenameNew);
+}
+
+int tfsOpen(char *filename, permission mode) {
+    return tfsSessionOpen(globalSession, filename, mode);
+}
+
+int tfsClose(int fd) {
+    return tfsSessionClose(globalSession, fd);
+}
+
+int tfsRead(int fd, char *buffer, int len) {
+    return tfsSessionRead(globalSession, fd, buffer, len);
+}
+
 int tfsWrite(int fd, char *buffer, int len) {
-    sprintf(cmd, "w %d %s", fd, buffer);
-    return run(cmd, NULL, 0);
-}
\ No newline at end of file
+    return tfsSessionWrite(globalSession, fd, buffer, len);
+}
+
+int tfsList(char* prefix, char* cursor, int limit, char* buffer, int len) {
+    return tfsSessionList(globalSession, prefix, cursor, limit, buffer, len);
+}
+
+int tfsCommit(tfs_transaction* transaction) {
+    return tfsSessionCommit(globalSession, transaction);
+}
+
+int tfsMkdir(char *path, permission ownerPermissions, permission othersPermissions) {
+    return tfsSessionMkdir(globalSession, path, ownerPermissions, othersPermissions);
+}
+
+int tfsRmdir(char *path) {
+    return tfsSessionRmdir(globalSession, path);
+}
+
+int tfsTraceSampling(int rate) {
+    return tfsSessionTraceSampling(globalSession, rate);
+}
+
+int tfsTraceDump() {
+    return tfsSessionTraceDump(globalSession);
+}
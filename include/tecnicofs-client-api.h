@@ -3,14 +3,94 @@
 
 #include "tecnicofs-api-constants.h"
 
+/*
+    A mounted connection to a TecnicoFS server. Sessions are independent
+    from each other (file descriptors belong to the session that opened
+    them) and every call on a session is thread-safe.
+*/
+typedef struct tfs_session tfs_session;
+
+/*
+    A fixed set of sessions to the same server, to spread the requests of
+    a multi-threaded application over several connections.
+*/
+typedef struct tfs_pool tfs_pool;
+
+/*
+    A batch of operations that the server applies atomically once
+    committed: either all of them, or none.
+*/
+typedef struct tfs_transaction tfs_transaction;
+
+/*
+    Completion callback of an asynchronous request: gets its status (what
+    the synchronous call would have returned) and the caller's argument.
+*/
+typedef void (*tfs_callback)(int status, void* arg);
+
+int tfsMountSession(char* address, tfs_session** session);
+int tfsUnmountSession(tfs_session* session);
+
+int tfsSessionCreate(tfs_session* session, char *filename, permission ownerPermissions, permission othersPermissions);
+int tfsSessionDelete(tfs_session* session, char *filename);
+int tfsSessionRename(tfs_session* session, char *filenameOld, char *filenameNew);
+int tfsSessionMkdir(tfs_session* session, char *path, permission ownerPermissions, permission othersPermissions);
+int tfsSessionRmdir(tfs_session* session, char *path);
+int tfsSessionOpen(tfs_session* session, char *filename, permission mode);
+int tfsSessionClose(tfs_session* session, int fd);
+int tfsSessionRead(tfs_session* session, int fd, char *buffer, int len);
+int tfsSessionWrite(tfs_session* session, int fd, char *buffer, int len);
+int tfsSessionList(tfs_session* session, char* prefix, char* cursor, int limit, char* buffer, int len);
+int tfsSessionCommit(tfs_session* session, tfs_transaction* transaction);
+int tfsSessionTraceSampling(tfs_session* session, int rate);
+int tfsSessionTraceDump(tfs_session* session);
+int tfsSessionJoinShard(tfs_session* session, char* address);
+int tfsSessionCache(tfs_session* session, int entries);
+void tfsSessionCacheStats(tfs_session* session, unsigned long* hits, unsigned long* misses, unsigned long* stale);
+
+int tfsAsyncCreate(tfs_session* session, char *filename, permission ownerPermissions, permission othersPermissions, tfs_callback callback, void* arg);
+int tfsAsyncDelete(tfs_session* session, char *filename, tfs_callback callback, void* arg);
+int tfsAsyncRename(tfs_session* session, char *filenameOld, char *filenameNew, tfs_callback callback, void* arg);
+int tfsAsyncMkdir(tfs_session* session, char *path, permission ownerPermissions, permission othersPermissions, tfs_callback callback, void* arg);
+int tfsAsyncRmdir(tfs_session* session, char *path, tfs_callback callback, void* arg);
+int tfsAsyncOpen(tfs_session* session, char *filename, permission mode, tfs_callback callback, void* arg);
+int tfsAsyncClose(tfs_session* session, int fd, tfs_callback callback, void* arg);
+int tfsAsyncRead(tfs_session* session, int fd, char *buffer, int len, tfs_callback callback, void* arg);
+int tfsAsyncWrite(tfs_session* session, int fd, char *buffer, int len, tfs_callback callback, void* arg);
+int tfsAsyncList(tfs_session* session, char* prefix, char* cursor, int limit, char* buffer, int len, tfs_callback callback, void* arg);
+int tfsAsyncCommit(tfs_session* session, tfs_transaction* transaction, tfs_callback callback, void* arg);
+int tfsWait(tfs_session* session, int request);
+
+int tfsTransactionBegin(tfs_transaction** transaction);
+int tfsTransactionCreate(tfs_transaction* transaction, char *filename, permission ownerPermissions, permission othersPermissions);
+int tfsTransactionDelete(tfs_transaction* transaction, char *filename);
+int tfsTransactionRename(tfs_transaction* transaction, char *filenameOld, char *filenameNew);
+int tfsTransactionWrite(tfs_transaction* transaction, char *filename, char *buffer, int len);
+void tfsTransactionAbort(tfs_transaction* transaction);
+
+int tfsPoolCreate(char* address, int size, tfs_pool** pool);
+tfs_session* tfsPoolAcquire(tfs_pool* pool);
+void tfsPoolRelease(tfs_pool* pool, tfs_session* session);
+int tfsPoolDestroy(tfs_pool* pool);
+
+/*
+    Legacy API: works on a single, process-wide session.
+*/
 int tfsCreate(char *filename, permission ownerPermissions, permission othersPermissions);
 int tfsDelete(char *filename);
 int tfsRename(char *filenameOld, char *filenameNew);
+int tfsMkdir(char *path, permission ownerPermissions, permission othersPermissions);
+int tfsRmdir(char *path);
 int tfsOpen(char *filename, permission mode);
 int tfsClose(int fd);
 int tfsRead(int fd, char *buffer, int len);
 int tfsWrite(int fd, char *buffer, int len);
+int tfsList(char* prefix, char* cursor, int limit, char* buffer, int len);
+int tfsCommit(tfs_transaction* transaction);
 int tfsMount(char * address);
 int tfsUnmount();
 
+int tfsTraceSampling(int rate);
+int tfsTraceDump();
+
 #endif /* TECNICOFS_CLIENT_API_H */
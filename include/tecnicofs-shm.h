@@ -0,0 +1,177 @@
+/*
+
+    File: tecnicofs-shm.h
+    Description: Shared-memory channel between a server session and a
+    client on the same host.
+
+    Once a session is mounted, the client may ask for one ('h'): the server
+    replies over the socket with a memfd attached (SCM_RIGHTS), and from
+    then on both sides map it and exchange their requests and replies,
+    byte for byte what they would have sent over the socket, through its
+    two rings instead. The socket stays open: when a ring can't move, the
+    side waiting on it looks at the socket to tell whether its peer is gone.
+
+    Each ring has a single producer and a single consumer (the session's
+    send lock and its single reader make sure of that). Whoever waits on
+    a ring spins briefly, then sleeps on a futex that the other side only
+    wakes if it announced it's sleeping.
+
+    Kept identical in include/ and src/lib/.
+
+*/
+
+#ifndef TECNICOFS_SHM_H
+#define TECNICOFS_SHM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+// Bytes in each ring (a power of two)
+#define SHM_RING_SIZE (64 * 1024)
+
+// Checks for a ring to move before sleeping on it
+#define SHM_SPINS 256
+
+// How long a sleep lasts before looking at the socket again
+#define SHM_WAIT_NS 20000000
+
+typedef struct {
+    uint32_t head __attribute__((aligned(64)));     // bytes taken out so far, the consumer's
+    uint32_t consumerSleeps;
+    uint32_t tail __attribute__((aligned(64)));     // bytes put in so far, the producer's
+    uint32_t producerSleeps;
+    uint32_t closed;                                // nothing else is coming
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+} shm_ring;
+
+typedef struct {
+    shm_ring requests;      // client -> server
+    shm_ring replies;       // server -> client
+} shm_channel;
+
+static inline void shm_sleep(uint32_t* word, uint32_t seen) {
+    struct timespec timeout = { 0, SHM_WAIT_NS };
+    syscall(SYS_futex, word, FUTEX_WAIT, seen, &timeout, NULL, 0);
+}
+
+static inline void shm_wake(uint32_t* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Whether the other end of the socket hung up */
+static inline bool shm_peer_gone(int socket) {
+    char next;
+    ssize_t got = recv(socket, &next, 1, MSG_PEEK | MSG_DONTWAIT);
+    return got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+static inline bool shm_pending(shm_ring* ring) {
+    return __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&ring -> head, __ATOMIC_RELAXED);
+}
+
+/*
+    Sleeps (after spinning) until *word is no longer seen, or it's time to
+    look at the socket. flag announces the sleep to the other side.
+*/
+static inline void shm_wait(uint32_t* word, uint32_t seen, uint32_t* flag, shm_ring* ring) {
+    for (int i = 0; i < SHM_SPINS; i++) {
+        if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != seen || __atomic_load_n(&ring -> closed, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+    }
+    __atomic_store_n(flag, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen && !__atomic_load_n(&ring -> closed, __ATOMIC_SEQ_CST)) {
+        shm_sleep(word, seen);
+    }
+    __atomic_store_n(flag, 0, __ATOMIC_RELAXED);
+}
+
+/* Wakes the other side if it's sleeping on word, once it was moved */
+static inline void shm_notify(uint32_t* word, uint32_t* flag) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(flag, __ATOMIC_RELAXED)) {
+        shm_wake(word);
+    }
+}
+
+/*
+    Puts len bytes in the ring, waiting for room as needed.
+
+    Returns: 0 if successful, -1 if the peer (on socket) is gone.
+*/
+static inline int shm_write(shm_ring* ring, const void* data, size_t len, int socket) {
+    const char* from = data;
+    while (len) {
+        uint32_t tail = ring -> tail;
+        uint32_t head = __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE);
+        uint32_t room = SHM_RING_SIZE - (tail - head);
+        if (!room) {
+            if (__atomic_load_n(&ring -> closed, __ATOMIC_ACQUIRE) || shm_peer_gone(socket)) {
+                return -1;
+            }
+            shm_wait(&ring -> head, head, &ring -> producerSleeps, ring);
+            continue;
+        }
+
+        uint32_t size = len < room ? len : room;
+        uint32_t at = tail & (SHM_RING_SIZE - 1);
+        uint32_t first = size < SHM_RING_SIZE - at ? size : SHM_RING_SIZE - at;
+        memcpy(ring -> data + at, from, first);
+        memcpy(ring -> data, from + first, size - first);
+        __atomic_store_n(&ring -> tail, tail + size, __ATOMIC_RELEASE);
+        shm_notify(&ring -> tail, &ring -> consumerSleeps);
+        from += size;
+        len -= size;
+    }
+    return 0;
+}
+
+/*
+    Takes up to len bytes out of the ring, waiting for the first one.
+
+    Returns: how many bytes were taken; 0 if the ring was closed (or the
+    peer on socket is gone) with nothing left in it.
+*/
+static inline ssize_t shm_read(shm_ring* ring, void* data, size_t len, int socket) {
+    for (;;) {
+        uint32_t head = ring -> head;
+        uint32_t tail = __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE);
+        if (tail == head) {
+            if (__atomic_load_n(&ring -> closed, __ATOMIC_ACQUIRE) || shm_peer_gone(socket)) {
+                // A last look, it may have been filled right before
+                if (__atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE) == head) {
+                    return 0;
+                }
+                continue;
+            }
+            shm_wait(&ring -> tail, tail, &ring -> consumerSleeps, ring);
+            continue;
+        }
+
+        uint32_t size = len < tail - head ? len : tail - head;
+        uint32_t at = head & (SHM_RING_SIZE - 1);
+        uint32_t first = size < SHM_RING_SIZE - at ? size : SHM_RING_SIZE - at;
+        memcpy(data, ring -> data + at, first);
+        memcpy((char*)data + first, ring -> data, size - first);
+        __atomic_store_n(&ring -> head, head + size, __ATOMIC_RELEASE);
+        shm_notify(&ring -> head, &ring -> producerSleeps);
+        return size;
+    }
+}
+
+/* Nothing else is coming through the ring: wakes whoever waits on it */
+static inline void shm_close(shm_ring* ring) {
+    __atomic_store_n(&ring -> closed, 1, __ATOMIC_SEQ_CST);
+    shm_wake(&ring -> tail);
+    shm_wake(&ring -> head);
+}
+
+#endif /* TECNICOFS_SHM_H */
@@ -1,55 +1,76 @@
 #!/bin/bash
 
+# Scalability sweep: runs loadgen against every lock variant and bucket
+# count, doubling the number of clients up to maxClients, and prints the
+# resulting throughput/latency curves.
+#
+# Any arguments after the third one are handed over to loadgen
+# (e.g. -d 10 -z 0.99 -m 10,0,0,80,10).
+
 # Minimal argument validation
-if [ $# -ne 4 ]; then
-    echo "Usage: ${0} inputDir outputDir maxThreads numBuckets"
+if [ $# -lt 3 ]; then
+    echo "Usage: ${0} maxClients \"bucketCounts\" \"lockVariants\" [loadgen options]"
+    echo "Example: ${0} 16 \"1 8 64\" \"mutex rwlock pfrwlock\" -d 5"
     exit 1
 fi
 
-inputdir=$1
-outputdir=$2
-maxthreads=$3
-buckets=$4
+maxclients=$1
+buckets=$2
+variants=$3
+shift 3
+
+socket=/tmp/tecnicofs-sweep-$$.sock
+output=/tmp/tecnicofs-sweep-$$.txt
+
+make -s loadgen || exit 1
 
-# Create a folder, ignore "file exists" error
-mkdir -p $outputdir
+function sweep {
+    # $1 = variant, $2 = number of buckets, then the loadgen options
+    variant=$1
+    count=$2
+    shift 2
+    make -s tecnicofs-$variant || exit 1
 
-function testfile {
     # Push stdout to a black hole, but keep stderr
-    $1 > /dev/null 2> /tmp/tecnicofs_stderr.out
-
-    regex="TecnicoFS completed in [0-9]+\.[0-9]+ seconds\."
-    lastline=$(tail -2 /tmp/tecnicofs_stderr.out)
-
-    if [[ $lastline =~ $regex ]]; then
-        # Execution successful, we can use the trimmed version
-        echo $lastline
-    else
-        # Execution failed, dump all stderr and exit
-        cat /tmp/tecnicofs_stderr.out
-        exit 1
-    fi
-}
+    ./tecnicofs-$variant $socket $output $count > /dev/null 2> /tmp/tecnicofs_stderr.out &
+    server=$!
+    sleep 0.5
 
-# This regex expression covers pretty much all POSIX-compliant filenames
-# Used to strip off extension names
-fregex="([_0-9A-Za-z\-]+)\.([_0-9A-Za-z\-\.]+)?"
-function strip {
-    [[ $input =~ $fregex ]];
-}
+    echo "Variant=${variant} Buckets=${count}"
+    echo "clients,ops,seconds,throughput,p50_us,p99_us,p999_us,errors,speedup"
 
-for input in $(ls ${1})
-do
-    strip $inupt
-    inputname=${BASH_REMATCH[1]}
+    base=""
+    clients=1
+    while [ $clients -le $maxclients ]; do
+        line=$(./loadgen -s $socket -c $clients -C "$@")
+        if [ -z "$line" ]; then
+            cat /tmp/tecnicofs_stderr.out
+            kill -INT $server
+            exit 1
+        fi
 
-    echo "InputFile=${input} NumThreads=1"
-    testfile "./tecnicofs-nosync ${inputdir}/${input} ${outputdir}/${inputname}-1.txt 1 1"
+        throughput=$(echo $line | cut -d, -f4)
+        if [ -z "$base" ]; then
+            base=$throughput
+        fi
+        speedup=$(awk "BEGIN { printf \"%.2f\", ${throughput} / ${base} }")
+        bar=$(awk "BEGIN { for (i = 0; i < ${speedup} * 10; i++) printf \"#\" }")
+        echo "${line},${speedup} ${bar}"
 
-    for threads in $(seq 2 ${maxthreads})
+        clients=$((clients * 2))
+    done
+    echo
+
+    kill -INT $server
+    wait $server
+}
+
+for variant in $variants
+do
+    for count in $buckets
     do
-        echo "InputFile=${input} NumThreads=${threads}"
-        testfile "./tecnicofs-mutex ${inputdir}/${input} ${outputdir}/${inputname}-${threads}.txt ${threads} ${buckets}"
+        sweep $variant $count "$@"
     done
+done
 
-done
\ No newline at end of file
+rm -f $output
@@ -3,463 +3,2241 @@
     File: cmd.c
     Description: Implements the main functionality of the server.
 
+    Each session has a dispatcher thread (applyCommands) that reads its
+    requests in order. Requests that could run alongside each other
+    (tagged ones, with no fd or path in common) are handed over to a small
+    pool of workers of the session; everything else runs on the
+    dispatcher once the requests before it are done.
+
+    In shard mode (numShards > 0) every bucket belongs to one shard
+    thread (a contiguous range of them each, see bucket_share), and
+    requests that only touch names in one shard's buckets are run by that
+    shard instead: the dispatcher hands them over through a ring of its
+    own per shard, so the shards' data paths never contend.
+
+    Mutations are appended to the replication log as they happen (see
+    replog.h) when there are replicas to ship it to; a replica applies
+    its primary's log through replica_apply, and turns mutations down
+    (readOnly) until it's promoted.
+
 */
 
 #define _GNU_SOURCE
 
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
 #include "lib/err.h"
 #include "lib/socket.h"
 #include "lib/inodes.h"
+#include "lib/log.h"
+#include "lib/record.h"
+#include "lib/replog.h"
+#include "lib/spans.h"
+#include "lib/spsc.h"
 #include "lib/tecnicofs-api-constants.h"
+#include "lib/tecnicofs-shm.h"
 
+#include "cmd.h"
 #include "fs.h"
 
-#define RETURN_STATUS(STATUS) *statuscode = STATUS; errWrap(send(sock.socket, statuscode, sizeof(int), 0) < 1, "Unable to deliver status code!"); continue
+#define RECORD(STATUS) if (recording) record_request(r -> arrival, sock.sessionId, sock.userId, token, arg1, arg2, STATUS)
+#define RETURN_STATUS(STATUS) reply[1] = STATUS; RECORD(reply[1]); \
+    SPAN(SPAN_REPLY, sendReply(s, reply, tagged, 0)); \
+    span_request_end(); return
 #define NOMINAL_BUFFER_SIZE 1024
-#define GLOBAL_BUFFER_SIZE 3 + NOMINAL_BUFFER_SIZE * 2
+#define ARG_FORMAT "%c %1023s %1023s"
+
+// Requests of a session that can be handed over to its workers at once
+#define SESSION_MAX_INFLIGHT 64
+
+// Passes over its rings an idle shard makes before it goes to sleep
+#define SHARD_SPINS 64
+
+int sessionWorkers = 4;
+int leaseDuration = 1000;
+int numShards = 0;
+cpu_set_t* threadCpus = NULL;
+bool shareMemory = true;
+bool readOnly = false;
+
+// Taken by renames that move a directory to another directory
+static pthread_mutex_t directoryMoves = PTHREAD_MUTEX_INITIALIZER;
 
 typedef struct fd {
     int inode;
     permission mode;
 } filed;
 
-void* applyCommands(void* args){
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT);
-    sigaddset(&mask, SIGTERM);
-
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+typedef struct {
+    char token;
+    int numTokens;
+    bool tagged;
+    bool barrier;       // must run after every request before it, and before every one after it
+    int id;
+    uint64_t arrival;
+    span_context span;
+    char arg1[NOMINAL_BUFFER_SIZE];
+    char arg2[NOMINAL_BUFFER_SIZE];
+    char* body;         // the whole request, only valid on the dispatcher (for transactions)
+} request;
 
-    socket_t sock = *((socket_t*)args);
-    tecnicofs fs = *((tecnicofs*)((intptr_t)args + (intptr_t)sizeof(socket_t)));
+/*
+    A session's way into a shard: only the session's dispatcher pushes
+    into it, only the shard pops from it. The shard frees it once the
+    session has closed it and it's empty.
+*/
+typedef struct {
+    spsc_ring ring;
+    bool closed;
+} shard_inbox;
+
+typedef struct {
+    int id;
+    int cpu;            // the one it's pinned to
+    pthread_t thread;
+    tecnicofs fs;
+
+    // The inboxes it serves, only the shard itself touches these
+    shard_inbox** inboxes;
+    int numInboxes;
+
+    // Inboxes of new sessions and the doorbell, guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    shard_inbox** joining;
+    int numJoining;
+    int capJoining;
+    bool pending;       // new inboxes, or closed ones to free
+    bool sleeping;
+} shard;
+
+static shard* shards = NULL;
+
+typedef struct {
+    socket_t sock;
+    tecnicofs fs;
+    shard_inbox** inboxes;  // one per shard, in shard mode
+    bool authenticated;     // TCP sessions only once they've handed over their token
+    bool trusted;           // whoever runs the server, on its unix socket: may act for others ('u')
+    request_reader* reader;
+    shm_channel* shm;       // the rings requests and replies go through instead of the socket, if any
 
-    int statuscode[1];
     filed openfiles[MAX_OPEN_FILES];
+    pthread_mutex_t filesLock;
+    pthread_mutex_t sendLock;
+
+    // Dispatcher <-> workers, all guarded by lock
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    request* inflight[SESSION_MAX_INFLIGHT]; // handed over, not finished yet
+    int numInflight;
+    request* queue[SESSION_MAX_INFLIGHT];    // handed over, not picked up yet
+    int queueHead;
+    int queueSize;
+    int idleWorkers;
+    bool closing;
+    int numWorkers;
+    pthread_t* workers;
+} session;
+
+typedef struct {
+    int header[2];
+    tecnicofs_lease lease;
+} lease_reply;
 
-    // = MAX_INPUT_SIZE for arg1 & arg2, then
-    // 2 chars for the spaces between args,
-    // and finally the command token itself.
-    char command[GLOBAL_BUFFER_SIZE];
+/*
+    An operation of a transaction: its arguments point into the request.
+    Validating it fills in the rest (and may already reserve what it needs:
+    a new i-node, a place in a directory), which is given back if the
+    transaction doesn't go through.
+*/
+typedef struct {
+    char op;
+    char* path;
+    char* arg;          // permissions, target path or contents
+    char key[MAX_KEY_SIZE];
+    char targetKey[MAX_KEY_SIZE];
+    int dir;
+    int targetDir;
+    unsigned int dirGeneration;
+    unsigned int targetGeneration;
+    int iNumber;
+    bool isDirectory;
+    bool created;       // its i-node was created while validating
+    bool linked;        // it was counted in its (target) directory while validating
+} tx_op;
 
-    char arg1[NOMINAL_BUFFER_SIZE];
-    char arg2[NOMINAL_BUFFER_SIZE];
-    char token;
+/*
+    A listing's names on their way to the client: [size][name\0name\0...]
+    chunks, sent as they fill up, ending with an empty one.
+*/
+typedef struct {
+    session* s;
+    int strip;          // leading characters of the keys that aren't part of the name
+    int size;
+    char names[LIST_CHUNK_SIZE];
+} name_chunk;
 
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        openfiles[i].inode = -1;
+/*
+    Sends bytes to the client, through the shared memory if the session has
+    it. Called with the send lock held.
+
+    Returns: how many bytes were sent.
+*/
+static ssize_t sendBytes(session* s, void* data, size_t size) {
+    if (s -> shm) {
+        return shm_write(&s -> shm -> replies, data, size, s -> sock.socket) < 0 ? -1 : (ssize_t)size;
     }
+    return send(s -> sock.socket, data, size, MSG_NOSIGNAL);
+}
 
-    for (;;) {
-        // Shallow-clean buffers
-        command[0] = '\0';
-        arg1[0] = '\0';
-        arg2[0] = '\0';
+/*
+    Sends a reply laid out as [id][status][payload...] in reply.
+    Requests tagged with an id (@id cmd ...) get it back so clients can
+    match out-of-order replies; untagged ones get the legacy
+    [status][payload...] reply.
+
+    A client that hangs up with replies in flight only loses them; the
+    session ends when its next read comes back empty.
+*/
+static void sendReply(session* s, int* reply, bool tagged, ssize_t payloadSize) {
+    void* from = tagged ? (void*)reply : (void*)(reply + 1);
+    ssize_t size = (tagged ? 2 : 1) * sizeof(int) + payloadSize;
+    pthread_mutex_lock(&s -> sendLock);
+    ssize_t sent = sendBytes(s, from, size);
+    pthread_mutex_unlock(&s -> sendLock);
+    if (sent < size) {
+        LOG_LIMITED(LOG_WARN, "reply_lost", "session=%d", s -> sock.sessionId);
+    }
+}
 
-        int success = read(sock.socket, command, GLOBAL_BUFFER_SIZE);
+/*
+    Sends an int with a descriptor attached (SCM_RIGHTS). Descriptors can
+    only go through the socket, even if the session has shared memory.
+    Called with the send lock held.
 
-        // Sanity verification block
-        errWrap(success < 0, "Error reading commands!");
-        if (!success) {
-            // Client unmounted
-            printf("Client hung up, exiting...\n");
-            errWrap(close(sock.socket), "Unable to close socket fdescriptor!");
-            // Internal cleanup
-            for (int i = 0; i < MAX_OPEN_FILES; i++) {
-                filed f = openfiles[i];
-                if (f.inode >= 0) {
-                    inode_update_fd(f.inode, -1);
-                }
-            }
+    Returns: whether it was sent.
+*/
+static bool sendDescriptor(session* s, int value, int fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec data = { &value, sizeof(int) };
+    struct msghdr message = { NULL, 0, &data, 1, control, sizeof(control), 0 };
+    struct cmsghdr* attached = CMSG_FIRSTHDR(&message);
+    attached -> cmsg_level = SOL_SOCKET;
+    attached -> cmsg_type = SCM_RIGHTS;
+    attached -> cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(attached), &fd, sizeof(int));
+    return sendmsg(s -> sock.socket, &message, MSG_NOSIGNAL) == sizeof(int);
+}
+
+/*
+    Sends a read reply whose contents are in a blob (see inode_blob): the
+    header, the kind of reply, then the blob's size with the blob attached.
+*/
+static void sendBlob(session* s, int* reply, bool tagged, int size, int blob) {
+    int header[3] = { reply[0], reply[1], READ_REPLY_BLOB };
+    void* from = tagged ? (void*)header : (void*)(header + 1);
+    ssize_t headerSize = (tagged ? 3 : 2) * sizeof(int);
+    pthread_mutex_lock(&s -> sendLock);
+    // Both under the same hold: nothing else may get between them
+    bool sent = sendBytes(s, from, headerSize) == headerSize && sendDescriptor(s, size, blob);
+    pthread_mutex_unlock(&s -> sendLock);
+    if (!sent) {
+        LOG_LIMITED(LOG_WARN, "reply_lost", "session=%d", s -> sock.sessionId);
+    }
+}
+
+/*
+    Resolves the path of a request into the key of its entry, and the
+    directory it's in (see resolve_path).
+
+    Returns: TECNICOFS_OK if successful, the error code otherwise.
+*/
+static int resolve(tecnicofs fs, char* path, int* dir, unsigned int* generation, char* key) {
+    int status;
+    SPAN(SPAN_LOOKUP, status = resolve_path(fs, path, dir, generation, key));
+    switch (status) {
+        case 0: return TECNICOFS_OK;
+        case -2: return TECNICOFS_ERROR_NOT_A_DIRECTORY;
+        case -3: return TECNICOFS_ERROR_OTHER;
+        default: return TECNICOFS_ERROR_FILE_NOT_FOUND;
+    }
+}
 
-            pthread_exit(NULL);
-            return NULL;
+/*
+    Whether dir is the given directory or somewhere below it. Parents only
+    change under directoryMoves, which the caller holds.
+*/
+static bool contains(int directory, int dir) {
+    while (dir != ROOT_DIRECTORY) {
+        if (dir == directory) {
+            return true;
         }
+        if (inode_directory(dir, NULL, &dir) != 1) {
+            return false;
+        }
+    }
+    return false;
+}
 
-        int numTokens = sscanf(command, "%c %s %s", &token, arg1, arg2);
+/*
+    Sends the chunk's names and empties it. Listings are barriers, so no
+    other reply of the session can end up between two chunks.
 
-        if (numTokens != 3 && numTokens != 2) {
-            RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+    Returns: 0 if successful, -1 if the client is gone.
+*/
+static int flushNames(name_chunk* chunk) {
+    ssize_t size = sizeof(int) + chunk -> size;
+    pthread_mutex_lock(&chunk -> s -> sendLock);
+    ssize_t sent = sendBytes(chunk -> s, &chunk -> size, size);
+    pthread_mutex_unlock(&chunk -> s -> sendLock);
+    chunk -> size = 0;
+    if (sent < size) {
+        LOG_LIMITED(LOG_WARN, "reply_lost", "session=%d", chunk -> s -> sock.sessionId);
+        return -1;
+    }
+    return 0;
+}
+
+static int streamName(char* key, void* ptr) {
+    name_chunk* chunk = ptr;
+    char* name = key + chunk -> strip;
+    int len = strlen(name) + 1;
+    if (chunk -> size + len > LIST_CHUNK_SIZE && flushNames(chunk) < 0) {
+        return -1;
+    }
+    memcpy(chunk -> names + chunk -> size, name, len);
+    chunk -> size += len;
+    return 0;
+}
+
+/*
+    Opens a file descriptor of the session on the given i-node, checking
+    the user's permissions and, unless it's ANY_GENERATION, that the
+    i-node is still at the given generation. Fills in lease, if given.
+
+    Returns: the new fd if successful, the error code otherwise.
+*/
+static int openFile(session* s, int iNumber, unsigned int* generation, permission mode, tecnicofs_lease* lease) {
+    filed* openfiles = s -> openfiles;
+
+    // Make sure we don't have a file descriptor for this file already
+    // and that we have room for one (which we reserve right away,
+    // other requests of this session may be opening files too)
+    int freeSlot = -1;
+    bool alreadyOpen = false;
+    pthread_mutex_lock(&s -> filesLock);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (openfiles[i].inode == iNumber) {
+            alreadyOpen = true;
+        } else if (openfiles[i].inode < 0 && freeSlot < 0) {
+            freeSlot = i;
         }
+    }
+    if (!alreadyOpen && freeSlot >= 0) {
+        openfiles[freeSlot].inode = iNumber;
+        openfiles[freeSlot].mode = 0;
+    }
+    pthread_mutex_unlock(&s -> filesLock);
 
-        int iNumber;
-        switch (token) {
-            case 'p': // ping (p 0 0)
-            {
-                /*
-                    The goal is to make sure that the connection isn't going
-                    to be immediately dropped. Getting a TECNICOFS_OK (aka 0)
-                    from this command means the connection is secured.
-                */
-                RETURN_STATUS(TECNICOFS_OK);
-                break;
-            }
-            case 'c': // creates a file (c filename perms)
-            {
-                // General syntax validation
-                if (numTokens != 3) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
-                permission me = arg2[0] - '0';
-                permission others = arg2[1] - '0';
-                if (
-                    me < 0 || me > 3 ||
-                    others < 0 || others > 3 ||
-                    arg2[2] != '\0'
-                ) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
+    if (alreadyOpen) {
+        return TECNICOFS_ERROR_FILE_IS_OPEN;
+    }
+    if (freeSlot < 0) {
+        return TECNICOFS_ERROR_MAXED_OPEN_FILES;
+    }
 
-                lock* fslock = get_lock(fs, arg1);
-                LOCK_WRITE(fslock);
+    // Have we got the permissions required to open the file?
+    // (checked and granted under a single i-node table lock)
+    uid_t owner;
+    permission ownerPerms;
+    permission generalPerms;
+    int inodeStatus;
+    SPAN(SPAN_INODE, inodeStatus = inode_open(iNumber, generation, s -> sock.userId, mode, &owner, &ownerPerms, &generalPerms));
+
+    int status = freeSlot;
+    switch (inodeStatus) {
+        case 0: break;
+        case -2: status = TECNICOFS_ERROR_PERMISSION_DENIED; break;
+        case -4: status = TECNICOFS_ERROR_IS_A_DIRECTORY; break;
+        default: status = TECNICOFS_ERROR_STALE_LEASE; break;
+    }
 
-                // Does the file exist already?
-                if (lookup(fs, arg1) >= 0) {
-                    printf("'%s' already exists.\n", arg1);
-                    LOCK_UNLOCK(fslock);;
-                    RETURN_STATUS(TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
-                }
+    pthread_mutex_lock(&s -> filesLock);
+    if (status >= 0) {
+        openfiles[freeSlot].mode = mode;
+    } else {
+        // Give the reserved slot back
+        openfiles[freeSlot].inode = -1;
+    }
+    pthread_mutex_unlock(&s -> filesLock);
+
+    if (status >= 0 && lease) {
+        lease -> inumber = iNumber;
+        lease -> generation = *generation;
+        lease -> owner = owner;
+        lease -> ownerPermissions = ownerPerms;
+        lease -> othersPermissions = generalPerms;
+        lease -> leaseMs = leaseDuration;
+    }
+    return status;
+}
+
+static filed openedFile(session* s, int fd) {
+    pthread_mutex_lock(&s -> filesLock);
+    filed f = s -> openfiles[fd];
+    pthread_mutex_unlock(&s -> filesLock);
+    return f;
+}
+
+/* Whether a request changes the file system: those are shipped to replicas, and turned down by them */
+static bool mutates(char token) {
+    return token == 'c' || token == 'm' || token == 'd' || token == 'e' || token == 'r' || token == 'w' || token == 't' || token == 'W';
+}
+
+/* The name part of a key (see make_key) */
+static char* keyName(char* key) {
+    char* slash = strchr(key, '/');
+    return slash ? slash + 1 : key;
+}
 
-                // Get our iNumber
-                iNumber = inode_create(sock.userId, me, others);
-                if (iNumber < 0) {
-                    // iNode table is full
-                    LOCK_UNLOCK(fslock);
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
+/*
+    Appends a mutation to the replication log. Called while still holding
+    what orders it against the other mutations of its names (their buckets'
+    write locks), so replicas apply them in the order they happened here.
+*/
+static void ship(replog_entry* entry, char* name, char* arg) {
+    if (!shipping) {
+        return;
+    }
+    replog_lock();
+    replog_append(entry, name, arg);
+    replog_unlock();
+}
+
+static void shipCreate(char op, int iNumber, int dir, char* key, uid_t owner, permission me, permission others) {
+    replog_entry entry = { .op = op, .inumber = iNumber, .dir = dir, .owner = owner, .ownerPerm = me, .othersPerm = others };
+    ship(&entry, keyName(key), NULL);
+}
+
+static void shipDelete(char op, int iNumber, int dir, char* key) {
+    replog_entry entry = { .op = op, .inumber = iNumber, .dir = dir };
+    ship(&entry, keyName(key), NULL);
+}
+
+static void shipRename(int iNumber, int dir, char* key, int targetDir, char* targetKey) {
+    replog_entry entry = { .op = 'r', .inumber = iNumber, .dir = dir, .targetDir = targetDir };
+    ship(&entry, keyName(key), keyName(targetKey));
+}
 
-                // All checks passed, insert the file in the filesystem
-                create(fs, arg1, iNumber);
-                LOCK_UNLOCK(fslock);
+/*
+    Sets the contents of a file. Nothing else orders the writes to a file,
+    so when they're shipped the log's lock does: no other write can get
+    between the change and its entry.
 
-                break;
-            }
-            case 'd': // delete file (d filename)
-            {
-                // General syntax validation
-                if (numTokens != 2) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
+    Returns: as inode_set.
+*/
+static int writeContents(int iNumber, char* contents) {
+    if (!shipping) {
+        return inode_set(iNumber, contents, strlen(contents));
+    }
+    replog_lock();
+    int status = inode_set(iNumber, contents, strlen(contents));
+    if (!status) {
+        replog_entry entry = { .op = 'w', .inumber = iNumber };
+        replog_append(&entry, NULL, contents);
+    }
+    replog_unlock();
+    return status;
+}
 
-                lock* fslock = get_lock(fs, arg1);
-                LOCK_WRITE(fslock);
+/*
+    Splits the lines of a transaction ("t count\nop path [arg]\n...") into
+    its operations, in place.
 
-                // Make sure the file does exist
-                iNumber = lookup(fs, arg1);
-                if (iNumber < 0) {
-                    LOCK_UNLOCK(fslock);
-                    RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_FOUND);
-                }
+    Returns: the number of operations if successful, -1 otherwise.
+*/
+static int parseTransaction(char* body, tx_op* ops) {
+    int count;
+    int at = -1;
+    if (sscanf(body, "t %d%n", &count, &at) != 1 || at < 0 || count < 1 || count > TRANSACTION_MAX_OPS) {
+        return -1;
+    }
 
-                // Make sure the we are the actual owner of the file
-                // And that such file is not open
+    if (body[at] != '\n') {
+        return -1;
+    }
+    char* line = body + at + 1;
+    for (int i = 0; i < count; i++) {
+        char* end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        // Only the last line may end the request (a '\n' after it is fine)
+        if (i < count - 1 ? !end : end && end[1]) {
+            return -1;
+        }
 
-                uid_t owner;
-                int fileIsOpen;
-                if (inode_get(iNumber, &fileIsOpen, &owner, NULL, NULL, NULL, 0) < 0) {
-                    LOCK_UNLOCK(fslock);
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                } else if (owner != sock.userId) {
-                    LOCK_UNLOCK(fslock);
-                    RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
-                } else if (fileIsOpen) {
-                    LOCK_UNLOCK(fslock);
-                    RETURN_STATUS(TECNICOFS_ERROR_FILE_IS_OPEN);
-                }
+        tx_op* op = ops + i;
+        memset(op, 0, sizeof(tx_op));
+        op -> op = line[0];
+        if (!op -> op || !strchr("cdrw", op -> op) || line[1] != ' ') {
+            return -1;
+        }
+        op -> path = line + 2;
+        char* space = strchr(op -> path, ' ');
+        if (space) {
+            *space = '\0';
+            op -> arg = space + 1;
+        }
+        if (
+            !*op -> path || strlen(op -> path) >= NOMINAL_BUFFER_SIZE ||
+            (op -> op == 'd') != !op -> arg ||
+            (op -> op != 'w' && op -> arg && (!*op -> arg || strlen(op -> arg) >= NOMINAL_BUFFER_SIZE || strchr(op -> arg, ' ')))
+        ) {
+            return -1;
+        }
+        line = end + 1;
+    }
+    return count;
+}
 
-                // All checks passed, delete the file
+/*
+    What key leads to as of the operation first, once the ones before it
+    are applied: an entry they create, rename or delete, or else whatever
+    is in the buckets (whose locks the caller holds).
+*/
+static int txLookup(tecnicofs fs, tx_op* ops, int first, char* key) {
+    for (int i = first - 1; i >= 0; i--) {
+        tx_op* op = ops + i;
+        if ((op -> op == 'c' || op -> op == 'd') && !strcmp(op -> key, key)) {
+            return op -> op == 'c' ? op -> iNumber : -1;
+        }
+        if (op -> op == 'r' && !strcmp(op -> targetKey, key)) {
+            return op -> iNumber;
+        }
+        if (op -> op == 'r' && !strcmp(op -> key, key)) {
+            return -1;
+        }
+    }
+    return lookup(fs, key);
+}
 
-                inode_delete(iNumber);
-                delete(fs, arg1);
+/*
+    Checks whether the i-th operation can be applied after the ones
+    before it, reserving what it needs.
 
-                LOCK_UNLOCK(fslock);
-                break;
+    Returns: TECNICOFS_OK if it can, the error code otherwise.
+*/
+static int txValidate(session* s, tx_op* ops, int i) {
+    tecnicofs fs = s -> fs;
+    uid_t user = s -> sock.userId;
+    tx_op* op = ops + i;
+    uid_t owner;
+    permission ownerPerms, othersPerms;
+    int fileIsOpen;
+
+    if (op -> op == 'c') {
+        permission me = op -> arg[0] - '0';
+        permission others = op -> arg[1] - '0';
+        if (me < 0 || me > 3 || others < 0 || others > 3 || op -> arg[2] != '\0') {
+            return TECNICOFS_ERROR_OTHER;
+        }
+        if (txLookup(fs, ops, i, op -> key) >= 0) {
+            return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+        }
+        if (op -> dir != ROOT_DIRECTORY) {
+            if (inode_link(op -> dir, op -> dirGeneration, 1) < 0) {
+                return TECNICOFS_ERROR_FILE_NOT_FOUND;
             }
-            case 'r': // rename file (r old new)
-            {
-                if (numTokens != 3) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            op -> linked = true;
+        }
+        SPAN(SPAN_INODE, op -> iNumber = inode_create(user, me, others));
+        if (op -> iNumber < 0) {
+            return TECNICOFS_ERROR_OTHER;
+        }
+        op -> created = true;
+        return TECNICOFS_OK;
+    }
+
+    op -> iNumber = txLookup(fs, ops, i, op -> key);
+    if (op -> iNumber < 0) {
+        return TECNICOFS_ERROR_FILE_NOT_FOUND;
+    }
+    op -> isDirectory = inode_directory(op -> iNumber, NULL, NULL) == 1;
+    if (inode_get(op -> iNumber, &fileIsOpen, &owner, &ownerPerms, &othersPerms, NULL, 0) < 0) {
+        return TECNICOFS_ERROR_OTHER;
+    }
+
+    switch (op -> op) {
+        case 'd':
+            if (op -> isDirectory) {
+                return TECNICOFS_ERROR_IS_A_DIRECTORY;
+            } else if (owner != user) {
+                return TECNICOFS_ERROR_PERMISSION_DENIED;
+            } else if (fileIsOpen) {
+                return TECNICOFS_ERROR_FILE_IS_OPEN;
+            }
+            return TECNICOFS_OK;
+        case 'r':
+        {
+            bool moving = op -> dir != op -> targetDir;
+            if (owner != user) {
+                return TECNICOFS_ERROR_PERMISSION_DENIED;
+            } else if (txLookup(fs, ops, i, op -> targetKey) >= 0) {
+                return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+            } else if (moving && op -> isDirectory && contains(op -> iNumber, op -> targetDir)) {
+                return TECNICOFS_ERROR_OTHER;
+            }
+            if (moving && op -> targetDir != ROOT_DIRECTORY) {
+                if (inode_link(op -> targetDir, op -> targetGeneration, 1) < 0) {
+                    return TECNICOFS_ERROR_FILE_NOT_FOUND;
                 }
+                op -> linked = true;
+            }
+            return TECNICOFS_OK;
+        }
+        default: // 'w'
+        {
+            permission allowed = user == owner ? ownerPerms : othersPerms;
+            if (op -> isDirectory) {
+                return TECNICOFS_ERROR_IS_A_DIRECTORY;
+            } else if ((allowed & WRITE) != WRITE) {
+                return TECNICOFS_ERROR_PERMISSION_DENIED;
+            }
+            return TECNICOFS_OK;
+        }
+    }
+}
+
+/* Gives back whatever the first count operations reserved */
+static void txRollback(tx_op* ops, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        tx_op* op = ops + i;
+        if (op -> created) {
+            inode_delete(op -> iNumber);
+        }
+        if (op -> linked) {
+            inode_link(op -> op == 'r' ? op -> targetDir : op -> dir, ANY_GENERATION, -1);
+        }
+    }
+}
+
+/* Applies a validated operation (which can't fail anymore) */
+static void txApply(session* s, tx_op* op) {
+    tecnicofs fs = s -> fs;
+    bool moving = op -> dir != op -> targetDir;
+    switch (op -> op) {
+        case 'c':
+            SPAN(SPAN_FS_UPDATE, create(fs, op -> key, op -> iNumber));
+            shipCreate('c', op -> iNumber, op -> dir, op -> key, s -> sock.userId, op -> arg[0] - '0', op -> arg[1] - '0');
+            break;
+        case 'd':
+            SPAN(SPAN_INODE, inode_delete(op -> iNumber));
+            SPAN(SPAN_FS_UPDATE, delete(fs, op -> key));
+            if (op -> dir != ROOT_DIRECTORY) {
+                inode_link(op -> dir, ANY_GENERATION, -1);
+            }
+            shipDelete('d', op -> iNumber, op -> dir, op -> key);
+            break;
+        case 'r':
+            SPAN(SPAN_FS_UPDATE, delete(fs, op -> key));
+            SPAN(SPAN_FS_UPDATE, create(fs, op -> targetKey, op -> iNumber));
+            SPAN(SPAN_INODE, inode_bump_generation(op -> iNumber));
+            if (moving && op -> dir != ROOT_DIRECTORY) {
+                inode_link(op -> dir, ANY_GENERATION, -1);
+            }
+            if (moving && op -> isDirectory) {
+                inode_set_parent(op -> iNumber, op -> targetDir);
+            }
+            if (op -> isDirectory) {
+                invalidate_paths(fs);
+            }
+            shipRename(op -> iNumber, op -> dir, op -> key, op -> targetDir, op -> targetKey);
+            break;
+        case 'w':
+            SPAN(SPAN_INODE, writeContents(op -> iNumber, op -> arg));
+            break;
+    }
+}
 
-                lock* fslock = get_lock(fs, arg1);
-                lock* tglock = get_lock(fs, arg2);
+static int compareLocks(const void* a, const void* b) {
+    intptr_t x = (intptr_t)*(lock**)a;
+    intptr_t y = (intptr_t)*(lock**)b;
+    return (x > y) - (x < y);
+}
 
-                if (fslock == tglock) {
-                    // Both names point to the same bucket
-                    LOCK_WRITE(fslock);
+/*
+    Runs a transaction: a batch of creates, deletes, renames and writes
+    (by path) that is applied as a whole, or not at all.
 
-                    // Make sure the file we're moving exists
-                    iNumber = lookup(fs, arg1);
-                    if (iNumber < 0) {
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_FOUND);
-                    }
+    Every bucket it touches is write-locked once, in address order (the
+    order renames take their two locks in), before anything is looked up;
+    then every operation is validated against the ones before it, and
+    only once they all pass are they applied. Moving a directory to another
+    one takes directoryMoves first, as a rename does.
 
-                    // Make sure we own the file we're moving
-                    uid_t owner;
-                    if (inode_get(iNumber, NULL, &owner, NULL, NULL, NULL, 0) < 0) {
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                    }
-                    if (owner != sock.userId) {
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
-                    }
-                    int targetFileiNumber = lookup(fs, arg2);
-
-                    if (targetFileiNumber < 0) {
-                        // Grant the rename
-                        delete(fs, arg1);
-                        create(fs, arg2, iNumber);
-                    } else {
-                        // The name we want is taken
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
-                    }
+    Returns: TECNICOFS_OK if it was applied, the error code of the first
+    operation that couldn't be otherwise.
+*/
+static int runTransaction(session* s, char* body) {
+    tecnicofs fs = s -> fs;
+    tx_op* ops = malloc(sizeof(tx_op) * TRANSACTION_MAX_OPS);
+    errWrap(!ops, "Unable to allocate a transaction!");
+    int count = parseTransaction(body, ops);
+    if (count < 0) {
+        free(ops);
+        return TECNICOFS_ERROR_OTHER;
+    }
 
-                    LOCK_UNLOCK(fslock);
-                } else {
-                    if ((intptr_t)fslock > (intptr_t)tglock) {
-                        // Swap the locks
-                        lock* tmp = fslock;
-                        fslock = tglock;
-                        tglock = tmp;
-                    }
-                    // Do the same steps as above except with both locks
-                    // Lock both threes, delete on origin, create on target
-                    LOCK_WRITE(fslock);
-                    LOCK_WRITE(tglock);
-
-                    iNumber = lookup(fs, arg1);
-                    if (iNumber < 0) {
-                        LOCK_UNLOCK(tglock);
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_FOUND);
-                    }
-                    uid_t owner;
-                    if (inode_get(iNumber, NULL, &owner, NULL, NULL, NULL, 0) < 0) {
-                        LOCK_UNLOCK(tglock);
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                    }
-                    if (owner != sock.userId) {
-                        LOCK_UNLOCK(tglock);
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
-                    }
-                    int targetFile = lookup(fs, arg2);
-
-                    if (targetFile < 0) {
-                        delete(fs, arg1);
-                        create(fs, arg2, iNumber);
-                    } else {
-                        LOCK_UNLOCK(tglock);
-                        LOCK_UNLOCK(fslock);
-                        RETURN_STATUS(TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
-                    }
+    // Paths are resolved up front, like any other request's
+    lock* locks[TRANSACTION_MAX_OPS * 2];
+    int numLocks = 0;
+    bool moves = false;
+    int status = TECNICOFS_OK;
+    for (int i = 0; i < count && status == TECNICOFS_OK; i++) {
+        tx_op* op = ops + i;
+        status = resolve(fs, op -> path, &op -> dir, &op -> dirGeneration, op -> key);
+        locks[numLocks++] = get_lock(fs, op -> key);
+        op -> targetDir = op -> dir;
+        if (status == TECNICOFS_OK && op -> op == 'r') {
+            status = resolve(fs, op -> arg, &op -> targetDir, &op -> targetGeneration, op -> targetKey);
+            locks[numLocks++] = get_lock(fs, op -> targetKey);
+            moves = moves || op -> targetDir != op -> dir;
+        }
+    }
+    if (status != TECNICOFS_OK) {
+        free(ops);
+        return status;
+    }
 
-                    LOCK_UNLOCK(tglock);
-                    LOCK_UNLOCK(fslock);
-                }
+    // Every bucket once, always in the same order
+    qsort(locks, numLocks, sizeof(lock*), compareLocks);
+    int unique = 0;
+    for (int i = 0; i < numLocks; i++) {
+        if (!unique || locks[unique - 1] != locks[i]) {
+            locks[unique++] = locks[i];
+        }
+    }
+    if (moves) {
+        SPAN(SPAN_LOCK_WAIT, pthread_mutex_lock(&directoryMoves));
+    }
+    for (int i = 0; i < unique; i++) {
+        SPAN(SPAN_LOCK_WAIT, LOCK_WRITE(locks[i]));
+    }
 
-                break;
+    int validated = 0;
+    while (validated < count && status == TECNICOFS_OK) {
+        SPAN(SPAN_LOOKUP, status = txValidate(s, ops, validated));
+        validated++;
+    }
+    if (status == TECNICOFS_OK) {
+        for (int i = 0; i < count; i++) {
+            txApply(s, ops + i);
+        }
+    } else {
+        LOG_LIMITED(LOG_DEBUG, "transaction_aborted", "session=%d op=%d status=%d", s -> sock.sessionId, validated - 1, status);
+        txRollback(ops, validated);
+    }
+
+    for (int i = unique - 1; i >= 0; i--) {
+        LOCK_UNLOCK(locks[i]);
+    }
+    if (moves) {
+        pthread_mutex_unlock(&directoryMoves);
+    }
+    free(ops);
+    return status;
+}
+
+/*
+    Runs a single (parsed) request of the session, replying to it.
+*/
+static void runRequest(session* s, request* r) {
+    socket_t sock = s -> sock;
+    tecnicofs fs = s -> fs;
+    filed* openfiles = s -> openfiles;
+
+    char token = r -> token;
+    int numTokens = r -> numTokens;
+    char* arg1 = r -> arg1;
+    char* arg2 = r -> arg2;
+    bool tagged = r -> tagged;
+    int reply[2] = { r -> id, 0 };
+
+    if (numTokens != 3 && numTokens != 2) {
+        RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+    }
+    if (!s -> authenticated && token != 'a') {
+        RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
+    }
+    if (mutates(token) && __atomic_load_n(&readOnly, __ATOMIC_ACQUIRE)) {
+        RETURN_STATUS(TECNICOFS_ERROR_READ_ONLY);
+    }
+
+    int iNumber;
+    int inodeStatus;
+    switch (token) {
+        case 'a': // authenticates a TCP session (a token), replies with the user it's now acting as
+        {
+            uid_t user;
+            bool known = sock.tcp && !s -> authenticated && tokenUser(arg1, &user);
+            // Tokens don't belong in traces
+            arg1[0] = '\0';
+            if (!known) {
+                log_event(LOG_WARN, "auth", "session=%d accepted=0", sock.sessionId);
+                RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
             }
-            case 'o': // opens a file (o filename mode)
-            {
-                // General syntax validation
-                if (numTokens != 3) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            // A barrier: nothing else of the session is running
+            s -> sock.userId = user;
+            sock.userId = user;
+            s -> authenticated = true;
+            log_event(LOG_INFO, "auth", "session=%d accepted=1 uid=%d", sock.sessionId, (int)user);
+            RETURN_STATUS((int)user);
+            break;
+        }
+        case 'h': // moves the session to shared memory (h 0 0), replied to with the memfd attached
+        {
+            // Only untagged: nothing else of the session may be on its way meanwhile
+            if (!shareMemory || sock.tcp || s -> shm || tagged) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            int fd = memfd_create("tecnicofs-session", MFD_CLOEXEC);
+            shm_channel* shm = MAP_FAILED;
+            if (fd >= 0 && !ftruncate(fd, sizeof(shm_channel))) {
+                // Zeroed, as both rings start out
+                shm = mmap(NULL, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            }
+            if (shm == MAP_FAILED) {
+                LOG_LIMITED(LOG_WARN, "shm_failed", "session=%d errno=%d", sock.sessionId, errno);
+                if (fd >= 0) {
+                    close(fd);
                 }
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
 
-                permission mode = arg2[0] - '0';
-                if (mode < 1 || mode > 3 || arg2[1] != '\0') {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
+            reply[1] = TECNICOFS_OK;
+            RECORD(reply[1]);
+            pthread_mutex_lock(&s -> sendLock);
+            bool sent = sendDescriptor(s, TECNICOFS_OK, fd);
+            if (sent) {
+                s -> shm = shm;
+                s -> reader -> ring = &shm -> requests;
+            }
+            pthread_mutex_unlock(&s -> sendLock);
+            close(fd);
+            if (!sent) {
+                munmap(shm, sizeof(shm_channel));
+                LOG_LIMITED(LOG_WARN, "reply_lost", "session=%d", sock.sessionId);
+            }
+            span_request_end();
+            return;
+        }
+        case 'p': // ping (p 0 0)
+        {
+            /*
+                The goal is to make sure that the connection isn't going
+                to be immediately dropped. Getting a TECNICOFS_OK (aka 0)
+                from this command means the connection is secured.
+            */
+            RETURN_STATUS(TECNICOFS_OK);
+            break;
+        }
+        case 'c': // creates a file (c path perms)
+        case 'm': // creates a directory (m path perms)
+        {
+            // General syntax validation
+            if (numTokens != 3) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            permission me = arg2[0] - '0';
+            permission others = arg2[1] - '0';
+            if (
+                me < 0 || me > 3 ||
+                others < 0 || others > 3 ||
+                arg2[2] != '\0'
+            ) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            char key[MAX_KEY_SIZE];
+            int dir;
+            unsigned int dirGeneration;
+            int status = resolve(fs, arg1, &dir, &dirGeneration, key);
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
+
+            lock* fslock = get_lock(fs, key);
+            SPAN(SPAN_LOCK_WAIT, LOCK_WRITE(fslock));
 
-                lock* fslock = get_lock(fs, arg1);
-                LOCK_READ(fslock);
+            // Does the file exist already?
+            SPAN(SPAN_LOOKUP, iNumber = lookup(fs, key));
+            if (iNumber >= 0) {
+                LOG_LIMITED(LOG_DEBUG, "create_exists", "session=%d name=%s", sock.sessionId, arg1);
+                LOCK_UNLOCK(fslock);;
+                RETURN_STATUS(TECNICOFS_ERROR_FILE_ALREADY_EXISTS);
+            }
 
-                // Does the file we want to open actually exist?
-                iNumber = lookup(fs, arg1);
+            // Count it in its directory, which fails if the directory was removed meanwhile
+            if (dir != ROOT_DIRECTORY && inode_link(dir, dirGeneration, 1) < 0) {
                 LOCK_UNLOCK(fslock);
+                RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_FOUND);
+            }
 
-                if (iNumber < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_FOUND);
+            // Get our iNumber
+            if (token == 'c') {
+                SPAN(SPAN_INODE, iNumber = inode_create(sock.userId, me, others));
+            } else {
+                SPAN(SPAN_INODE, iNumber = inode_create_directory(sock.userId, me, others, dir));
+            }
+            if (iNumber < 0) {
+                // iNode table is full
+                if (dir != ROOT_DIRECTORY) {
+                    inode_link(dir, ANY_GENERATION, -1);
                 }
+                LOCK_UNLOCK(fslock);
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
 
-                // Make sure we don't have a file descriptor for this file already
-                // and that we have room for one
-                int freeSlot = -1;
-                for (int i = 0; i < MAX_OPEN_FILES; i++) {
-                    if (openfiles[i].inode == iNumber) {
-                        RETURN_STATUS(TECNICOFS_ERROR_FILE_IS_OPEN);
-                    } else if (openfiles[i].inode < 0 && freeSlot < 0) {
-                        freeSlot = i;
-                    }
-                }
+            // All checks passed, insert the file in the filesystem
+            SPAN(SPAN_FS_UPDATE, create(fs, key, iNumber));
+            shipCreate(token, iNumber, dir, key, sock.userId, me, others);
+            LOCK_UNLOCK(fslock);
 
-                if (freeSlot < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_MAXED_OPEN_FILES);
-                }
+            break;
+        }
+        case 'd': // delete file (d path)
+        case 'e': // delete an empty directory (e path)
+        {
+            // General syntax validation
+            if (numTokens != 2) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
 
-                // Have we got the permissions required to open the file?
-                uid_t owner;
-                permission ownerPerms;
-                permission generalPerms;
+            char key[MAX_KEY_SIZE];
+            int dir;
+            unsigned int dirGeneration;
+            int status = resolve(fs, arg1, &dir, &dirGeneration, key);
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
 
-                if (inode_get(iNumber, NULL, &owner, &ownerPerms, &generalPerms, NULL, 0) < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
-                if (sock.userId != owner) {
-                    // Apply general permissions
-                    if ((mode & generalPerms) != mode) {
-                        RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
-                    }
+            lock* fslock = get_lock(fs, key);
+            SPAN(SPAN_LOCK_WAIT, LOCK_WRITE(fslock));
+
+            // Make sure the file does exist
+            SPAN(SPAN_LOOKUP, iNumber = lookup(fs, key));
+            if (iNumber < 0) {
+                LOCK_UNLOCK(fslock);
+                RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_FOUND);
+            }
+
+            // Make sure the we are the actual owner of the file
+            // And that such file is not open (or, for directories, empty)
+
+            uid_t owner;
+            int fileIsOpen;
+            bool isDirectory = inode_directory(iNumber, NULL, NULL) == 1;
+            SPAN(SPAN_INODE, inodeStatus = inode_get(iNumber, &fileIsOpen, &owner, NULL, NULL, NULL, 0));
+            if (inodeStatus < 0) {
+                status = TECNICOFS_ERROR_OTHER;
+            } else if (token == 'd' && isDirectory) {
+                status = TECNICOFS_ERROR_IS_A_DIRECTORY;
+            } else if (token == 'e' && !isDirectory) {
+                status = TECNICOFS_ERROR_NOT_A_DIRECTORY;
+            } else if (owner != sock.userId) {
+                status = TECNICOFS_ERROR_PERMISSION_DENIED;
+            } else if (fileIsOpen) {
+                status = TECNICOFS_ERROR_FILE_IS_OPEN;
+            } else {
+                // All checks passed, delete the file
+                SPAN(SPAN_INODE, inodeStatus = inode_delete(iNumber));
+                if (inodeStatus == -3) {
+                    status = TECNICOFS_ERROR_DIRECTORY_NOT_EMPTY;
                 } else {
-                    // Apply owner permissions
-                    if ((mode & ownerPerms) != mode) {
-                        RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
+                    SPAN(SPAN_FS_UPDATE, delete(fs, key));
+                    if (dir != ROOT_DIRECTORY) {
+                        inode_link(dir, ANY_GENERATION, -1);
+                    }
+                    if (isDirectory) {
+                        // Only now, so nothing can cache it again from before
+                        invalidate_paths(fs);
                     }
+                    shipDelete(token, iNumber, dir, key);
                 }
+            }
 
-                // All checks passed, grant the file descriptor
-                if (inode_update_fd(iNumber, 1) < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
-                openfiles[freeSlot].inode = iNumber;
-                openfiles[freeSlot].mode = mode;
+            LOCK_UNLOCK(fslock);
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
+            break;
+        }
+        case 'r': // rename file or directory (r old new)
+        {
+            if (numTokens != 3) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
 
-                // Return the new fd
-                RETURN_STATUS(freeSlot);
+            char key[MAX_KEY_SIZE], targetKey[MAX_KEY_SIZE];
+            int dir, targetDir;
+            unsigned int dirGeneration, targetGeneration;
+            int status = resolve(fs, arg1, &dir, &dirGeneration, key);
+            if (status == TECNICOFS_OK) {
+                status = resolve(fs, arg2, &targetDir, &targetGeneration, targetKey);
+            }
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
 
-                break;
+            lock* fslock = get_lock(fs, key);
+            lock* tglock = get_lock(fs, targetKey);
+            if ((intptr_t)fslock > (intptr_t)tglock) {
+                // Always lock in the same order
+                lock* tmp = fslock;
+                fslock = tglock;
+                tglock = tmp;
             }
-            case 'x': // closes an open file (x fd)
-            {
-                // General syntax validation
-                if (numTokens != 2) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+
+            // Moving a directory to another one must not race with other such
+            // moves (together they could close a cycle), so those take
+            // directoryMoves first, and retry if it turns out they needed it
+            bool moving = dir != targetDir;
+            bool serialized = false;
+            bool isDirectory;
+            for (;;) {
+                if (serialized) {
+                    SPAN(SPAN_LOCK_WAIT, pthread_mutex_lock(&directoryMoves));
+                }
+                SPAN(SPAN_LOCK_WAIT, LOCK_WRITE(fslock));
+                if (tglock != fslock) {
+                    SPAN(SPAN_LOCK_WAIT, LOCK_WRITE(tglock));
                 }
 
-                int fd = atoi(arg1);
-                if (fd < 0 || fd >= MAX_OPEN_FILES) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                } else if (openfiles[fd].inode < 0) {
-                    // This filedescriptor wasn't linked to anything
-                    RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_OPEN);
+                SPAN(SPAN_LOOKUP, iNumber = lookup(fs, key));
+                isDirectory = iNumber >= 0 && inode_directory(iNumber, NULL, NULL) == 1;
+                if (!moving || !isDirectory || serialized) {
+                    break;
+                }
+                if (tglock != fslock) {
+                    LOCK_UNLOCK(tglock);
                 }
+                LOCK_UNLOCK(fslock);
+                serialized = true;
+            }
 
-                // Update the filedescriptors
-                if (inode_update_fd(openfiles[fd].inode, -1) < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            uid_t owner;
+            if (iNumber < 0) {
+                // Make sure the file we're moving exists
+                status = TECNICOFS_ERROR_FILE_NOT_FOUND;
+            } else if (inode_get(iNumber, NULL, &owner, NULL, NULL, NULL, 0) < 0) {
+                status = TECNICOFS_ERROR_OTHER;
+            } else if (owner != sock.userId) {
+                // Make sure we own the file we're moving
+                status = TECNICOFS_ERROR_PERMISSION_DENIED;
+            } else if (lookup(fs, targetKey) >= 0) {
+                // The name we want is taken
+                status = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+            } else if (moving && isDirectory && contains(iNumber, targetDir)) {
+                // A directory can't be moved inside itself
+                status = TECNICOFS_ERROR_OTHER;
+            } else if (moving && targetDir != ROOT_DIRECTORY && inode_link(targetDir, targetGeneration, 1) < 0) {
+                // The target directory was removed meanwhile
+                status = TECNICOFS_ERROR_FILE_NOT_FOUND;
+            } else {
+                // Grant the rename (a directory's entries stay where they are)
+                SPAN(SPAN_FS_UPDATE, delete(fs, key));
+                SPAN(SPAN_FS_UPDATE, create(fs, targetKey, iNumber));
+                // Leases on the old name must not reach the file anymore
+                SPAN(SPAN_INODE, inode_bump_generation(iNumber));
+                if (moving && dir != ROOT_DIRECTORY) {
+                    inode_link(dir, ANY_GENERATION, -1);
                 }
-                openfiles[fd].inode = -1;
+                if (moving && isDirectory) {
+                    inode_set_parent(iNumber, targetDir);
+                }
+                if (isDirectory) {
+                    invalidate_paths(fs);
+                }
+                shipRename(iNumber, dir, key, targetDir, targetKey);
+            }
 
-                break;
+            if (tglock != fslock) {
+                LOCK_UNLOCK(tglock);
+            }
+            LOCK_UNLOCK(fslock);
+            if (serialized) {
+                pthread_mutex_unlock(&directoryMoves);
+            }
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
+            break;
+        }
+        case 'o': // opens a file (o path mode)
+        case 'L': // opens a file and leases its name (L path mode)
+        {
+            // General syntax validation
+            if (numTokens != 3) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
             }
-            case 'l': // reads len bytes of a file (l fd len)
-            {
-                // General syntax validation
-                if (numTokens != 3) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
 
-                // Make sure arguments are valid
-                int fd = atoi(arg1);
-                int len = atoi(arg2);
-                if (fd < 0 || fd >= MAX_OPEN_FILES || len <= 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
+            permission mode = arg2[0] - '0';
+            if (mode < 1 || mode > 3 || arg2[1] != '\0') {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            if ((mode & WRITE) && __atomic_load_n(&readOnly, __ATOMIC_ACQUIRE)) {
+                RETURN_STATUS(TECNICOFS_ERROR_READ_ONLY);
+            }
 
-                // Make sure our fd is valid
-                filed f = openfiles[fd];
-                if (f.inode < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_OPEN);
-                }
+            char key[MAX_KEY_SIZE];
+            int dir;
+            unsigned int dirGeneration;
+            int status = resolve(fs, arg1, &dir, &dirGeneration, key);
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
 
-                // Make sure our fd is open in a valid mode
-                if (f.mode != READ && f.mode != RW) {
-                    RETURN_STATUS(TECNICOFS_ERROR_INVALID_MODE);
-                }
+            // Does the file we want to open actually exist? (no lock needed)
+            SPAN(SPAN_LOOKUP, iNumber = lookup(fs, key));
 
-                // Create our buffer: [iiii|c|c|c|c|c|...|c|c]
-                void* readBuffer = malloc(sizeof(int) + len * sizeof(char));
+            if (iNumber < 0) {
+                RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_FOUND);
+            }
 
-                int* status = readBuffer;
-                char* contents = (char*)((intptr_t)readBuffer + (intptr_t)sizeof(int));
+            lease_reply leased;
+            unsigned int generation = ANY_GENERATION;
+            int fd = openFile(s, iNumber, &generation, mode, &leased.lease);
+            if (fd < 0 || token == 'o') {
+                // Return the new fd (no lease to grant)
+                // A stale i-node here means it was deleted after the lookup
+                RETURN_STATUS(fd == TECNICOFS_ERROR_STALE_LEASE ? TECNICOFS_ERROR_FILE_NOT_FOUND : fd);
+            }
 
-                // Copy the file contents to the buffer
-                int charsRead = inode_get(f.inode, NULL, NULL, NULL, NULL, contents, len);
-                printf("%d\n", charsRead);
-                if (charsRead < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                }
+            // Return the new fd along with the lease: [id][fd][lease]
+            // (a lease of 0 ms when leases are disabled, or for paths below
+            // the root: moving a directory doesn't change its files' generation)
+            if (dir != ROOT_DIRECTORY) {
+                leased.lease.leaseMs = 0;
+            }
+            leased.header[0] = reply[0];
+            leased.header[1] = fd;
+            RECORD(fd);
+            SPAN(SPAN_REPLY, sendReply(s, leased.header, tagged, sizeof(tecnicofs_lease)));
+            span_request_end();
+            return;
+        }
+        case 'O': // reopens a file by its lease, skipping the name lookup (O inumber:generation mode)
+        {
+            // General syntax validation
+            unsigned int generation;
+            permission mode = arg2[0] - '0';
+            if (
+                numTokens != 3 ||
+                sscanf(arg1, "%d:%u", &iNumber, &generation) != 2 ||
+                generation == ANY_GENERATION ||
+                mode < 1 || mode > 3 || arg2[1] != '\0'
+            ) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            if ((mode & WRITE) && __atomic_load_n(&readOnly, __ATOMIC_ACQUIRE)) {
+                RETURN_STATUS(TECNICOFS_ERROR_READ_ONLY);
+            }
+
+            // The generation tells whether the name still leads to this i-node
+            RETURN_STATUS(openFile(s, iNumber, &generation, mode, NULL));
+        }
+        case 'x': // closes an open file (x fd)
+        {
+            // General syntax validation
+            if (numTokens != 2) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            int fd = atoi(arg1);
+            if (fd < 0 || fd >= MAX_OPEN_FILES) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            filed f = openedFile(s, fd);
+            if (f.inode < 0) {
+                // This filedescriptor wasn't linked to anything
+                RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_OPEN);
+            }
+
+            // Update the filedescriptors
+            SPAN(SPAN_INODE, inodeStatus = inode_update_fd(f.inode, -1));
+            if (inodeStatus < 0) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            pthread_mutex_lock(&s -> filesLock);
+            openfiles[fd].inode = -1;
+            pthread_mutex_unlock(&s -> filesLock);
 
-                // Perform required adjustments to the buffer
-                *status = charsRead;
-                ssize_t bufferSize = sizeof(int) + (charsRead + 1) * sizeof(char);
+            break;
+        }
+        case 'l': // reads len bytes of a file (l fd len)
+        case 'z': // the same, but large contents may come as a sealed memfd (z fd len)
+        {
+            // General syntax validation
+            if (numTokens != 3) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            // Make sure arguments are valid
+            int fd = atoi(arg1);
+            int len = atoi(arg2);
+            if (fd < 0 || fd >= MAX_OPEN_FILES || len <= 0) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            // Make sure our fd is valid
+            filed f = openedFile(s, fd);
+            if (f.inode < 0) {
+                RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_OPEN);
+            }
 
-                // Manually send this over to the client and return
-                errWrap(
-                    send(sock.socket, readBuffer, bufferSize, 0) < bufferSize,
-                    "Unable to send stuff over to client!"
-                );
+            // Make sure our fd is open in a valid mode
+            if (f.mode != READ && f.mode != RW) {
+                RETURN_STATUS(TECNICOFS_ERROR_INVALID_MODE);
+            }
+
+            // Large contents go as a blob, mapped by the client instead of copied through
+            if (token == 'z' && !sock.tcp) {
+                int size;
+                int blob;
+                SPAN(SPAN_INODE, blob = inode_blob(f.inode, READ_BLOB_THRESHOLD, &size));
+                if (blob >= 0) {
+                    reply[1] = size < len ? size : len - 1;
+                    RECORD(reply[1]);
+                    LOG_LIMITED(LOG_DEBUG, "read", "session=%d fd=%d bytes=%d blob=1", sock.sessionId, fd, reply[1]);
+                    SPAN(SPAN_REPLY, sendBlob(s, reply, tagged, size, blob));
+                    close(blob);
+                    span_request_end();
+                    return;
+                }
+            }
 
+            // Create our buffer: [iiii|iiii|c|c|c|c|c|...|c|c], 'z' has its kind before the contents
+            int inlineKind = token == 'z' ? sizeof(int) : 0;
+            int* readBuffer = malloc(sizeof(reply) + inlineKind + len * sizeof(char));
+            char* contents = (char*)((intptr_t)readBuffer + (intptr_t)sizeof(reply) + inlineKind);
+            contents[0] = '\0';
+
+            // Copy the file contents to the buffer
+            int charsRead;
+            SPAN(SPAN_INODE, charsRead = inode_get(f.inode, NULL, NULL, NULL, NULL, contents, len));
+            LOG_LIMITED(LOG_DEBUG, "read", "session=%d fd=%d bytes=%d", sock.sessionId, fd, charsRead);
+            if (charsRead < 0) {
                 free(readBuffer);
-                continue;
-                break;
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            // Perform required adjustments to the buffer
+            readBuffer[0] = reply[0];
+            readBuffer[1] = charsRead;
+            if (inlineKind) {
+                readBuffer[2] = READ_REPLY_INLINE;
+            }
+            RECORD(charsRead);
+
+            // Manually send this over to the client and return
+            SPAN(SPAN_REPLY, sendReply(s, readBuffer, tagged, inlineKind + (charsRead + 1) * sizeof(char)));
+
+            free(readBuffer);
+            span_request_end();
+            return;
+        }
+        case 'w': // writes the message supplied to file (w fd msg)
+        {
+            // General validation syntax
+            if (numTokens != 3) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            // Validate file descriptor
+            int fd = atoi(arg1);
+            if (fd < 0 || fd >= MAX_OPEN_FILES) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            filed f = openedFile(s, fd);
+            if (f.inode < 0) {
+                RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_OPEN);
+            }
+            if (f.mode != WRITE && f.mode != RW) {
+                RETURN_STATUS(TECNICOFS_ERROR_INVALID_MODE);
+            }
+
+            // We can assume the message is complete
+            // (aka buffer is large enough)
+
+            SPAN(SPAN_INODE, inodeStatus = writeContents(f.inode, arg2));
+            if (inodeStatus < 0) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+
+            break;
+        }
+        case 'n': // lists the names of a directory in order (n limit:[dir/]prefix [after])
+        {
+            // General syntax validation
+            int limit;
+            int prefixAt = -1;
+            if (sscanf(arg1, "%d:%n", &limit, &prefixAt) != 1 || prefixAt < 0 || limit < 1) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            char* path = arg1 + prefixAt;
+            while (*path == '/') {
+                path++;
+            }
+
+            // The directory part of the prefix picks the directory, the rest its names
+            char* slash = strrchr(path, '/');
+            char* prefix = slash ? slash + 1 : path;
+            int dir;
+            unsigned int dirGeneration;
+            int status;
+            SPAN(SPAN_LOOKUP, status = resolve_directory(fs, path, slash ? (size_t)(slash - path) : 0, &dir, &dirGeneration));
+            if (status < 0) {
+                RETURN_STATUS(status == -2 ? TECNICOFS_ERROR_NOT_A_DIRECTORY :
+                    status == -3 ? TECNICOFS_ERROR_OTHER : TECNICOFS_ERROR_FILE_NOT_FOUND);
+            }
+            char keyPrefix[MAX_KEY_SIZE], after[MAX_KEY_SIZE];
+            make_key(dir, prefix, keyPrefix);
+            if (numTokens == 3) {
+                make_key(dir, arg2, after);
+            }
+
+            // Status first, then the names as the buckets' merge yields them
+            SPAN(SPAN_REPLY, sendReply(s, reply, tagged, 0));
+            name_chunk* chunk = malloc(sizeof(name_chunk));
+            errWrap(!chunk, "Unable to allocate a listing!");
+            chunk -> s = s;
+            chunk -> size = 0;
+            // Clients get the names, without the directory part of the keys
+            char dirKey[MAX_KEY_SIZE];
+            chunk -> strip = make_key(dir, "", dirKey);
+            int listed;
+            SPAN(SPAN_LOOKUP, listed = list_names(fs, keyPrefix, numTokens == 3 ? after : NULL, limit, streamName, chunk));
+            // Whatever is left, then the empty chunk that ends the listing
+            if (chunk -> size) {
+                SPAN(SPAN_REPLY, flushNames(chunk));
+            }
+            SPAN(SPAN_REPLY, flushNames(chunk));
+            free(chunk);
+
+            RECORD(listed);
+            span_request_end();
+            return;
+        }
+        case 't': // applies a batch of operations atomically (t count\nop path [arg]\n...)
+        {
+            RETURN_STATUS(runTransaction(s, r -> body));
+        }
+        case 'u': // acts for another user from now on, for whoever runs the server (u uid)
+        {
+            if (numTokens != 2) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            // A router in front of the server: it tells who its clients are
+            if (!s -> trusted) {
+                RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
+            }
+            char* end;
+            long user = strtol(arg1, &end, 10);
+            if (*end || user < 0) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
             }
-            case 'w': // writes the message supplied to file (w fd msg)
-            {
-                // General validation syntax
-                if (numTokens != 3) {
+            // A barrier: nothing else of the session is running
+            s -> sock.userId = (uid_t)user;
+            sock.userId = (uid_t)user;
+            LOG_LIMITED(LOG_DEBUG, "delegated", "session=%d uid=%ld", sock.sessionId, user);
+            break;
+        }
+        case 'i': // describes a name to whoever runs the server, contents and all (i path)
+        {
+            if (numTokens != 2) {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
+            if (!s -> trusted) {
+                RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
+            }
+
+            char key[MAX_KEY_SIZE];
+            int dir;
+            unsigned int dirGeneration;
+            int status = resolve(fs, arg1, &dir, &dirGeneration, key);
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
+
+            // [id][size][entry][contents\0]: nothing can write more than a request carries
+            int* described = malloc(sizeof(reply) + sizeof(tecnicofs_entry) + REQUEST_BUFFER_SIZE);
+            tecnicofs_entry* entry = (tecnicofs_entry*)(described + 2);
+            char* contents = (char*)(entry + 1);
+            contents[0] = '\0';
+            uid_t owner;
+            permission me, others;
+
+            // Held for reading, so the i-node can't be deleted (and reused) meanwhile
+            lock* fslock = get_lock(fs, key);
+            SPAN(SPAN_LOCK_WAIT, LOCK_READ(fslock));
+            SPAN(SPAN_LOOKUP, iNumber = lookup(fs, key));
+            int size = -1;
+            if (iNumber >= 0) {
+                SPAN(SPAN_INODE, size = inode_get(iNumber, NULL, &owner, &me, &others, contents, REQUEST_BUFFER_SIZE));
+                entry -> isDirectory = inode_directory(iNumber, NULL, NULL) == 1;
+            }
+            LOCK_UNLOCK(fslock);
+            if (size < 0) {
+                free(described);
+                RETURN_STATUS(iNumber < 0 ? TECNICOFS_ERROR_FILE_NOT_FOUND : TECNICOFS_ERROR_OTHER);
+            }
+
+            entry -> owner = owner;
+            entry -> ownerPermissions = me;
+            entry -> othersPermissions = others;
+            described[0] = reply[0];
+            described[1] = size;
+            RECORD(size);
+            SPAN(SPAN_REPLY, sendReply(s, described, tagged, sizeof(tecnicofs_entry) + size + 1));
+            free(described);
+            span_request_end();
+            return;
+        }
+        case 'W': // sets a file's contents for whoever runs the server, skipping permissions (W path contents)
+        {
+            if (!s -> trusted) {
+                RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
+            }
+            // The contents are the rest of the request, spaces and all (a barrier: the body is there)
+            char* contents = strchr(r -> body + 2, ' ');
+            contents = contents ? contents + 1 : "";
+
+            char key[MAX_KEY_SIZE];
+            int dir;
+            unsigned int dirGeneration;
+            int status = resolve(fs, arg1, &dir, &dirGeneration, key);
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
+
+            lock* fslock = get_lock(fs, key);
+            SPAN(SPAN_LOCK_WAIT, LOCK_READ(fslock));
+            SPAN(SPAN_LOOKUP, iNumber = lookup(fs, key));
+            if (iNumber < 0) {
+                status = TECNICOFS_ERROR_FILE_NOT_FOUND;
+            } else if (inode_directory(iNumber, NULL, NULL) == 1) {
+                status = TECNICOFS_ERROR_IS_A_DIRECTORY;
+            } else {
+                SPAN(SPAN_INODE, status = writeContents(iNumber, contents) < 0 ? TECNICOFS_ERROR_OTHER : TECNICOFS_OK);
+            }
+            LOCK_UNLOCK(fslock);
+            if (status != TECNICOFS_OK) {
+                RETURN_STATUS(status);
+            }
+            break;
+        }
+        case 'T': // controls the span tracer (T s rate | T d)
+        {
+            // Only whoever runs the server may control tracing
+            if (sock.userId != getuid()) {
+                RETURN_STATUS(TECNICOFS_ERROR_PERMISSION_DENIED);
+            }
+
+            if (!strcmp(arg1, "s") && numTokens == 3) {
+                // Set the sampling rate, 0 turns tracing off
+                int rate = atoi(arg2);
+                if (rate < 0) {
                     RETURN_STATUS(TECNICOFS_ERROR_OTHER);
                 }
-
-                // Validate file descriptor
-                int fd = atoi(arg1);
-                if (fd < 0 || fd >= MAX_OPEN_FILES) {
+                __atomic_store_n(&spanSampling, rate, __ATOMIC_RELAXED);
+            } else if (!strcmp(arg1, "d") && numTokens == 2) {
+                // Dump the spans collected so far
+                if (span_dump(spanDumpPath) < 0) {
                     RETURN_STATUS(TECNICOFS_ERROR_OTHER);
                 }
+            } else {
+                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            }
 
-                filed f = openfiles[fd];
-                if (f.inode < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_FILE_NOT_OPEN);
-                }
-                if (f.mode != WRITE && f.mode != RW) {
-                    RETURN_STATUS(TECNICOFS_ERROR_INVALID_MODE);
-                }
+            break;
+        }
+        default: {
+            RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+            break;
+        }
+    }
 
-                // We can assume the message is complete
-                // (aka buffer is large enough)
+    // Everything went smooth, return OK status
+    RETURN_STATUS(TECNICOFS_OK);
 
-                if (inode_set(f.inode, arg2, strlen(arg2)) < 0) {
-                    RETURN_STATUS(TECNICOFS_ERROR_OTHER);
+    #undef RETURN_STATUS
+    #undef RECORD
+}
+
+/*
+    Handles a single (parsed) request of the session. Mutations run inside
+    the replication gate, so replicas' snapshots never see half of one.
+*/
+static void handleRequest(session* s, request* r) {
+    bool mutation = mutates(r -> token);
+    if (mutation) {
+        replog_enter();
+    }
+    runRequest(s, r);
+    if (mutation) {
+        replog_leave();
+    }
+}
+
+/*
+    The replica's i-node for each of its primary's (-1 for none), only
+    touched by whoever applies the log.
+*/
+static int* replicaInodes = NULL;
+
+static int replicaInode(int primary) {
+    return primary >= 0 && primary < INODE_TABLE_SIZE ? replicaInodes[primary] : -1;
+}
+
+static bool replicaKnows(int primaryDir) {
+    return primaryDir == ROOT_DIRECTORY || replicaInode(primaryDir) >= 0;
+}
+
+/*
+    Applies an entry of the primary's log (see replog_apply). The primary
+    already checked everything, in the order the entries come in: all that
+    is left is translating its i-nodes into the replica's. Entries are
+    appended to the replica's own log, for replicas that follow it.
+*/
+void replica_apply(replog_entry* entry, char* name, char* arg, void* state) {
+    tecnicofs fs = *(tecnicofs*)state;
+    if (!replicaInodes) {
+        replicaInodes = malloc(sizeof(int) * INODE_TABLE_SIZE);
+        errWrap(!replicaInodes, "Unable to allocate the replica's i-node map!");
+        memset(replicaInodes, -1, sizeof(int) * INODE_TABLE_SIZE);
+    }
+
+    bool creates = entry -> op == 'c' || entry -> op == 'm';
+    if (
+        entry -> inumber < 0 || entry -> inumber >= INODE_TABLE_SIZE ||
+        creates == (replicaInode(entry -> inumber) >= 0) ||
+        !replicaKnows(entry -> dir) ||
+        (entry -> op == 'r' && !replicaKnows(entry -> targetDir))
+    ) {
+        LOG_LIMITED(LOG_ERROR, "replica_inconsistent", "seq=%lu op=%c inumber=%d",
+            (unsigned long)entry -> seq, entry -> op, entry -> inumber);
+        return;
+    }
+
+    int iNumber = replicaInode(entry -> inumber);
+    int dir = entry -> dir == ROOT_DIRECTORY ? ROOT_DIRECTORY : replicaInode(entry -> dir);
+    char key[MAX_KEY_SIZE];
+    make_key(dir, name, key);
+
+    replog_enter();
+    switch (entry -> op) {
+        case 'c':
+        case 'm':
+        {
+            lock* fslock = get_lock(fs, key);
+            LOCK_WRITE(fslock);
+            iNumber = entry -> op == 'c'
+                ? inode_create(entry -> owner, entry -> ownerPerm, entry -> othersPerm)
+                : inode_create_directory(entry -> owner, entry -> ownerPerm, entry -> othersPerm, dir);
+            if (iNumber >= 0) {
+                if (dir != ROOT_DIRECTORY) {
+                    inode_link(dir, ANY_GENERATION, 1);
                 }
+                create(fs, key, iNumber);
+                replicaInodes[entry -> inumber] = iNumber;
+                shipCreate(entry -> op, iNumber, dir, key, entry -> owner, entry -> ownerPerm, entry -> othersPerm);
+            } else {
+                LOG_LIMITED(LOG_ERROR, "replica_full", "seq=%lu", (unsigned long)entry -> seq);
+            }
+            LOCK_UNLOCK(fslock);
+            break;
+        }
+        case 'd':
+        case 'e':
+        {
+            lock* fslock = get_lock(fs, key);
+            LOCK_WRITE(fslock);
+            delete(fs, key);
+            // Readers of the replica may still have it open: it goes once they close it
+            inode_unlink(iNumber);
+            if (dir != ROOT_DIRECTORY) {
+                inode_link(dir, ANY_GENERATION, -1);
+            }
+            if (entry -> op == 'e') {
+                invalidate_paths(fs);
+            }
+            replicaInodes[entry -> inumber] = -1;
+            shipDelete(entry -> op, iNumber, dir, key);
+            LOCK_UNLOCK(fslock);
+            break;
+        }
+        case 'r':
+        {
+            char targetKey[MAX_KEY_SIZE];
+            int targetDir = entry -> targetDir == ROOT_DIRECTORY ? ROOT_DIRECTORY : replicaInode(entry -> targetDir);
+            make_key(targetDir, arg, targetKey);
+            bool moving = dir != targetDir;
+            bool isDirectory = inode_directory(iNumber, NULL, NULL) == 1;
+
+            lock* fslock = get_lock(fs, key);
+            lock* tglock = get_lock(fs, targetKey);
+            if ((intptr_t)fslock > (intptr_t)tglock) {
+                lock* tmp = fslock;
+                fslock = tglock;
+                tglock = tmp;
+            }
+            // Nothing else moves directories here: no need for directoryMoves
+            LOCK_WRITE(fslock);
+            if (tglock != fslock) {
+                LOCK_WRITE(tglock);
+            }
+            delete(fs, key);
+            create(fs, targetKey, iNumber);
+            inode_bump_generation(iNumber);
+            if (moving && targetDir != ROOT_DIRECTORY) {
+                inode_link(targetDir, ANY_GENERATION, 1);
+            }
+            if (moving && dir != ROOT_DIRECTORY) {
+                inode_link(dir, ANY_GENERATION, -1);
+            }
+            if (moving && isDirectory) {
+                inode_set_parent(iNumber, targetDir);
+            }
+            if (isDirectory) {
+                invalidate_paths(fs);
+            }
+            shipRename(iNumber, dir, key, targetDir, targetKey);
+            if (tglock != fslock) {
+                LOCK_UNLOCK(tglock);
+            }
+            LOCK_UNLOCK(fslock);
+            break;
+        }
+        case 'w':
+            writeContents(iNumber, arg);
+            break;
+        default:
+            LOG_LIMITED(LOG_ERROR, "replica_inconsistent", "seq=%lu op=%c", (unsigned long)entry -> seq, entry -> op);
+    }
+    replog_leave();
+}
+
+typedef struct {
+    char* key;
+    int iNumber;
+    int depth;          // of the directory it's in
+} snapshot_name;
+
+typedef struct {
+    snapshot_name* names;
+    int count;
+    int capacity;
+} snapshot_names;
+
+static void collectName(char* key, int iNumber, void* ptr) {
+    snapshot_names* names = ptr;
+    if (names -> count == names -> capacity) {
+        names -> capacity = names -> capacity ? names -> capacity * 2 : 1024;
+        names -> names = realloc(names -> names, sizeof(snapshot_name) * names -> capacity);
+        errWrap(!names -> names, "Unable to allocate a snapshot!");
+    }
+    snapshot_name* name = names -> names + names -> count++;
+    name -> key = strdup(key);
+    errWrap(!name -> key, "Unable to allocate a snapshot!");
+    name -> iNumber = iNumber;
+}
+
+/* How deep a directory is (the root is 0), remembered in depths (0 while unknown) */
+static int depthOf(int dir, int* depths) {
+    if (dir < 0 || dir >= INODE_TABLE_SIZE) {
+        return 0;
+    }
+    if (!depths[dir]) {
+        int parent = ROOT_DIRECTORY;
+        inode_directory(dir, NULL, &parent);
+        depths[dir] = depthOf(parent, depths) + 1;
+    }
+    return depths[dir];
+}
+
+static int compareDepths(const void* a, const void* b) {
+    return ((snapshot_name*)a) -> depth - ((snapshot_name*)b) -> depth;
+}
 
-                break;
+/*
+    Writes the whole file system into a new replica's log (see
+    replog_snapshot): every name, directories before what's in them, and
+    the contents of every file.
+*/
+void replica_snapshot(void* state, void* replica) {
+    tecnicofs fs = *(tecnicofs*)state;
+    snapshot_names names = { NULL, 0, 0 };
+    walk_tecnicofs(fs, collectName, &names);
+
+    int* depths = calloc(INODE_TABLE_SIZE, sizeof(int));
+    errWrap(!depths, "Unable to allocate a snapshot!");
+    for (int i = 0; i < names.count; i++) {
+        char* slash = strchr(names.names[i].key, '/');
+        names.names[i].depth = depthOf(slash ? atoi(names.names[i].key) : ROOT_DIRECTORY, depths);
+    }
+    free(depths);
+    qsort(names.names, names.count, sizeof(snapshot_name), compareDepths);
+
+    char contents[REQUEST_BUFFER_SIZE];
+    for (int i = 0; i < names.count; i++) {
+        snapshot_name* name = names.names + i;
+        char* slash = strchr(name -> key, '/');
+        uid_t owner;
+        permission me, others;
+        bool isDirectory = inode_directory(name -> iNumber, NULL, NULL) == 1;
+        if (inode_get(name -> iNumber, NULL, &owner, &me, &others, contents, sizeof(contents)) >= 0) {
+            replog_entry entry = {
+                .op = isDirectory ? 'm' : 'c', .inumber = name -> iNumber,
+                .dir = slash ? atoi(name -> key) : ROOT_DIRECTORY,
+                .owner = owner, .ownerPerm = me, .othersPerm = others
+            };
+            replog_emit(replica, &entry, keyName(name -> key), NULL);
+            if (!isDirectory && contents[0]) {
+                replog_entry write = { .op = 'w', .inumber = name -> iNumber };
+                replog_emit(replica, &write, NULL, contents);
             }
-            default: {
-                RETURN_STATUS(TECNICOFS_ERROR_OTHER);
-                break;
+        }
+        free(name -> key);
+    }
+    free(names.names);
+}
+
+/*
+    Whether a request touches the given file descriptor (or path, which
+    includes the paths below it and the directories above it).
+*/
+static bool usesFd(request* r, int fd) {
+    return (r -> token == 'x' || r -> token == 'l' || r -> token == 'z' || r -> token == 'w') && atoi(r -> arg1) == fd;
+}
+
+static bool overlaps(char* a, char* b) {
+    while (*a == '/') {
+        a++;
+    }
+    while (*b == '/') {
+        b++;
+    }
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return (!*a && (!*b || *b == '/')) || (!*b && *a == '/');
+}
+
+static bool usesName(request* r, char* name) {
+    switch (r -> token) {
+        case 'c':
+        case 'd':
+        case 'm':
+        case 'e':
+        case 'o':
+        case 'L':
+            return overlaps(r -> arg1, name);
+        case 'r':
+            return overlaps(r -> arg1, name) || overlaps(r -> arg2, name);
+        default:
+            return false;
+    }
+}
+
+/*
+    Whether two requests of a session must run in the order they arrived.
+*/
+static bool conflicts(request* a, request* b) {
+    if (a -> barrier || b -> barrier) {
+        return true;
+    }
+    switch (b -> token) {
+        case 'x':
+        case 'l':
+        case 'z':
+        case 'w':
+            return usesFd(a, atoi(b -> arg1));
+        case 'r':
+            return usesName(a, b -> arg1) || usesName(a, b -> arg2);
+        default:
+            return usesName(a, b -> arg1);
+    }
+}
+
+/*
+    Takes a request that was handed over out of the in-flight ones, once
+    it's done. Called with the session lock held.
+*/
+static void finished(session* s, request* r) {
+    for (int i = 0; i < s -> numInflight; i++) {
+        if (s -> inflight[i] == r) {
+            s -> inflight[i] = s -> inflight[--s -> numInflight];
+            break;
+        }
+    }
+    pthread_cond_broadcast(&s -> changed);
+    free(r);
+}
+
+static void* sessionWorker(void* ptr) {
+    session* s = ptr;
+    pthread_mutex_lock(&s -> lock);
+    for (;;) {
+        while (!s -> queueSize && !s -> closing) {
+            s -> idleWorkers++;
+            uint64_t deadline;
+            if (pollBegin(&deadline)) {
+                // Spinning: the dispatcher won't spawn another worker meanwhile
+                pthread_mutex_unlock(&s -> lock);
+                bool waiting;
+                do {
+                    waiting = !__atomic_load_n(&s -> queueSize, __ATOMIC_RELAXED) &&
+                        !__atomic_load_n(&s -> closing, __ATOMIC_RELAXED);
+                } while (waiting && pollContinue(deadline));
+                pollEnd(!waiting);
+                pthread_mutex_lock(&s -> lock);
+                if (!waiting) {
+                    s -> idleWorkers--;
+                    continue;
+                }
             }
+            pthread_cond_wait(&s -> changed, &s -> lock);
+            s -> idleWorkers--;
+        }
+        if (!s -> queueSize) {
+            break;
         }
+        request* r = s -> queue[s -> queueHead];
+        s -> queueHead = (s -> queueHead + 1) % SESSION_MAX_INFLIGHT;
+        s -> queueSize--;
+        pthread_mutex_unlock(&s -> lock);
 
-        // Everything went smooth, return OK status
-        RETURN_STATUS(TECNICOFS_OK);
+        span_request_attach(r -> span);
+        handleRequest(s, r);
+
+        pthread_mutex_lock(&s -> lock);
+        finished(s, r);
     }
+    pthread_mutex_unlock(&s -> lock);
 
+    record_flush();
     return NULL;
+}
 
-    #undef RETURN_STATUS
-}
\ No newline at end of file
+/*
+    Hands a request over to the workers, spawning one if none is idle.
+    Called with the session lock held, once the request conflicts with
+    nothing in flight.
+*/
+static request* track(session* s, request* r) {
+    request* copy = malloc(sizeof(request));
+    errWrap(!copy, "Unable to allocate a request!");
+    memcpy(copy, r, sizeof(request));
+    // Only the dispatcher may look at the body (see request)
+    copy -> body = NULL;
+    s -> inflight[s -> numInflight++] = copy;
+    return copy;
+}
+
+static void handOver(session* s, request* r) {
+    request* copy = track(s, r);
+    s -> queue[(s -> queueHead + s -> queueSize) % SESSION_MAX_INFLIGHT] = copy;
+    s -> queueSize++;
+
+    if (s -> idleWorkers < s -> queueSize && s -> numWorkers < sessionWorkers) {
+        if (!s -> workers) {
+            errWrap(!(s -> workers = malloc(sizeof(pthread_t) * sessionWorkers)), "Unable to allocate the session workers!");
+        }
+        errWrap(pthread_create(s -> workers + s -> numWorkers, NULL, sessionWorker, s), "Unable to spawn a session worker!");
+        s -> numWorkers++;
+    }
+    pthread_cond_broadcast(&s -> changed);
+}
+
+static void ringShard(shard* sh) {
+    // Pairs with the shard announcing it's going to sleep, then looking again
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sh -> sleeping, __ATOMIC_RELAXED)) {
+        pthread_mutex_lock(&sh -> lock);
+        pthread_cond_signal(&sh -> wake);
+        pthread_mutex_unlock(&sh -> lock);
+    }
+}
+
+static void joinShard(shard* sh, shard_inbox* inbox) {
+    pthread_mutex_lock(&sh -> lock);
+    if (sh -> numJoining == sh -> capJoining) {
+        sh -> capJoining = sh -> capJoining ? sh -> capJoining * 2 : 16;
+        sh -> joining = realloc(sh -> joining, sizeof(shard_inbox*) * sh -> capJoining);
+        errWrap(!sh -> joining, "Unable to allocate the shard inboxes!");
+    }
+    sh -> joining[sh -> numJoining++] = inbox;
+    sh -> pending = true;
+    pthread_cond_signal(&sh -> wake);
+    pthread_mutex_unlock(&sh -> lock);
+}
+
+static void leaveShard(shard* sh, shard_inbox* inbox) {
+    pthread_mutex_lock(&sh -> lock);
+    __atomic_store_n(&inbox -> closed, true, __ATOMIC_RELEASE);
+    sh -> pending = true;
+    pthread_cond_signal(&sh -> wake);
+    pthread_mutex_unlock(&sh -> lock);
+}
+
+/* Picks up the inboxes of new sessions and frees the ones of finished sessions */
+static void shardAdopt(shard* sh) {
+    pthread_mutex_lock(&sh -> lock);
+    if (sh -> numJoining) {
+        sh -> inboxes = realloc(sh -> inboxes, sizeof(shard_inbox*) * (sh -> numInboxes + sh -> numJoining));
+        errWrap(!sh -> inboxes, "Unable to allocate the shard inboxes!");
+        memcpy(sh -> inboxes + sh -> numInboxes, sh -> joining, sizeof(shard_inbox*) * sh -> numJoining);
+        sh -> numInboxes += sh -> numJoining;
+        sh -> numJoining = 0;
+    }
+    sh -> pending = false;
+    pthread_mutex_unlock(&sh -> lock);
+
+    for (int i = 0; i < sh -> numInboxes; i++) {
+        shard_inbox* inbox = sh -> inboxes[i];
+        if (__atomic_load_n(&inbox -> closed, __ATOMIC_ACQUIRE) && spsc_empty(&inbox -> ring)) {
+            spsc_destroy(&inbox -> ring);
+            free(inbox);
+            sh -> inboxes[i--] = sh -> inboxes[--sh -> numInboxes];
+        }
+    }
+}
+
+/*
+    A shard: runs the requests its sessions hand over, spinning for a
+    while once they run out, then sleeping until one rings it.
+*/
+static void* shardLoop(void* ptr) {
+    shard* sh = ptr;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(sh -> cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+        log_event(LOG_WARN, "shard", "id=%d cpu=%d pinned=0", sh -> id, sh -> cpu);
+    }
+
+    // New i-nodes come from a slice of the table of its own
+    inode_set_home(sh -> id, numShards);
+
+    int idle = 0;
+    for (;;) {
+        if (__atomic_load_n(&sh -> pending, __ATOMIC_ACQUIRE)) {
+            shardAdopt(sh);
+        }
+
+        bool worked = false;
+        for (int i = 0; i < sh -> numInboxes; i++) {
+            request* r = spsc_pop(&sh -> inboxes[i] -> ring);
+            if (r) {
+                // The inbox says nothing about the session, the request does
+                session* s = (session*)r -> body;
+                r -> body = NULL;
+                span_request_attach(r -> span);
+                handleRequest(s, r);
+                pthread_mutex_lock(&s -> lock);
+                finished(s, r);
+                pthread_mutex_unlock(&s -> lock);
+                worked = true;
+            }
+        }
+        if (worked || ++idle < SHARD_SPINS) {
+            if (worked) {
+                idle = 0;
+            } else {
+                sched_yield();
+            }
+            continue;
+        }
+
+        record_flush();
+        pthread_mutex_lock(&sh -> lock);
+        __atomic_store_n(&sh -> sleeping, true, __ATOMIC_SEQ_CST);
+        bool empty = !sh -> pending;
+        for (int i = 0; i < sh -> numInboxes && empty; i++) {
+            empty = spsc_empty(&sh -> inboxes[i] -> ring);
+        }
+        if (empty) {
+            pthread_cond_wait(&sh -> wake, &sh -> lock);
+        }
+        __atomic_store_n(&sh -> sleeping, false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&sh -> lock);
+        idle = 0;
+    }
+    return NULL;
+}
+
+void start_shards(tecnicofs fs) {
+    shards = calloc(numShards, sizeof(shard));
+    errWrap(!shards, "Unable to allocate the shards!");
+
+    // Each shard's buckets and i-nodes go on the node of the CPU it's pinned to
+    int* nodes = malloc(sizeof(int) * numShards);
+    errWrap(!nodes, "Unable to allocate the shards!");
+    for (int i = 0; i < numShards; i++) {
+        shards[i].cpu = numa_nth_cpu(threadCpus, i);
+        nodes[i] = numa_node_of_cpu(shards[i].cpu);
+        inode_place(i, numShards, nodes[i]);
+    }
+    place_tecnicofs(fs, numShards, nodes);
+    free(nodes);
+
+    for (int i = 0; i < numShards; i++) {
+        shard* sh = shards + i;
+        sh -> id = i;
+        sh -> fs = fs;
+        pthread_mutex_init(&sh -> lock, NULL);
+        pthread_cond_init(&sh -> wake, NULL);
+        errWrap(pthread_create(&sh -> thread, NULL, shardLoop, sh), "Unable to spawn a shard!");
+    }
+}
+
+static int shardOf(tecnicofs fs, char* path) {
+    char key[MAX_KEY_SIZE];
+    int dir;
+    unsigned int generation;
+    if (resolve_path(fs, path, &dir, &generation, key) < 0) {
+        return -1;
+    }
+    return bucket_share(fs, get_bucket(fs, key), numShards);
+}
+
+/*
+    The shard that owns every name the request touches, -1 if there's
+    none (it touches no names, or names of different shards).
+*/
+static int shardFor(session* s, request* r) {
+    switch (r -> token) {
+        case 'c':
+        case 'm':
+        case 'd':
+        case 'e':
+        case 'o':
+        case 'L':
+            return r -> numTokens >= 2 ? shardOf(s -> fs, r -> arg1) : -1;
+        case 'r':
+        {
+            int from = r -> numTokens == 3 ? shardOf(s -> fs, r -> arg1) : -1;
+            return from >= 0 && from == shardOf(s -> fs, r -> arg2) ? from : -1;
+        }
+        default:
+            return -1;
+    }
+}
+
+/*
+    Decides where a request runs: returns true if it was handed over to
+    the workers (or to a shard), false if the dispatcher should run it
+    itself (which it may, since nothing else is in flight then).
+*/
+static bool dispatch(session* s, request_reader* reader, request* r) {
+    // Resolved before waiting: the shard resolves the names again anyway
+    int target = s -> inboxes ? shardFor(s, r) : -1;
+
+    pthread_mutex_lock(&s -> lock);
+    for (;;) {
+        bool blocked = s -> numInflight == SESSION_MAX_INFLIGHT;
+        for (int i = 0; i < s -> numInflight && !blocked; i++) {
+            blocked = conflicts(s -> inflight[i], r);
+        }
+        if (!blocked) {
+            break;
+        }
+        pthread_cond_wait(&s -> changed, &s -> lock);
+    }
+
+    // Nothing to overlap with (or allowed to), so don't pay for the hand-over
+    bool handedOver = false;
+    if (target >= 0) {
+        // The shard finds the session in the body, which it has no use for
+        request* copy = track(s, r);
+        copy -> body = (char*)s;
+        errWrap(!spsc_push(&s -> inboxes[target] -> ring, copy), "Shard inbox overflow!");
+        ringShard(shards + target);
+        handedOver = true;
+    } else if (!r -> barrier && sessionWorkers > 1 && (s -> numInflight || readerPending(reader))) {
+        handOver(s, r);
+        handedOver = true;
+    }
+    pthread_mutex_unlock(&s -> lock);
+    return handedOver;
+}
+
+void* applyCommands(void* args){
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    session* s = malloc(sizeof(session));
+    errWrap(!s, "Unable to allocate the session!");
+    s -> sock = *((socket_t*)args);
+    s -> fs = *((tecnicofs*)((intptr_t)args + (intptr_t)sizeof(socket_t)));
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        s -> openfiles[i].inode = -1;
+    }
+    pthread_mutex_init(&s -> filesLock, NULL);
+    pthread_mutex_init(&s -> sendLock, NULL);
+    pthread_mutex_init(&s -> lock, NULL);
+    pthread_cond_init(&s -> changed, NULL);
+    s -> numInflight = 0;
+    s -> queueHead = 0;
+    s -> queueSize = 0;
+    s -> idleWorkers = 0;
+    s -> closing = false;
+    s -> numWorkers = 0;
+    s -> workers = NULL;
+    s -> inboxes = NULL;
+    s -> authenticated = !s -> sock.tcp;
+    s -> trusted = !s -> sock.tcp && s -> sock.userId == getuid();
+    s -> shm = NULL;
+    if (numShards > 0) {
+        s -> inboxes = malloc(sizeof(shard_inbox*) * numShards);
+        errWrap(!s -> inboxes, "Unable to allocate the session inboxes!");
+        for (int i = 0; i < numShards; i++) {
+            void* inbox;
+            errWrap(posix_memalign(&inbox, 64, sizeof(shard_inbox)), "Unable to allocate a session inbox!");
+            s -> inboxes[i] = inbox;
+            // Never more than the requests in flight in it
+            spsc_init(&s -> inboxes[i] -> ring, SESSION_MAX_INFLIGHT);
+            s -> inboxes[i] -> closed = false;
+            joinShard(shards + i, s -> inboxes[i]);
+        }
+    }
+
+    socket_t sock = s -> sock;
+    request_reader* reader = malloc(sizeof(request_reader));
+    readerInit(reader, sock.socket);
+    s -> reader = reader;
+    request* r = malloc(sizeof(request));
+    char* command;
+    ssize_t success;
+
+    for (;;) {
+        // Whether it comes from the socket, the shm ring or the reader's buffer
+        success = readerNext(reader, &command);
+        span_request_begin(sock.sessionId);
+        r -> arrival = recording ? record_clock() : 0;
+
+        // Sanity verification block
+        if (success <= 0) {
+            break;
+        }
+
+        // Tagged request? (@id cmd ..., or @id! cmd ... for a barrier)
+        r -> tagged = command[0] == '@';
+        r -> barrier = !r -> tagged;
+        r -> id = 0;
+        if (r -> tagged) {
+            r -> id = (int)strtol(command + 1, &command, 10);
+            if (*command == '!') {
+                r -> barrier = true;
+                command++;
+            }
+            while (*command == ' ') {
+                command++;
+            }
+        }
+
+        // Shallow-clean buffers
+        r -> arg1[0] = '\0';
+        r -> arg2[0] = '\0';
+        r -> token = '\0';
+        r -> body = command;
+        SPAN(SPAN_PARSE, r -> numTokens = sscanf(command, ARG_FORMAT, &r -> token, r -> arg1, r -> arg2));
+        if (!strchr("cdmeroxlzwLO", r -> token)) {
+            // Pings, listings, transactions, tracer control and anything unknown keep their place
+            r -> barrier = true;
+        }
+
+        r -> span = span_request_detach();
+        if (!dispatch(s, reader, r)) {
+            span_request_attach(r -> span);
+            handleRequest(s, r);
+        }
+    }
+
+    // Client unmounted (or the connection broke): let the workers finish first
+    pthread_mutex_lock(&s -> lock);
+    s -> closing = true;
+    pthread_cond_broadcast(&s -> changed);
+    pthread_mutex_unlock(&s -> lock);
+    for (int i = 0; i < s -> numWorkers; i++) {
+        pthread_join(s -> workers[i], NULL);
+    }
+    if (s -> inboxes) {
+        // The shards may still be running some, they free the inboxes once empty
+        pthread_mutex_lock(&s -> lock);
+        while (s -> numInflight) {
+            pthread_cond_wait(&s -> changed, &s -> lock);
+        }
+        pthread_mutex_unlock(&s -> lock);
+        for (int i = 0; i < numShards; i++) {
+            leaveShard(shards + i, s -> inboxes[i]);
+        }
+        free(s -> inboxes);
+    }
+
+    // Authenticating may have changed who the session is
+    sock = s -> sock;
+    log_event(success ? LOG_WARN : LOG_INFO, "disconnected", "session=%d uid=%d", sock.sessionId, sock.userId);
+    if (recording) {
+        record_request(record_clock(), sock.sessionId, sock.userId, RECORD_HANGUP, NULL, NULL, TECNICOFS_OK);
+        record_flush();
+    }
+    errWrap(close(sock.socket), "Unable to close socket fdescriptor!");
+    if (s -> shm) {
+        munmap(s -> shm, sizeof(shm_channel));
+    }
+    // Internal cleanup
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        filed f = s -> openfiles[i];
+        if (f.inode >= 0) {
+            inode_update_fd(f.inode, -1);
+        }
+    }
+
+    pthread_mutex_destroy(&s -> filesLock);
+    pthread_mutex_destroy(&s -> sendLock);
+    pthread_mutex_destroy(&s -> lock);
+    pthread_cond_destroy(&s -> changed);
+    free(s -> workers);
+    free(s);
+    free(reader);
+    free(r);
+
+    pthread_exit(NULL);
+    return NULL;
+}
@@ -5,4 +5,29 @@
 
 */
 
-void* applyCommands(void*);
\ No newline at end of file
+#include "fs.h"
+#include "lib/numa.h"
+#include "lib/replog.h"
+
+// How many workers a session may spawn to run its independent requests (1 = none)
+extern int sessionWorkers;
+
+// How long the leases granted along with 'L' opens last, in ms (0 = no leases)
+extern int leaseDuration;
+
+// The CPUs the sessions and shards run on, NULL = wherever the scheduler puts them
+extern cpu_set_t* threadCpus;
+
+// Threads that own the buckets (and run the requests on them) in shard mode, 0 = off
+extern int numShards;
+
+// Whether same-host clients may move their sessions to shared memory ('h')
+extern bool shareMemory;
+
+// Whether mutations are turned down (a replica that wasn't promoted yet)
+extern bool readOnly;
+
+void start_shards(tecnicofs);
+void replica_apply(replog_entry*, char*, char*, void*);
+void replica_snapshot(void*, void*);
+void* applyCommands(void*);
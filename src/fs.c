@@ -1,32 +1,134 @@
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
 #include "fs.h"
 #include "lib/color.h"
 #include "lib/bst.h"
+#include "lib/ebr.h"
+#include "lib/err.h"
 #include "lib/hash.h"
+#include "lib/inodes.h"
 #include "lib/locks.h"
+#include "lib/numa.h"
+
+// How many names a listing copies out of a bucket per lock acquisition
+#define LIST_BATCH 32
+
+// Lock-free attempts a lookup makes before it takes the bucket's lock
+#define LOOKUP_ATTEMPTS 4
+
+// Lookups that had to walk a tree again, and that gave up and locked it
+static unsigned long lookupRetries = 0;
+static unsigned long lookupFallbacks = 0;
+
+// Which of the buckets' stats stripes this thread counts in (-1 if not picked yet)
+static __thread int statsStripe = -1;
+static int nextStatsStripe = 0;
+
+/*
+    A bucket's place in a listing: the next few of its names (in order),
+    copied out so that the bucket's lock isn't held in between.
+*/
+typedef struct {
+    tecnicofs_node* bucket;
+    char* names[LIST_BATCH];
+    int count;
+    int next;
+    bool exhausted;
+} list_iterator;
+
+typedef struct {
+    list_iterator* it;
+    char* prefix;
+    size_t prefixLen;
+} list_batch;
+
+// A bucket's part of the shutdown dump
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} dump_buffer;
+
+typedef struct {
+    tecnicofs fs;
+    int next;               // next bucket to render
+    dump_buffer* buffers;
+} dump_job;
+
+// Directory paths the dentry cache has room for (longer ones are always walked)
+#define DENTRY_SLOTS 4096
+#define DENTRY_STRIPES 64
+#define DENTRY_PATH_SIZE 116
+
+typedef struct {
+    char path[DENTRY_PATH_SIZE];
+    int length;             // 0 if the slot is empty
+    int inumber;
+    unsigned int generation;
+    unsigned long epoch;
+} dentry;
+
+/*
+    Maps directory paths to their i-nodes, so resolving a path doesn't
+    walk (and lock) every component again. Slots are direct-mapped and
+    guarded by striped locks. Moving or removing a directory bumps the
+    epoch, which makes every entry filled before it stale at once.
+*/
+struct dentry_cache {
+    lock stripes[DENTRY_STRIPES];
+    dentry slots[DENTRY_SLOTS];
+    unsigned long epoch;
+    unsigned long hits;
+    unsigned long misses;
+};
 
 tecnicofs new_tecnicofs(int buckets){
     tecnicofs root;
     root.numBuckets = buckets;
-    root.fs = malloc(sizeof(tecnicofs_node) * buckets);
+    void* nodes = NULL;
 
-    if (!root.fs) {
+    // Aligned, so the stats stripes of different threads never share a line
+    if (posix_memalign(&nodes, sizeof(stats_stripe), sizeof(tecnicofs_node) * buckets)) {
         fprintf(stderr, red_bold("Failed to allocate TecnicoFS!"));
         perror("\nError");
         exit(EXIT_FAILURE);
     }
+    root.fs = nodes;
+    root.locks = malloc(sizeof(lock) * buckets);
+    errWrap(!root.locks, "Unable to allocate the bucket locks!");
 
     for (int i = 0; i < buckets; i++) {
         tecnicofs_node* bucket = root.fs + i;
         bucket -> bstRoot = NULL;
-        bucket -> sync_lock = malloc(sizeof(lock));
+        bucket -> version = 0;
+        bucket -> filter = malloc(sizeof(name_filter));
+        errWrap(!bucket -> filter, "Unable to allocate a name filter!");
+        filter_init(bucket -> filter, FILTER_MIN_CAPACITY);
+        bucket -> node = -1;
+        memset(bucket -> stats, 0, sizeof(bucket -> stats));
+        bucket -> sync_lock = root.locks + i;
         INIT_LOCK(bucket -> sync_lock);
     }
 
+    root.dentries = calloc(1, sizeof(dentry_cache));
+    if (!root.dentries) {
+        fprintf(stderr, red_bold("Failed to allocate the dentry cache!"));
+        perror("\nError");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < DENTRY_STRIPES; i++) {
+        INIT_LOCK(root.dentries -> stripes + i);
+    }
+
     return root;
 }
 
@@ -35,30 +137,237 @@ void free_tecnicofs(tecnicofs root){
     for (int i = 0; i < root.numBuckets; i++) {
         tecnicofs_node* fsnode = fs + i;
         DESTROY_LOCK(fsnode -> sync_lock);
-        free(fsnode -> sync_lock);
+        filter_destroy(fsnode -> filter);
+        free(fsnode -> filter);
         free_tree(fsnode -> bstRoot);
     }
     free(fs);
+    free(root.locks);
+    ebr_drain();
+    for (int i = 0; i < DENTRY_STRIPES; i++) {
+        DESTROY_LOCK(root.dentries -> stripes + i);
+    }
+    free(root.dentries);
+}
+
+static void refilter(node* n, void* filter) {
+    filter_add(filter, n -> key);
+}
+
+static void releaseNode(void* n) {
+    free_node(n);
+}
+
+static void releaseFilter(void* filter) {
+    filter_destroy(filter);
+    free(filter);
+}
+
+/* The bucket's stats stripe of the calling thread (each thread sticks to one) */
+static stats_stripe* myStripe(tecnicofs_node* fsnode) {
+    if (statsStripe < 0) {
+        statsStripe = __atomic_fetch_add(&nextStatsStripe, 1, __ATOMIC_RELAXED) % STATS_STRIPES;
+    }
+    return fsnode -> stats + statsStripe;
+}
+
+static filter_stats* myStats(tecnicofs_node* fsnode) {
+    return &myStripe(fsnode) -> stats;
+}
+
+/* Counts an access to a placed bucket as local or remote to where we run */
+static void countAccess(tecnicofs_node* fsnode) {
+    if (fsnode -> node < 0) {
+        return;
+    }
+    stats_stripe* stripe = myStripe(fsnode);
+    __atomic_fetch_add(numa_current_node() == fsnode -> node ? &stripe -> local : &stripe -> remote, 1, __ATOMIC_RELAXED);
+}
+
+/*
+    Seqlock writer side, with the bucket's write lock held: the version is
+    odd from before the first change until after the last one.
+*/
+static void beginChange(tecnicofs_node* fsnode) {
+    __atomic_store_n(&fsnode -> version, fsnode -> version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void endChange(tecnicofs_node* fsnode) {
+    __atomic_store_n(&fsnode -> version, fsnode -> version + 1, __ATOMIC_RELEASE);
 }
 
 void create(tecnicofs fs, char *name, int inumber){
     tecnicofs_node* fsnode = fs.fs + hash(name, fs.numBuckets);
+    countAccess(fsnode);
+    beginChange(fsnode);
     fsnode -> bstRoot = insert(fsnode -> bstRoot, name, inumber);
+    filter_add(fsnode -> filter, name);
+    endChange(fsnode);
+
+    // Outgrown: build one twice as large, then swap it in (we hold the bucket's write lock)
+    if (filter_full(fsnode -> filter)) {
+        name_filter* filter = malloc(sizeof(name_filter));
+        errWrap(!filter, "Unable to allocate a name filter!");
+        filter_init(filter, fsnode -> filter -> capacity * 2);
+        walk_tree(fsnode -> bstRoot, refilter, filter);
+        name_filter* old = fsnode -> filter;
+        __atomic_store_n(&fsnode -> filter, filter, __ATOMIC_RELEASE);
+        ebr_retire(old, releaseFilter);
+    }
 }
 
 void delete(tecnicofs fs, char *name){
     tecnicofs_node* fsnode = fs.fs + hash(name, fs.numBuckets);
-    fsnode -> bstRoot = remove_item(fsnode -> bstRoot, name);
+    countAccess(fsnode);
+    // Taking out a name that isn't there would leave the filter with misses
+    node* removed = NULL;
+    beginChange(fsnode);
+    fsnode -> bstRoot = unlink_item(fsnode -> bstRoot, name, &removed);
+    if (removed) {
+        filter_remove(fsnode -> filter, name);
+    }
+    endChange(fsnode);
+    // Lookups without the lock may still be on it
+    if (removed) {
+        ebr_retire(removed, releaseNode);
+    }
 }
 
+/*
+    One lock-free attempt: walks the bucket's filter and tree as they are,
+    then checks no change started or ended meanwhile.
+
+    Returns: 1 if it got an answer (in *inumber, -1 if the name isn't there;
+    *rejected tells whether the filter ruled it out, *filtered whether there
+    was a filter at all), 0 if it must retry.
+*/
+static int lookupOptimistic(tecnicofs_node* fsnode, char* name, int* inumber, bool* rejected, bool* filtered) {
+    unsigned int version = __atomic_load_n(&fsnode -> version, __ATOMIC_ACQUIRE);
+    if (version & 1) {
+        return 0;
+    }
+
+    name_filter* filter = __atomic_load_n(&fsnode -> filter, __ATOMIC_ACQUIRE);
+    // A consistent tree is never deeper than the names in it
+    unsigned int depth = __atomic_load_n(&filter -> names, __ATOMIC_RELAXED);
+    *rejected = !filter_may_contain(filter, name);
+    *filtered = filter -> counters != NULL;
+    int found = 0;
+    if (!*rejected) {
+        found = search_unlocked(__atomic_load_n(&fsnode -> bstRoot, __ATOMIC_RELAXED), name, depth, inumber);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (found < 0 || __atomic_load_n(&fsnode -> version, __ATOMIC_RELAXED) != version) {
+        return 0;
+    }
+    if (!found) {
+        *inumber = -1;
+    }
+    return 1;
+}
+
+/*
+    Looks a name up in its bucket. Needs no lock: the tree is walked
+    optimistically (readers don't write to anything shared) and the walk
+    is retried if a change got in the way; after LOOKUP_ATTEMPTS of those
+    it takes the bucket's read lock instead. Callers that hold the
+    bucket's lock (either way) always get through at the first attempt.
+
+    Returns: the name's i-number, -1 if it isn't there.
+*/
 int lookup(tecnicofs fs, char *name){
     tecnicofs_node* fsnode = fs.fs + hash(name, fs.numBuckets);
+    filter_stats* stats = myStats(fsnode);
+    __atomic_fetch_add(&stats -> lookups, 1, __ATOMIC_RELAXED);
+    countAccess(fsnode);
+
+    int inumber = -1;
+    bool rejected = false;
+    bool filtered = false;
+    bool answered = false;
+    ebr_enter();
+    for (int attempt = 0; attempt < LOOKUP_ATTEMPTS && !answered; attempt++) {
+        answered = lookupOptimistic(fsnode, name, &inumber, &rejected, &filtered);
+        if (!answered) {
+            __atomic_fetch_add(&lookupRetries, 1, __ATOMIC_RELAXED);
+        }
+    }
+    ebr_exit();
+
+    if (!answered) {
+        __atomic_fetch_add(&lookupFallbacks, 1, __ATOMIC_RELAXED);
+        LOCK_READ(fsnode -> sync_lock);
+        rejected = !filter_may_contain(fsnode -> filter, name);
+        filtered = fsnode -> filter -> counters != NULL;
+        node* searchNode = rejected ? NULL : search(fsnode -> bstRoot, name);
+        inumber = searchNode ? searchNode -> inumber : -1;
+        LOCK_UNLOCK(fsnode -> sync_lock);
+    }
+
+    if (rejected) {
+        __atomic_fetch_add(&stats -> rejected, 1, __ATOMIC_RELAXED);
+    } else if (inumber < 0 && filtered) {
+        // Without filters (-F 0) every name gets through: that's no false positive
+        __atomic_fetch_add(&stats -> falsePositives, 1, __ATOMIC_RELAXED);
+    }
+    return inumber;
+}
+
+void get_lookup_stats(unsigned long* retries, unsigned long* fallbacks){
+    *retries = __atomic_load_n(&lookupRetries, __ATOMIC_RELAXED);
+    *fallbacks = __atomic_load_n(&lookupFallbacks, __ATOMIC_RELAXED);
+}
+
+int get_bucket(tecnicofs fs, char *name){
+    return hash(name, fs.numBuckets);
+}
+
+/* Which of shares contiguous ranges of buckets the bucket is in */
+int bucket_share(tecnicofs fs, int bucket, int shares){
+    return (int)((long)bucket * shares / fs.numBuckets);
+}
+
+/*
+    Places each share of the buckets (see bucket_share), along with their
+    locks, on the NUMA node given for it; or, without shares, spreads them
+    over every node. The trees follow on their own: their nodes come from
+    whichever thread inserts them, which mostly runs on that node too.
+*/
+void place_tecnicofs(tecnicofs fs, int shares, int* nodes){
+    if (shares <= 0) {
+        numa_interleave(fs.fs, sizeof(tecnicofs_node) * fs.numBuckets);
+        numa_interleave(fs.locks, sizeof(lock) * fs.numBuckets);
+        return;
+    }
+
+    // Runs of buckets of the same share
+    for (int first = 0, i = 1; i <= fs.numBuckets; i++) {
+        int share = bucket_share(fs, first, shares);
+        if (i < fs.numBuckets && bucket_share(fs, i, shares) == share) {
+            continue;
+        }
+        if (numa_prefer(fs.fs + first, sizeof(tecnicofs_node) * (i - first), nodes[share]) < 0 ||
+            numa_prefer(fs.locks + first, sizeof(lock) * (i - first), nodes[share]) < 0) {
+            perror("Unable to place the buckets");
+        }
+        for (int j = first; j < i; j++) {
+            fs.fs[j].node = nodes[share];
+        }
+        first = i;
+    }
+}
 
-    node* searchNode = search(fsnode -> bstRoot, name);
-    if (searchNode) {
-        return searchNode -> inumber;
+void get_numa_stats(tecnicofs fs, unsigned long* local, unsigned long* remote){
+    *local = 0;
+    *remote = 0;
+    for (int i = 0; i < fs.numBuckets; i++) {
+        for (int j = 0; j < STATS_STRIPES; j++) {
+            *local += __atomic_load_n(&fs.fs[i].stats[j].local, __ATOMIC_RELAXED);
+            *remote += __atomic_load_n(&fs.fs[i].stats[j].remote, __ATOMIC_RELAXED);
+        }
     }
-    return -1;
 }
 
 lock* get_lock(tecnicofs fs, char *name){
@@ -66,9 +375,440 @@ lock* get_lock(tecnicofs fs, char *name){
     return fsnode -> sync_lock;
 }
 
+static int collectName(node* n, void* ptr) {
+    list_batch* batch = ptr;
+    int comp = strncmp(n -> key, batch -> prefix, batch -> prefixLen);
+    if (comp > 0) {
+        // Past the names with the prefix, nothing else to find here
+        batch -> it -> exhausted = true;
+        return 1;
+    }
+    // Entries of subdirectories of the root also start with the root's prefix
+    if (!comp && !strchr(n -> key + batch -> prefixLen, '/')) {
+        batch -> it -> names[batch -> it -> count++] = strdup(n -> key);
+    }
+    return batch -> it -> count == LIST_BATCH;
+}
+
+/* Copies the bucket's next batch of names after from (or from on) */
+static void refill(list_iterator* it, char* prefix, char* from, int inclusive) {
+    char* previous[LIST_BATCH];
+    int numPrevious = it -> count;
+    memcpy(previous, it -> names, sizeof(char*) * numPrevious);
+    it -> count = 0;
+    it -> next = 0;
+
+    list_batch batch = { it, prefix, strlen(prefix) };
+    LOCK_READ(it -> bucket -> sync_lock);
+    if (!walk_tree_from(it -> bucket -> bstRoot, from, inclusive, collectName, &batch)) {
+        it -> exhausted = true;
+    }
+    LOCK_UNLOCK(it -> bucket -> sync_lock);
+
+    // from may be the last of them
+    for (int i = 0; i < numPrevious; i++) {
+        free(previous[i]);
+    }
+}
+
+static char* currentName(list_iterator* it) {
+    return it -> names[it -> next];
+}
+
+/* Min-heap of the buckets by their next name */
+static void siftDown(list_iterator** heap, int size, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < size && strcmp(currentName(heap[left]), currentName(heap[smallest])) < 0) {
+            smallest = left;
+        }
+        if (right < size && strcmp(currentName(heap[right]), currentName(heap[smallest])) < 0) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        list_iterator* tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+typedef struct {
+    void (*visit)(char*, int, void*);
+    void* arg;
+} walk_job;
+
+static void walkNode(node* n, void* job) {
+    ((walk_job*)job) -> visit(n -> key, n -> inumber, ((walk_job*)job) -> arg);
+}
+
+/*
+    Hands visit every key and its i-node, in no particular order, a bucket
+    at a time (under its read lock).
+*/
+void walk_tecnicofs(tecnicofs fs, void (*visit)(char*, int, void*), void* arg){
+    walk_job job = { visit, arg };
+    for (int i = 0; i < fs.numBuckets; i++) {
+        LOCK_READ(fs.fs[i].sync_lock);
+        walk_tree(fs.fs[i].bstRoot, walkNode, &job);
+        LOCK_UNLOCK(fs.fs[i].sync_lock);
+    }
+}
+
+/*
+    Hands emit, in order, up to limit keys starting with prefix (which
+    holds the key of a directory, see make_key) that come after the given
+    one (from the start, if after is NULL), merging every bucket. Takes
+    the bucket locks itself, a batch of names at a time, so the listing
+    isn't a snapshot: names created or deleted meanwhile may or may not
+    show up. Stops early if emit returns non-zero.
+
+    Returns: how many names were emitted.
+*/
+int list_names(tecnicofs fs, char* prefix, char* after, int limit, int (*emit)(char*, void*), void* arg){
+    // Names with the prefix start at the prefix itself
+    char* from = prefix;
+    int inclusive = 1;
+    if (after && strcmp(after, prefix) >= 0) {
+        from = after;
+        inclusive = 0;
+    }
+
+    list_iterator* iterators = malloc(sizeof(list_iterator) * fs.numBuckets);
+    list_iterator** heap = malloc(sizeof(list_iterator*) * fs.numBuckets);
+    int heapSize = 0;
+    for (int i = 0; i < fs.numBuckets; i++) {
+        list_iterator* it = iterators + i;
+        it -> bucket = fs.fs + i;
+        it -> count = 0;
+        it -> exhausted = false;
+        refill(it, prefix, from, inclusive);
+        if (it -> count) {
+            heap[heapSize++] = it;
+        }
+    }
+    for (int i = heapSize / 2 - 1; i >= 0; i--) {
+        siftDown(heap, heapSize, i);
+    }
+
+    int emitted = 0;
+    while (heapSize && emitted < limit) {
+        list_iterator* it = heap[0];
+        emitted++;
+        if (emit(it -> names[it -> next++], arg)) {
+            break;
+        }
+        if (it -> next == it -> count) {
+            if (!it -> exhausted) {
+                refill(it, prefix, it -> names[it -> count - 1], 0);
+            }
+            if (it -> next == it -> count) {
+                heap[0] = heap[--heapSize];
+            }
+        }
+        siftDown(heap, heapSize, 0);
+    }
+
+    for (int i = 0; i < fs.numBuckets; i++) {
+        for (int j = 0; j < iterators[i].count; j++) {
+            free(iterators[i].names[j]);
+        }
+    }
+    free(iterators);
+    free(heap);
+    return emitted;
+}
+
+/*
+    Fills key with the key of the entry with the given name in the given
+    directory. Returns its length.
+*/
+int make_key(int directory, char* name, char* key){
+    if (directory == ROOT_DIRECTORY) {
+        return snprintf(key, MAX_KEY_SIZE, "%s", name);
+    }
+    return snprintf(key, MAX_KEY_SIZE, "%d/%s", directory, name);
+}
+
+static dentry* dentrySlot(dentry_cache* cache, char* path, size_t len, lock** stripe) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    *stripe = cache -> stripes + h % DENTRY_STRIPES;
+    return cache -> slots + h % DENTRY_SLOTS;
+}
+
+static bool dentryLookup(dentry_cache* cache, char* path, size_t len, unsigned long epoch, int* inumber, unsigned int* generation) {
+    lock* stripe;
+    dentry* entry = dentrySlot(cache, path, len, &stripe);
+    LOCK_READ(stripe);
+    bool hit = entry -> length == (int)len && entry -> epoch == epoch && !memcmp(entry -> path, path, len);
+    if (hit) {
+        *inumber = entry -> inumber;
+        *generation = entry -> generation;
+    }
+    LOCK_UNLOCK(stripe);
+    return hit;
+}
+
+static void dentryStore(dentry_cache* cache, char* path, size_t len, unsigned long epoch, int inumber, unsigned int generation) {
+    if (len >= DENTRY_PATH_SIZE) {
+        return;
+    }
+    lock* stripe;
+    dentry* entry = dentrySlot(cache, path, len, &stripe);
+    LOCK_WRITE(stripe);
+    memcpy(entry -> path, path, len);
+    entry -> length = len;
+    entry -> inumber = inumber;
+    entry -> generation = generation;
+    entry -> epoch = epoch;
+    LOCK_UNLOCK(stripe);
+}
+
+/*
+    Resolves the first len characters of path ("dir/dir/...", relative to
+    the root) to the directory they lead to. Starts from the longest
+    prefix found in the dentry cache and walks the rest, one component
+    (and one lookup) at a time, caching what it finds on the way.
+
+    Returns: 0 if successful (and the directory's i-node and generation,
+    ROOT_DIRECTORY and ANY_GENERATION for the root), -1 if some directory
+    doesn't exist, -2 if some component isn't a directory, -3 if the path
+    is malformed.
+*/
+int resolve_directory(tecnicofs fs, char* path, size_t len, int* directory, unsigned int* generation){
+    dentry_cache* cache = fs.dentries;
+    unsigned long epoch = __atomic_load_n(&cache -> epoch, __ATOMIC_ACQUIRE);
+    int current = ROOT_DIRECTORY;
+    unsigned int currentGeneration = ANY_GENERATION;
+    if (len && path[len - 1] == '/') {
+        return -3;
+    }
+
+    size_t resolved = len;
+    while (resolved && !dentryLookup(cache, path, resolved, epoch, &current, &currentGeneration)) {
+        // Drop the last component
+        while (resolved && path[resolved - 1] != '/') {
+            resolved--;
+        }
+        if (resolved) {
+            resolved--;
+        }
+    }
+    if (len) {
+        __atomic_fetch_add(resolved == len ? &cache -> hits : &cache -> misses, 1, __ATOMIC_RELAXED);
+    }
+
+    char name[MAX_KEY_SIZE];
+    char key[MAX_KEY_SIZE];
+    for (size_t at = resolved ? resolved + 1 : 0; at < len; ) {
+        size_t end = at;
+        while (end < len && path[end] != '/') {
+            end++;
+        }
+        if (end == at || end - at >= sizeof(name)) {
+            return -3;
+        }
+        memcpy(name, path + at, end - at);
+        name[end - at] = '\0';
+        make_key(current, name, key);
+
+        int inumber = lookup(fs, key);
+        if (inumber < 0) {
+            return -1;
+        }
+        switch (inode_directory(inumber, &currentGeneration, NULL)) {
+            case 1: break;
+            case 0: return -2;
+            default: return -1;
+        }
+        current = inumber;
+        dentryStore(cache, path, end, epoch, current, currentGeneration);
+        at = end + 1;
+    }
+
+    *directory = current;
+    *generation = currentGeneration;
+    return 0;
+}
+
+/*
+    Resolves a path ("[/]dir/.../name") to the directory its entry is in
+    (as resolve_directory does) and fills key with the entry's key.
+
+    Returns: as resolve_directory.
+*/
+int resolve_path(tecnicofs fs, char* path, int* directory, unsigned int* generation, char* key){
+    while (*path == '/') {
+        path++;
+    }
+    char* slash = strrchr(path, '/');
+    char* name = slash ? slash + 1 : path;
+    if (!*name) {
+        return -3;
+    }
+
+    int status = resolve_directory(fs, path, slash ? (size_t)(slash - path) : 0, directory, generation);
+    if (!status) {
+        make_key(*directory, name, key);
+    }
+    return status;
+}
+
+/* Called whenever a directory is moved or removed */
+void invalidate_paths(tecnicofs fs){
+    __atomic_fetch_add(&fs.dentries -> epoch, 1, __ATOMIC_RELEASE);
+}
+
+void get_dentry_stats(tecnicofs fs, unsigned long* hits, unsigned long* misses){
+    *hits = __atomic_load_n(&fs.dentries -> hits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&fs.dentries -> misses, __ATOMIC_RELAXED);
+}
+
+/* Adds up the filter counters of every bucket */
+void get_filter_stats(tecnicofs fs, filter_stats* stats){
+    memset(stats, 0, sizeof(filter_stats));
+    for (int i = 0; i < fs.numBuckets; i++) {
+        for (int j = 0; j < STATS_STRIPES; j++) {
+            filter_stats* stripe = &fs.fs[i].stats[j].stats;
+            stats -> lookups += __atomic_load_n(&stripe -> lookups, __ATOMIC_RELAXED);
+            stats -> rejected += __atomic_load_n(&stripe -> rejected, __ATOMIC_RELAXED);
+            stats -> falsePositives += __atomic_load_n(&stripe -> falsePositives, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* writev until every byte is out (it may stop short) */
+static int writeAll(int fd, struct iovec* iov, int count) {
+    while (count) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count && (size_t)written >= iov -> iov_len) {
+            written -= iov -> iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov -> iov_base = (char*)iov -> iov_base + written;
+            iov -> iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static void reserve(dump_buffer* buffer, size_t more) {
+    if (buffer -> len + more > buffer -> cap) {
+        buffer -> cap = (buffer -> len + more) * 2;
+        buffer -> data = realloc(buffer -> data, buffer -> cap);
+        if (!buffer -> data) {
+            perror("Unable to grow a dump buffer");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+    Renders a bucket's tree the way print_tree does, into its buffer.
+    In order without recursion (a tree fed sorted names is a list).
+*/
+static void renderBucket(tecnicofs_node* bucket, dump_buffer* buffer) {
+    size_t top = 0, capacity = 64;
+    node** stack = malloc(sizeof(node*) * capacity);
+    int* levels = malloc(sizeof(int) * capacity);
+    node* p = bucket -> bstRoot;
+    int level = 0;
+
+    reserve(buffer, 1);
+    buffer -> data[buffer -> len++] = '\n';
+    while (p || top) {
+        while (p) {
+            if (top == capacity) {
+                capacity *= 2;
+                stack = realloc(stack, sizeof(node*) * capacity);
+                levels = realloc(levels, sizeof(int) * capacity);
+            }
+            stack[top] = p;
+            levels[top++] = level++;
+            p = p -> left;
+        }
+        p = stack[--top];
+        level = levels[top];
+
+        size_t indent = 2 * (level + 1);
+        size_t keyLen = strlen(p -> key);
+        reserve(buffer, indent + keyLen + 1);
+        memset(buffer -> data + buffer -> len, ' ', indent);
+        memcpy(buffer -> data + buffer -> len + indent, p -> key, keyLen);
+        buffer -> len += indent + keyLen;
+        buffer -> data[buffer -> len++] = '\n';
+
+        p = p -> right;
+        level++;
+    }
+    free(stack);
+    free(levels);
+}
+
+static void* dumpWorker(void* ptr) {
+    dump_job* job = ptr;
+    for (;;) {
+        int i = __atomic_fetch_add(&job -> next, 1, __ATOMIC_RELAXED);
+        if (i >= job -> fs.numBuckets) {
+            return NULL;
+        }
+        renderBucket(job -> fs.fs + i, job -> buffers + i);
+    }
+}
+
+/*
+    Writes every bucket's tree (as print_tree would, bucket after bucket).
+    The buckets are rendered in parallel into their own buffers, which are
+    then written out in order with writev. Only meant for when nothing
+    else touches the fs anymore (no locks are taken).
+*/
 void print_tecnicofs_tree(FILE* fp, tecnicofs fs){
+    dump_job job = { fs, 0, calloc(fs.numBuckets, sizeof(dump_buffer)) };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int numThreads = cpus < 1 ? 1 : cpus > fs.numBuckets ? fs.numBuckets : cpus;
+    pthread_t threads[numThreads];
+    int spawned = 0;
+    // This thread renders as well
+    while (spawned < numThreads - 1 && !pthread_create(threads + spawned, NULL, dumpWorker, &job)) {
+        spawned++;
+    }
+    dumpWorker(&job);
+    for (int i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    fflush(fp);
+    int fd = fileno(fp);
+    struct iovec iov[IOV_MAX];
+    for (int first = 0; first < fs.numBuckets; first += IOV_MAX) {
+        int count = fs.numBuckets - first < IOV_MAX ? fs.numBuckets - first : IOV_MAX;
+        for (int i = 0; i < count; i++) {
+            iov[i].iov_base = job.buffers[first + i].data;
+            iov[i].iov_len = job.buffers[first + i].len;
+        }
+        if (writeAll(fd, iov, count) < 0) {
+            perror("Unable to write the file system out");
+            break;
+        }
+    }
+
     for (int i = 0; i < fs.numBuckets; i++) {
-        tecnicofs_node* fsnode = fs.fs + i;
-        print_tree(fp, fsnode -> bstRoot);
+        free(job.buffers[i].data);
     }
+    free(job.buffers);
 }
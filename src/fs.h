@@ -1,16 +1,47 @@
 #ifndef FS_H
 #define FS_H
 #include "lib/bst.h"
+#include "lib/filter.h"
 #include "lib/locks.h"
 
+// How many ways each bucket's filter counters are split (by thread)
+#define STATS_STRIPES 8
+
+typedef struct {
+    filter_stats stats;
+    unsigned long local;        // accesses from the bucket's home node
+    unsigned long remote;       // and from elsewhere
+} __attribute__((aligned(64))) stats_stripe;
+
+/*
+    A bucket. Changes to its tree take the write lock and bump version
+    around them (a seqlock: odd while a change is underway), so lookups
+    can walk it without writing to the lock (see lookup).
+*/
 typedef struct tecnicofs_node {
     lock* sync_lock;
     node* bstRoot;
+    unsigned int version;
+    name_filter* filter;        // rebuilt into a new one, never resized in place
+    int node;                   // the NUMA node it was placed on, -1 if none
+    stats_stripe stats[STATS_STRIPES];
 } tecnicofs_node;
 
+/*
+    Entries live in the buckets under a key made of the directory they are
+    in and their name: "inumber/name", or just "name" in the root (which
+    has no i-node). Moving a directory only moves its own entry.
+*/
+#define ROOT_DIRECTORY -1
+#define MAX_KEY_SIZE 1040
+
+typedef struct dentry_cache dentry_cache;
+
 typedef struct tecnicofs {
     int numBuckets;
     tecnicofs_node* fs;
+    lock* locks;                // the buckets', side by side so they can be placed along
+    dentry_cache* dentries;
 } tecnicofs;
 
 tecnicofs new_tecnicofs(int);
@@ -20,5 +51,18 @@ void delete(tecnicofs, char*);
 int lookup(tecnicofs, char*);
 void print_tecnicofs_tree(FILE*, tecnicofs);
 lock* get_lock(tecnicofs, char*);
+int get_bucket(tecnicofs, char*);
+int bucket_share(tecnicofs, int, int);
+void place_tecnicofs(tecnicofs, int, int*);
+void get_numa_stats(tecnicofs, unsigned long*, unsigned long*);
+void get_filter_stats(tecnicofs, filter_stats*);
+int list_names(tecnicofs, char*, char*, int, int (*)(char*, void*), void*);
+void walk_tecnicofs(tecnicofs, void (*)(char*, int, void*), void*);
+int make_key(int, char*, char*);
+int resolve_directory(tecnicofs, char*, size_t, int*, unsigned int*);
+int resolve_path(tecnicofs, char*, int*, unsigned int*, char*);
+void invalidate_paths(tecnicofs);
+void get_dentry_stats(tecnicofs, unsigned long*, unsigned long*);
+void get_lookup_stats(unsigned long*, unsigned long*);
 
 #endif /* FS_H */
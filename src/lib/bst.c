@@ -24,6 +24,8 @@ node* new_node(char* key, int inumber)
     p->inumber = inumber;
     p->left  = NULL;
     p->right = NULL;
+    // Readers without the lock must never reach it half filled in
+    __atomic_thread_fence(__ATOMIC_RELEASE);
     return p;
 }
 
@@ -84,23 +86,35 @@ node* remove_min(node* p)
 }
 
 node* remove_item(node* p, char* key)
+{
+    node* removed = NULL;
+    p = unlink_item(p, key, &removed);
+    if (removed)
+        free_node(removed);
+    return p;
+}
+
+/*
+    Takes the node with the given key out of the tree, without freeing
+    it: it is handed out in *removed (left alone if there's no such key).
+*/
+node* unlink_item(node* p, char* key, node** removed)
 {
     insertDelay(DELAY);
     if (!p)
         return NULL;
-    
+
     int comp = strcmp(key, p->key);
     if (comp < 0)
-        p->left = remove_item(p->left, key);
+        p->left = unlink_item(p->left, key, removed);
     else if (comp > 0)
-        p->right = remove_item(p->right, key);
+        p->right = unlink_item(p->right, key, removed);
     else
     {
         node* l = p->left;
         node* r = p->right;
         node* m;
-        free(p->key);
-        free(p);
+        *removed = p;
 
         if (r == NULL)
             return l;
@@ -115,6 +129,41 @@ node* remove_item(node* p, char* key)
     return p;
 }
 
+/*
+    search() for readers that don't hold the tree's lock, and may find it
+    halfway through a change: every link is read once, and the walk gives
+    up after maxDepth levels (a tree being changed may briefly have a
+    cycle). Whatever it finds must be validated by the caller.
+
+    Returns: 1 (and the node's i-number in *inumber) if it found the key,
+    0 if it didn't, -1 if it gave up.
+*/
+int search_unlocked(node* p, char* key, unsigned int maxDepth, int* inumber)
+{
+    for (unsigned int depth = 0; depth <= maxDepth; depth++) {
+        insertDelay(DELAY);
+        if (!p)
+            return 0;
+
+        int comp = strcmp(key, __atomic_load_n(&p->key, __ATOMIC_RELAXED));
+        if (comp < 0)
+            p = __atomic_load_n(&p->left, __ATOMIC_RELAXED);
+        else if (comp > 0)
+            p = __atomic_load_n(&p->right, __ATOMIC_RELAXED);
+        else {
+            *inumber = __atomic_load_n(&p->inumber, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return -1;
+}
+
+void free_node(node* p)
+{
+    free(p->key);
+    free(p);
+}
+
 void free_tree(node* p)
 {
     if (!p)
@@ -140,3 +189,35 @@ void print_tree(FILE* fp, node* p)
     fprintf(fp, "\n");
     print_tree_2(fp, p, 0);
 }
+
+/* Calls visit on every node, in order */
+void walk_tree(node* p, void (*visit)(node*, void*), void* arg)
+{
+    if (p) {
+        walk_tree(p->left, visit, arg);
+        visit(p, arg);
+        walk_tree(p->right, visit, arg);
+    }
+}
+
+/*
+    Calls visit, in order, on the nodes whose key comes after from (or is
+    from, if inclusive) until it returns non-zero, skipping the subtrees
+    that only hold earlier keys. Returns what visit returned, 0 if the
+    walk reached the end.
+*/
+int walk_tree_from(node* p, char* from, int inclusive, int (*visit)(node*, void*), void* arg)
+{
+    if (!p)
+        return 0;
+
+    int comp = strcmp(p->key, from);
+    int stop = 0;
+    if (comp > 0)
+        stop = walk_tree_from(p->left, from, inclusive, visit, arg);
+    if (!stop && (comp > 0 || (comp == 0 && inclusive)))
+        stop = visit(p, arg);
+    if (!stop)
+        stop = walk_tree_from(p->right, from, inclusive, visit, arg);
+    return stop;
+}
@@ -3,7 +3,9 @@
 #define BST_H
 #include <stdio.h>
 
+#ifndef DELAY
 #define DELAY 5000
+#endif
 
 typedef struct node {
     char* key;
@@ -19,7 +21,12 @@ node *insert(node *p, char* key, int inumber);
 node *find_min(node *p);
 node *remove_min(node *p);
 node *remove_item(node *p, char* key);
+node *unlink_item(node *p, char* key, node** removed);
+int search_unlocked(node *p, char* key, unsigned int maxDepth, int* inumber);
+void free_node(node *p);
 void free_tree(node *p);
 void print_tree(FILE* fp, node *p);
+void walk_tree(node *p, void (*visit)(node*, void*), void* arg);
+int walk_tree_from(node *p, char* from, int inclusive, int (*visit)(node*, void*), void* arg);
 
 #endif /* BST_H */
@@ -0,0 +1,169 @@
+/*
+
+    File: ebr.c
+    Description: Epoch-based reclamation.
+
+    There is a global epoch, and every thread that reads without locks
+    has a slot where it announces the epoch it entered at (0 while it's
+    outside). Retiring something tags it with the epoch of the moment
+    it became unreachable: only readers that announce that epoch (or an
+    earlier one) could have reached it, so it's released once none does.
+
+    Each slot keeps the list of what its thread retired, so writers to
+    different buckets share nothing but the epoch, which only moves
+    forward once every EBR_BATCH retires of a thread, right before that
+    thread releases what it can of its list.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "ebr.h"
+#include "err.h"
+
+/*
+    A thread's announcement, on a cache line of its own. Slots are never
+    freed: a thread leaving gives its slot back for the next one.
+*/
+typedef struct {
+    void* ptr;
+    void (*release)(void*);
+    unsigned long epoch;
+} ebr_retired;
+
+typedef struct ebr_slot {
+    unsigned long epoch;
+    bool owned;
+    struct ebr_slot* next;
+    // What its owner retired, yet to be released (only the owner touches them)
+    ebr_retired* retired;
+    size_t numRetired;
+    size_t capRetired;
+    unsigned long totalRetired;
+    unsigned long totalReleased;
+} __attribute__((aligned(64))) ebr_slot;
+
+static unsigned long globalEpoch = 1;
+static ebr_slot* slots = NULL;
+static __thread ebr_slot* self = NULL;
+static pthread_key_t slotKey;
+static pthread_once_t slotKeyOnce = PTHREAD_ONCE_INIT;
+
+static void giveBack(void* slot) {
+    __atomic_store_n(&((ebr_slot*)slot) -> owned, false, __ATOMIC_RELEASE);
+}
+
+static void createKey(void) {
+    errWrap(pthread_key_create(&slotKey, giveBack), "Unable to create the reclamation key!");
+}
+
+static ebr_slot* claimSlot(void) {
+    pthread_once(&slotKeyOnce, createKey);
+    for (ebr_slot* slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot && !self; slot = slot -> next) {
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&slot -> owned, &expected, true, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            self = slot;
+        }
+    }
+
+    if (!self) {
+        void* slot;
+        errWrap(posix_memalign(&slot, sizeof(ebr_slot), sizeof(ebr_slot)), "Unable to allocate a reclamation slot!");
+        self = slot;
+        self -> epoch = 0;
+        self -> owned = true;
+        self -> retired = NULL;
+        self -> numRetired = self -> capRetired = 0;
+        self -> totalRetired = self -> totalReleased = 0;
+        self -> next = __atomic_load_n(&slots, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&slots, &self -> next, self, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(slotKey, self);
+    return self;
+}
+
+void ebr_enter(void) {
+    ebr_slot* slot = self ? self : claimSlot();
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    for (;;) {
+        __atomic_store_n(&slot -> epoch, epoch, __ATOMIC_SEQ_CST);
+        // Moved on before we announced it? Then announce the new one
+        unsigned long now = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+        if (now == epoch) {
+            return;
+        }
+        epoch = now;
+    }
+}
+
+void ebr_exit(void) {
+    __atomic_store_n(&self -> epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Releases what of the slot's list no reader can be looking at anymore */
+static void reclaim(ebr_slot* slot) {
+    unsigned long oldest = ULONG_MAX;
+    for (ebr_slot* other = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); other; other = other -> next) {
+        unsigned long epoch = __atomic_load_n(&other -> epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    size_t kept = 0;
+    unsigned long released = 0;
+    for (size_t i = 0; i < slot -> numRetired; i++) {
+        if (slot -> retired[i].epoch < oldest) {
+            slot -> retired[i].release(slot -> retired[i].ptr);
+            released++;
+        } else {
+            slot -> retired[kept++] = slot -> retired[i];
+        }
+    }
+    slot -> numRetired = kept;
+    __atomic_add_fetch(&slot -> totalReleased, released, __ATOMIC_RELAXED);
+}
+
+void ebr_retire(void* ptr, void (*release)(void*)) {
+    ebr_slot* slot = self ? self : claimSlot();
+    if (slot -> numRetired == slot -> capRetired) {
+        slot -> capRetired = slot -> capRetired ? slot -> capRetired * 2 : EBR_BATCH;
+        slot -> retired = realloc(slot -> retired, sizeof(ebr_retired) * slot -> capRetired);
+        errWrap(!slot -> retired, "Unable to allocate the retired list!");
+    }
+    // Readers that announce a later epoch can't reach it
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+    slot -> retired[slot -> numRetired++] = (ebr_retired){ ptr, release, epoch };
+    unsigned long retired = __atomic_add_fetch(&slot -> totalRetired, 1, __ATOMIC_RELAXED);
+    if (retired % EBR_BATCH == 0) {
+        // Moved on, so what was retired until now can be told apart from what comes next
+        __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_SEQ_CST);
+        reclaim(slot);
+    }
+}
+
+void ebr_drain(void) {
+    for (ebr_slot* slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot -> next) {
+        for (size_t i = 0; i < slot -> numRetired; i++) {
+            slot -> retired[i].release(slot -> retired[i].ptr);
+        }
+        __atomic_add_fetch(&slot -> totalReleased, slot -> numRetired, __ATOMIC_RELAXED);
+        slot -> numRetired = 0;
+        free(slot -> retired);
+        slot -> retired = NULL;
+        slot -> capRetired = 0;
+    }
+}
+
+void ebr_stats(unsigned long* retiredCount, unsigned long* releasedCount) {
+    *retiredCount = *releasedCount = 0;
+    for (ebr_slot* slot = __atomic_load_n(&slots, __ATOMIC_ACQUIRE); slot; slot = slot -> next) {
+        *retiredCount += __atomic_load_n(&slot -> totalRetired, __ATOMIC_RELAXED);
+        *releasedCount += __atomic_load_n(&slot -> totalReleased, __ATOMIC_RELAXED);
+    }
+}
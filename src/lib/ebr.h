@@ -0,0 +1,29 @@
+/*
+
+    File: ebr.h
+    Description: Epoch-based reclamation of the memory that readers
+    without locks may still be looking at (tree nodes, name filters).
+
+    Readers wrap their lock-free accesses in ebr_enter() and ebr_exit(),
+    which only write to a slot of their own. Writers, once they have
+    unlinked something, hand it to ebr_retire() instead of freeing it:
+    it is released once every reader that could have seen it has left.
+
+*/
+
+#ifndef TECNICOFS_EBR_H
+#define TECNICOFS_EBR_H
+
+// How many pointers a thread retires between moving the epoch on and releasing what it can
+#define EBR_BATCH 64
+
+void ebr_enter(void);
+void ebr_exit(void);
+void ebr_retire(void* ptr, void (*release)(void*));
+
+/* Releases everything retired so far, only once no reader or writer is left */
+void ebr_drain(void);
+
+void ebr_stats(unsigned long* retired, unsigned long* released);
+
+#endif /* TECNICOFS_EBR_H */
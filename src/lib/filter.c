@@ -0,0 +1,113 @@
+/*
+
+    File: filter.c
+    Description: Counting Bloom filters for negative name lookups.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "filter.h"
+
+int filterDensity = 10;
+
+/*
+    FNV-1a over the whole name, with a final mix so that names sharing
+    a prefix still spread over the blocks.
+*/
+static uint64_t filterHash(char* name) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char* c = (unsigned char*)name; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The high half picks the block, the low bits the counters inside it */
+static unsigned char* filterBlock(name_filter* filter, uint64_t h) {
+    uint64_t block = ((h >> 32) * filter -> numBlocks) >> 32;
+    return filter -> counters + block * FILTER_BLOCK;
+}
+
+#define PROBE(h, i) (((h) >> (6 * (i))) & (FILTER_BLOCK - 1))
+
+void filter_init(name_filter* filter, unsigned int capacity) {
+    filter -> names = 0;
+    filter -> capacity = capacity < FILTER_MIN_CAPACITY ? FILTER_MIN_CAPACITY : capacity;
+    filter -> numBlocks = 0;
+    filter -> counters = NULL;
+    if (filterDensity <= 0) {
+        return;
+    }
+
+    filter -> numBlocks = (filter -> capacity * filterDensity + FILTER_BLOCK - 1) / FILTER_BLOCK;
+    void* counters;
+    errWrap(posix_memalign(&counters, FILTER_BLOCK, (size_t)filter -> numBlocks * FILTER_BLOCK),
+        "Unable to allocate a name filter!");
+    memset(counters, 0, (size_t)filter -> numBlocks * FILTER_BLOCK);
+    filter -> counters = counters;
+}
+
+void filter_destroy(name_filter* filter) {
+    free(filter -> counters);
+    filter -> counters = NULL;
+}
+
+void filter_add(name_filter* filter, char* name) {
+    filter -> names++;
+    if (!filter -> counters) {
+        return;
+    }
+    uint64_t h = filterHash(name);
+    unsigned char* block = filterBlock(filter, h);
+    for (int i = 0; i < FILTER_PROBES; i++) {
+        unsigned char* counter = block + PROBE(h, i);
+        if (*counter != UINT8_MAX) {
+            (*counter)++;
+        }
+    }
+}
+
+/* The name must have been added before (and not removed since) */
+void filter_remove(name_filter* filter, char* name) {
+    filter -> names--;
+    if (!filter -> counters) {
+        return;
+    }
+    uint64_t h = filterHash(name);
+    unsigned char* block = filterBlock(filter, h);
+    for (int i = 0; i < FILTER_PROBES; i++) {
+        unsigned char* counter = block + PROBE(h, i);
+        if (*counter != UINT8_MAX) {
+            (*counter)--;
+        }
+    }
+}
+
+bool filter_may_contain(name_filter* filter, char* name) {
+    if (!filter -> counters) {
+        return true;
+    }
+    uint64_t h = filterHash(name);
+    unsigned char* block = filterBlock(filter, h);
+    for (int i = 0; i < FILTER_PROBES; i++) {
+        if (!block[PROBE(h, i)]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Past its capacity the false positive rate climbs quickly */
+bool filter_full(name_filter* filter) {
+    return filter -> counters && filter -> names > filter -> capacity;
+}
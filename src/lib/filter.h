@@ -0,0 +1,54 @@
+/*
+
+    File: filter.h
+    Description: Describes the name filters, counting Bloom filters that
+    sit in front of each bucket's tree and answer "definitely not here"
+    without walking it.
+
+    The filter is blocked: all the counters a name touches live in the
+    same 64 byte block, so a check costs a single cache line. Counters
+    are 8 bits wide and stick once they saturate (they are never taken
+    down again), which can only cause false positives, never misses.
+
+*/
+
+#ifndef TECNICOFS_FILTER_H
+#define TECNICOFS_FILTER_H
+
+#include <stdbool.h>
+
+#define FILTER_BLOCK 64
+#define FILTER_PROBES 4
+
+// How many names a filter is sized for before it is first rebuilt
+#define FILTER_MIN_CAPACITY 64
+
+// Counters per name the filters are sized with (0 disables them)
+extern int filterDensity;
+
+typedef struct {
+    unsigned char* counters;
+    unsigned int numBlocks;
+    unsigned int names;
+    unsigned int capacity;
+} name_filter;
+
+/*
+    Filter counters, bumped without locks (lookups run under read locks).
+    lookups: every lookup; rejected: answered by the filter alone;
+    falsePositives: the filter let it through, but the name wasn't there.
+*/
+typedef struct {
+    unsigned long lookups;
+    unsigned long rejected;
+    unsigned long falsePositives;
+} filter_stats;
+
+void filter_init(name_filter* filter, unsigned int capacity);
+void filter_destroy(name_filter* filter);
+void filter_add(name_filter* filter, char* name);
+void filter_remove(name_filter* filter, char* name);
+bool filter_may_contain(name_filter* filter, char* name);
+bool filter_full(name_filter* filter);
+
+#endif /* TECNICOFS_FILTER_H */
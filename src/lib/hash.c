@@ -5,9 +5,15 @@
 /* Simple hash function for strings.
  * Receives a string and resturns its hash value
  * which is a number between 0 and n-1
- * In case the string is null, returns -1 */
+ * In case the string is null, returns -1
+ * (FNV-1a over the whole string: names in the same
+ * directory share their first characters) */
 int hash(char* name, int n) {
     if (!name)
         return -1;
-    return (int) name[0] % n;
+    unsigned int h = 2166136261u;
+    for (unsigned char* c = (unsigned char*)name; *c; c++) {
+        h = (h ^ *c) * 16777619u;
+    }
+    return (int) (h % (unsigned int) n);
 }
@@ -1,60 +1,184 @@
 #define _GNU_SOURCE
 
+#include <fcntl.h>
 #include <string.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "inodes.h"
+#include "log.h"
+#include "lz.h"
+#include "numa.h"
 #include "tecnicofs-api-constants.h"
 
 inode_t inode_table[INODE_TABLE_SIZE];
-pthread_mutex_t inode_table_lock;
 
-void lock_inode_table(){
-    if(pthread_mutex_lock(&inode_table_lock) != 0){
+/*
+    The table is split in INODE_SLICES slices, each with a lock of its
+    own: an i-node is guarded by its slice's lock. New i-nodes are taken
+    from the calling thread's home slice first (see inode_set_home).
+*/
+#define SLICE_SIZE ((INODE_TABLE_SIZE + INODE_SLICES - 1) / INODE_SLICES)
+
+typedef struct {
+    pthread_mutex_t lock;
+} __attribute__((aligned(64))) inode_slice;
+
+static inode_slice slices[INODE_SLICES];
+static __thread int homeSlice = 0;
+
+/*
+    Contents at least this long are compressed (0 keeps them all raw), if
+    that saves at least an eighth of them. How many bytes the contents
+    are, and how many they take, across the table.
+*/
+static int compressAbove = 0;
+static unsigned long rawBytes = 0;
+static unsigned long storedBytes = 0;
+static unsigned long compressedFiles = 0;
+
+static int sliceOf(int inumber){
+    // Out of range i-numbers are only checked and turned down
+    return (inumber < 0 || inumber >= INODE_TABLE_SIZE) ? 0 : inumber / SLICE_SIZE;
+}
+
+static void lock_slice(int slice){
+    if(pthread_mutex_lock(&slices[slice].lock) != 0){
         perror("Failed to acquire the i-node table lock.");
         exit(EXIT_FAILURE);
     }
 }
 
-void unlock_inode_table(){
-    if(pthread_mutex_unlock(&inode_table_lock) != 0){
+static void unlock_slice(int slice){
+    if(pthread_mutex_unlock(&slices[slice].lock) != 0){
         perror("Failed to release the i-node table lock.");
         exit(EXIT_FAILURE);
     }
 }
 
+void lock_inode(int inumber){
+    lock_slice(sliceOf(inumber));
+}
+
+void unlock_inode(int inumber){
+    unlock_slice(sliceOf(inumber));
+}
+
 /*
- * Initializes the i-nodes table and the mutex.
+ * Initializes the i-nodes table and the mutexes.
  */
 void inode_table_init(){
-    if(pthread_mutex_init(&inode_table_lock, NULL) != 0){
-        perror("Failed to initialize inode table mutex.\n");
-        exit(EXIT_FAILURE);
+    for(int i = 0; i < INODE_SLICES; i++){
+        if(pthread_mutex_init(&slices[i].lock, NULL) != 0){
+            perror("Failed to initialize inode table mutex.\n");
+            exit(EXIT_FAILURE);
+        }
     }
     for(int i = 0; i < INODE_TABLE_SIZE; i++){
         inode_table[i].owner = FREE_INODE;
         inode_table[i].fileContent = NULL;
+        inode_table[i].size = 0;
+        inode_table[i].compressed = 0;
+        inode_table[i].generation = 1;
+        inode_table[i].blob = -1;
+        inode_table[i].unlinked = 0;
     }
 }
 
 /*
  * Releases the allocated memory for the i-nodes tables
- * and destroys the mutex.
+ * and destroys the mutexes.
  */
 
 void inode_table_destroy(){
     for(int i = 0; i < INODE_TABLE_SIZE; i++){
         if(inode_table[i].owner!=FREE_INODE && inode_table[i].fileContent)
             free(inode_table[i].fileContent);
+        if(inode_table[i].blob >= 0)
+            close(inode_table[i].blob);
     }
     
-    if(pthread_mutex_destroy(&inode_table_lock) != 0){
-        perror("Failed to destroy inode table mutex.\n");
-        exit(EXIT_FAILURE);
+    for(int i = 0; i < INODE_SLICES; i++){
+        if(pthread_mutex_destroy(&slices[i].lock) != 0){
+            perror("Failed to destroy inode table mutex.\n");
+            exit(EXIT_FAILURE);
+        }
     }
 }
 
+/*
+ * Makes the calling thread take new i-nodes from the given share of the
+ * table first (share out of shares), e.g. a shard its own slice.
+ */
+void inode_set_home(int share, int shares){
+    homeSlice = shares > 0 ? (int)((long)share * INODE_SLICES / shares) % INODE_SLICES : 0;
+}
+
+/*
+ * Places the slices of the given share of the table (those that its
+ * threads take new i-nodes from first) on a NUMA node.
+ */
+void inode_place(int share, int shares, int node){
+    int first = (int)((long)share * INODE_SLICES / shares);
+    int end = (int)((long)(share + 1) * INODE_SLICES / shares);
+    if(end <= first){
+        return;
+    }
+    int from = first * SLICE_SIZE;
+    int to = end * SLICE_SIZE < INODE_TABLE_SIZE ? end * SLICE_SIZE : INODE_TABLE_SIZE;
+    if(numa_prefer(inode_table + from, sizeof(inode_t) * (to - from), node) < 0 ||
+       numa_prefer(slices + first, sizeof(inode_slice) * (end - first), node) < 0){
+        perror("Unable to place the i-node table");
+    }
+}
+
+/*
+ * Compresses the contents of i-nodes set from now on that are at least
+ * minSize long (0 stops compressing them). Reads don't tell the difference.
+ */
+void inode_set_compression(int minSize){
+    __atomic_store_n(&compressAbove, minSize, __ATOMIC_RELAXED);
+}
+
+/*
+ * How many bytes of contents the table has (raw), how many they take as
+ * stored, and how many files are stored compressed.
+ */
+void inode_storage_stats(unsigned long* raw, unsigned long* stored, unsigned long* compressed){
+    *raw = __atomic_load_n(&rawBytes, __ATOMIC_RELAXED);
+    *stored = __atomic_load_n(&storedBytes, __ATOMIC_RELAXED);
+    *compressed = __atomic_load_n(&compressedFiles, __ATOMIC_RELAXED);
+}
+
+static int allocate(uid_t owner, permission ownerPerm, permission othersPerm, int directory, int parent){
+    // Starting from the home slice, then the ones after it
+    for(int i = 0; i < INODE_SLICES; i++){
+        int slice = (homeSlice + i) % INODE_SLICES;
+        int end = (slice + 1) * SLICE_SIZE < INODE_TABLE_SIZE ? (slice + 1) * SLICE_SIZE : INODE_TABLE_SIZE;
+        lock_slice(slice);
+        for(int inumber = slice * SLICE_SIZE; inumber < end; inumber++){
+            if(inode_table[inumber].owner == FREE_INODE){
+                inode_table[inumber].fileDescriptors = 0;
+                inode_table[inumber].owner = owner;
+                inode_table[inumber].ownerPermissions = ownerPerm;
+                inode_table[inumber].othersPermissions = othersPerm;
+                inode_table[inumber].fileContent = NULL;
+                inode_table[inumber].size = 0;
+                inode_table[inumber].compressed = 0;
+                inode_table[inumber].directory = directory;
+                inode_table[inumber].parent = parent;
+                inode_table[inumber].entries = 0;
+                unlock_slice(slice);
+                return inumber;
+            }
+        }
+        unlock_slice(slice);
+    }
+    return -1;
+}
+
 /*
  * Creates a new i-node in the table with the given information.
  * Input:
@@ -66,20 +190,77 @@ void inode_table_destroy(){
  *       -1: if an error occurs
  */
 int inode_create(uid_t owner, permission ownerPerm, permission othersPerm){
-    lock_inode_table();
-    for(int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++){
-        if(inode_table[inumber].owner == FREE_INODE){
-            inode_table[inumber].fileDescriptors = 0;
-            inode_table[inumber].owner = owner;
-            inode_table[inumber].ownerPermissions = ownerPerm;
-            inode_table[inumber].othersPermissions = othersPerm;
-            inode_table[inumber].fileContent = NULL;
-            unlock_inode_table();
-            return inumber;
-        }
+    return allocate(owner, ownerPerm, othersPerm, 0, -1);
+}
+
+/*
+ * Creates a new, empty directory i-node.
+ * Input:
+ *  - owner, ownerPerm, othersPerm: as in inode_create
+ *  - parent: identifier of the directory it's in (-1 for the root)
+ * Returns:
+ *  inumber: identifier of the new i-node, if successfully created
+ *       -1: if an error occurs
+ */
+int inode_create_directory(uid_t owner, permission ownerPerm, permission othersPerm, int parent){
+    return allocate(owner, ownerPerm, othersPerm, 1, parent);
+}
+
+/*
+ * Drops the i-node's blob once its contents change (readers that got it
+ * keep their own descriptors). Called with the i-node's lock held.
+ */
+static void drop_blob(int inumber){
+    if(inode_table[inumber].blob >= 0){
+        close(inode_table[inumber].blob);
+        inode_table[inumber].blob = -1;
     }
-    unlock_inode_table();
-    return -1;
+}
+
+/* Frees the i-node's contents, and takes them off the counts. Called with its lock held. */
+static void drop_contents(int inumber){
+    inode_t* inode = inode_table + inumber;
+    if(!inode -> fileContent){
+        return;
+    }
+    __atomic_sub_fetch(&rawBytes, inode -> size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&storedBytes, inode -> compressed ? inode -> compressed : inode -> size, __ATOMIC_RELAXED);
+    if(inode -> compressed)
+        __atomic_sub_fetch(&compressedFiles, 1, __ATOMIC_RELAXED);
+    free(inode -> fileContent);
+    inode -> fileContent = NULL;
+    inode -> size = 0;
+    inode -> compressed = 0;
+}
+
+/*
+ * Copies up to len bytes of the i-node's contents (no '\0' added),
+ * decompressing them if need be. Called with its lock held.
+ * Returns: how many bytes were copied, -1 if the stored block is broken
+ */
+static int copy_contents(int inumber, char* to, int len){
+    inode_t* inode = inode_table + inumber;
+    if(len > inode -> size)
+        len = inode -> size;
+    if(!inode -> compressed){
+        memcpy(to, inode -> fileContent, len);
+        return len;
+    }
+    if(lz_decompress(inode -> fileContent, inode -> compressed, to, len) != len){
+        LOG_LIMITED(LOG_ERROR, "inode_contents", "error=corrupt inumber=%d", inumber);
+        return -1;
+    }
+    return len;
+}
+
+/* Frees the i-node for reuse. Called with its lock held. */
+static void release(int inumber){
+    inode_table[inumber].owner = FREE_INODE;
+    drop_contents(inumber);
+    drop_blob(inumber);
+    inode_table[inumber].unlinked = 0;
+    if(++inode_table[inumber].generation == ANY_GENERATION)
+        inode_table[inumber].generation++;
 }
 
 /*
@@ -90,24 +271,55 @@ int inode_create(uid_t owner, permission ownerPerm, permission othersPerm){
  *   0: if successful
  *  -1: if the file is still open
  *  -2: if an error occurs
+ *  -3: if it's a directory that still has entries
  */
 int inode_delete(int inumber){
-    lock_inode_table();
+    lock_inode(inumber);
     if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
-        printf("inode_delete: invalid inumber");
-        unlock_inode_table();
+        LOG_LIMITED(LOG_WARN, "inode_delete", "error=invalid_inumber inumber=%d", inumber);
+        unlock_inode(inumber);
         return -2;
     } else if (inode_table[inumber].fileDescriptors) {
-        printf("inode_delete: file is still open");
-        unlock_inode_table();
+        LOG_LIMITED(LOG_WARN, "inode_delete", "error=file_open inumber=%d", inumber);
+        unlock_inode(inumber);
         return -1;
+    } else if (inode_table[inumber].directory && inode_table[inumber].entries) {
+        unlock_inode(inumber);
+        return -3;
     }
 
-    inode_table[inumber].owner = FREE_INODE;
-    if(inode_table[inumber].fileContent){
-        free(inode_table[inumber].fileContent);
+    release(inumber);
+    unlock_inode(inumber);
+    return 0;
+}
+
+/*
+ * Deletes the i-node even if it's open: it's freed on the last close
+ * instead, and meanwhile can't be opened again. For replicas, which
+ * can't turn down a delete their primary already made.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns:
+ *   0: if successful
+ *  -2: if an error occurs
+ */
+int inode_unlink(int inumber){
+    lock_inode(inumber);
+    if((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
+        LOG_LIMITED(LOG_WARN, "inode_unlink", "error=invalid_inumber inumber=%d", inumber);
+        unlock_inode(inumber);
+        return -2;
     }
-    unlock_inode_table();
+
+    if(inode_table[inumber].fileDescriptors){
+        // Leases and reopens must not reach it anymore
+        inode_table[inumber].unlinked = 1;
+        if(++inode_table[inumber].generation == ANY_GENERATION)
+            inode_table[inumber].generation++;
+    } else {
+        release(inumber);
+    }
+    unlock_inode(inumber);
     return 0;
 }
 
@@ -126,16 +338,16 @@ int inode_delete(int inumber){
  */
 int inode_get(int inumber, int* numFilesOpen, uid_t *owner, permission *ownerPerm, permission *othersPerm,
                      char* fileContents, int len){
-    lock_inode_table();
+    lock_inode(inumber);
     if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
-        printf("inode_getValues: invalid inumber %d\n", inumber);
-        unlock_inode_table();
+        LOG_LIMITED(LOG_WARN, "inode_get", "error=invalid_inumber inumber=%d", inumber);
+        unlock_inode(inumber);
         return -1;
     }
 
     if(len < 0){
-        printf("inode_getValues: invalid len %d\n", len);
-        unlock_inode_table();
+        LOG_LIMITED(LOG_WARN, "inode_get", "error=invalid_len inumber=%d len=%d", inumber, len);
+        unlock_inode(inumber);
         return -1;
     }
 
@@ -152,21 +364,20 @@ int inode_get(int inumber, int* numFilesOpen, uid_t *owner, permission *ownerPer
         *othersPerm = inode_table[inumber].othersPermissions;
 
     if(fileContents && len > 0 && inode_table[inumber].fileContent){
-        if(len > ((int) strlen(inode_table[inumber].fileContent)) + 1)
-            len = ((int) strlen(inode_table[inumber].fileContent) + 1);
-        strncpy(fileContents, inode_table[inumber].fileContent, len-1);
-        fileContents[len-1] = '\0';
-        unlock_inode_table();
-        return strlen(fileContents);
+        int copied = copy_contents(inumber, fileContents, len-1);
+        fileContents[copied < 0 ? 0 : copied] = '\0';
+        unlock_inode(inumber);
+        return copied;
     }
 
-    unlock_inode_table();
+    unlock_inode(inumber);
     return 0;
 }
 
 
 /*
- * Updates the i-node file content.
+ * Updates the i-node file content, compressed if it's long enough
+ * (see inode_set_compression).
  * Input:
  *  - inumber: identifier of the i-node
  *  - fileContent: pointer to the string with size >= len
@@ -176,31 +387,117 @@ int inode_get(int inumber, int* numFilesOpen, uid_t *owner, permission *ownerPer
  *   -1: if an error occurs
  */
 int inode_set(int inumber, char *fileContents, int len){
-    lock_inode_table();
-    if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
-        printf("inode_setFileContent: invalid inumber");
-        unlock_inode_table();
+    if(!fileContents || len < 0 || strlen(fileContents) < len){
+        LOG_LIMITED(LOG_WARN, "inode_set", "error=invalid_contents inumber=%d len=%d", inumber, len);
         return -1;
     }
 
-    if(!fileContents || len < 0 || strlen(fileContents) < len){
-        printf("inode_setFileContent: \
-               fileContents must be non-null && len > 0 && strlen(fileContents) > len");
-        unlock_inode_table();
+    // Compressed before taking the lock: it only needs the caller's copy
+    char* stored = NULL;
+    int compressed = 0;
+    int minSize = __atomic_load_n(&compressAbove, __ATOMIC_RELAXED);
+    if(minSize > 0 && len >= minSize){
+        int cap = len - len / 8;
+        stored = malloc(cap);
+        compressed = stored ? lz_compress(fileContents, len, stored, cap) : -1;
+        if(compressed > 0){
+            char* fitted = realloc(stored, compressed);
+            stored = fitted ? fitted : stored;
+        } else {
+            free(stored);
+            stored = NULL;
+            compressed = 0;
+        }
+    }
+    if(!stored){
+        stored = malloc(sizeof(char) * (len+1));
+        if(!stored){
+            LOG_LIMITED(LOG_ERROR, "inode_set", "error=no_memory inumber=%d len=%d", inumber, len);
+            return -1;
+        }
+        memcpy(stored, fileContents, len);
+        stored[len] = '\0';
+    }
+
+    lock_inode(inumber);
+    if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
+        LOG_LIMITED(LOG_WARN, "inode_set", "error=invalid_inumber inumber=%d", inumber);
+        unlock_inode(inumber);
+        free(stored);
         return -1;
     }
-    
-    if(inode_table[inumber].fileContent)
-        free(inode_table[inumber].fileContent);
 
-    inode_table[inumber].fileContent = malloc(sizeof(char) * (len+1));
-    strncpy(inode_table[inumber].fileContent, fileContents, len);
-    inode_table[inumber].fileContent[len] = '\0';
+    drop_contents(inumber);
+    drop_blob(inumber);
 
-    unlock_inode_table();
+    inode_table[inumber].fileContent = stored;
+    inode_table[inumber].size = len;
+    inode_table[inumber].compressed = compressed;
+    __atomic_add_fetch(&rawBytes, len, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&storedBytes, compressed ? compressed : len, __ATOMIC_RELAXED);
+    if(compressed)
+        __atomic_add_fetch(&compressedFiles, 1, __ATOMIC_RELAXED);
+
+    unlock_inode(inumber);
     return 0;
 }
 
+/*
+ * Gets the i-node's contents as a sealed (read-only for good) memfd,
+ * made on the first call after they change and shared by every reader
+ * until then.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - minSize: smaller contents aren't worth it
+ *  - size: where to store the size of the contents
+ * Returns: a descriptor of the blob of its own for the caller to close,
+ *  -2 if the contents are smaller than minSize, -1 on error
+ */
+int inode_blob(int inumber, int minSize, int* size){
+    lock_inode(inumber);
+    if((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
+        LOG_LIMITED(LOG_WARN, "inode_blob", "error=invalid_inumber inumber=%d", inumber);
+        unlock_inode(inumber);
+        return -1;
+    }
+
+    *size = inode_table[inumber].fileContent ? inode_table[inumber].size : 0;
+    if(*size < minSize || *size == 0){
+        unlock_inode(inumber);
+        return -2;
+    }
+
+    if(inode_table[inumber].blob < 0){
+        // Compressed contents are inflated into it once, then shared as any other
+        char* contents = inode_table[inumber].fileContent;
+        if(inode_table[inumber].compressed){
+            contents = malloc(*size);
+            if(!contents || copy_contents(inumber, contents, *size) != *size){
+                free(contents);
+                unlock_inode(inumber);
+                return -1;
+            }
+        }
+        int blob = memfd_create("tecnicofs-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        int written = blob < 0 ? -1 : write(blob, contents, *size);
+        if(contents != inode_table[inumber].fileContent)
+            free(contents);
+        if(blob < 0 || written != *size ||
+           fcntl(blob, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0){
+            LOG_LIMITED(LOG_WARN, "inode_blob", "error=memfd inumber=%d", inumber);
+            if(blob >= 0)
+                close(blob);
+            unlock_inode(inumber);
+            return -1;
+        }
+        inode_table[inumber].blob = blob;
+    }
+
+    int mine = dup(inode_table[inumber].blob);
+    unlock_inode(inumber);
+    return mine < 0 ? -1 : mine;
+}
+
 /*
  * Updates the number of open file descriptors linked to the file
  * Input:
@@ -211,24 +508,168 @@ int inode_set(int inumber, char *fileContents, int len){
  *   -1 if an error occurs
  */
 int inode_update_fd(int inumber, int direction) {
-    lock_inode_table();
+    lock_inode(inumber);
     if((inumber < 0) || (inumber > INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
-        printf("inode_setFileContent: invalid inumber");
-        unlock_inode_table();
+        LOG_LIMITED(LOG_WARN, "inode_update_fd", "error=invalid_inumber inumber=%d", inumber);
+        unlock_inode(inumber);
         return -1;
     } else if (direction != 1 && direction != -1) {
-        printf("inode_setFileContent: invalid update code");
-        unlock_inode_table();
+        LOG_LIMITED(LOG_WARN, "inode_update_fd", "error=invalid_direction inumber=%d direction=%d", inumber, direction);
+        unlock_inode(inumber);
         return -1;
     }
 
     inode_table[inumber].fileDescriptors += direction;
     if (inode_table[inumber].fileDescriptors < 0) {
-        printf("inode_setFileContent: inode in inconsistent state");
-        unlock_inode_table();
+        LOG_LIMITED(LOG_ERROR, "inode_update_fd", "error=inconsistent inumber=%d", inumber);
+        unlock_inode(inumber);
         return -1;
     }
+    if (!inode_table[inumber].fileDescriptors && inode_table[inumber].unlinked) {
+        release(inumber);
+    }
 
-    unlock_inode_table();
+    unlock_inode(inumber);
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Opens a file descriptor on the i-node, checking that the user may
+ * open it in the given mode, all in a single critical section.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - generation: the generation the caller expects the i-node to be at
+ *    (or ANY_GENERATION); updated with the actual one if successful
+ *  - user: uid of the user opening the file
+ *  - mode: mode the file is being opened in
+ *  - owner, ownerPerm, othersPerm: as in inode_get (may be null)
+ * Returns:
+ *    0: if successful
+ *   -1: if the i-node doesn't exist
+ *   -2: if the user isn't allowed to open it in that mode
+ *   -3: if the i-node isn't at the expected generation anymore
+ *   -4: if the i-node is a directory
+ */
+int inode_open(int inumber, unsigned int* generation, uid_t user, permission mode,
+                     uid_t *owner, permission *ownerPerm, permission *othersPerm){
+    lock_inode(inumber);
+    if((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE) ||
+        inode_table[inumber].unlinked){
+        unlock_inode(inumber);
+        return -1;
+    }
+
+    inode_t* inode = inode_table + inumber;
+    if(*generation != ANY_GENERATION && *generation != inode -> generation){
+        unlock_inode(inumber);
+        return -3;
+    }
+    if(inode -> directory){
+        unlock_inode(inumber);
+        return -4;
+    }
+
+    permission allowed = user == inode -> owner ? inode -> ownerPermissions : inode -> othersPermissions;
+    if((mode & allowed) != mode){
+        unlock_inode(inumber);
+        return -2;
+    }
+
+    inode -> fileDescriptors++;
+    *generation = inode -> generation;
+    if(owner)
+        *owner = inode -> owner;
+    if(ownerPerm)
+        *ownerPerm = inode -> ownerPermissions;
+    if(othersPerm)
+        *othersPerm = inode -> othersPermissions;
+
+    unlock_inode(inumber);
+    return 0;
+}
+
+/*
+ * Moves the i-node to a new generation, so whoever identifies it by the
+ * old one (e.g. a client holding a lease) finds out it changed.
+ * Input:
+ *  - inumber: identifier of the i-node
+ */
+void inode_bump_generation(int inumber){
+    lock_inode(inumber);
+    if((inumber >= 0) && (inumber < INODE_TABLE_SIZE) && (inode_table[inumber].owner != FREE_INODE)){
+        if(++inode_table[inumber].generation == ANY_GENERATION)
+            inode_table[inumber].generation++;
+    }
+    unlock_inode(inumber);
+}
+
+/*
+ * Tells whether the i-node is a directory.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - generation: where to put its generation (may be null)
+ *  - parent: where to put the directory it's in, if it's one (may be null)
+ * Returns:
+ *    1: if it's a directory
+ *    0: if it's a file
+ *   -1: if the i-node doesn't exist
+ */
+int inode_directory(int inumber, unsigned int* generation, int* parent){
+    lock_inode(inumber);
+    if((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE)){
+        unlock_inode(inumber);
+        return -1;
+    }
+    int directory = inode_table[inumber].directory;
+    if(generation)
+        *generation = inode_table[inumber].generation;
+    if(parent && directory)
+        *parent = inode_table[inumber].parent;
+    unlock_inode(inumber);
+    return directory;
+}
+
+/*
+ * Counts entries in or out of a directory. A directory that has entries
+ * can't be deleted, so this is also how creating something in it makes
+ * sure it's still there.
+ * Input:
+ *  - inumber: identifier of the directory
+ *  - generation: the generation the caller expects it to be at
+ *    (or ANY_GENERATION)
+ *  - delta: 1 for a new entry, -1 for one that left
+ * Returns:
+ *    0: if successful
+ *   -1: if the i-node doesn't exist or isn't a directory
+ *   -3: if the i-node isn't at the expected generation anymore
+ */
+int inode_link(int inumber, unsigned int generation, int delta){
+    lock_inode(inumber);
+    if((inumber < 0) || (inumber >= INODE_TABLE_SIZE) || (inode_table[inumber].owner == FREE_INODE) ||
+        !inode_table[inumber].directory){
+        unlock_inode(inumber);
+        return -1;
+    }
+    if(generation != ANY_GENERATION && generation != inode_table[inumber].generation){
+        unlock_inode(inumber);
+        return -3;
+    }
+    inode_table[inumber].entries += delta;
+    if(inode_table[inumber].entries < 0){
+        LOG_LIMITED(LOG_ERROR, "inode_link", "error=inconsistent inumber=%d", inumber);
+        inode_table[inumber].entries = 0;
+    }
+    unlock_inode(inumber);
+    return 0;
+}
+
+/*
+ * Records the directory a directory i-node was moved to.
+ */
+void inode_set_parent(int inumber, int parent){
+    lock_inode(inumber);
+    if((inumber >= 0) && (inumber < INODE_TABLE_SIZE) && (inode_table[inumber].owner != FREE_INODE)){
+        inode_table[inumber].parent = parent;
+    }
+    unlock_inode(inumber);
+}
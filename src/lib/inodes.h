@@ -9,23 +9,50 @@
 #define FREE_INODE -1
 #define INODE_TABLE_SIZE 50000
 
+// How many parts the table is split in, each with its own lock
+#define INODE_SLICES 64
+
+// Matches whatever generation an i-node is at (see inode_open)
+#define ANY_GENERATION 0
+
 typedef struct inode_t {
     int fileDescriptors;
     uid_t owner;
     permission ownerPermissions;
     permission othersPermissions;
-    char* fileContent;
+    char* fileContent;       // the contents, '\0'-terminated, or an lz block of them (see compressed)
+    int size;                // of the contents, whichever way they're stored
+    int compressed;          // size of the lz block fileContent holds (0 if it holds them raw)
+    unsigned int generation; // changes whenever the i-node changes identity (deleted, reused, renamed)
+    int directory;           // directories have no contents, but a parent and entries
+    int parent;
+    int entries;
+    int blob;                // sealed memfd with the contents, made when first asked for (-1 if none)
+    int unlinked;            // deleted while still open (see inode_unlink), freed on the last close
 } inode_t;
 
 
 void inode_table_init();
 void inode_table_destroy();
+void inode_set_home(int share, int shares);
+void inode_place(int share, int shares, int node);
+void inode_set_compression(int minSize);
+void inode_storage_stats(unsigned long* raw, unsigned long* stored, unsigned long* compressedFiles);
 int inode_create(uid_t owner, permission ownerPerm, permission othersPerm);
+int inode_create_directory(uid_t owner, permission ownerPerm, permission othersPerm, int parent);
 int inode_delete(int inumber);
+int inode_unlink(int inumber);
 int inode_get(int inumber, int* numOpenFiles, uid_t *owner, permission *ownerPerm, permission *othersPerm,
                      char* fileContents, int len);
 int inode_set(int inumber, char *contents, int len);
+int inode_blob(int inumber, int minSize, int* size);
 int inode_update_fd(int inumber, int direction);
+int inode_open(int inumber, unsigned int* generation, uid_t user, permission mode,
+                     uid_t *owner, permission *ownerPerm, permission *othersPerm);
+void inode_bump_generation(int inumber);
+int inode_directory(int inumber, unsigned int* generation, int* parent);
+int inode_link(int inumber, unsigned int generation, int delta);
+void inode_set_parent(int inumber, int parent);
 
 
 #endif /* INODES_H */
\ No newline at end of file
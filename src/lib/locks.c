@@ -8,7 +8,10 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -44,3 +47,302 @@ void rwlock_unlock(pthread_rwlock_t* lock) {
 void rwlock_destroy(pthread_rwlock_t* lock) {
     errWrap(pthread_rwlock_destroy(lock), "Could not destroy the R/W Lock!");
 }
+
+/*
+    Spinning helper: burns a few cycles, and gives the CPU away every
+    once in a while so the lock holder can make progress when there are
+    more threads than cores.
+*/
+static inline void spin_wait(int* spins) {
+    if (++(*spins) >= SPIN_YIELD_THRESHOLD) {
+        *spins = 0;
+        sched_yield();
+    } else {
+        cpu_relax();
+    }
+}
+
+/*
+    Test-and-test-and-set spinlock.
+    Waiters spin on a plain load, and only attempt the atomic exchange
+    (which takes the cache line in exclusive mode) once the lock looks free.
+*/
+void ttas_init(ttas_lock_t* lock) {
+    lock -> held = 0;
+}
+void ttas_lock(ttas_lock_t* lock) {
+    int spins = 0;
+    for (;;) {
+        while (__atomic_load_n(&lock -> held, __ATOMIC_RELAXED)) {
+            spin_wait(&spins);
+        }
+        if (!__atomic_exchange_n(&lock -> held, 1, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+    }
+}
+void ttas_unlock(ttas_lock_t* lock) {
+    errWrap(!__atomic_load_n(&lock -> held, __ATOMIC_RELAXED), "Failed to unlock the spinlock!");
+    __atomic_store_n(&lock -> held, 0, __ATOMIC_RELEASE);
+}
+void ttas_destroy(ttas_lock_t* lock) {
+    errWrap(__atomic_load_n(&lock -> held, __ATOMIC_RELAXED), "Could not destroy the spinlock!");
+}
+
+/*
+    Ticket lock: threads take a ticket and are served in FIFO order.
+*/
+void ticket_init(ticket_lock_t* lock) {
+    lock -> next = 0;
+    lock -> serving = 0;
+}
+void ticket_lock(ticket_lock_t* lock) {
+    int spins = 0;
+    uint32_t ticket = __atomic_fetch_add(&lock -> next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock -> serving, __ATOMIC_ACQUIRE) != ticket) {
+        spin_wait(&spins);
+    }
+}
+void ticket_unlock(ticket_lock_t* lock) {
+    __atomic_store_n(&lock -> serving, lock -> serving + 1, __ATOMIC_RELEASE);
+}
+void ticket_destroy(ticket_lock_t* lock) {
+    errWrap(
+        __atomic_load_n(&lock -> next, __ATOMIC_RELAXED) != __atomic_load_n(&lock -> serving, __ATOMIC_RELAXED),
+        "Could not destroy the ticket lock!"
+    );
+}
+
+/*
+    MCS queue lock.
+    Since the LOCK_UNLOCK interface doesn't carry the queue node around,
+    the holder's node is stashed in the lock itself. Queue nodes come from
+    a per-thread free list so a thread can hold several MCS locks at once.
+*/
+static pthread_key_t mcs_pool_key;
+static pthread_once_t mcs_pool_once = PTHREAD_ONCE_INIT;
+
+static void mcs_pool_free(void* pool) {
+    mcs_node* qnode = pool;
+    while (qnode) {
+        mcs_node* next = qnode -> freelist;
+        free(qnode);
+        qnode = next;
+    }
+}
+
+static void mcs_pool_init() {
+    errWrap(pthread_key_create(&mcs_pool_key, mcs_pool_free), "Could not create the MCS node pool!");
+}
+
+static mcs_node* mcs_node_get() {
+    pthread_once(&mcs_pool_once, mcs_pool_init);
+    mcs_node* qnode = pthread_getspecific(mcs_pool_key);
+    if (qnode) {
+        pthread_setspecific(mcs_pool_key, qnode -> freelist);
+        return qnode;
+    }
+
+    errWrap((qnode = malloc(sizeof(mcs_node))) == NULL, "Could not allocate an MCS node!");
+    return qnode;
+}
+
+static void mcs_node_put(mcs_node* qnode) {
+    qnode -> freelist = pthread_getspecific(mcs_pool_key);
+    pthread_setspecific(mcs_pool_key, qnode);
+}
+
+void mcs_init(mcs_lock_t* lock) {
+    lock -> tail = NULL;
+    lock -> holder = NULL;
+}
+void mcs_lock(mcs_lock_t* lock) {
+    int spins = 0;
+    mcs_node* me = mcs_node_get();
+    me -> next = NULL;
+    me -> locked = 1;
+
+    mcs_node* prev = __atomic_exchange_n(&lock -> tail, me, __ATOMIC_ACQ_REL);
+    if (prev) {
+        __atomic_store_n(&prev -> next, me, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&me -> locked, __ATOMIC_ACQUIRE)) {
+            spin_wait(&spins);
+        }
+    }
+    lock -> holder = me;
+}
+void mcs_unlock(mcs_lock_t* lock) {
+    int spins = 0;
+    mcs_node* me = lock -> holder;
+    errWrap(me == NULL, "Failed to unlock the MCS lock!");
+    lock -> holder = NULL;
+
+    mcs_node* next = __atomic_load_n(&me -> next, __ATOMIC_ACQUIRE);
+    if (!next) {
+        mcs_node* expected = me;
+        if (__atomic_compare_exchange_n(&lock -> tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            mcs_node_put(me);
+            return;
+        }
+        // Someone is enqueueing behind us, wait for the link
+        while (!(next = __atomic_load_n(&me -> next, __ATOMIC_ACQUIRE))) {
+            spin_wait(&spins);
+        }
+    }
+    __atomic_store_n(&next -> locked, 0, __ATOMIC_RELEASE);
+    mcs_node_put(me);
+}
+void mcs_destroy(mcs_lock_t* lock) {
+    errWrap(__atomic_load_n(&lock -> tail, __ATOMIC_RELAXED) != NULL, "Could not destroy the MCS lock!");
+}
+
+/*
+    Adaptive mutex: spins on trylock for a bounded budget, then parks
+    on the pthread mutex (futex) if the lock is still contended.
+*/
+void adaptive_init(adaptive_mutex_t* lock) {
+    errWrap(pthread_mutex_init(&lock -> mutex, NULL), "Could not initialize the adaptive mutex!");
+}
+void adaptive_lock(adaptive_mutex_t* lock) {
+    for (int i = 0; i < ADAPTIVE_SPIN_BUDGET; i++) {
+        int err = pthread_mutex_trylock(&lock -> mutex);
+        if (!err) {
+            return;
+        }
+        errWrap(err != EBUSY, "Failed to lock the adaptive mutex!");
+        cpu_relax();
+    }
+    errWrap(pthread_mutex_lock(&lock -> mutex), "Failed to lock the adaptive mutex!");
+}
+void adaptive_unlock(adaptive_mutex_t* lock) {
+    errWrap(pthread_mutex_unlock(&lock -> mutex), "Failed to unlock the adaptive mutex!");
+}
+void adaptive_destroy(adaptive_mutex_t* lock) {
+    errWrap(pthread_mutex_destroy(&lock -> mutex), "Failed to destroy the adaptive mutex!");
+}
+
+/*
+    Phase-fair ticket R/W lock.
+    Readers and writers alternate in phases, so neither side can starve
+    the other: a writer waits for at most one reader phase, and readers
+    wait for at most one writer.
+*/
+#define PF_RINC 0x100
+#define PF_WBITS 0x3
+#define PF_PRES 0x2
+#define PF_PHID 0x1
+
+void pfrw_init(pf_rwlock_t* lock) {
+    lock -> rin = 0;
+    lock -> rout = 0;
+    lock -> win = 0;
+    lock -> wout = 0;
+    lock -> writer = 0;
+}
+void pfrw_rdlock(pf_rwlock_t* lock) {
+    int spins = 0;
+    uint32_t w = __atomic_fetch_add(&lock -> rin, PF_RINC, __ATOMIC_ACQUIRE) & PF_WBITS;
+    if (w) {
+        // A writer is present, wait for its phase to end
+        while ((__atomic_load_n(&lock -> rin, __ATOMIC_ACQUIRE) & PF_WBITS) == w) {
+            spin_wait(&spins);
+        }
+    }
+}
+void pfrw_wrlock(pf_rwlock_t* lock) {
+    int spins = 0;
+    uint32_t ticket = __atomic_fetch_add(&lock -> win, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&lock -> wout, __ATOMIC_ACQUIRE) != ticket) {
+        spin_wait(&spins);
+    }
+
+    // Block new readers, then wait for the ones already inside to leave
+    uint32_t w = PF_PRES | (ticket & PF_PHID);
+    uint32_t readers = __atomic_fetch_add(&lock -> rin, w, __ATOMIC_ACQUIRE);
+    while (__atomic_load_n(&lock -> rout, __ATOMIC_ACQUIRE) != readers) {
+        spin_wait(&spins);
+    }
+    lock -> writer = 1;
+}
+void pfrw_unlock(pf_rwlock_t* lock) {
+    // Readers can never observe the writer flag: it is only raised
+    // once every reader has left, and cleared before new ones enter.
+    if (lock -> writer) {
+        lock -> writer = 0;
+        __atomic_fetch_and(&lock -> rin, ~(uint32_t)0xFF, __ATOMIC_RELEASE);
+        __atomic_fetch_add(&lock -> wout, 1, __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_add(&lock -> rout, PF_RINC, __ATOMIC_RELEASE);
+    }
+}
+void pfrw_destroy(pf_rwlock_t* lock) {
+    errWrap(
+        lock -> writer || __atomic_load_n(&lock -> rin, __ATOMIC_RELAXED) != __atomic_load_n(&lock -> rout, __ATOMIC_RELAXED),
+        "Could not destroy the phase-fair R/W Lock!"
+    );
+}
+
+/*
+    Per-CPU reader-biased R/W lock.
+    Each thread is bound to one reader slot (picked from the CPU it first
+    ran on), so readers only ever write to their own cache line. Writers
+    pay for it: they must raise the pending flag and scan every slot.
+*/
+static __thread int brlock_slot_id = -1;
+
+static int brlock_my_slot() {
+    if (brlock_slot_id < 0) {
+        int cpu = sched_getcpu();
+        brlock_slot_id = (cpu < 0 ? 0 : cpu) % BRLOCK_SLOTS;
+    }
+    return brlock_slot_id;
+}
+
+void brlock_init(br_rwlock_t* lock) {
+    for (int i = 0; i < BRLOCK_SLOTS; i++) {
+        lock -> slots[i].readers = 0;
+    }
+    lock -> pending = 0;
+    lock -> writer = 0;
+    errWrap(pthread_mutex_init(&lock -> writers, NULL), "Could not initialize the per-CPU R/W Lock!");
+}
+void brlock_rdlock(br_rwlock_t* lock) {
+    int spins = 0;
+    int* readers = &lock -> slots[brlock_my_slot()].readers;
+    for (;;) {
+        __atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&lock -> pending, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        // A writer wants in, back off until it is done
+        __atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&lock -> pending, __ATOMIC_ACQUIRE)) {
+            spin_wait(&spins);
+        }
+    }
+}
+void brlock_wrlock(br_rwlock_t* lock) {
+    int spins = 0;
+    errWrap(pthread_mutex_lock(&lock -> writers), "Failed to lock the per-CPU R/W Lock!");
+    __atomic_store_n(&lock -> pending, 1, __ATOMIC_SEQ_CST);
+    for (int i = 0; i < BRLOCK_SLOTS; i++) {
+        while (__atomic_load_n(&lock -> slots[i].readers, __ATOMIC_SEQ_CST)) {
+            spin_wait(&spins);
+        }
+    }
+    lock -> writer = 1;
+}
+void brlock_unlock(br_rwlock_t* lock) {
+    // Same reasoning as the phase-fair lock: a reader holding the lock
+    // always sees the writer flag lowered.
+    if (lock -> writer) {
+        lock -> writer = 0;
+        __atomic_store_n(&lock -> pending, 0, __ATOMIC_RELEASE);
+        errWrap(pthread_mutex_unlock(&lock -> writers), "Failed to unlock the per-CPU R/W Lock!");
+    } else {
+        __atomic_fetch_sub(&lock -> slots[brlock_my_slot()].readers, 1, __ATOMIC_RELEASE);
+    }
+}
+void brlock_destroy(br_rwlock_t* lock) {
+    errWrap(pthread_mutex_destroy(&lock -> writers), "Could not destroy the per-CPU R/W Lock!");
+}
@@ -3,13 +3,89 @@
     File: locks.h
     Description: Describes functions that protect lock switches
 
+    The lock policy is chosen at compile time with one of the following flags:
+    -DMUTEX, -DRWLOCK, -DSPINLOCK, -DTICKET, -DMCS, -DADAPTIVE, -DPFRWLOCK
+    or -DBRLOCK. Every policy is exposed through the same lock type and
+    INIT_LOCK/LOCK_READ/LOCK_WRITE/LOCK_UNLOCK/DESTROY_LOCK macros.
+
 */
 
 #include <pthread.h>
+#include <stdint.h>
 
 #ifndef LOCKS
 #define LOCKS
 
+// Assumed size of a cache line, used to keep hot lock words apart
+#define CACHE_LINE 64
+
+// How many times the spinning locks retry before yielding the CPU
+#define SPIN_YIELD_THRESHOLD 128
+
+// How many times the adaptive mutex spins before parking in the kernel
+#define ADAPTIVE_SPIN_BUDGET 256
+
+// Number of reader slots in the per-CPU reader-biased R/W lock
+#define BRLOCK_SLOTS 32
+
+#if defined(__x86_64__) || defined(__i386__)
+    #define cpu_relax() __asm__ __volatile__ ("pause" ::: "memory")
+#elif defined(__aarch64__)
+    #define cpu_relax() __asm__ __volatile__ ("yield" ::: "memory")
+#else
+    #define cpu_relax() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
+// Test-and-test-and-set spinlock
+typedef struct {
+    int held;
+} ttas_lock_t;
+
+// FIFO ticket spinlock
+typedef struct {
+    uint32_t next;
+    uint32_t serving;
+} ticket_lock_t;
+
+// MCS queue lock: every waiter spins on its own queue node
+typedef struct mcs_node {
+    struct mcs_node* next;
+    int locked;
+    struct mcs_node* freelist;
+} mcs_node;
+
+typedef struct {
+    mcs_node* tail;
+    mcs_node* holder;
+} mcs_lock_t;
+
+// Spin-then-park mutex
+typedef struct {
+    pthread_mutex_t mutex;
+} adaptive_mutex_t;
+
+// Phase-fair ticket R/W lock (Brandenburg & Anderson)
+typedef struct {
+    uint32_t rin;
+    uint32_t rout;
+    uint32_t win;
+    uint32_t wout;
+    int writer;
+} pf_rwlock_t;
+
+// Per-CPU reader-biased R/W lock: readers only touch their own slot
+typedef struct {
+    int readers;
+    char pad[CACHE_LINE - sizeof(int)];
+} brlock_slot;
+
+typedef struct {
+    brlock_slot slots[BRLOCK_SLOTS];
+    pthread_mutex_t writers;
+    int pending;
+    int writer;
+} br_rwlock_t;
+
 void mutex_init(pthread_mutex_t*);
 void mutex_lock(pthread_mutex_t*);
 void mutex_unlock(pthread_mutex_t*);
@@ -21,11 +97,44 @@ void rwlock_wrlock(pthread_rwlock_t*);
 void rwlock_unlock(pthread_rwlock_t*);
 void rwlock_destroy(pthread_rwlock_t*);
 
+void ttas_init(ttas_lock_t*);
+void ttas_lock(ttas_lock_t*);
+void ttas_unlock(ttas_lock_t*);
+void ttas_destroy(ttas_lock_t*);
+
+void ticket_init(ticket_lock_t*);
+void ticket_lock(ticket_lock_t*);
+void ticket_unlock(ticket_lock_t*);
+void ticket_destroy(ticket_lock_t*);
+
+void mcs_init(mcs_lock_t*);
+void mcs_lock(mcs_lock_t*);
+void mcs_unlock(mcs_lock_t*);
+void mcs_destroy(mcs_lock_t*);
+
+void adaptive_init(adaptive_mutex_t*);
+void adaptive_lock(adaptive_mutex_t*);
+void adaptive_unlock(adaptive_mutex_t*);
+void adaptive_destroy(adaptive_mutex_t*);
+
+void pfrw_init(pf_rwlock_t*);
+void pfrw_rdlock(pf_rwlock_t*);
+void pfrw_wrlock(pf_rwlock_t*);
+void pfrw_unlock(pf_rwlock_t*);
+void pfrw_destroy(pf_rwlock_t*);
+
+void brlock_init(br_rwlock_t*);
+void brlock_rdlock(br_rwlock_t*);
+void brlock_wrlock(br_rwlock_t*);
+void brlock_unlock(br_rwlock_t*);
+void brlock_destroy(br_rwlock_t*);
+
 #ifdef MUTEX
     // Map macros to mutex
 
     typedef pthread_mutex_t lock;
 
+    #define LOCK_NAME "mutex"
     #define INIT_LOCK mutex_init
     #define LOCK_READ mutex_lock
     #define LOCK_WRITE mutex_lock
@@ -35,12 +144,79 @@ void rwlock_destroy(pthread_rwlock_t*);
     // Map macros to RWLOCK
 
     typedef pthread_rwlock_t lock;
-    
+
+    #define LOCK_NAME "rwlock"
     #define INIT_LOCK rwlock_init
     #define LOCK_READ rwlock_rdlock
     #define LOCK_WRITE rwlock_wrlock
     #define LOCK_UNLOCK rwlock_unlock
     #define DESTROY_LOCK rwlock_destroy
+#elif SPINLOCK
+    // Map macros to the test-and-test-and-set spinlock
+
+    typedef ttas_lock_t lock;
+
+    #define LOCK_NAME "spinlock"
+    #define INIT_LOCK ttas_init
+    #define LOCK_READ ttas_lock
+    #define LOCK_WRITE ttas_lock
+    #define LOCK_UNLOCK ttas_unlock
+    #define DESTROY_LOCK ttas_destroy
+#elif TICKET
+    // Map macros to the ticket lock
+
+    typedef ticket_lock_t lock;
+
+    #define LOCK_NAME "ticket"
+    #define INIT_LOCK ticket_init
+    #define LOCK_READ ticket_lock
+    #define LOCK_WRITE ticket_lock
+    #define LOCK_UNLOCK ticket_unlock
+    #define DESTROY_LOCK ticket_destroy
+#elif MCS
+    // Map macros to the MCS queue lock
+
+    typedef mcs_lock_t lock;
+
+    #define LOCK_NAME "mcs"
+    #define INIT_LOCK mcs_init
+    #define LOCK_READ mcs_lock
+    #define LOCK_WRITE mcs_lock
+    #define LOCK_UNLOCK mcs_unlock
+    #define DESTROY_LOCK mcs_destroy
+#elif ADAPTIVE
+    // Map macros to the spin-then-park mutex
+
+    typedef adaptive_mutex_t lock;
+
+    #define LOCK_NAME "adaptive"
+    #define INIT_LOCK adaptive_init
+    #define LOCK_READ adaptive_lock
+    #define LOCK_WRITE adaptive_lock
+    #define LOCK_UNLOCK adaptive_unlock
+    #define DESTROY_LOCK adaptive_destroy
+#elif PFRWLOCK
+    // Map macros to the phase-fair R/W lock
+
+    typedef pf_rwlock_t lock;
+
+    #define LOCK_NAME "pfrwlock"
+    #define INIT_LOCK pfrw_init
+    #define LOCK_READ pfrw_rdlock
+    #define LOCK_WRITE pfrw_wrlock
+    #define LOCK_UNLOCK pfrw_unlock
+    #define DESTROY_LOCK pfrw_destroy
+#elif BRLOCK
+    // Map macros to the per-CPU reader-biased R/W lock
+
+    typedef br_rwlock_t lock;
+
+    #define LOCK_NAME "brlock"
+    #define INIT_LOCK brlock_init
+    #define LOCK_READ brlock_rdlock
+    #define LOCK_WRITE brlock_wrlock
+    #define LOCK_UNLOCK brlock_unlock
+    #define DESTROY_LOCK brlock_destroy
 #else
     typedef void* lock;
 
@@ -50,7 +226,7 @@ void rwlock_destroy(pthread_rwlock_t*);
     #define LOCK_UNLOCK
     #define DESTROY_LOCK
 
-    #error TecnicoFS requires a synchronization mechanism to be defined, either with the -DMUTEX or -DRWLOCK flag.
+    #error TecnicoFS requires a synchronization mechanism to be defined (-DMUTEX, -DRWLOCK, -DSPINLOCK, -DTICKET, -DMCS, -DADAPTIVE, -DPFRWLOCK or -DBRLOCK).
 #endif
 
 #endif
@@ -0,0 +1,210 @@
+/*
+
+    File: log.c
+    Description: Implements the asynchronous logger.
+
+    Every thread owns a single-producer/single-consumer ring; the only
+    consumer is the drain thread. Rings of finished threads are recycled
+    once the drain thread has emptied them.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "log.h"
+
+typedef struct {
+    uint64_t timestamp;
+    log_level level;
+    char text[LOG_LINE_SIZE];
+} log_entry;
+
+typedef struct log_ring {
+    struct log_ring* next;
+    bool inUse;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    log_entry entries[LOG_RING_SIZE];
+} log_ring;
+
+log_level logLevel = LOG_INFO;
+
+static const char* levelNames[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+static log_ring* rings = NULL;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+static __thread log_ring* myRing = NULL;
+
+static pthread_t drainer;
+static bool running = false;
+static bool stopping = false;
+static uint64_t startTime = 0;
+
+static uint64_t monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void ring_release(void* ring) {
+    __atomic_store_n(&((log_ring*)ring) -> inUse, false, __ATOMIC_RELEASE);
+}
+
+static void ring_key_init() {
+    errWrap(pthread_key_create(&ringKey, ring_release), "Unable to create the log ring key!");
+}
+
+static log_ring* ring_acquire() {
+    pthread_once(&ringKeyOnce, ring_key_init);
+    pthread_mutex_lock(&ringsLock);
+
+    // Reuse the ring of a finished thread, once it has been drained
+    log_ring* ring = rings;
+    while (ring && (__atomic_load_n(&ring -> inUse, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE) != ring -> head)) {
+        ring = ring -> next;
+    }
+    if (!ring) {
+        errWrap((ring = malloc(sizeof(log_ring))) == NULL, "Unable to allocate a log ring!");
+        ring -> head = 0;
+        ring -> tail = 0;
+        ring -> dropped = 0;
+        ring -> next = rings;
+        __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+    }
+    ring -> inUse = true;
+
+    pthread_mutex_unlock(&ringsLock);
+    pthread_setspecific(ringKey, ring);
+    return ring;
+}
+
+/*
+    Appends a line to the calling thread's ring. Never blocks.
+*/
+static void push(log_level level, const char* event, const char* fields, va_list args) {
+    if (!myRing) {
+        myRing = ring_acquire();
+    }
+
+    uint64_t head = myRing -> head;
+    if (head - __atomic_load_n(&myRing -> tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        __atomic_fetch_add(&myRing -> dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    log_entry* entry = myRing -> entries + (head % LOG_RING_SIZE);
+    entry -> timestamp = monotonic();
+    entry -> level = level;
+    int used = snprintf(entry -> text, LOG_LINE_SIZE, "%s ", event);
+    if (used < LOG_LINE_SIZE) {
+        vsnprintf(entry -> text + used, LOG_LINE_SIZE - used, fields, args);
+    }
+    __atomic_store_n(&myRing -> head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_event(log_level level, const char* event, const char* fields, ...) {
+    if (level < logLevel) {
+        return;
+    }
+    va_list args;
+    va_start(args, fields);
+    push(level, event, fields, args);
+    va_end(args);
+}
+
+void log_event_limited(log_limiter* limiter, log_level level, const char* event, const char* fields, ...) {
+    uint64_t window = monotonic() / 1000000000ull;
+    uint64_t current = __atomic_load_n(&limiter -> window, __ATOMIC_RELAXED);
+    uint32_t suppressed = 0;
+
+    if (window != current && __atomic_compare_exchange_n(&limiter -> window, &current, window, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // New one-second window: report what was swallowed by the last one
+        __atomic_store_n(&limiter -> count, 0, __ATOMIC_RELAXED);
+        suppressed = __atomic_exchange_n(&limiter -> suppressed, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_fetch_add(&limiter -> count, 1, __ATOMIC_RELAXED) >= LOG_RATE_LIMIT) {
+        __atomic_fetch_add(&limiter -> suppressed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (suppressed) {
+        log_event(level, event, "suppressed=%u", suppressed);
+    }
+    va_list args;
+    va_start(args, fields);
+    push(level, event, fields, args);
+    va_end(args);
+}
+
+/*
+    Moves every pending line to stdout. Returns how many lines were written.
+*/
+static int drain() {
+    int written = 0;
+    log_ring* ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring; ring = ring -> next) {
+        uint64_t head = __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring -> tail;
+        for (; tail < head; tail++) {
+            log_entry* entry = ring -> entries + (tail % LOG_RING_SIZE);
+            uint64_t elapsed = entry -> timestamp - startTime;
+            fprintf(stdout, "[%6llu.%06llu] %s %s\n",
+                (unsigned long long)(elapsed / 1000000000ull),
+                (unsigned long long)((elapsed / 1000ull) % 1000000ull),
+                levelNames[entry -> level],
+                entry -> text
+            );
+            written++;
+        }
+        __atomic_store_n(&ring -> tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&ring -> dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            fprintf(stdout, "[logger] %llu lines dropped, log ring was full\n", (unsigned long long)dropped);
+        }
+    }
+    if (written) {
+        fflush(stdout);
+    }
+    return written;
+}
+
+static void* drain_loop(void* arg) {
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (!drain()) {
+            usleep(LOG_DRAIN_INTERVAL);
+        }
+    }
+    drain();
+    return NULL;
+}
+
+void log_init() {
+    startTime = monotonic();
+    stopping = false;
+    errWrap(pthread_create(&drainer, NULL, drain_loop, NULL), "Unable to start the logger!");
+    running = true;
+}
+
+void log_stop() {
+    if (!running) {
+        return;
+    }
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(drainer, NULL);
+    running = false;
+}
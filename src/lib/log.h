@@ -0,0 +1,65 @@
+/*
+
+    File: log.h
+    Description: Describes the asynchronous logger.
+
+    Threads never write to stdout themselves: log lines are formatted
+    into a per-thread ring and a background thread drains every ring
+    into stdout in batches. If a ring is full the line is dropped (and
+    counted) instead of blocking the caller.
+
+*/
+
+#ifndef TECNICOFS_LOG_H
+#define TECNICOFS_LOG_H
+
+#include <stdint.h>
+
+#define LOG_RING_SIZE 1024
+#define LOG_LINE_SIZE 240
+
+// How often the background thread looks for new lines (microseconds)
+#define LOG_DRAIN_INTERVAL 2000
+
+typedef enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR } log_level;
+
+// Lines below this level are discarded right away
+extern log_level logLevel;
+
+/*
+    Per call-site state for rate-limited events.
+*/
+typedef struct {
+    uint64_t window;
+    uint32_t count;
+    uint32_t suppressed;
+} log_limiter;
+
+// Rate-limited events are let through at most this many times per second
+#define LOG_RATE_LIMIT 10
+
+void log_init();
+void log_stop();
+
+/*
+    Logs a structured event: a name followed by key=value fields,
+    e.g. log_event(LOG_INFO, "connected", "pid=%d uid=%d", pid, uid).
+*/
+void log_event(log_level level, const char* event, const char* fields, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*
+    Same as log_event, but at most LOG_RATE_LIMIT times per second for
+    the given limiter. Suppressed events are reported with the next one
+    that gets through.
+*/
+void log_event_limited(log_limiter* limiter, log_level level, const char* event, const char* fields, ...)
+    __attribute__((format(printf, 4, 5)));
+
+// Rate-limited event with a limiter private to the call site
+#define LOG_LIMITED(LEVEL, EVENT, ...) do { \
+        static log_limiter _limiter; \
+        if ((LEVEL) >= logLevel) log_event_limited(&_limiter, LEVEL, EVENT, __VA_ARGS__); \
+    } while (0)
+
+#endif
@@ -0,0 +1,160 @@
+/*
+
+    File: lz.c
+    Description: Implements the LZ77 codec file contents are stored
+    compressed with (see lz.h for the block format).
+
+    The compressor keeps, for each 4-byte hash, the last position it was
+    seen at, and takes the first match it finds there: no chains, no
+    lazy matching. The decompressor checks every length and offset
+    against the block and the output, so a broken block is an error.
+
+*/
+
+#include <limits.h>
+#include <string.h>
+#include "lz.h"
+
+// Where the last place each 4 bytes were seen is kept (4096 slots, on the stack)
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static unsigned int read32(const unsigned char* at) {
+    unsigned int value;
+    memcpy(&value, at, sizeof(value));
+    return value;
+}
+
+static int slot(unsigned int value) {
+    return (int) ((value * 2654435761u) >> (32 - LZ_HASH_BITS));
+}
+
+/* Writes what's left of a length past its nibble's 15 */
+static unsigned char* putLength(unsigned char* out, int n) {
+    while (n >= 255) {
+        *out++ = 255;
+        n -= 255;
+    }
+    *out++ = (unsigned char) n;
+    return out;
+}
+
+/* Reads the rest of a length (added to *n). Returns -1 if the block ends first. */
+static int getLength(const unsigned char** in, const unsigned char* end, int* n) {
+    int byte;
+    do {
+        if (*in == end || *n > INT_MAX / 2) {
+            return -1;
+        }
+        byte = *(*in)++;
+        *n += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+/*
+    Writes a sequence: the literals, then the match (matchLen < 0 for the
+    last sequence, which has none). Returns NULL if it doesn't fit.
+*/
+static unsigned char* sequence(unsigned char* out, unsigned char* end, const unsigned char* literals,
+                               int numLiterals, int offset, int matchLen) {
+    // At its longest, so none of the writes below must check on their own
+    long longest = 1 + numLiterals + numLiterals / 255 + 1 + (matchLen >= 0 ? 2 + matchLen / 255 + 1 : 0);
+    if (end - out < longest) {
+        return NULL;
+    }
+    unsigned char* token = out++;
+    *token = (unsigned char) ((numLiterals < 15 ? numLiterals : 15) << 4);
+    if (numLiterals >= 15) {
+        out = putLength(out, numLiterals - 15);
+    }
+    memcpy(out, literals, numLiterals);
+    out += numLiterals;
+    if (matchLen < 0) {
+        return out;
+    }
+
+    int extra = matchLen - LZ_MIN_MATCH;
+    *token |= (unsigned char) (extra < 15 ? extra : 15);
+    *out++ = (unsigned char) (offset & 0xff);
+    *out++ = (unsigned char) (offset >> 8);
+    if (extra >= 15) {
+        out = putLength(out, extra - 15);
+    }
+    return out;
+}
+
+int lz_compress(const char* src, int len, char* dst, int cap) {
+    const unsigned char* in = (const unsigned char*) src;
+    unsigned char* out = (unsigned char*) dst;
+    unsigned char* end = out + cap;
+    int seen[1 << LZ_HASH_BITS];
+    memset(seen, 0xff, sizeof(seen));
+
+    int anchor = 0;
+    int at = 0;
+    while (at + LZ_MIN_MATCH <= len) {
+        unsigned int value = read32(in + at);
+        int where = slot(value);
+        int candidate = seen[where];
+        seen[where] = at;
+        if (candidate < 0 || at - candidate > LZ_MAX_OFFSET || read32(in + candidate) != value) {
+            // The longer nothing matches, the faster it skips ahead (incompressible data)
+            at += 1 + ((at - anchor) >> 6);
+            continue;
+        }
+
+        int matchLen = LZ_MIN_MATCH;
+        while (at + matchLen < len && in[candidate + matchLen] == in[at + matchLen]) {
+            matchLen++;
+        }
+        out = sequence(out, end, in + anchor, at - anchor, at - candidate, matchLen);
+        if (!out) {
+            return -1;
+        }
+        at += matchLen;
+        anchor = at;
+    }
+
+    out = sequence(out, end, in + anchor, len - anchor, 0, -1);
+    return out ? (int) (out - (unsigned char*) dst) : -1;
+}
+
+int lz_decompress(const char* src, int len, char* dst, int cap) {
+    const unsigned char* in = (const unsigned char*) src;
+    const unsigned char* end = in + len;
+    int written = 0;
+    while (in < end && written < cap) {
+        int token = *in++;
+        int numLiterals = token >> 4;
+        if ((numLiterals == 15 && getLength(&in, end, &numLiterals)) || numLiterals > end - in) {
+            return -1;
+        }
+        int copied = numLiterals < cap - written ? numLiterals : cap - written;
+        memcpy(dst + written, in, copied);
+        written += copied;
+        in += numLiterals;
+        if (in == end || written == cap) {
+            break;
+        }
+
+        if (end - in < 2) {
+            return -1;
+        }
+        int offset = in[0] | (in[1] << 8);
+        in += 2;
+        int matchLen = token & 15;
+        if (matchLen == 15 && getLength(&in, end, &matchLen)) {
+            return -1;
+        }
+        matchLen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > written) {
+            return -1;
+        }
+        // Byte by byte: a match may overlap what it's copying (runs)
+        for (int i = 0; i < matchLen && written < cap; i++, written++) {
+            dst[written] = dst[written - offset];
+        }
+    }
+    return written;
+}
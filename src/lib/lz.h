@@ -0,0 +1,37 @@
+/*
+
+    File: lz.h
+    Description: A small LZ77 codec (in the spirit of LZ4) for file
+    contents: greedy matching through a hash table of the last place each
+    4 bytes were seen, no entropy coding, so both ways run at memory speed.
+
+    A block is a run of sequences, each a token (literal count in its high
+    nibble, match length - LZ_MIN_MATCH in the low one, 15 meaning more
+    bytes of 255s follow), the literals, then the match's 2-byte offset
+    (little-endian) and the rest of its length. The last sequence has
+    literals only.
+
+*/
+
+#ifndef TECNICOFS_LZ_H
+#define TECNICOFS_LZ_H
+
+#define LZ_MIN_MATCH 4
+
+/*
+    Compresses len bytes of src into dst, which holds up to cap bytes.
+
+    Returns: the compressed size, -1 if it doesn't fit in cap (i.e. the
+    data doesn't compress enough).
+*/
+int lz_compress(const char* src, int len, char* dst, int cap);
+
+/*
+    Decompresses a block of len bytes into dst, stopping after cap bytes
+    (the rest of the data is simply not needed).
+
+    Returns: how many bytes were written, -1 if the block is malformed.
+*/
+int lz_decompress(const char* src, int len, char* dst, int cap);
+
+#endif /* TECNICOFS_LZ_H */
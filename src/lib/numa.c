@@ -0,0 +1,143 @@
+/*
+
+    File: numa.c
+    Description: CPU sets and NUMA placement, without libnuma.
+
+    Memory policies are set through the raw mbind system call, which
+    glibc doesn't wrap; its constants are those of <linux/mempolicy.h>.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#include "numa.h"
+
+#define MAX_NODES 64
+
+#define MPOL_PREFERRED 1
+#define MPOL_INTERLEAVE 3
+#define MPOL_MF_MOVE (1 << 1)
+
+static int numNodes = 1;
+static short nodeOf[CPU_SETSIZE];
+
+void numa_init(void) {
+    numNodes = 1;
+    for (int node = 0; node < MAX_NODES; node++) {
+        char path[64], list[1024];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (!file) {
+            // Node ids may have holes (offline nodes), keep looking
+            continue;
+        }
+        cpu_set_t cpus;
+        bool parsed = fgets(list, sizeof(list), file) && numa_parse_cpus(list, &cpus) == 0;
+        fclose(file);
+        if (!parsed) {
+            continue;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                nodeOf[cpu] = node;
+            }
+        }
+        if (node + 1 > numNodes) {
+            numNodes = node + 1;
+        }
+    }
+}
+
+int numa_nodes(void) {
+    return numNodes;
+}
+
+int numa_node_of_cpu(int cpu) {
+    return cpu >= 0 && cpu < CPU_SETSIZE ? nodeOf[cpu] : 0;
+}
+
+int numa_current_node(void) {
+    return numa_node_of_cpu(sched_getcpu());
+}
+
+int numa_parse_cpus(char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    char* at = list;
+    while (*at && !isspace((unsigned char)*at)) {
+        char* end;
+        long first = strtol(at, &end, 10);
+        long last = first;
+        if (end == at) {
+            return -1;
+        }
+        if (*end == '-') {
+            at = end + 1;
+            last = strtol(at, &end, 10);
+            if (end == at) {
+                return -1;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end && !isspace((unsigned char)*end)) {
+            return -1;
+        }
+        at = end;
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+int numa_nth_cpu(cpu_set_t* set, int n) {
+    cpu_set_t mine;
+    if (!set) {
+        if (sched_getaffinity(0, sizeof(mine), &mine) < 0) {
+            return n % sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        set = &mine;
+    }
+    int count = CPU_COUNT(set);
+    n = count ? n % count : 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && !n--) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+static int setPolicy(void* addr, size_t len, int mode, unsigned long mask) {
+    if (numNodes < 2) {
+        return 0;
+    }
+    // Only whole pages: the ones at the edges may hold someone else's memory
+    unsigned long page = sysconf(_SC_PAGESIZE);
+    unsigned long start = ((unsigned long)addr + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long)addr + len) & ~(page - 1);
+    if (end <= start) {
+        return 0;
+    }
+    return syscall(SYS_mbind, start, end - start, mode, &mask, (unsigned long)MAX_NODES + 1, MPOL_MF_MOVE) < 0 ? -1 : 0;
+}
+
+int numa_prefer(void* addr, size_t len, int node) {
+    return setPolicy(addr, len, MPOL_PREFERRED, 1UL << node);
+}
+
+int numa_interleave(void* addr, size_t len) {
+    unsigned long mask = numNodes >= MAX_NODES ? ~0UL : (1UL << numNodes) - 1;
+    return setPolicy(addr, len, MPOL_INTERLEAVE, mask);
+}
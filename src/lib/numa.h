@@ -0,0 +1,40 @@
+/*
+
+    File: numa.h
+    Description: CPU sets and NUMA placement, without libnuma.
+
+    The topology is read from sysfs (/sys/devices/system/node) once, by
+    numa_init(). Machines without it (or with a single node) look like one
+    node holding every CPU, and then placing memory does nothing.
+
+*/
+
+#ifndef TECNICOFS_NUMA_H
+#define TECNICOFS_NUMA_H
+
+// cpu_set_t needs _GNU_SOURCE, defined by the includer
+#include <sched.h>
+#include <stddef.h>
+
+void numa_init(void);
+int numa_nodes(void);
+int numa_node_of_cpu(int cpu);
+
+/* The node of the CPU the calling thread is running on right now */
+int numa_current_node(void);
+
+/* Parses a CPU list such as "0-3,8,10-11", returns -1 if it's malformed or empty */
+int numa_parse_cpus(char* list, cpu_set_t* set);
+
+/* The n-th CPU of the set, wrapping around (the process's CPUs if set is NULL) */
+int numa_nth_cpu(cpu_set_t* set, int n);
+
+/*
+    Asks for the pages that lie entirely within [addr, addr + len) to be
+    on the given node (moving the ones already touched), or spread over
+    every node. Returns -1 if the kernel turns it down.
+*/
+int numa_prefer(void* addr, size_t len, int node);
+int numa_interleave(void* addr, size_t len);
+
+#endif /* TECNICOFS_NUMA_H */
@@ -0,0 +1,124 @@
+/*
+
+    File: record.c
+    Description: Implements the request recorder.
+
+    Every thread appends records to its own private buffer, so the
+    request path never takes a lock. Full buffers are handed to the
+    kernel with a single write() on an O_APPEND descriptor, which keeps
+    records from different threads from interleaving.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "record.h"
+
+bool recording = false;
+
+static int traceFd = -1;
+static uint64_t traceStart = 0;
+
+typedef struct {
+    size_t used;
+    char data[RECORD_BUFFER_SIZE];
+} record_buffer;
+
+static __thread record_buffer* buffer = NULL;
+
+static uint64_t monotonic() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t record_clock() {
+    return monotonic() - traceStart;
+}
+
+void record_init(char* path) {
+    errWrap((traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0, "Unable to open the trace file!");
+
+    trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.start = traceStart = monotonic();
+
+    errWrap(write(traceFd, &header, sizeof(header)) != sizeof(header), "Unable to write the trace header!");
+    recording = true;
+}
+
+static void flush_buffer() {
+    errWrap(write(traceFd, buffer -> data, buffer -> used) != (ssize_t)buffer -> used, "Unable to write to the trace file!");
+    buffer -> used = 0;
+}
+
+void record_flush() {
+    if (!buffer) {
+        return;
+    }
+    if (buffer -> used) {
+        flush_buffer();
+    }
+    free(buffer);
+    buffer = NULL;
+}
+
+void record_request(uint64_t arrival, uint32_t session, uid_t uid, char opcode,
+    char* arg1, char* arg2, int32_t status) {
+    if (!buffer) {
+        errWrap((buffer = malloc(sizeof(record_buffer))) == NULL, "Unable to allocate the trace buffer!");
+        buffer -> used = 0;
+    }
+
+    trace_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.timestamp = arrival;
+    rec.answered = record_clock();
+    rec.session = session;
+    rec.uid = (uint32_t)uid;
+    rec.status = status;
+    rec.opcode = opcode;
+
+    size_t len1 = arg1 ? strlen(arg1) : 0;
+    size_t len2 = arg2 ? strlen(arg2) : 0;
+    if (opcode == 'w') {
+        rec.payload = (uint32_t)len2;
+        len2 = 0;
+    } else if ((opcode == 'l' || opcode == 'z') && arg2) {
+        rec.payload = (uint32_t)atoi(arg2);
+    }
+    rec.arg1Len = (uint16_t)len1;
+    rec.arg2Len = (uint16_t)len2;
+
+    size_t size = sizeof(rec) + len1 + len2;
+    if (buffer -> used + size > RECORD_BUFFER_SIZE) {
+        flush_buffer();
+    }
+
+    char* out = buffer -> data + buffer -> used;
+    memcpy(out, &rec, sizeof(rec));
+    if (len1) {
+        memcpy(out + sizeof(rec), arg1, len1);
+    }
+    if (len2) {
+        memcpy(out + sizeof(rec) + len1, arg2, len2);
+    }
+    buffer -> used += size;
+}
+
+void record_close() {
+    if (!recording) {
+        return;
+    }
+    recording = false;
+    errWrap(close(traceFd) < 0, "Unable to close the trace file!");
+}
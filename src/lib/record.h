@@ -0,0 +1,81 @@
+/*
+
+    File: record.h
+    Description: Describes the request recorder, which writes every
+    incoming request into a compact binary trace file that can be
+    replayed later on (see bench/replay.c).
+
+*/
+
+#ifndef TECNICOFS_RECORD_H
+#define TECNICOFS_RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define TRACE_MAGIC "TFSTRACE"
+#define TRACE_VERSION 2
+
+// Size of each thread's private buffer before it gets flushed
+#define RECORD_BUFFER_SIZE (64 * 1024)
+
+// Opcode used to mark the end of a session (the client hung up)
+#define RECORD_HANGUP 'u'
+
+/*
+    File layout: one trace_header, followed by trace_records, each one
+    immediately followed by arg1Len + arg2Len bytes of arguments
+    (without NUL terminators).
+
+    Each thread's records come in the order it answered them, and the
+    threads' buffers one after the other: a session's requests in flight
+    together may be spread across several buffers. The order the server
+    applied them in is the one of their answered times.
+*/
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t start;
+} trace_header;
+
+typedef struct {
+    uint64_t timestamp;     // ns since the trace started, when the request arrived
+    uint64_t answered;      // ... and when the server was done with it (before replying)
+    uint32_t session;
+    uint32_t uid;
+    int32_t status;         // what the server answered
+    uint32_t payload;       // bytes written ('w') or requested ('l')
+    uint16_t arg1Len;
+    uint16_t arg2Len;
+    char opcode;
+    char pad[3];
+} trace_record;
+
+extern bool recording;
+
+/*
+    Opens the trace file and starts recording. In case of error, the
+    program automatically exits.
+*/
+void record_init(char* path);
+
+/*
+    Appends a request to the calling thread's buffer. For writes, only
+    the size of the contents is kept, not the contents themselves.
+*/
+void record_request(uint64_t arrival, uint32_t session, uid_t uid, char opcode,
+    char* arg1, char* arg2, int32_t status);
+
+/*
+    Flushes and releases the calling thread's buffer. Must be called
+    before a recording thread exits.
+*/
+void record_flush();
+
+void record_close();
+
+uint64_t record_clock();
+
+#endif
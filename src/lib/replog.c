@@ -0,0 +1,423 @@
+/*
+
+    File: replog.c
+    Description: Implements the replication log.
+
+    Every replica has a buffer of entries waiting to be sent, filled by
+    whoever appends (under the log lock) and drained by a sender thread
+    of its own, which also collects the replica's acknowledgements. A
+    replica that hangs up or falls too far behind is dropped: it has to
+    start over, from a new snapshot.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "err.h"
+#include "log.h"
+#include "replog.h"
+#include "socket.h"
+
+// How long closing the log waits for the replicas to get what's pending (ms)
+#define REPLOG_CLOSE_MS 1000
+
+typedef struct replica {
+    int id;
+    int socket;
+    // Entries waiting to be sent, guarded by logLock
+    char* pending;
+    size_t used;
+    size_t capacity;
+    bool dropped;               // hung up or fell too far behind, its sender lets it go
+    uint64_t acked;             // how far it applied the log
+    // A partial acknowledgement, the sender's only
+    char ack[sizeof(uint64_t)];
+    size_t ackBytes;
+    struct replica* next;
+} replica;
+
+bool shipping = false;
+
+// Mutations hold it for reading, snapshots for writing (and mustn't starve)
+static pthread_rwlock_t gate = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+// The log's position and its replicas, guarded by logLock
+static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logChanged = PTHREAD_COND_INITIALIZER;
+static uint64_t logSeq = 0;
+static replica* replicas = NULL;
+static int numSenders = 0;
+static bool closing = false;
+
+static int listenSocket = -1;
+static char* listenPath = NULL;
+static pthread_t acceptor;
+static replog_snapshot takeSnapshot;
+static void* snapshotState;
+static int nextReplicaId = 0;
+
+// The replica's side
+static int followSocket = -1;
+static pthread_t follower;
+static replog_apply applyEntry;
+static void* applyState;
+static uint64_t applied = 0;
+static bool unfollowing = false;
+static pthread_mutex_t followLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Adds an entry to what a replica has pending (logLock held, or it isn't listed yet) */
+static void push(replica* r, replog_entry* entry, char* name, char* arg) {
+    size_t size = sizeof(replog_entry) + entry -> nameLen + entry -> argLen;
+    if (r -> dropped) {
+        return;
+    }
+    if (r -> used + size > REPLOG_MAX_BACKLOG) {
+        log_event(LOG_WARN, "replica_dropped", "replica=%d reason=backlog", r -> id);
+        r -> dropped = true;
+        return;
+    }
+    if (r -> used + size > r -> capacity) {
+        size_t capacity = r -> capacity ? r -> capacity : 64 * 1024;
+        while (capacity < r -> used + size) {
+            capacity *= 2;
+        }
+        r -> pending = realloc(r -> pending, capacity);
+        errWrap(!r -> pending, "Unable to allocate a replica's log!");
+        r -> capacity = capacity;
+    }
+
+    char* at = r -> pending + r -> used;
+    memcpy(at, entry, sizeof(replog_entry));
+    memcpy(at + sizeof(replog_entry), name, entry -> nameLen);
+    memcpy(at + sizeof(replog_entry) + entry -> nameLen, arg, entry -> argLen);
+    r -> used += size;
+}
+
+static void measure(replog_entry* entry, char* name, char* arg) {
+    entry -> nameLen = name ? strlen(name) : 0;
+    entry -> argLen = arg ? strlen(arg) : 0;
+}
+
+/*
+    Takes in the acknowledgements that arrived, without waiting for more.
+
+    Returns: 0 if successful, -1 if the replica is gone.
+*/
+static int collectAcks(replica* r) {
+    for (;;) {
+        ssize_t got = recv(r -> socket, r -> ack + r -> ackBytes, sizeof(r -> ack) - r -> ackBytes, MSG_DONTWAIT);
+        if (got == 0) {
+            return -1;
+        } else if (got < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+        }
+        r -> ackBytes += got;
+        if (r -> ackBytes == sizeof(r -> ack)) {
+            uint64_t acked;
+            memcpy(&acked, r -> ack, sizeof(acked));
+            __atomic_store_n(&r -> acked, acked, __ATOMIC_RELAXED);
+            r -> ackBytes = 0;
+        }
+    }
+}
+
+static int sendAll(int socket, char* data, size_t size) {
+    while (size) {
+        ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+/*
+    Sends a replica what it has pending as it piles up, swapping buffers
+    with whoever appends so they don't wait for the socket.
+*/
+static void* sender(void* ptr) {
+    replica* r = ptr;
+    char* sending = NULL;
+    size_t sendingCapacity = 0;
+
+    pthread_mutex_lock(&logLock);
+    while (!r -> dropped && !(closing && !r -> used)) {
+        bool gone;
+        if (!r -> used) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += REPLOG_ACK_MS * 1000000L;
+            until.tv_sec += until.tv_nsec / 1000000000L;
+            until.tv_nsec %= 1000000000L;
+            pthread_cond_timedwait(&logChanged, &logLock, &until);
+            pthread_mutex_unlock(&logLock);
+            gone = collectAcks(r) < 0;
+        } else {
+            char* data = r -> pending;
+            size_t size = r -> used;
+            size_t capacity = r -> capacity;
+            r -> pending = sending;
+            r -> capacity = sendingCapacity;
+            r -> used = 0;
+            sending = data;
+            sendingCapacity = capacity;
+            pthread_mutex_unlock(&logLock);
+            gone = sendAll(r -> socket, sending, size) < 0 || collectAcks(r) < 0;
+        }
+        pthread_mutex_lock(&logLock);
+        if (gone && !r -> dropped) {
+            log_event(LOG_WARN, "replica_dropped", "replica=%d reason=hangup", r -> id);
+            r -> dropped = true;
+        }
+    }
+
+    for (replica** at = &replicas; *at; at = &(*at) -> next) {
+        if (*at == r) {
+            *at = r -> next;
+            break;
+        }
+    }
+    numSenders--;
+    pthread_cond_broadcast(&logChanged);
+    pthread_mutex_unlock(&logLock);
+
+    log_event(LOG_INFO, "replica_gone", "replica=%d acked=%lu", r -> id,
+        (unsigned long)__atomic_load_n(&r -> acked, __ATOMIC_RELAXED));
+    close(r -> socket);
+    free(r -> pending);
+    free(sending);
+    free(r);
+    return NULL;
+}
+
+static void* acceptReplicas(void* arg) {
+    for (;;) {
+        int fd = accept(listenSocket, NULL, NULL);
+        if (fd < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+            continue;
+        } else if (fd < 0) {
+            // Closed (see replog_close)
+            return NULL;
+        }
+
+        // A replica gets everyone's files: only whoever runs the server may follow it
+        struct ucred credentials;
+        socklen_t size = sizeof(credentials);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) < 0 || credentials.uid != getuid()) {
+            log_event(LOG_WARN, "replica_refused", "uid=%d", size == sizeof(credentials) ? (int)credentials.uid : -1);
+            close(fd);
+            continue;
+        }
+
+        replica* r = calloc(1, sizeof(replica));
+        errWrap(!r, "Unable to allocate a replica!");
+        r -> id = nextReplicaId++;
+        r -> socket = fd;
+
+        // The snapshot must end exactly where the log it gets afterwards starts
+        pthread_rwlock_wrlock(&gate);
+        takeSnapshot(snapshotState, r);
+        pthread_mutex_lock(&logLock);
+        uint64_t seq = logSeq;
+        r -> next = replicas;
+        replicas = r;
+        numSenders++;
+        pthread_mutex_unlock(&logLock);
+        pthread_rwlock_unlock(&gate);
+
+        log_event(LOG_INFO, "replica_joined", "replica=%d seq=%lu snapshot_bytes=%lu",
+            r -> id, (unsigned long)seq, (unsigned long)r -> used);
+        pthread_t thread;
+        errWrap(pthread_create(&thread, NULL, sender, r), "Unable to start a replica's sender!");
+        pthread_detach(thread);
+    }
+}
+
+void replog_listen(char* path, replog_snapshot snapshot, void* state) {
+    socket_t sock = newSocket(path, MAX_PENDING_CALL_QUEUE);
+    free(sock.server);
+    listenSocket = sock.socket;
+    listenPath = path;
+    takeSnapshot = snapshot;
+    snapshotState = state;
+    shipping = true;
+    errWrap(pthread_create(&acceptor, NULL, acceptReplicas, NULL), "Unable to start taking replicas!");
+}
+
+void replog_close(void) {
+    if (listenSocket < 0) {
+        return;
+    }
+    shutdown(listenSocket, SHUT_RDWR);
+    pthread_join(acceptor, NULL);
+    close(listenSocket);
+    listenSocket = -1;
+    unlink(listenPath);
+
+    // Give the replicas some time to get what they have pending, then let go
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += REPLOG_CLOSE_MS / 1000;
+    pthread_mutex_lock(&logLock);
+    closing = true;
+    pthread_cond_broadcast(&logChanged);
+    while (numSenders && pthread_cond_timedwait(&logChanged, &logLock, &until) != ETIMEDOUT);
+    for (replica* r = replicas; r; r = r -> next) {
+        r -> dropped = true;
+        shutdown(r -> socket, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+void replog_emit(void* r, replog_entry* entry, char* name, char* arg) {
+    // No mutation is underway: the log stays where it is meanwhile
+    entry -> seq = logSeq;
+    measure(entry, name, arg);
+    push(r, entry, name, arg);
+}
+
+void replog_enter(void) {
+    if (shipping) {
+        pthread_rwlock_rdlock(&gate);
+    }
+}
+
+void replog_leave(void) {
+    if (shipping) {
+        pthread_rwlock_unlock(&gate);
+    }
+}
+
+void replog_lock(void) {
+    pthread_mutex_lock(&logLock);
+}
+
+void replog_unlock(void) {
+    pthread_mutex_unlock(&logLock);
+}
+
+void replog_append(replog_entry* entry, char* name, char* arg) {
+    entry -> seq = ++logSeq;
+    measure(entry, name, arg);
+    for (replica* r = replicas; r; r = r -> next) {
+        push(r, entry, name, arg);
+    }
+    if (replicas) {
+        pthread_cond_broadcast(&logChanged);
+    }
+}
+
+void replog_stats(uint64_t* seq, int* count, uint64_t* maxLag) {
+    pthread_mutex_lock(&logLock);
+    *seq = logSeq;
+    *count = 0;
+    *maxLag = 0;
+    for (replica* r = replicas; r; r = r -> next) {
+        uint64_t lag = logSeq - __atomic_load_n(&r -> acked, __ATOMIC_RELAXED);
+        *maxLag = lag > *maxLag ? lag : *maxLag;
+        (*count)++;
+    }
+    pthread_mutex_unlock(&logLock);
+}
+
+/*
+    Applies the primary's entries as they come, acknowledging each batch
+    of them once it's applied.
+*/
+static void* follow(void* arg) {
+    // Twice the largest entry: once one is taken out, the next always fits
+    size_t capacity = 2 * (sizeof(replog_entry) + 2 * (UINT16_MAX + 1));
+    char* data = malloc(capacity);
+    char* name = malloc(UINT16_MAX + 1);
+    char* contents = malloc(UINT16_MAX + 1);
+    errWrap(!data || !name || !contents, "Unable to allocate the replication buffers!");
+
+    size_t used = 0;
+    for (;;) {
+        ssize_t got = read(followSocket, data + used, capacity - used);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            break;
+        }
+        used += got;
+
+        size_t at = 0;
+        uint64_t before = applied;
+        while (used - at >= sizeof(replog_entry)) {
+            replog_entry entry;
+            memcpy(&entry, data + at, sizeof(entry));
+            size_t size = sizeof(entry) + entry.nameLen + entry.argLen;
+            if (used - at < size) {
+                break;
+            }
+            memcpy(name, data + at + sizeof(entry), entry.nameLen);
+            name[entry.nameLen] = '\0';
+            memcpy(contents, data + at + sizeof(entry) + entry.nameLen, entry.argLen);
+            contents[entry.argLen] = '\0';
+            applyEntry(&entry, name, contents, applyState);
+            __atomic_store_n(&applied, entry.seq, __ATOMIC_RELAXED);
+            at += size;
+        }
+        memmove(data, data + at, used - at);
+        used -= at;
+
+        uint64_t now = applied;
+        if (now != before && sendAll(followSocket, (char*)&now, sizeof(now)) < 0) {
+            break;
+        }
+    }
+
+    if (!unfollowing) {
+        log_event(LOG_WARN, "primary_gone", "applied=%lu", (unsigned long)applied);
+    }
+    free(data);
+    free(name);
+    free(contents);
+    return NULL;
+}
+
+void replog_follow(char* path, replog_apply apply, void* state) {
+    struct sockaddr_un primary;
+    memset(&primary, '\0', sizeof(primary));
+    primary.sun_family = AF_UNIX;
+    errWrap(strlen(path) >= sizeof(primary.sun_path), "The primary's log socket path is too long!");
+    strcpy(primary.sun_path, path);
+
+    errWrap((followSocket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0, "Unable to create socket!");
+    errWrap(connect(followSocket, (struct sockaddr*)&primary, sizeof(primary)) < 0, "Unable to reach the primary's log!");
+    applyEntry = apply;
+    applyState = state;
+    errWrap(pthread_create(&follower, NULL, follow, NULL), "Unable to start following the primary!");
+}
+
+void replog_unfollow(void) {
+    // Promotion and shutting down may both try at once
+    pthread_mutex_lock(&followLock);
+    if (followSocket >= 0) {
+        unfollowing = true;
+        shutdown(followSocket, SHUT_RDWR);
+        pthread_join(follower, NULL);
+        close(followSocket);
+        followSocket = -1;
+    }
+    pthread_mutex_unlock(&followLock);
+}
+
+uint64_t replog_applied(void) {
+    return __atomic_load_n(&applied, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,99 @@
+/*
+
+    File: replog.h
+    Description: The replication log: a primary server's mutations, in
+    the order they happened, shipped to the replicas that follow it.
+
+    Replicas connect to the primary's log socket (as the user the primary
+    runs as), get a snapshot of the file system as it is, then every
+    mutation after it. They acknowledge how far they applied the log,
+    which is how the primary knows how far behind each of them is.
+
+    Each entry is a replog_entry followed by nameLen + argLen bytes (no
+    '\0's): the name it's about, then the contents ('w') or the name it
+    gets ('r').
+
+*/
+
+#ifndef TECNICOFS_REPLOG_H
+#define TECNICOFS_REPLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How far (in bytes) a replica may fall behind before the primary drops it
+#define REPLOG_MAX_BACKLOG (64 * 1024 * 1024)
+
+// How often (ms) an idle sender looks for acknowledgements
+#define REPLOG_ACK_MS 100
+
+typedef struct {
+    uint64_t seq;           // position in the log (a snapshot's entries all get the one it was taken at)
+    char op;                // as the requests: 'c', 'm', 'd', 'e', 'r', 'w'
+    uint8_t ownerPerm;      // creates only, as are owner and othersPerm
+    uint8_t othersPerm;
+    uint8_t pad;
+    int32_t inumber;        // the primary's i-node
+    int32_t dir;            // the primary's directory the name is in (ROOT_DIRECTORY for the root)
+    int32_t targetDir;      // renames: the one it moves to
+    uint32_t owner;
+    uint16_t nameLen;
+    uint16_t argLen;
+} replog_entry;
+
+/*
+    Writes what state holds into a new replica's log, one replog_emit at
+    a time. Runs with no mutation underway (see replog_enter).
+*/
+typedef void (*replog_snapshot)(void* state, void* replica);
+
+/* Applies an entry (whose name and arg are '\0'-terminated copies) to state */
+typedef void (*replog_apply)(replog_entry* entry, char* name, char* arg, void* state);
+
+// Whether there's a log socket (replog_listen), i.e. mutations must be appended
+extern bool shipping;
+
+/*
+    Starts taking replicas on a unix socket at path. In case of error,
+    the program automatically exits.
+*/
+void replog_listen(char* path, replog_snapshot snapshot, void* state);
+
+/* Stops taking replicas and lets go of the ones there are */
+void replog_close(void);
+
+/* Adds an entry to a new replica's log (from a replog_snapshot) */
+void replog_emit(void* replica, replog_entry* entry, char* name, char* arg);
+
+/*
+    Mutations run between these two, so snapshots can be taken with none
+    underway. Nothing happens unless shipping.
+*/
+void replog_enter(void);
+void replog_leave(void);
+
+/*
+    Appends an entry for every replica, with the log locked: whoever makes
+    a change takes the lock while it still holds whatever orders the change
+    against others to the same names, and appends it before letting go.
+*/
+void replog_lock(void);
+void replog_unlock(void);
+void replog_append(replog_entry* entry, char* name, char* arg);
+
+/* Where the log is at, how many replicas follow it, and how far behind the slowest is */
+void replog_stats(uint64_t* seq, int* replicas, uint64_t* maxLag);
+
+/*
+    Follows the log of the primary at path, applying its entries to state
+    as they come. In case of error, the program automatically exits.
+*/
+void replog_follow(char* path, replog_apply apply, void* state);
+
+/* Stops following (once the entry being applied, if any, is done) */
+void replog_unfollow(void);
+
+/* How far this replica applied its primary's log */
+uint64_t replog_applied(void);
+
+#endif /* TECNICOFS_REPLOG_H */
@@ -11,15 +11,40 @@
 #include "socket.h"
 
 #include <errno.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 
-socket_t newSocket(char* socketPath) {
+#define MAX_TOKEN_SIZE 256
+
+typedef struct {
+    char token[MAX_TOKEN_SIZE];
+    uid_t uid;
+} token_entry;
+
+// Sessions are numbered in the order they are accepted
+static int nextSessionId = 0;
+
+// Who TCP clients may be (see tokensLoad), loaded once before accepting any
+static token_entry* tokens = NULL;
+static int numTokens = 0;
+
+// Busy-polling budget (ns) and spinning slots left (see pollingSetup)
+static uint64_t pollBudget = 0;
+static int pollSlots = 0;
+static unsigned long pollHits = 0;
+static unsigned long pollMisses = 0;
+
+socket_t newSocket(char* socketPath, int backlog) {
     socket_t sock;
     sockaddr* server = malloc(sizeof(sockaddr));
     fdesc socketfd;
@@ -35,13 +60,53 @@ socket_t newSocket(char* socketPath) {
 
     errWrap(bind(socketfd, (struct sockaddr *)server, sizeof(*server)) < 0, "Unable to bind socket to local address!");
     sock.socket = socketfd;
+    sock.tcp = false;
+    sock.sessionId = -1;
     sock.userId = -1;
     sock.procId = -1;
     sock.thread = NULL;
     sock.server = server;
     sock.client = NULL;
 
-    errWrap(listen(socketfd, MAX_PENDING_CALL_QUEUE), "Unable to listen to clients!");
+    errWrap(listen(socketfd, backlog), "Unable to listen to clients!");
+    return sock;
+}
+
+socket_t newTcpSocket(char* address, int backlog) {
+    socket_t sock;
+    char host[256];
+    char* port = strrchr(address, ':');
+    if (port) {
+        snprintf(host, sizeof(host), "%.*s", (int)(port - address), address);
+        port++;
+    } else {
+        port = address;
+    }
+
+    struct addrinfo hints, *found;
+    memset(&hints, '\0', sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    errWrap(getaddrinfo(address == port ? NULL : host, port, &hints, &found), "Unable to resolve the TCP address!");
+
+    fdesc socketfd;
+    errWrap((socketfd = socket(found -> ai_family, SOCK_STREAM, 0)) < 0, "Unable to create socket!");
+    int on = 1;
+    errWrap(setsockopt(socketfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0, "Unable to reuse the TCP address!");
+    errWrap(bind(socketfd, found -> ai_addr, found -> ai_addrlen) < 0, "Unable to bind socket to the TCP address!");
+    freeaddrinfo(found);
+
+    sock.socket = socketfd;
+    sock.tcp = true;
+    sock.sessionId = -1;
+    sock.userId = -1;
+    sock.procId = -1;
+    sock.thread = NULL;
+    sock.server = NULL;
+    sock.client = NULL;
+
+    errWrap(listen(socketfd, backlog), "Unable to listen to clients!");
     return sock;
 }
 
@@ -56,6 +121,7 @@ socket_t acceptConnectionFrom(socket_t sock, bool* acceptCondition) {
     if (!*acceptCondition) {
         free(newclient);
         fork.socket = -1;
+        fork.sessionId = -1;
         fork.thread = NULL;
         fork.client = NULL;
         fork.server = NULL;
@@ -64,10 +130,22 @@ socket_t acceptConnectionFrom(socket_t sock, bool* acceptCondition) {
         return fork;
     }
     fork.socket = fork_fd;
+    fork.tcp = sock.tcp;
+    fork.sessionId = nextSessionId++;
     fork.thread = malloc(sizeof(pthread_t));
     fork.client = newclient; // Fork will inherit the client information
     fork.server = NULL;
 
+    if (sock.tcp) {
+        // Requests are small and answered one by one, don't hold them back
+        int on = 1;
+        errWrap(setsockopt(fork_fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0, "Unable to set TCP_NODELAY!");
+        // Nobody until the client hands over its token
+        fork.procId = -1;
+        fork.userId = -1;
+        return fork;
+    }
+
     struct ucred user;
     socklen_t usersize = sizeof(struct ucred);
     errWrap(getsockopt(fork_fd, SOL_SOCKET, SO_PEERCRED, &user, &usersize), "Failed to get user id!");
@@ -76,3 +154,151 @@ socket_t acceptConnectionFrom(socket_t sock, bool* acceptCondition) {
 
     return fork;
 }
+
+int tokensLoad(char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char token[MAX_TOKEN_SIZE];
+    unsigned long uid;
+    while (fscanf(file, "%255s %lu", token, &uid) == 2) {
+        tokens = realloc(tokens, sizeof(token_entry) * (numTokens + 1));
+        errWrap(!tokens, "Unable to allocate the tokens!");
+        strcpy(tokens[numTokens].token, token);
+        tokens[numTokens++].uid = (uid_t)uid;
+    }
+    fclose(file);
+    return numTokens;
+}
+
+/* Compares every byte, so how long it takes doesn't tell how much of the token was right */
+static bool sameToken(char* known, char* given) {
+    size_t len = strlen(given);
+    if (len >= MAX_TOKEN_SIZE) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i <= len; i++) {
+        diff |= (unsigned char)known[i] ^ (unsigned char)given[i];
+    }
+    return !diff;
+}
+
+bool tokenUser(char* token, uid_t* uid) {
+    for (int i = 0; i < numTokens; i++) {
+        if (sameToken(tokens[i].token, token)) {
+            *uid = tokens[i].uid;
+            return true;
+        }
+    }
+    return false;
+}
+
+void readerInit(request_reader* reader, fdesc socket) {
+    reader -> socket = socket;
+    reader -> ring = NULL;
+    reader -> start = 0;
+    reader -> end = 0;
+}
+
+ssize_t readerNext(request_reader* reader, char** request) {
+    for (;;) {
+        char* from = reader -> data + reader -> start;
+        char* terminator = memchr(from, '\0', reader -> end - reader -> start);
+        if (terminator) {
+            reader -> start = terminator - reader -> data + 1;
+            *request = from;
+            return terminator - from;
+        }
+
+        // Move the partial request to the front to make room for the rest
+        if (reader -> start) {
+            memmove(reader -> data, from, reader -> end - reader -> start);
+            reader -> end -= reader -> start;
+            reader -> start = 0;
+        }
+        if (reader -> end == REQUEST_BUFFER_SIZE - 1) {
+            // No terminator in sight, hand over what we have
+            reader -> data[reader -> end] = '\0';
+            reader -> start = reader -> end = 0;
+            *request = reader -> data;
+            return REQUEST_BUFFER_SIZE - 1;
+        }
+
+        // Spin for a while first, if allowed, so the thread isn't put to sleep in between
+        char* to = reader -> data + reader -> end;
+        size_t room = REQUEST_BUFFER_SIZE - 1 - reader -> end;
+        ssize_t got = -1;
+        bool waiting = true;
+        uint64_t deadline;
+        if (pollBegin(&deadline)) {
+            do {
+                if (reader -> ring) {
+                    waiting = !shm_pending(reader -> ring);
+                } else {
+                    got = recv(reader -> socket, to, room, MSG_DONTWAIT);
+                    waiting = got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                }
+            } while (waiting && pollContinue(deadline));
+            pollEnd(!waiting);
+        }
+        if (reader -> ring) {
+            got = shm_read(reader -> ring, to, room, reader -> socket);
+        } else if (waiting) {
+            got = read(reader -> socket, to, room);
+        }
+        if (got <= 0) {
+            return got;
+        }
+        reader -> end += got;
+    }
+}
+
+bool readerPending(request_reader* reader) {
+    char next;
+    if (reader -> start < reader -> end) {
+        return true;
+    }
+    return reader -> ring ? shm_pending(reader -> ring) :
+        recv(reader -> socket, &next, 1, MSG_PEEK | MSG_DONTWAIT) > 0;
+}
+
+static uint64_t nowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void pollingSetup(int budget, int maxPollers) {
+    pollBudget = budget > 0 ? (uint64_t)budget * 1000 : 0;
+    pollSlots = maxPollers > 0 ? maxPollers : 0;
+}
+
+bool pollBegin(uint64_t* deadline) {
+    if (!pollBudget) {
+        return false;
+    }
+    int slots = __atomic_load_n(&pollSlots, __ATOMIC_RELAXED);
+    do {
+        if (slots <= 0) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&pollSlots, &slots, slots - 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    *deadline = nowNs() + pollBudget;
+    return true;
+}
+
+bool pollContinue(uint64_t deadline) {
+    return nowNs() < deadline;
+}
+
+void pollEnd(bool hit) {
+    __atomic_fetch_add(&pollSlots, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(hit ? &pollHits : &pollMisses, 1, __ATOMIC_RELAXED);
+}
+
+void pollStats(unsigned long* hits, unsigned long* misses) {
+    *hits = __atomic_load_n(&pollHits, __ATOMIC_RELAXED);
+    *misses = __atomic_load_n(&pollMisses, __ATOMIC_RELAXED);
+}
@@ -7,11 +7,15 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
+#include "tecnicofs-shm.h"
+
 #ifndef TECNICOFS_SOCKET_H
 #define TECNICOFS_SOCKET_H
 #define MAX_PENDING_CALL_QUEUE 32
+#define REQUEST_BUFFER_SIZE 8192
 
 typedef int fdesc;
 
@@ -19,6 +23,8 @@ typedef struct sockaddr_un sockaddr;
 
 typedef struct {
     fdesc socket;
+    bool tcp;           // identity comes from a token (see tokenUser), not from the peer's credentials
+    int sessionId;
     uid_t userId;
     pid_t procId;
     pthread_t* thread;
@@ -26,16 +32,42 @@ typedef struct {
     sockaddr* client;
 } socket_t;
 
+/*
+    Splits the byte stream of a connection into requests. Clients may
+    pipeline several requests, each one terminated by a '\0', so a single
+    read() can carry more than one request (or only part of one).
+*/
+typedef struct {
+    fdesc socket;
+    shm_ring* ring;     // where the requests come from instead, once the session shares memory
+    size_t start;
+    size_t end;
+    char data[REQUEST_BUFFER_SIZE];
+} request_reader;
+
 /*
     Creates a new socket that is listening.
 
     char* socketPath: the path where to store the socket. It is suggested to be chosen in the /tmp directory.
+    int backlog: how many connections may wait to be accepted.
 
     Returns: a new socket_t struct
 
     In case of error, the program automatically exits.
 */
-socket_t newSocket(char*);
+socket_t newSocket(char*, int);
+
+/*
+    Creates a new TCP socket that is listening.
+
+    char* address: "host:port", or just "port" to listen on every interface.
+    int backlog: how many connections may wait to be accepted.
+
+    Returns: a new socket_t struct
+
+    In case of error, the program automatically exits.
+*/
+socket_t newTcpSocket(char*, int);
 
 /*
     Accepts and handles a new process connecting to the socket.
@@ -49,4 +81,63 @@ socket_t newSocket(char*);
 */
 socket_t acceptConnectionFrom(socket_t, bool*);
 
+/*
+    Loads the tokens TCP clients identify themselves with: one per line,
+    "token uid". Returns the number of tokens, -1 if the file can't be read.
+*/
+int tokensLoad(char*);
+
+/*
+    Finds the user a token belongs to.
+
+    Returns: true if the token is known (and its user in *uid).
+*/
+bool tokenUser(char*, uid_t*);
+
+/*
+    Prepares a request reader for the given connection.
+*/
+void readerInit(request_reader*, fdesc);
+
+/*
+    Gets the next request sent over the connection, reading from the
+    socket only when no complete request is buffered.
+
+    request_reader* reader: the connection's reader.
+    char** request: where to store a pointer to the request (valid until the next call).
+
+    Returns: the size of the request; 0 if the client hung up; -1 on error.
+    Requests too large for the buffer are cut short.
+*/
+ssize_t readerNext(request_reader*, char**);
+
+/*
+    Whether (part of) the next request has already arrived, either in
+    the reader's buffer or in the socket's.
+*/
+bool readerPending(request_reader*);
+
+/*
+    Busy-polling: a thread that would block waiting for work may spin
+    for it instead (readerNext spins on non-blocking recv()s), for up to
+    budget microseconds, as long as fewer than maxPollers threads are
+    spinning already. A budget of 0 (the default) turns it off.
+*/
+void pollingSetup(int budget, int maxPollers);
+
+/*
+    Claims a spinning slot, and sets deadline to when the spinning ends.
+
+    Returns: false if there's no budget, or no slot left (block instead).
+*/
+bool pollBegin(uint64_t* deadline);
+
+/* Whether there's time left to spin, until deadline */
+bool pollContinue(uint64_t deadline);
+
+/* Gives the slot back; hit tells whether work showed up while spinning */
+void pollEnd(bool hit);
+
+void pollStats(unsigned long* hits, unsigned long* misses);
+
 #endif
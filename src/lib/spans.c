@@ -0,0 +1,202 @@
+/*
+
+    File: spans.c
+    Description: Implements the per-request span tracer.
+
+    Each thread owns a ring of events and is its only writer. The ring
+    head is published with release semantics, so the dumper can copy the
+    ring without stopping anyone and then drop whatever was overwritten
+    while it was copying. Rings of finished threads are recycled.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "err.h"
+#include "spans.h"
+
+typedef struct {
+    uint64_t begin;
+    uint64_t end;
+    uint32_t request;
+    int32_t session;
+    uint32_t stage;
+} span_event;
+
+typedef struct span_ring {
+    struct span_ring* next;
+    int id;
+    bool inUse;
+    uint64_t head;
+    span_event events[SPAN_RING_SIZE];
+} span_ring;
+
+int spanSampling = 0;
+char* spanDumpPath = "tecnicofs-trace.json";
+__thread bool spanActive = false;
+
+static span_ring* rings = NULL;
+static int numRings = 0;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static pthread_once_t ringKeyOnce = PTHREAD_ONCE_INIT;
+
+static __thread span_ring* myRing = NULL;
+static __thread uint32_t requestCounter = 0;
+static __thread uint32_t requestId = 0;
+static __thread int32_t requestSession = -1;
+static __thread uint64_t requestBegin = 0;
+
+static const char* stageNames[SPAN_NUM_STAGES] = {
+    "request", "parse", "bucket lock wait", "lookup", "fs update", "inode", "reply"
+};
+
+uint64_t span_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void ring_release(void* ring) {
+    pthread_mutex_lock(&ringsLock);
+    ((span_ring*)ring) -> inUse = false;
+    pthread_mutex_unlock(&ringsLock);
+}
+
+static void ring_key_init() {
+    errWrap(pthread_key_create(&ringKey, ring_release), "Unable to create the span ring key!");
+}
+
+/*
+    Hands a ring to the calling thread, reusing the ring of a finished
+    thread when there is one. Only happens once per thread.
+*/
+static span_ring* ring_acquire() {
+    pthread_once(&ringKeyOnce, ring_key_init);
+    pthread_mutex_lock(&ringsLock);
+
+    span_ring* ring = rings;
+    while (ring && ring -> inUse) {
+        ring = ring -> next;
+    }
+    if (!ring) {
+        errWrap((ring = malloc(sizeof(span_ring))) == NULL, "Unable to allocate a span ring!");
+        ring -> id = numRings++;
+        ring -> head = 0;
+        ring -> next = rings;
+        rings = ring;
+    }
+    ring -> inUse = true;
+
+    pthread_mutex_unlock(&ringsLock);
+    pthread_setspecific(ringKey, ring);
+    return ring;
+}
+
+void span_emit(span_stage stage, uint64_t begin, uint64_t end) {
+    if (!myRing) {
+        myRing = ring_acquire();
+    }
+    uint64_t head = myRing -> head;
+    span_event* event = myRing -> events + (head % SPAN_RING_SIZE);
+    event -> begin = begin;
+    event -> end = end;
+    event -> request = requestId;
+    event -> session = requestSession;
+    event -> stage = stage;
+    __atomic_store_n(&myRing -> head, head + 1, __ATOMIC_RELEASE);
+}
+
+void span_request_begin(int session) {
+    int sampling = __atomic_load_n(&spanSampling, __ATOMIC_RELAXED);
+    spanActive = sampling > 0 && (requestCounter++ % (uint32_t)sampling) == 0;
+    if (spanActive) {
+        requestId++;
+        requestSession = session;
+        requestBegin = span_clock();
+    }
+}
+
+void span_request_end() {
+    if (spanActive) {
+        span_emit(SPAN_REQUEST, requestBegin, span_clock());
+        spanActive = false;
+    }
+}
+
+span_context span_request_detach() {
+    span_context context = { spanActive, requestId, requestSession, requestBegin };
+    spanActive = false;
+    return context;
+}
+
+void span_request_attach(span_context context) {
+    spanActive = context.active;
+    if (spanActive) {
+        requestId = context.request;
+        requestSession = context.session;
+        requestBegin = context.begin;
+    }
+}
+
+int span_dump(char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        return -1;
+    }
+
+    span_event* copy = malloc(sizeof(span_event) * SPAN_RING_SIZE);
+    if (!copy) {
+        fclose(out);
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+
+    // Rings are never freed, so walking the list outside the lock is fine
+    // as long as we pick up its head under it.
+    pthread_mutex_lock(&ringsLock);
+    span_ring* ring = rings;
+    pthread_mutex_unlock(&ringsLock);
+
+    for (; ring; ring = ring -> next) {
+        uint64_t head = __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE);
+        uint64_t start = head > SPAN_RING_SIZE ? head - SPAN_RING_SIZE : 0;
+        memcpy(copy, ring -> events, sizeof(span_event) * SPAN_RING_SIZE);
+
+        // Anything the owner wrote meanwhile may have clobbered our copy
+        uint64_t after = __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE);
+        if (after > SPAN_RING_SIZE && after - SPAN_RING_SIZE > start) {
+            start = after - SPAN_RING_SIZE;
+        }
+
+        for (uint64_t i = start; i < head; i++) {
+            span_event* event = copy + (i % SPAN_RING_SIZE);
+            if (event -> stage >= SPAN_NUM_STAGES) {
+                continue;
+            }
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"tecnicofs\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"session\":%d,\"request\":%u}}",
+                first ? "" : ",\n",
+                stageNames[event -> stage],
+                ring -> id,
+                (double)event -> begin / 1000.0,
+                (double)(event -> end - event -> begin) / 1000.0,
+                event -> session,
+                event -> request
+            );
+            first = false;
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    free(copy);
+    return fclose(out) ? -1 : 0;
+}
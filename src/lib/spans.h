@@ -0,0 +1,94 @@
+/*
+
+    File: spans.h
+    Description: Describes the per-request span tracer.
+
+    Sampled requests get timestamped spans around each stage of their
+    handling (parse, bucket lock wait, lookup, i-node operations and
+    reply), from the moment they have been read. Spans go into per-thread rings and can be
+    dumped as Chrome trace-event JSON (viewable in Perfetto).
+
+    When a request isn't sampled, every SPAN() costs a single branch on
+    a thread-local flag.
+
+*/
+
+#ifndef TECNICOFS_SPANS_H
+#define TECNICOFS_SPANS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Events kept per thread; older ones are overwritten
+#define SPAN_RING_SIZE 4096
+
+typedef enum {
+    SPAN_REQUEST,
+    SPAN_PARSE,
+    SPAN_LOCK_WAIT,
+    SPAN_LOOKUP,
+    SPAN_FS_UPDATE,
+    SPAN_INODE,
+    SPAN_REPLY,
+    SPAN_NUM_STAGES
+} span_stage;
+
+// Trace one in every spanSampling requests (0 disables tracing)
+extern int spanSampling;
+
+// Where span_dump() output goes when triggered by a signal or command
+extern char* spanDumpPath;
+
+// Whether the request currently handled by this thread is sampled
+extern __thread bool spanActive;
+
+uint64_t span_clock();
+void span_emit(span_stage stage, uint64_t begin, uint64_t end);
+
+/*
+    Decides whether the request the calling thread just read is sampled,
+    and if so starts its clock: called once it's read, so neither the
+    idle time between requests nor the wait for a request already
+    buffered is attributed to it. session identifies it in the dump.
+*/
+void span_request_begin(int session);
+
+void span_request_end();
+
+/*
+    The sampling state of a request, so it can be handed over to the
+    thread that finishes handling it.
+*/
+typedef struct {
+    bool active;
+    uint32_t request;
+    int32_t session;
+    uint64_t begin;
+} span_context;
+
+// Takes the current request away from the calling thread
+span_context span_request_detach();
+
+// Makes the calling thread carry on with a detached request
+void span_request_attach(span_context context);
+
+/*
+    Writes every span still in the rings to the given file, as Chrome
+    trace-event JSON. Returns 0 on success, -1 otherwise.
+*/
+int span_dump(char* path);
+
+static inline uint64_t span_begin() {
+    return spanActive ? span_clock() : 0;
+}
+
+static inline void span_end(span_stage stage, uint64_t begin) {
+    if (spanActive) {
+        span_emit(stage, begin, span_clock());
+    }
+}
+
+// Runs the statement and, if the request is sampled, records it as a span
+#define SPAN(STAGE, STMT) do { uint64_t _spanBegin = span_begin(); STMT; span_end(STAGE, _spanBegin); } while (0)
+
+#endif
@@ -0,0 +1,49 @@
+/*
+
+    File: spsc.c
+    Description: Single-producer, single-consumer rings of pointers.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "err.h"
+#include "spsc.h"
+
+void spsc_init(spsc_ring* ring, unsigned int capacity) {
+    ring -> head = 0;
+    ring -> tail = 0;
+    ring -> mask = capacity - 1;
+    ring -> items = malloc(sizeof(void*) * capacity);
+    errWrap(!ring -> items, "Unable to allocate a ring!");
+}
+
+void spsc_destroy(spsc_ring* ring) {
+    free(ring -> items);
+}
+
+bool spsc_push(spsc_ring* ring, void* item) {
+    unsigned int tail = ring -> tail;
+    if (tail - __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE) > ring -> mask) {
+        return false;
+    }
+    ring -> items[tail & ring -> mask] = item;
+    __atomic_store_n(&ring -> tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void* spsc_pop(spsc_ring* ring) {
+    unsigned int head = ring -> head;
+    if (head == __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    void* item = ring -> items[head & ring -> mask];
+    __atomic_store_n(&ring -> head, head + 1, __ATOMIC_RELEASE);
+    return item;
+}
+
+bool spsc_empty(spsc_ring* ring) {
+    return __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE) == __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,36 @@
+/*
+
+    File: spsc.h
+    Description: Single-producer, single-consumer rings of pointers.
+
+    Exactly one thread pushes and exactly one thread pops, so neither side
+    takes a lock: each owns its own index (on a cache line of its own) and
+    only reads the other's.
+
+*/
+
+#ifndef TECNICOFS_SPSC_H
+#define TECNICOFS_SPSC_H
+
+#include <stdbool.h>
+
+typedef struct {
+    unsigned int head __attribute__((aligned(64)));  // next to pop, the consumer's
+    unsigned int tail __attribute__((aligned(64)));  // next to push, the producer's
+    unsigned int mask;
+    void** items;
+} spsc_ring;
+
+/* capacity must be a power of two */
+void spsc_init(spsc_ring* ring, unsigned int capacity);
+void spsc_destroy(spsc_ring* ring);
+
+/* Returns false if the ring is full */
+bool spsc_push(spsc_ring* ring, void* item);
+
+/* Returns NULL if the ring is empty */
+void* spsc_pop(spsc_ring* ring);
+
+bool spsc_empty(spsc_ring* ring);
+
+#endif /* TECNICOFS_SPSC_H */
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <wait.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 
@@ -32,11 +33,17 @@
 #include <sys/un.h>
 
 #include "lib/color.h"
+#include "lib/ebr.h"
 #include "lib/err.h"
 #include "lib/memutils.h"
 #include "lib/inodes.h"
 #include "lib/locks.h"
+#include "lib/log.h"
+#include "lib/numa.h"
+#include "lib/record.h"
+#include "lib/replog.h"
 #include "lib/socket.h"
+#include "lib/spans.h"
 #include "lib/tecnicofs-api-constants.h"
 
 #include "cmd.h"
@@ -44,37 +51,195 @@
 
 bool acceptingNewConnections = true;
 char* socketname;
+char* outputname;
+char* traceFile = NULL;
 socket_t currentsocket;
+socket_t tcpsocket;
 RootNode* connections;
 
 int numberBuckets = 0;
 tecnicofs fs;
 
+// Free every node and inode on the way out (for leak checkers)
+static bool fullTeardown = false;
+
+// What -A pins the threads to
+static cpu_set_t cpus;
+
+// The optional TCP listener, the tokens its clients identify with, and how many may queue up
+static char* tcpAddress = NULL;
+static char* tokenFile = NULL;
+static int backlog = MAX_PENDING_CALL_QUEUE;
+
+// Busy-polling budget (us) and how many threads may spin at once (-1 = half the CPUs)
+static int pollBudget = 0;
+static int maxPollers = -1;
+
+// Where replicas follow this server's log, and the log of the primary it follows (a replica)
+static char* logSocket = NULL;
+static char* primaryLog = NULL;
+
+// How long file contents must be to be stored compressed (0 keeps them raw)
+static int compressAbove = 0;
+
+static void usage(char* name) {
+    fprintf(stderr, red_bold("Invalid format!\n"));
+    fprintf(stderr, red("Usage: %s [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] [%s] %s %s %s\n"),
+        name,
+        "-L debug|info|warn|error",
+        "-R trace_file",
+        "-S span_sampling",
+        "-J span_dump_file",
+        "-W workers_per_session",
+        "-E lease_ms",
+        "-F filter_counters_per_name",
+        "-C compress_min_bytes",
+        "-P shards",
+        "-A cpu_list",
+        "-B poll_us",
+        "-Q max_pollers",
+        "-T [host:]port",
+        "-K token_file",
+        "-G backlog",
+        "-M",
+        "-X log_socket",
+        "-Y primary_log_socket",
+        "-V",
+        "socket_name",
+        "output_file[.txt]",
+        "num_buckets"
+    );
+    exit(EXIT_FAILURE);
+}
+
+static double elapsedMs(struct timeval* from, struct timeval* to) {
+    return (double)(to -> tv_sec - from -> tv_sec) * 1000.0 + (double)(to -> tv_usec - from -> tv_usec) / 1000.0;
+}
+
 static void parseArgs (int argc, char** const argv){
-    // For the nosync edition, we are allowing the two last arguments
-    // (num_threads and num_buckets) to be omitted, since they're redundant
-    if (argc != 4) {
-        fprintf(stderr, red_bold("Invalid format!\n"));
-        fprintf(stderr, red("Usage: %s %s %s %s\n"),
-            argv[0],
-            "socket_name",
-            "output_file[.txt]",
-            "num_buckets"
-        );
-        exit(EXIT_FAILURE);
+    int opt;
+    while ((opt = getopt(argc, argv, "L:R:S:J:W:E:F:C:P:A:B:Q:T:K:G:MX:Y:V")) != -1) {
+        switch (opt) {
+            case 'L': // Log level
+                if (!strcmp(optarg, "debug")) {
+                    logLevel = LOG_DEBUG;
+                } else if (!strcmp(optarg, "info")) {
+                    logLevel = LOG_INFO;
+                } else if (!strcmp(optarg, "warn")) {
+                    logLevel = LOG_WARN;
+                } else if (!strcmp(optarg, "error")) {
+                    logLevel = LOG_ERROR;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'R': // Record every request into a trace file
+                traceFile = optarg;
+                break;
+            case 'S': // Trace the stages of one in every N requests
+                spanSampling = atoi(optarg);
+                if (spanSampling < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'J': // Where to dump the request spans
+                spanDumpPath = optarg;
+                break;
+            case 'W': // Workers a session may use for its independent requests
+                sessionWorkers = atoi(optarg);
+                if (sessionWorkers < 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'P': // Threads that own the buckets (0 keeps the sessions on their own)
+                numShards = atoi(optarg);
+                if (numShards < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'A': // Which CPUs the sessions and shards may run on
+                if (numa_parse_cpus(optarg, &cpus) < 0) {
+                    usage(argv[0]);
+                }
+                threadCpus = &cpus;
+                break;
+            case 'B': // How long idle sessions and workers spin before they block
+                pollBudget = atoi(optarg);
+                if (pollBudget < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'Q': // How many of them may spin at once
+                maxPollers = atoi(optarg);
+                if (maxPollers < 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'T': // Also listen on TCP
+                tcpAddress = optarg;
+                break;
+            case 'K': // Who TCP clients may be
+                tokenFile = optarg;
+                break;
+            case 'G': // How many connections may wait to be accepted
+                backlog = atoi(optarg);
+                if (backlog < 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'E': // How long the name leases given to clients last
+                leaseDuration = atoi(optarg);
+                if (leaseDuration < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'F': // How large the name filters are (0 turns them off)
+                filterDensity = atoi(optarg);
+                if (filterDensity < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'C': // How long file contents must be to be compressed (0 keeps them raw)
+                compressAbove = atoi(optarg);
+                if (compressAbove < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'M': // Keep every session on its socket, even same-host ones
+                shareMemory = false;
+                break;
+            case 'X': // Ship the log of mutations to the replicas that connect here
+                logSocket = optarg;
+                break;
+            case 'Y': // Be a (read-only) replica of the primary whose log is here
+                primaryLog = optarg;
+                break;
+            case 'V': // Tear the file system down piece by piece before exiting
+                fullTeardown = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
 
+    // TCP clients have no peer credentials, they must bring a token
+    if (argc - optind != 3 || (tcpAddress && !tokenFile)) {
+        usage(argv[0]);
+    }
+    socketname = argv[optind];
+    outputname = argv[optind + 1];
+
     // Validates the number of buckets
-    numberBuckets = atoi(argv[3]);
+    numberBuckets = atoi(argv[optind + 2]);
     if (numberBuckets < 1) {
         fprintf(stderr, "%s\n%s %s\n",
             red_bold("Invalid number of buckets!"),
             red("Expected a positive integer, got"),
-            argv[4]
+            argv[optind + 2]
         );
         exit(EXIT_FAILURE);
     } else {
-        fprintf(stderr, green("Spawning %d buckets.\n\n"), numberBuckets);
+        fprintf(stderr, green("Spawning %d buckets (%s locks).\n\n"), numberBuckets, LOCK_NAME);
     }
 }
 
@@ -86,6 +251,46 @@ void closesocket(int signal) {
     acceptingNewConnections = false;
     errWrap(close(currentsocket.socket) < 0, "Unable to unlink socket!");
     errWrap(unlink(socketname) < 0, "Unable to unlink socket!");
+    if (tcpAddress) {
+        errWrap(close(tcpsocket.socket) < 0, "Unable to close the TCP socket!");
+    }
+}
+
+/*
+    Stops following the primary and starts taking mutations: the replica
+    is the primary now, with everything of the old one's log it applied.
+*/
+static void promote(void) {
+    if (!primaryLog || !__atomic_load_n(&readOnly, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    replog_unfollow();
+    __atomic_store_n(&readOnly, false, __ATOMIC_RELEASE);
+    log_event(LOG_INFO, "promoted", "applied=%lu", (unsigned long)replog_applied());
+    fprintf(stderr, green("Promoted to primary.\n"));
+}
+
+/*
+    Dumps the request spans whenever SIGUSR1 is received, and promotes a
+    replica on SIGUSR2. Both are blocked everywhere else, so they always
+    end up here.
+*/
+void* spandumper(void* arg) {
+    sigset_t* mask = arg;
+    int sig;
+    for (;;) {
+        if (sigwait(mask, &sig)) {
+            continue;
+        }
+        if (sig == SIGUSR2) {
+            promote();
+        } else if (span_dump(spanDumpPath) < 0) {
+            fprintf(stderr, red("Unable to dump the request spans to %s\n"), spanDumpPath);
+        } else {
+            fprintf(stderr, green("Request spans dumped to %s\n"), spanDumpPath);
+        }
+    }
+    return NULL;
 }
 
 void deletefork(void* forkptr) {
@@ -96,24 +301,39 @@ void deletefork(void* forkptr) {
     free(forkptr);
 }
 
-void deploy_threads(socket_t sock) {
+void deploy_threads(socket_t* socks, int numSocks) {
     signal(SIGINT, closesocket);
     signal(SIGTERM, closesocket);
 
+    pthread_attr_t sessionAttr;
+    pthread_attr_init(&sessionAttr);
+    if (threadCpus) {
+        pthread_attr_setaffinity_np(&sessionAttr, sizeof(cpu_set_t), threadCpus);
+    }
+
+    struct pollfd listeners[2];
+    for (int i = 0; i < numSocks; i++) {
+        listeners[i].fd = socks[i].socket;
+        listeners[i].events = POLLIN;
+    }
+
     socket_t fork;
     while (acceptingNewConnections)
     {
-        fork = acceptConnectionFrom(sock, &acceptingNewConnections);
+        // Interrupted (by the signals that stop us, most likely): look again
+        if (poll(listeners, numSocks, -1) <= 0) {
+            continue;
+        }
+        int ready = 0;
+        while (ready < numSocks - 1 && !(listeners[ready].revents & POLLIN)) {
+            ready++;
+        }
+        fork = acceptConnectionFrom(socks[ready], &acceptingNewConnections);
         if (!acceptingNewConnections) {
             continue;
         }
 
-        printf("Connected!\nConnection details:\n %s %d\n %s %d\n",
-            yellow_bold("> PID:"),
-            fork.procId,
-            yellow_bold("> UID:"),
-            fork.userId
-        );
+        log_event(LOG_INFO, "connected", "session=%d pid=%d uid=%d", fork.sessionId, fork.procId, fork.userId);
 
         void* forkptr = malloc(sizeof(socket_t) + sizeof(tecnicofs));
         memcpy(forkptr, &fork, sizeof(socket_t));
@@ -123,38 +343,138 @@ void deploy_threads(socket_t sock) {
             sizeof(tecnicofs)                                        // For how many bytes needed
         );
         appendToList(connections, forkptr);
-        pthread_create(((socket_t*)forkptr) -> thread, NULL, applyCommands, forkptr);
+        // The session's workers inherit its CPUs
+        pthread_create(((socket_t*)forkptr) -> thread, threadCpus ? &sessionAttr : NULL, applyCommands, forkptr);
     }
 
-    printf(yellow_bold("\nTermination signal caught - No more connections accepted.\n"));
+    log_event(LOG_INFO, "terminating", "reason=signal accepting=0");
     destroyLinkedList(connections, deletefork);
-    free(sock.server);
+    pthread_attr_destroy(&sessionAttr);
+    for (int i = 0; i < numSocks; i++) {
+        free(socks[i].server);
+    }
 }
 
 int main(int argc, char** argv) {
     parseArgs(argc, argv);
     FILE* out;
-    errWrap((out = fopen(argv[2], "w")) == NULL, "Unable to create/open output file!");
+    errWrap((out = fopen(outputname, "w")) == NULL, "Unable to create/open output file!");
+
+    // Blocked before any thread starts (the logger's included), so they all inherit it
+    static sigset_t dumpmask;
+    pthread_t dumper;
+    sigemptyset(&dumpmask);
+    sigaddset(&dumpmask, SIGUSR1);
+    sigaddset(&dumpmask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &dumpmask, NULL);
+
+    log_init();
+    if (traceFile) {
+        record_init(traceFile);
+    }
+    pthread_create(&dumper, NULL, spandumper, &dumpmask);
 
     inode_table_init();
+    inode_set_compression(compressAbove);
     connections = createLinkedList();
     // Deploy our socket
-    socketname = argv[1];
-    currentsocket = newSocket(socketname);
+    currentsocket = newSocket(socketname, backlog);
+    if (tcpAddress) {
+        errWrap(tokensLoad(tokenFile) < 0, "Unable to read the token file!");
+        tcpsocket = newTcpSocket(tcpAddress, backlog);
+        log_event(LOG_INFO, "listening", "tcp=%s", tcpAddress);
+    }
 
     struct timeval start, end;
 
     // This time getting approach was found on https://stackoverflow.com/a/10192994
+    numa_init();
+    if (maxPollers < 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        maxPollers = online > 1 ? online / 2 : 1;
+    }
+    pollingSetup(pollBudget, maxPollers);
     fs = new_tecnicofs(numberBuckets);
+    if (numShards > 0) {
+        start_shards(fs);
+    } else {
+        place_tecnicofs(fs, 0, NULL);
+    }
+    if (primaryLog) {
+        readOnly = true;
+        replog_follow(primaryLog, replica_apply, &fs);
+        log_event(LOG_INFO, "following", "log=%s", primaryLog);
+    }
+    if (logSocket) {
+        replog_listen(logSocket, replica_snapshot, &fs);
+        log_event(LOG_INFO, "shipping", "log=%s", logSocket);
+    }
 
     gettimeofday(&start, NULL);
-    deploy_threads(currentsocket);
+    socket_t listeners[] = { currentsocket, tcpsocket };
+    deploy_threads(listeners, tcpAddress ? 2 : 1);
+
+    // Nothing changes the file system anymore, and the replicas get all of it
+    replog_unfollow();
+    replog_close();
+    uint64_t logSeq, maxLag;
+    int replicas;
+    replog_stats(&logSeq, &replicas, &maxLag);
+    log_event(LOG_INFO, "replication", "seq=%lu replicas=%d max_lag=%lu applied=%lu read_only=%d",
+        (unsigned long)logSeq, replicas, (unsigned long)maxLag, (unsigned long)replog_applied(), readOnly);
 
+    struct timeval stopped, dumped, tornDown;
+    gettimeofday(&stopped, NULL);
     print_tecnicofs_tree(out, fs);
     fclose(out);
+    gettimeofday(&dumped, NULL);
+
+    // fp_rate: share of the names that weren't there the filter let through (n/a without filters)
+    filter_stats stats;
+    get_filter_stats(fs, &stats);
+    unsigned long misses = stats.rejected + stats.falsePositives;
+    char fpRate[16] = "n/a";
+    if (filterDensity > 0) {
+        snprintf(fpRate, sizeof(fpRate), "%.4f", misses ? (double)stats.falsePositives / (double)misses : 0.0);
+    }
+    log_event(LOG_INFO, "name_filter", "lookups=%lu rejected=%lu false_positives=%lu fp_rate=%s",
+        stats.lookups, stats.rejected, stats.falsePositives, fpRate);
+    unsigned long dentryHits, dentryMisses;
+    get_dentry_stats(fs, &dentryHits, &dentryMisses);
+    log_event(LOG_INFO, "dentry_cache", "hits=%lu misses=%lu", dentryHits, dentryMisses);
+    unsigned long retries, fallbacks, retired, released;
+    get_lookup_stats(&retries, &fallbacks);
+    ebr_stats(&retired, &released);
+    log_event(LOG_INFO, "lookups", "retries=%lu fallbacks=%lu retired=%lu released=%lu",
+        retries, fallbacks, retired, released);
+    unsigned long local, remote;
+    get_numa_stats(fs, &local, &remote);
+    unsigned long pollHits, pollMisses;
+    pollStats(&pollHits, &pollMisses);
+    log_event(LOG_INFO, "busy_poll", "budget_us=%d max_pollers=%d hits=%lu misses=%lu",
+        pollBudget, maxPollers, pollHits, pollMisses);
+    log_event(LOG_INFO, "numa", "nodes=%d local=%lu remote=%lu", numa_nodes(), local, remote);
+    // ratio: how many bytes of contents each stored byte holds
+    unsigned long rawBytes, storedBytes, compressedFiles;
+    inode_storage_stats(&rawBytes, &storedBytes, &compressedFiles);
+    log_event(LOG_INFO, "storage", "compress_min=%d raw_bytes=%lu stored_bytes=%lu compressed_files=%lu ratio=%.2f",
+        compressAbove, rawBytes, storedBytes, compressedFiles,
+        storedBytes ? (double)rawBytes / (double)storedBytes : 1.0);
+
+    /*
+        The process is about to exit and the kernel takes its memory back
+        in one go: walking every tree just to free it is wasted time.
+    */
+    if (fullTeardown) {
+        free_tecnicofs(fs);
+        inode_table_destroy();
+    }
+    gettimeofday(&tornDown, NULL);
 
-    free_tecnicofs(fs);
-    inode_table_destroy();
+    log_event(LOG_INFO, "shutdown", "dump_ms=%.1f teardown_ms=%.1f full_teardown=%d",
+        elapsedMs(&stopped, &dumped), elapsedMs(&dumped, &tornDown), fullTeardown);
+    record_close();
+    log_stop();
     gettimeofday(&end, NULL);
 
     double elapsed = (((double)(end.tv_usec - start.tv_usec)) / 1000000.0) + ((double)(end.tv_sec - start.tv_sec));
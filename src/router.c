@@ -0,0 +1,1201 @@
+/*
+
+    File: router.c
+    Description: Spreads the names of a TecnicoFS over several servers
+    (shards), standing in front of them as a server itself.
+
+    Names are placed by their first component on a consistent-hashing
+    ring (ROUTER_POINTS points per shard, hashed from its socket path),
+    so a directory and everything below it live on the same shard, and a
+    shard joining only takes over the names that land on its points.
+
+    Clients talk to the router as they would to a server. For each of
+    them the router mounts a session of its own on every shard it needs,
+    and tells the shard who the client is ('u'): the router must run as
+    the shards' user. File descriptors are the router's, each one mapped
+    to the shard (and the shard's fd) the file was opened on.
+
+    What spans shards is handled here: listing the root merges every
+    shard's names, renames across shards copy the tree over and delete
+    it (refused while any of it is open through the router), and
+    transactions must stay within one shard.
+
+    A shard joins online ('j'): the names whose place moved are marked
+    pending and keep being served by their old shard until the router
+    moves them over, one at a time, holding every request back meanwhile.
+
+    Usage: tecnicofs-router [-L level] socket_name shard_socket...
+
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "lib/color.h"
+#include "lib/err.h"
+#include "lib/hash.h"
+#include "lib/log.h"
+#include "lib/socket.h"
+#include "lib/tecnicofs-api-constants.h"
+
+#define NOMINAL_BUFFER_SIZE 1024
+#define ARG_FORMAT "%c %1023s %1023s"
+
+// Points each shard has on the ring
+#define ROUTER_POINTS 64
+
+#define MAX_SHARDS 16
+
+// Names asked for at a time, when walking a shard's directories
+#define ROUTER_LIST_BATCH 64
+
+// How long a join waits before retrying the names it couldn't move yet (ms)
+#define ROUTER_RETRY_MS 100
+
+typedef struct {
+    int position;
+    int shard;
+} ring_point;
+
+typedef struct {
+    int numPoints;
+    ring_point points[MAX_SHARDS * ROUTER_POINTS];
+} ring;
+
+typedef struct {
+    int shard;          // -1 if the slot is free
+    int fd;             // the shard's
+    char path[NOMINAL_BUFFER_SIZE];
+} routed_file;
+
+typedef struct client {
+    socket_t sock;
+    int upstreams[MAX_SHARDS];  // the client's sessions on the shards, -1 until it needs one
+    // Only changed with routing held for reading, so moves (holding it for writing) see them still
+    routed_file files[MAX_OPEN_FILES];
+    struct client* next;
+} client;
+
+typedef struct {
+    char token;
+    int numTokens;
+    bool tagged;
+    int id;
+    char arg1[NOMINAL_BUFFER_SIZE];
+    char arg2[NOMINAL_BUFFER_SIZE];
+    char* body;         // the whole request, without its tag
+} routed_request;
+
+// Names as they come out of a listing
+typedef struct {
+    char** names;
+    int count;
+    int capacity;
+} name_list;
+
+static bool accepting = true;
+static char* socketName;
+static socket_t listener;
+
+/*
+    Where names go, guarded by routing: requests hold it for reading
+    while they're forwarded, moving names holds it for writing.
+*/
+static pthread_rwlock_t routing = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static char* shardPaths[MAX_SHARDS];
+static int numShards = 0;
+static ring* current;
+static ring* previous = NULL;   // the ring before the shard joining, if any
+static int joining = -1;
+static char** pending = NULL;   // sorted, the names still on their old shard
+static int numPending = 0;
+
+// One join at a time
+static pthread_mutex_t joins = PTHREAD_MUTEX_INITIALIZER;
+
+// The router's own sessions on the shards, for moving names (routing held for writing)
+static int admins[MAX_SHARDS];
+
+// Every client, so moves can tell whether what they'd take away is open
+static client* clients = NULL;
+static int numClients = 0;
+static pthread_mutex_t clientsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clientGone = PTHREAD_COND_INITIALIZER;
+
+static unsigned long forwarded = 0;
+static unsigned long fannedOut = 0;
+static unsigned long renamesAcross = 0;
+static unsigned long namesMoved = 0;
+
+static void usage(char* name) {
+    fprintf(stderr, red_bold("Invalid format!\n"));
+    fprintf(stderr, red("Usage: %s [%s] %s %s...\n"),
+        name,
+        "-L debug|info|warn|error",
+        "socket_name",
+        "shard_socket"
+    );
+    exit(EXIT_FAILURE);
+}
+
+static void parseArgs(int argc, char** const argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "L:")) != -1) {
+        switch (opt) {
+            case 'L': // Log level
+                if (!strcmp(optarg, "debug")) {
+                    logLevel = LOG_DEBUG;
+                } else if (!strcmp(optarg, "info")) {
+                    logLevel = LOG_INFO;
+                } else if (!strcmp(optarg, "warn")) {
+                    logLevel = LOG_WARN;
+                } else if (!strcmp(optarg, "error")) {
+                    logLevel = LOG_ERROR;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (argc - optind < 2 || argc - optind - 1 > MAX_SHARDS) {
+        usage(argv[0]);
+    }
+    socketName = argv[optind];
+    for (int i = optind + 1; i < argc; i++) {
+        shardPaths[numShards++] = argv[i];
+    }
+}
+
+static void stopAccepting(int signal) {
+    if (!accepting) {
+        return;
+    }
+    accepting = false;
+    errWrap(close(listener.socket) < 0, "Unable to close the socket!");
+    errWrap(unlink(socketName) < 0, "Unable to unlink socket!");
+}
+
+/* Ring */
+
+/*
+    Where a string lands on the ring. hash() alone keeps strings that only
+    differ at the end (f01, f02..., or a shard's points) close together:
+    its value is mixed again (murmur3's finalizer) to spread them out.
+*/
+static int position(char* s) {
+    unsigned int h = (unsigned int) hash(s, INT_MAX);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return (int) (h & INT_MAX);
+}
+
+static int comparePoints(const void* a, const void* b) {
+    const ring_point* x = a;
+    const ring_point* y = b;
+    if (x -> position != y -> position) {
+        return x -> position < y -> position ? -1 : 1;
+    }
+    return x -> shard - y -> shard;
+}
+
+static ring* buildRing(int shards) {
+    ring* r = malloc(sizeof(ring));
+    errWrap(!r, "Unable to allocate the ring!");
+    char point[sizeof(((sockaddr*)NULL) -> sun_path) + 16];
+    r -> numPoints = 0;
+    for (int shard = 0; shard < shards; shard++) {
+        for (int i = 0; i < ROUTER_POINTS; i++) {
+            snprintf(point, sizeof(point), "%s#%d", shardPaths[shard], i);
+            r -> points[r -> numPoints].position = position(point);
+            r -> points[r -> numPoints++].shard = shard;
+        }
+    }
+    qsort(r -> points, r -> numPoints, sizeof(ring_point), comparePoints);
+    return r;
+}
+
+/* The shard of the first point at or after the name's */
+static int ownerIn(ring* r, char* root) {
+    int at = position(root);
+    int low = 0;
+    int high = r -> numPoints;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (r -> points[middle].position < at) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return r -> points[low == r -> numPoints ? 0 : low].shard;
+}
+
+/* Copies the first component of the path (what places it) into root */
+static void rootOf(char* path, char* root) {
+    while (*path == '/') {
+        path++;
+    }
+    size_t len = strcspn(path, "/");
+    if (len >= NOMINAL_BUFFER_SIZE) {
+        len = NOMINAL_BUFFER_SIZE - 1;
+    }
+    memcpy(root, path, len);
+    root[len] = '\0';
+}
+
+static int compareNames(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static bool isPending(char* root) {
+    return numPending && bsearch(&root, pending, numPending, sizeof(char*), compareNames);
+}
+
+/* The shard a path is on (routing held) */
+static int route(char* path) {
+    char root[NOMINAL_BUFFER_SIZE];
+    rootOf(path, root);
+    int shard = ownerIn(current, root);
+    if (shard == joining && isPending(root)) {
+        shard = ownerIn(previous, root);
+    }
+    return shard;
+}
+
+/* Talking to the shards (untagged requests, one at a time) */
+
+static int sendAll(int socket, void* data, size_t size) {
+    char* from = data;
+    while (size) {
+        ssize_t sent = send(socket, from, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent <= 0) {
+            return -1;
+        }
+        from += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+static int readFully(int socket, void* buffer, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t r = read(socket, (char*)buffer + got, len - got);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r <= 0) {
+            return -1;
+        }
+        got += r;
+    }
+    return 0;
+}
+
+/*
+    Sends a request and reads the status of its reply (whatever follows
+    it is the caller's to read).
+
+    Returns: the status, TECNICOFS_ERROR_CONNECTION_ERROR if the shard is gone.
+*/
+static int call(int socket, char* request) {
+    int status;
+    if (sendAll(socket, request, strlen(request) + 1) || readFully(socket, &status, sizeof(status))) {
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    return status;
+}
+
+/*
+    Mounts a session on a shard, acting for user (or as the router
+    itself, if it's the router's).
+
+    Returns: the connected socket, -1 if the shard can't be reached or
+    won't let the router act for others.
+*/
+static int connectShard(int shard, uid_t user) {
+    sockaddr server;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    memset(&server, '\0', sizeof(server));
+    server.sun_family = AF_UNIX;
+    strncpy(server.sun_path, shardPaths[shard], sizeof(server.sun_path) - 1);
+
+    char delegate[32];
+    snprintf(delegate, sizeof(delegate), "u %u", (unsigned int)user);
+    if (connect(sock, (struct sockaddr*)&server, sizeof(server)) || call(sock, delegate) != TECNICOFS_OK) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static int adminOf(int shard) {
+    if (admins[shard] < 0) {
+        admins[shard] = connectShard(shard, getuid());
+    }
+    return admins[shard];
+}
+
+/*
+    Calls on the router's own session on a shard, acting for user (routing
+    held for writing, so nothing else uses it).
+*/
+static int adminCall(int shard, uid_t user, char* request) {
+    char delegate[32];
+    snprintf(delegate, sizeof(delegate), "u %u", (unsigned int)user);
+    int sock = adminOf(shard);
+    int status = sock < 0 ? TECNICOFS_ERROR_CONNECTION_ERROR : call(sock, delegate);
+    if (status == TECNICOFS_OK) {
+        status = call(sock, request);
+    }
+    if (status == TECNICOFS_ERROR_CONNECTION_ERROR && sock >= 0) {
+        close(sock);
+        admins[shard] = -1;
+    }
+    return status;
+}
+
+static int upstreamOf(client* c, int shard) {
+    if (c -> upstreams[shard] < 0) {
+        c -> upstreams[shard] = connectShard(shard, c -> sock.userId);
+    }
+    return c -> upstreams[shard];
+}
+
+/* The shard is gone for the client: so are the files it had open there */
+static void dropUpstream(client* c, int shard) {
+    if (c -> upstreams[shard] >= 0) {
+        close(c -> upstreams[shard]);
+        c -> upstreams[shard] = -1;
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (c -> files[i].shard == shard) {
+            c -> files[i].shard = -1;
+        }
+    }
+}
+
+/*
+    Forwards a request on the client's session on a shard.
+
+    Returns: the status of the reply (whatever follows it is still on
+    c -> upstreams[shard]), TECNICOFS_ERROR_CONNECTION_ERROR if the shard
+    is gone.
+*/
+static int forward(client* c, int shard, char* request) {
+    int sock = upstreamOf(c, shard);
+    int status = sock < 0 ? TECNICOFS_ERROR_CONNECTION_ERROR : call(sock, request);
+    if (status == TECNICOFS_ERROR_CONNECTION_ERROR) {
+        dropUpstream(c, shard);
+    }
+    __atomic_add_fetch(&forwarded, 1, __ATOMIC_RELAXED);
+    return status;
+}
+
+/* Listings */
+
+static void addName(name_list* list, char* name) {
+    if (list -> count == list -> capacity) {
+        list -> capacity = list -> capacity ? list -> capacity * 2 : ROUTER_LIST_BATCH;
+        list -> names = realloc(list -> names, sizeof(char*) * list -> capacity);
+        errWrap(!list -> names, "Unable to allocate a listing!");
+    }
+    list -> names[list -> count] = strdup(name);
+    errWrap(!list -> names[list -> count++], "Unable to allocate a listing!");
+}
+
+static void freeNames(name_list* list) {
+    for (int i = 0; i < list -> count; i++) {
+        free(list -> names[i]);
+    }
+    free(list -> names);
+    list -> names = NULL;
+    list -> count = list -> capacity = 0;
+}
+
+/*
+    Reads the chunks of names a successful listing streams after its
+    status, up to the empty one that ends it.
+
+    Returns: 0 if successful, -1 if the shard is gone.
+*/
+static int receiveNames(int socket, name_list* list) {
+    char chunk[LIST_CHUNK_SIZE];
+    int size;
+    for (;;) {
+        if (readFully(socket, &size, sizeof(size)) || size < 0 || size > LIST_CHUNK_SIZE) {
+            return -1;
+        }
+        if (!size) {
+            return 0;
+        }
+        if (readFully(socket, chunk, size)) {
+            return -1;
+        }
+        for (int at = 0; at < size; ) {
+            int len = strnlen(chunk + at, size - at);
+            chunk[at + len < size ? at + len : size - 1] = '\0';
+            addName(list, chunk + at);
+            at += len + 1;
+        }
+    }
+}
+
+/*
+    Lists every name in a directory of a shard (the root if dir is ""),
+    batch by batch, on the router's session.
+
+    Returns: TECNICOFS_OK if successful, the error code otherwise.
+*/
+static int listAll(int shard, char* dir, name_list* list) {
+    char request[3 * NOMINAL_BUFFER_SIZE];
+    int status;
+    // Names already in the list (another shard's) are no cursor of this one's
+    int start = list -> count;
+    int before;
+    do {
+        before = list -> count;
+        if (before > start) {
+            snprintf(request, sizeof(request), "n %d:%s%s %s", ROUTER_LIST_BATCH, dir, *dir ? "/" : "", list -> names[before - 1]);
+        } else {
+            snprintf(request, sizeof(request), "n %d:%s%s", ROUTER_LIST_BATCH, dir, *dir ? "/" : "");
+        }
+        status = adminCall(shard, getuid(), request);
+        if (status < 0) {
+            return status;
+        }
+        if (receiveNames(admins[shard], list)) {
+            close(admins[shard]);
+            admins[shard] = -1;
+            return TECNICOFS_ERROR_CONNECTION_ERROR;
+        }
+    } while (list -> count - before == ROUTER_LIST_BATCH);
+    return TECNICOFS_OK;
+}
+
+/* Moving names across shards (routing held for writing) */
+
+/*
+    Describes a name on a shard ('i'), contents and all (*contents is
+    then the caller's to free).
+
+    Returns: TECNICOFS_OK if successful, the error code otherwise.
+*/
+static int inspect(int shard, char* path, tecnicofs_entry* entry, char** contents) {
+    char request[NOMINAL_BUFFER_SIZE + 8];
+    snprintf(request, sizeof(request), "i %s", path);
+    int size = adminCall(shard, getuid(), request);
+    if (size < 0) {
+        return size;
+    }
+    *contents = malloc(size + 1);
+    errWrap(!*contents, "Unable to allocate a file's contents!");
+    if (readFully(admins[shard], entry, sizeof(tecnicofs_entry)) || readFully(admins[shard], *contents, size + 1)) {
+        free(*contents);
+        close(admins[shard]);
+        admins[shard] = -1;
+        return TECNICOFS_ERROR_CONNECTION_ERROR;
+    }
+    (*contents)[size] = '\0';
+    return TECNICOFS_OK;
+}
+
+/* Whether some client has a file open at path, or below it, on the shard */
+static bool isOpen(int shard, char* path) {
+    while (*path == '/') {
+        path++;
+    }
+    size_t len = strlen(path);
+    bool open = false;
+    pthread_mutex_lock(&clientsLock);
+    for (client* c = clients; c && !open; c = c -> next) {
+        for (int i = 0; i < MAX_OPEN_FILES && !open; i++) {
+            routed_file* f = c -> files + i;
+            open = f -> shard == shard && !strncmp(f -> path, path, len) && (!f -> path[len] || f -> path[len] == '/');
+        }
+    }
+    pthread_mutex_unlock(&clientsLock);
+    return open;
+}
+
+static void childPath(char* path, char* name, char* child) {
+    snprintf(child, NOMINAL_BUFFER_SIZE, "%s/%s", path, name);
+}
+
+/* Deletes a tree from a shard, as the owners of what's in it */
+static int removeTree(int shard, char* path) {
+    tecnicofs_entry entry;
+    char* contents;
+    int status = inspect(shard, path, &entry, &contents);
+    if (status != TECNICOFS_OK) {
+        return status;
+    }
+    free(contents);
+
+    if (entry.isDirectory) {
+        name_list children = { NULL, 0, 0 };
+        char child[NOMINAL_BUFFER_SIZE];
+        status = listAll(shard, path, &children);
+        for (int i = 0; i < children.count && status == TECNICOFS_OK; i++) {
+            childPath(path, children.names[i], child);
+            status = removeTree(shard, child);
+        }
+        freeNames(&children);
+        if (status != TECNICOFS_OK) {
+            return status;
+        }
+    }
+
+    char request[NOMINAL_BUFFER_SIZE + 8];
+    snprintf(request, sizeof(request), "%c %s", entry.isDirectory ? 'e' : 'd', path);
+    return adminCall(shard, entry.owner, request);
+}
+
+/* Copies a tree from a shard to another, owners and permissions kept */
+static int copyTree(int source, char* from, int target, char* to) {
+    tecnicofs_entry entry;
+    char* contents;
+    int status = inspect(source, from, &entry, &contents);
+    if (status != TECNICOFS_OK) {
+        return status;
+    }
+
+    char* request = malloc(NOMINAL_BUFFER_SIZE + strlen(contents) + 8);
+    errWrap(!request, "Unable to allocate a request!");
+    sprintf(request, "%c %s %d%d", entry.isDirectory ? 'm' : 'c', to, entry.ownerPermissions, entry.othersPermissions);
+    status = adminCall(target, entry.owner, request);
+    if (status == TECNICOFS_OK && *contents) {
+        sprintf(request, "W %s %s", to, contents);
+        status = adminCall(target, getuid(), request);
+    }
+    free(request);
+    free(contents);
+
+    if (status == TECNICOFS_OK && entry.isDirectory) {
+        name_list children = { NULL, 0, 0 };
+        char fromChild[NOMINAL_BUFFER_SIZE], toChild[NOMINAL_BUFFER_SIZE];
+        status = listAll(source, from, &children);
+        for (int i = 0; i < children.count && status == TECNICOFS_OK; i++) {
+            childPath(from, children.names[i], fromChild);
+            childPath(to, children.names[i], toChild);
+            status = copyTree(source, fromChild, target, toChild);
+        }
+        freeNames(&children);
+    }
+    return status;
+}
+
+/*
+    Moves a tree to another shard (and name): copies it over, then
+    deletes it where it was. Renames check the requester owns it, as a
+    server would; joins move whatever there is.
+
+    Returns: TECNICOFS_OK if successful, the error code otherwise.
+*/
+static int moveTree(int source, char* from, int target, char* to, uid_t* requester) {
+    tecnicofs_entry entry;
+    char* contents;
+    int status = inspect(source, from, &entry, &contents);
+    if (status != TECNICOFS_OK) {
+        return status;
+    }
+    free(contents);
+    if (requester && entry.owner != *requester) {
+        return TECNICOFS_ERROR_PERMISSION_DENIED;
+    }
+    // Its files couldn't be deleted, nor their fds follow them
+    if (isOpen(source, from)) {
+        return TECNICOFS_ERROR_FILE_IS_OPEN;
+    }
+    status = inspect(target, to, &entry, &contents);
+    if (status == TECNICOFS_OK) {
+        free(contents);
+        return TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+    } else if (status != TECNICOFS_ERROR_FILE_NOT_FOUND) {
+        return status;
+    }
+
+    status = copyTree(source, from, target, to);
+    if (status != TECNICOFS_OK) {
+        // Whatever made it over goes, the original stays
+        removeTree(target, to);
+        return status;
+    }
+    return removeTree(source, from);
+}
+
+/* Renames across shards copy and delete, with every other request held back */
+static int renameAcross(client* c, routed_request* r) {
+    pthread_rwlock_wrlock(&routing);
+    int source = route(r -> arg1);
+    int target = route(r -> arg2);
+    int status;
+    if (source == target) {
+        // A join moved them together meanwhile
+        status = forward(c, source, r -> body);
+    } else {
+        status = moveTree(source, r -> arg1, target, r -> arg2, &c -> sock.userId);
+        __atomic_add_fetch(&renamesAcross, 1, __ATOMIC_RELAXED);
+        LOG_LIMITED(LOG_DEBUG, "rename_across", "session=%d from=%d to=%d status=%d", c -> sock.sessionId, source, target, status);
+    }
+    pthread_rwlock_unlock(&routing);
+    return status;
+}
+
+/*
+    Takes in another shard: its points go on the ring right away, and the
+    names they take over are moved one at a time (the ones that are open
+    wait for their files to be closed).
+
+    Returns: TECNICOFS_OK once every name is on its shard, the error code
+    otherwise.
+*/
+static int join(char* path) {
+    pthread_mutex_lock(&joins);
+    pthread_rwlock_wrlock(&routing);
+    int status = TECNICOFS_OK;
+    for (int i = 0; i < numShards; i++) {
+        if (!strcmp(shardPaths[i], path)) {
+            status = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+        }
+    }
+    if (status == TECNICOFS_OK && numShards == MAX_SHARDS) {
+        status = TECNICOFS_ERROR_OTHER;
+    }
+    int shard = numShards;
+    name_list names = { NULL, 0, 0 };
+    if (status == TECNICOFS_OK) {
+        shardPaths[shard] = strdup(path);
+        admins[shard] = -1;
+        // Joining shards start out empty: nothing of theirs could be told apart
+        status = adminOf(shard) < 0 ? TECNICOFS_ERROR_CONNECTION_ERROR : listAll(shard, "", &names);
+        if (status == TECNICOFS_OK && names.count) {
+            status = TECNICOFS_ERROR_FILE_ALREADY_EXISTS;
+        }
+        freeNames(&names);
+        if (status != TECNICOFS_OK) {
+            if (admins[shard] >= 0) {
+                close(admins[shard]);
+            }
+            free(shardPaths[shard]);
+        }
+    }
+    if (status != TECNICOFS_OK) {
+        pthread_rwlock_unlock(&routing);
+        pthread_mutex_unlock(&joins);
+        return status;
+    }
+
+    // Whatever lands on its points is pending, until it's moved
+    for (int i = 0; i < shard && status == TECNICOFS_OK; i++) {
+        status = listAll(i, "", &names);
+    }
+    if (status != TECNICOFS_OK) {
+        freeNames(&names);
+        close(admins[shard]);
+        admins[shard] = -1;
+        free(shardPaths[shard]);
+        pthread_rwlock_unlock(&routing);
+        pthread_mutex_unlock(&joins);
+        return status;
+    }
+    previous = current;
+    current = buildRing(++numShards);
+    joining = shard;
+    for (int i = 0; i < names.count; i++) {
+        if (ownerIn(current, names.names[i]) == shard) {
+            pending = realloc(pending, sizeof(char*) * (numPending + 1));
+            errWrap(!pending, "Unable to allocate the pending names!");
+            pending[numPending++] = names.names[i];
+        } else {
+            free(names.names[i]);
+        }
+    }
+    free(names.names);
+    qsort(pending, numPending, sizeof(char*), compareNames);
+    log_event(LOG_INFO, "shard_joining", "shard=%d path=%s pending=%d", shard, path, numPending);
+    pthread_rwlock_unlock(&routing);
+
+    // Requests get through between two names
+    int moved = 0;
+    while (numPending) {
+        for (int i = 0; i < numPending; ) {
+            pthread_rwlock_wrlock(&routing);
+            char* name = pending[i];
+            status = moveTree(ownerIn(previous, name), name, shard, name, NULL);
+            if (status == TECNICOFS_OK || status == TECNICOFS_ERROR_FILE_NOT_FOUND) {
+                // Moved, or deleted meanwhile: it's the new shard's now
+                memmove(pending + i, pending + i + 1, sizeof(char*) * (numPending - i - 1));
+                numPending--;
+                free(name);
+                moved += status == TECNICOFS_OK;
+            } else {
+                if (status != TECNICOFS_ERROR_FILE_IS_OPEN) {
+                    LOG_LIMITED(LOG_WARN, "move_failed", "shard=%d name=%s status=%d", shard, name, status);
+                }
+                i++;
+            }
+            pthread_rwlock_unlock(&routing);
+        }
+        if (numPending) {
+            usleep(ROUTER_RETRY_MS * 1000);
+        }
+    }
+
+    pthread_rwlock_wrlock(&routing);
+    free(previous);
+    previous = NULL;
+    joining = -1;
+    free(pending);
+    pending = NULL;
+    pthread_rwlock_unlock(&routing);
+    __atomic_add_fetch(&namesMoved, moved, __ATOMIC_RELAXED);
+    log_event(LOG_INFO, "shard_joined", "shard=%d path=%s moved=%d", shard, path, moved);
+    pthread_mutex_unlock(&joins);
+    return TECNICOFS_OK;
+}
+
+/* Serving the clients */
+
+static void reply(client* c, routed_request* r, int status, void* payload, size_t size) {
+    int header[2] = { r -> id, status };
+    void* from = r -> tagged ? (void*)header : (void*)(header + 1);
+    size_t headerSize = (r -> tagged ? 2 : 1) * sizeof(int);
+    if (sendAll(c -> sock.socket, from, headerSize) || (size && sendAll(c -> sock.socket, payload, size))) {
+        LOG_LIMITED(LOG_WARN, "reply_lost", "session=%d", c -> sock.sessionId);
+    }
+}
+
+static int flushNames(client* c, char* chunk, int* size) {
+    memcpy(chunk, size, sizeof(int));
+    int failed = sendAll(c -> sock.socket, chunk, sizeof(int) + *size);
+    *size = 0;
+    if (failed) {
+        LOG_LIMITED(LOG_WARN, "reply_lost", "session=%d", c -> sock.sessionId);
+    }
+    return failed;
+}
+
+/* Streams names to the client as a server would: [size][name\0...] chunks, then an empty one */
+static void replyNames(client* c, routed_request* r, char** names, int count) {
+    char chunk[sizeof(int) + LIST_CHUNK_SIZE];
+    int size = 0;
+    reply(c, r, TECNICOFS_OK, NULL, 0);
+    for (int i = 0; i < count; i++) {
+        int len = strlen(names[i]) + 1;
+        if (size + len > LIST_CHUNK_SIZE && flushNames(c, chunk, &size)) {
+            return;
+        }
+        memcpy(chunk + sizeof(int) + size, names[i], len);
+        size += len;
+    }
+    // Whatever is left, then the empty chunk that ends the listing
+    if (size && flushNames(c, chunk, &size)) {
+        return;
+    }
+    flushNames(c, chunk, &size);
+}
+
+/* Lists a directory: the root is on every shard, anything else on one */
+static void list(client* c, routed_request* r) {
+    int limit;
+    int prefixAt = -1;
+    if (sscanf(r -> arg1, "%d:%n", &limit, &prefixAt) != 1 || prefixAt < 0 || limit < 1) {
+        reply(c, r, TECNICOFS_ERROR_OTHER, NULL, 0);
+        return;
+    }
+    char* path = r -> arg1 + prefixAt;
+    name_list names = { NULL, 0, 0 };
+    int status = TECNICOFS_OK;
+
+    if (strchr(path + strspn(path, "/"), '/')) {
+        int shard = route(path);
+        status = forward(c, shard, r -> body);
+        if (status >= 0 && receiveNames(c -> upstreams[shard], &names)) {
+            dropUpstream(c, shard);
+            status = TECNICOFS_ERROR_CONNECTION_ERROR;
+        }
+    } else {
+        // Each shard's first limit names after the cursor hold the first limit of them all
+        __atomic_add_fetch(&fannedOut, 1, __ATOMIC_RELAXED);
+        for (int shard = 0; shard < numShards && status >= 0; shard++) {
+            status = forward(c, shard, r -> body);
+            if (status >= 0 && receiveNames(c -> upstreams[shard], &names)) {
+                dropUpstream(c, shard);
+                status = TECNICOFS_ERROR_CONNECTION_ERROR;
+            }
+        }
+        qsort(names.names, names.count, sizeof(char*), compareNames);
+        if (names.count > limit) {
+            for (int i = limit; i < names.count; i++) {
+                free(names.names[i]);
+            }
+            names.count = limit;
+        }
+    }
+
+    if (status < 0) {
+        reply(c, r, status, NULL, 0);
+    } else {
+        replyNames(c, r, names.names, names.count);
+    }
+    freeNames(&names);
+}
+
+/*
+    Finds the shard a transaction's names are all on.
+
+    Returns: the shard, TECNICOFS_ERROR_CROSS_SHARD if they're on several.
+*/
+static int transactionShard(char* body) {
+    int shard = -1;
+    char op;
+    char path[NOMINAL_BUFFER_SIZE], arg[NOMINAL_BUFFER_SIZE];
+    for (char* line = strchr(body, '\n'); line; line = strchr(line + 1, '\n')) {
+        int fields = sscanf(line + 1, ARG_FORMAT, &op, path, arg);
+        for (int i = 1; i < fields && i < (op == 'r' ? 3 : 2); i++) {
+            int at = route(i == 1 ? path : arg);
+            if (shard >= 0 && at != shard) {
+                return TECNICOFS_ERROR_CROSS_SHARD;
+            }
+            shard = at;
+        }
+    }
+    // Malformed ones get the shard's say
+    return shard < 0 ? 0 : shard;
+}
+
+static routed_file* fileOf(client* c, char* arg, int* status) {
+    int fd = atoi(arg);
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        *status = TECNICOFS_ERROR_OTHER;
+        return NULL;
+    }
+    if (c -> files[fd].shard < 0) {
+        *status = TECNICOFS_ERROR_FILE_NOT_OPEN;
+        return NULL;
+    }
+    return c -> files + fd;
+}
+
+/* Handles a request of the client (routing held for reading) */
+static void handle(client* c, routed_request* r) {
+    char request[3 * NOMINAL_BUFFER_SIZE];
+    int status = TECNICOFS_OK;
+    routed_file* f;
+
+    if (r -> numTokens != 2 && r -> numTokens != 3) {
+        reply(c, r, TECNICOFS_ERROR_OTHER, NULL, 0);
+        return;
+    }
+
+    switch (r -> token) {
+        case 'p': // ping
+        {
+            reply(c, r, TECNICOFS_OK, NULL, 0);
+            return;
+        }
+        case 'a': // only TCP sessions authenticate
+        {
+            reply(c, r, TECNICOFS_ERROR_PERMISSION_DENIED, NULL, 0);
+            return;
+        }
+        case 'c':
+        case 'm':
+        case 'd':
+        case 'e':
+        {
+            reply(c, r, forward(c, route(r -> arg1), r -> body), NULL, 0);
+            return;
+        }
+        case 'r':
+        {
+            if (r -> numTokens != 3) {
+                reply(c, r, TECNICOFS_ERROR_OTHER, NULL, 0);
+                return;
+            }
+            int source = route(r -> arg1);
+            if (source == route(r -> arg2)) {
+                reply(c, r, forward(c, source, r -> body), NULL, 0);
+                return;
+            }
+            pthread_rwlock_unlock(&routing);
+            status = renameAcross(c, r);
+            pthread_rwlock_rdlock(&routing);
+            reply(c, r, status, NULL, 0);
+            return;
+        }
+        case 'o':
+        case 'L': // no leases: the name could be on another shard by the time it's reopened
+        {
+            int fd = 0;
+            while (fd < MAX_OPEN_FILES && c -> files[fd].shard >= 0) {
+                fd++;
+            }
+            if (fd == MAX_OPEN_FILES) {
+                reply(c, r, TECNICOFS_ERROR_MAXED_OPEN_FILES, NULL, 0);
+                return;
+            }
+            int shard = route(r -> arg1);
+            snprintf(request, sizeof(request), "o %s %s", r -> arg1, r -> arg2);
+            status = forward(c, shard, request);
+            if (status >= 0) {
+                c -> files[fd].shard = shard;
+                c -> files[fd].fd = status;
+                strcpy(c -> files[fd].path, r -> arg1 + strspn(r -> arg1, "/"));
+                status = fd;
+            }
+            if (r -> token == 'L' && status >= 0) {
+                tecnicofs_lease lease;
+                memset(&lease, '\0', sizeof(lease));
+                reply(c, r, status, &lease, sizeof(lease));
+            } else {
+                reply(c, r, status, NULL, 0);
+            }
+            return;
+        }
+        case 'x':
+        {
+            if (!(f = fileOf(c, r -> arg1, &status))) {
+                reply(c, r, status, NULL, 0);
+                return;
+            }
+            int shard = f -> shard;
+            snprintf(request, sizeof(request), "x %d", f -> fd);
+            status = forward(c, shard, request);
+            if (status == TECNICOFS_OK || status == TECNICOFS_ERROR_FILE_NOT_OPEN) {
+                f -> shard = -1;
+            }
+            reply(c, r, status, NULL, 0);
+            return;
+        }
+        case 'l':
+        case 'z': // always inline: a blob would have to be passed on anyway
+        {
+            if (r -> numTokens != 3 || !(f = fileOf(c, r -> arg1, &status))) {
+                reply(c, r, r -> numTokens != 3 ? TECNICOFS_ERROR_OTHER : status, NULL, 0);
+                return;
+            }
+            int shard = f -> shard;
+            snprintf(request, sizeof(request), "l %d %s", f -> fd, r -> arg2);
+            status = forward(c, shard, request);
+            if (status < 0) {
+                reply(c, r, status, NULL, 0);
+                return;
+            }
+            // [kind][contents\0] for 'z', just the contents for 'l'
+            int kind = r -> token == 'z' ? sizeof(int) : 0;
+            char* payload = malloc(kind + status + 1);
+            errWrap(!payload, "Unable to allocate a read!");
+            *(int*)payload = READ_REPLY_INLINE;
+            if (readFully(c -> upstreams[shard], payload + kind, status + 1)) {
+                dropUpstream(c, shard);
+                reply(c, r, TECNICOFS_ERROR_CONNECTION_ERROR, NULL, 0);
+            } else {
+                reply(c, r, status, payload, kind + status + 1);
+            }
+            free(payload);
+            return;
+        }
+        case 'w':
+        {
+            if (r -> numTokens != 3 || !(f = fileOf(c, r -> arg1, &status))) {
+                reply(c, r, r -> numTokens != 3 ? TECNICOFS_ERROR_OTHER : status, NULL, 0);
+                return;
+            }
+            snprintf(request, sizeof(request), "w %d %s", f -> fd, r -> arg2);
+            reply(c, r, forward(c, f -> shard, request), NULL, 0);
+            return;
+        }
+        case 'n':
+        {
+            list(c, r);
+            return;
+        }
+        case 't':
+        {
+            int shard = transactionShard(r -> body);
+            reply(c, r, shard < 0 ? shard : forward(c, shard, r -> body), NULL, 0);
+            return;
+        }
+        case 'T': // every shard's tracer
+        {
+            for (int shard = 0; shard < numShards; shard++) {
+                int shardStatus = forward(c, shard, r -> body);
+                status = status == TECNICOFS_OK ? shardStatus : status;
+            }
+            reply(c, r, status, NULL, 0);
+            return;
+        }
+        case 'j': // takes in another shard (j shard_socket)
+        {
+            if (c -> sock.userId != getuid()) {
+                reply(c, r, TECNICOFS_ERROR_PERMISSION_DENIED, NULL, 0);
+                return;
+            }
+            pthread_rwlock_unlock(&routing);
+            status = join(r -> arg1);
+            pthread_rwlock_rdlock(&routing);
+            reply(c, r, status, NULL, 0);
+            return;
+        }
+        default: // shared memory ('h') and leases ('O') included: the client does without them
+        {
+            reply(c, r, TECNICOFS_ERROR_OTHER, NULL, 0);
+            return;
+        }
+    }
+}
+
+static void* serveClient(void* ptr) {
+    client* c = ptr;
+    request_reader* reader = malloc(sizeof(request_reader));
+    errWrap(!reader, "Unable to allocate a request reader!");
+    readerInit(reader, c -> sock.socket);
+    routed_request* r = malloc(sizeof(routed_request));
+    errWrap(!r, "Unable to allocate a request!");
+
+    char* command;
+    while (readerNext(reader, &command) > 0) {
+        r -> tagged = command[0] == '@';
+        r -> id = 0;
+        if (r -> tagged) {
+            r -> id = (int)strtol(command + 1, &command, 10);
+            command += *command == '!';
+            while (*command == ' ') {
+                command++;
+            }
+        }
+        r -> arg1[0] = '\0';
+        r -> arg2[0] = '\0';
+        r -> token = '\0';
+        r -> body = command;
+        r -> numTokens = sscanf(command, ARG_FORMAT, &r -> token, r -> arg1, r -> arg2);
+
+        pthread_rwlock_rdlock(&routing);
+        handle(c, r);
+        pthread_rwlock_unlock(&routing);
+    }
+
+    log_event(LOG_INFO, "disconnected", "session=%d uid=%d", c -> sock.sessionId, c -> sock.userId);
+    pthread_mutex_lock(&clientsLock);
+    for (client** at = &clients; *at; at = &(*at) -> next) {
+        if (*at == c) {
+            *at = c -> next;
+            break;
+        }
+    }
+    numClients--;
+    pthread_cond_broadcast(&clientGone);
+    pthread_mutex_unlock(&clientsLock);
+
+    // Hanging up on the shards closes the files there
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        if (c -> upstreams[i] >= 0) {
+            close(c -> upstreams[i]);
+        }
+    }
+    close(c -> sock.socket);
+    free(c -> sock.client);
+    free(c);
+    free(reader);
+    free(r);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+    log_init();
+
+    for (int i = 0; i < MAX_SHARDS; i++) {
+        admins[i] = -1;
+    }
+    for (int i = 0; i < numShards; i++) {
+        if (adminOf(i) < 0) {
+            fprintf(stderr, red("Unable to reach the shard at %s (or act for others on it)\n"), shardPaths[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    current = buildRing(numShards);
+
+    listener = newSocket(socketName, MAX_PENDING_CALL_QUEUE);
+    signal(SIGINT, stopAccepting);
+    signal(SIGTERM, stopAccepting);
+    fprintf(stderr, green("Routing over %d shards.\n\n"), numShards);
+    log_event(LOG_INFO, "routing", "socket=%s shards=%d", socketName, numShards);
+
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    while (accepting) {
+        socket_t sock = acceptConnectionFrom(listener, &accepting);
+        if (!accepting) {
+            continue;
+        }
+        log_event(LOG_INFO, "connected", "session=%d pid=%d uid=%d", sock.sessionId, sock.procId, sock.userId);
+
+        client* c = malloc(sizeof(client));
+        errWrap(!c, "Unable to allocate a client!");
+        // Clients go on their own, nobody joins them
+        free(sock.thread);
+        sock.thread = NULL;
+        c -> sock = sock;
+        for (int i = 0; i < MAX_SHARDS; i++) {
+            c -> upstreams[i] = -1;
+        }
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            c -> files[i].shard = -1;
+        }
+        pthread_mutex_lock(&clientsLock);
+        c -> next = clients;
+        clients = c;
+        numClients++;
+        pthread_mutex_unlock(&clientsLock);
+        pthread_t thread;
+        errWrap(pthread_create(&thread, &detached, serveClient, c), "Unable to serve a client!");
+    }
+
+    // As a server does, wait for the clients to hang up
+    pthread_attr_destroy(&detached);
+    pthread_mutex_lock(&clientsLock);
+    while (numClients) {
+        pthread_cond_wait(&clientGone, &clientsLock);
+    }
+    pthread_mutex_unlock(&clientsLock);
+
+    for (int i = 0; i < numShards; i++) {
+        if (admins[i] >= 0) {
+            close(admins[i]);
+        }
+    }
+    log_event(LOG_INFO, "routed", "shards=%d forwarded=%lu fanned_out=%lu renames_across=%lu names_moved=%lu",
+        numShards, forwarded, fannedOut, renamesAcross, namesMoved);
+    log_stop();
+    free(current);
+    fprintf(stderr, green_bold("TecnicoFS router stopped.\n"));
+    exit(EXIT_SUCCESS);
+}